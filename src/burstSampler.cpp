@@ -0,0 +1,334 @@
+//========================================================================
+// FILE:
+//    burstSampler.cpp
+//
+// DESCRIPTION:
+//    Arnold-Ryder two-version code: every function holds an instrumented and a
+//    clean version of its body, and checks on function entry and on loop
+//    backedges decide which version runs next. Most of the time the program
+//    runs the clean code; every Period checks, it runs the instrumented code
+//    for a burst of Length checks.
+//
+//    Both versions share the same stack frame so that a loop can switch
+//    version at any iteration. Before instrumentation, the registers of a
+//    function that live across blocks (and its PHIs) are demoted to stack
+//    slots, as reg2mem does, and the clean copy is cloned from the result.
+//    Once the function is instrumented, the clean blocks are moved back into
+//    it (using the same slots, allocas and arguments), the checks are
+//    injected, and the slots are promoted back to registers.
+//
+//    The checks are thread-local: LLVM_burst_countdown counts the checks left
+//    before switching version, and LLVM_burst_active tells which version
+//    runs. Since a switch only happens at a check, a burst may end in the
+//    middle of a loop iteration: counting modes that rebuild block counts
+//    from complete executions (edge, path, hoisted loops, control
+//    equivalence, promoted counters) cannot be combined with bursts.
+//
+//    Functions can also switch version right after the calls to given
+//    functions (switch points), such as the ones turning counting on or off.
+//
+//    The same checks implement the runtime toggle (see countingToggle.cpp):
+//    they also test the flag of the function, and run the clean code while
+//    counting is disabled. Without bursts, they only test the flag.
+//
+// License: MIT
+//========================================================================
+#include "burstSampler.h"
+#include "counterPlacement.h"
+#include "countingToggle.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+using namespace llvm;
+
+static const char *DemotedMDName = "dynic.demoted";
+
+namespace {
+// First instruction of BB that is not an alloca
+Instruction *getFirstNonAlloca(BasicBlock &BB) {
+  for (auto &I : BB)
+    if (!isa<AllocaInst>(I))
+      return &I;
+  return nullptr;
+}
+} // namespace
+
+struct BurstSampler::FunctionVersions {
+  Function *F;
+  Function *Clean;
+  // Values of F (as it was when cloned) -> values of the clean copy
+  ValueToValueMapTy VMap;
+  // Stack slots of the demoted registers
+  std::vector<AllocaInst *> Slots;
+  // Edges leaving the calls to the switch points
+  SmallVector<std::pair<BasicBlock *, BasicBlock *>, 4> SwitchEdges;
+};
+
+BurstSampler::BurstSampler(Module &M, uint64_t Period, uint64_t Length,
+                           CountingToggle *Toggle)
+    : M(M), Period(Period), Length(std::max<uint64_t>(Length, 1)), Toggle(Toggle) {
+  if (!Period)
+    return;
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Countdown = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                                 ConstantInt::get(Int64Ty, Period), "LLVM_burst_countdown",
+                                 nullptr, GlobalValue::GeneralDynamicTLSModel);
+  Active = new GlobalVariable(M, Int8Ty, false, GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int8Ty, 0), "LLVM_burst_active", nullptr,
+                              GlobalValue::GeneralDynamicTLSModel);
+}
+
+BurstSampler::~BurstSampler() = default;
+
+//-----------------------------------------------------------------------------
+// Demotion and cloning
+//-----------------------------------------------------------------------------
+bool BurstSampler::addFunction(Function &F) {
+  if (F.isDeclaration() || !canSplitEdges(F))
+    return false;
+
+  BasicBlock &Entry = F.getEntryBlock();
+  SmallVector<PHINode *, 16> Phis;
+  for (auto &BB : F)
+    for (auto &I : BB) {
+      if (auto *Phi = dyn_cast<PHINode>(&I))
+        Phis.push_back(Phi);
+      if (I.getType()->isTokenTy())
+        return false;
+    }
+
+  auto FV = std::make_unique<FunctionVersions>();
+  FV->F = &F;
+
+  // Calls to the switch points end their block, so that the values crossing them are
+  // demoted below
+  SmallVector<CallInst *, 4> SwitchCalls;
+  for (auto &I : instructions(F))
+    if (auto *Call = dyn_cast<CallInst>(&I))
+      if (SwitchCallees.count(Call->getCalledFunction()))
+        SwitchCalls.push_back(Call);
+  auto &CTX = M.getContext();
+  MDNode *Skip = MDNode::get(CTX, {});
+  MDNode *CountAsPhi = MDNode::get(CTX, {MDString::get(CTX, "phi")});
+  for (CallInst *Call : SwitchCalls) {
+    BasicBlock *Src = Call->getParent();
+    FV->SwitchEdges.push_back({Src, SplitBlock(Src, Call->getNextNode())});
+    Src->getTerminator()->setMetadata(DemotedMDName, Skip);
+  }
+
+  Instruction *AllocaPt = getFirstNonAlloca(Entry);
+
+  // PHIs first: the loads replacing them may escape their block in turn
+  for (PHINode *Phi : Phis) {
+    AllocaInst *Slot = DemotePHIToStack(Phi, AllocaPt);
+    if (!Slot)
+      continue;
+    Slot->setMetadata(DemotedMDName, Skip);
+    for (User *U : Slot->users())
+      cast<Instruction>(U)->setMetadata(DemotedMDName, isa<LoadInst>(U) ? CountAsPhi : Skip);
+    FV->Slots.push_back(Slot);
+  }
+  SmallVector<Instruction *, 32> Escaping;
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (!(isa<AllocaInst>(I) && &BB == &Entry) && I.isUsedOutsideOfBlock(&BB))
+        Escaping.push_back(&I);
+  for (Instruction *I : Escaping) {
+    AllocaInst *Slot = DemoteRegToStack(*I, /*VolatileLoads=*/false, AllocaPt);
+    Slot->setMetadata(DemotedMDName, Skip);
+    for (User *U : Slot->users())
+      cast<Instruction>(U)->setMetadata(DemotedMDName, Skip);
+    FV->Slots.push_back(Slot);
+  }
+
+  FV->Clean = CloneFunction(&F, FV->VMap);
+  FV->Clean->setName(F.getName() + ".clean");
+  FV->Clean->setLinkage(GlobalValue::InternalLinkage);
+  CleanCopies.insert(FV->Clean);
+  Functions.push_back(std::move(FV));
+  return true;
+}
+
+bool BurstSampler::isDemoted(const Instruction &I, StringRef &Opcode) {
+  MDNode *MD = I.getMetadata(DemotedMDName);
+  if (!MD)
+    return false;
+  Opcode = MD->getNumOperands() ? cast<MDString>(MD->getOperand(0))->getString() : "";
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Checks
+//-----------------------------------------------------------------------------
+// void LLVM_burst_switch(): switches version and reloads the countdown
+Function *BurstSampler::getSwitchFunction() {
+  if (Function *F = M.getFunction("LLVM_burst_switch"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                 GlobalValue::InternalLinkage, "LLVM_burst_switch", M);
+  F->addFnAttr(Attribute::NoInline);
+  F->addFnAttr(Attribute::Cold);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *NowActive = Builder.CreateXor(Builder.CreateLoad(Int8Ty, Active), Builder.getInt8(1));
+  Builder.CreateStore(NowActive, Active);
+  Builder.CreateStore(Builder.CreateSelect(Builder.CreateICmpNE(NowActive, Builder.getInt8(0)),
+                                           ConstantInt::get(Int64Ty, Length),
+                                           ConstantInt::get(Int64Ty, Period)),
+                      Countdown);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// Fills Check (a block without terminator) with:
+//   if (--countdown <= 0) LLVM_burst_switch();
+//   goto (active && enabled(F)) ? Instrumented : Clean;
+// leaving out the burst or the toggle part when it is not in use.
+void BurstSampler::emitCheck(BasicBlock *Check, BasicBlock *Instrumented, BasicBlock *Clean) {
+  auto &CTX = M.getContext();
+  Function *F = Check->getParent();
+  MDBuilder MDB(CTX);
+  IRBuilder<> Builder(Check);
+
+  Value *Run = nullptr;
+  if (Period) {
+    BasicBlock *Switch = BasicBlock::Create(CTX, "burst.switch", F);
+    BasicBlock *Dispatch = BasicBlock::Create(CTX, "burst.dispatch", F);
+    Value *Left = Builder.CreateSub(Builder.CreateLoad(Builder.getInt64Ty(), Countdown),
+                                    Builder.getInt64(1));
+    Builder.CreateStore(Left, Countdown);
+    Builder.CreateCondBr(Builder.CreateICmpSLE(Left, Builder.getInt64(0)), Switch, Dispatch,
+                         MDB.createBranchWeights(1, 1000));
+
+    Builder.SetInsertPoint(Switch);
+    Builder.CreateCall(getSwitchFunction());
+    Builder.CreateBr(Dispatch);
+
+    Builder.SetInsertPoint(Dispatch);
+    Run = Builder.CreateICmpNE(Builder.CreateLoad(Builder.getInt8Ty(), Active),
+                               Builder.getInt8(0));
+  }
+  if (Toggle) {
+    Value *Enabled = Toggle->emitEnabled(Builder, *F);
+    Run = Run ? Builder.CreateAnd(Run, Enabled) : Enabled;
+  }
+  // With the toggle, counting is expected to be off most of the time
+  uint32_t InstrumentedWeight = Toggle ? 1 : std::min<uint64_t>(Length, UINT32_MAX);
+  uint32_t CleanWeight = Toggle ? 1000 : std::min<uint64_t>(Period, UINT32_MAX);
+  Builder.CreateCondBr(Run, Instrumented, Clean,
+                       MDB.createBranchWeights(InstrumentedWeight, CleanWeight));
+}
+
+//-----------------------------------------------------------------------------
+// Merging
+//-----------------------------------------------------------------------------
+void BurstSampler::instrument() {
+  auto &CTX = M.getContext();
+
+  for (auto &FV : Functions) {
+    Function &F = *FV->F;
+    Function &Clean = *FV->Clean;
+
+    // Backedges of both versions, collected before they are merged
+    SmallVector<std::pair<BasicBlock *, BasicBlock *>, 8> Backedges, CleanBackedges;
+    {
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+      for (Loop *L : LI.getLoopsInPreorder()) {
+        SmallVector<BasicBlock *, 4> Latches;
+        L->getLoopLatches(Latches);
+        for (BasicBlock *Latch : Latches)
+          Backedges.push_back({Latch, L->getHeader()});
+      }
+      DominatorTree CleanDT(Clean);
+      LoopInfo CleanLI(CleanDT);
+      for (Loop *L : CleanLI.getLoopsInPreorder()) {
+        SmallVector<BasicBlock *, 4> Latches;
+        L->getLoopLatches(Latches);
+        for (BasicBlock *Latch : Latches)
+          CleanBackedges.push_back({Latch, L->getHeader()});
+      }
+    }
+    DenseMap<Value *, Value *> CleanToOriginal;
+    for (auto It = FV->VMap.begin(); It != FV->VMap.end(); ++It)
+      CleanToOriginal[It->second] = const_cast<Value *>(It->first);
+
+    // Static allocas at the top of the entry block, which is then split after them
+    BasicBlock &Entry = F.getEntryBlock();
+    SmallVector<AllocaInst *, 16> Allocas;
+    for (auto &I : Entry)
+      if (auto *Alloca = dyn_cast<AllocaInst>(&I))
+        Allocas.push_back(Alloca);
+    for (AllocaInst *Alloca : Allocas)
+      Alloca->moveBefore(getFirstNonAlloca(Entry));
+    BasicBlock *InstrumentedEntry = SplitBlock(&Entry, getFirstNonAlloca(Entry));
+
+    // Move the clean blocks into F, on top of the same frame and arguments
+    BasicBlock *CleanEntry = &Clean.getEntryBlock();
+    SmallVector<AllocaInst *, 16> CleanAllocas;
+    for (auto &I : *CleanEntry)
+      if (auto *Alloca = dyn_cast<AllocaInst>(&I))
+        if (CleanToOriginal.count(Alloca))
+          CleanAllocas.push_back(Alloca);
+    for (AllocaInst *Alloca : CleanAllocas) {
+      Alloca->replaceAllUsesWith(CleanToOriginal[Alloca]);
+      Alloca->eraseFromParent();
+    }
+    for (Argument &Arg : Clean.args())
+      Arg.replaceAllUsesWith(F.getArg(Arg.getArgNo()));
+    SmallVector<BasicBlock *, 32> CleanBlocks;
+    for (auto &BB : Clean)
+      CleanBlocks.push_back(&BB);
+    for (BasicBlock *BB : CleanBlocks) {
+      BB->removeFromParent();
+      BB->insertInto(&F);
+    }
+    CleanCopies.erase(&Clean);
+    Clean.eraseFromParent();
+
+    // Checks: on entry, on every backedge of both versions, and after the calls to the
+    // switch points
+    for (auto &Edge : FV->SwitchEdges) {
+      auto *CleanSrc = cast<BasicBlock>(FV->VMap[Edge.first]);
+      CleanBackedges.push_back({CleanSrc, cast<BasicBlock>(FV->VMap[Edge.second])});
+      Backedges.push_back(Edge);
+    }
+    Entry.getTerminator()->eraseFromParent();
+    emitCheck(&Entry, InstrumentedEntry, CleanEntry);
+    for (auto &Backedge : Backedges) {
+      auto *CleanHeader = dyn_cast_or_null<BasicBlock>(FV->VMap.lookup(Backedge.second));
+      if (!CleanHeader)
+        continue;
+      BasicBlock *Check = BasicBlock::Create(CTX, "burst.check", &F);
+      Backedge.first->getTerminator()->replaceSuccessorWith(Backedge.second, Check);
+      emitCheck(Check, Backedge.second, CleanHeader);
+    }
+    for (auto &Backedge : CleanBackedges) {
+      BasicBlock *Check = BasicBlock::Create(CTX, "burst.check", &F);
+      Backedge.first->getTerminator()->replaceSuccessorWith(Backedge.second, Check);
+      emitCheck(Check, cast<BasicBlock>(CleanToOriginal[Backedge.second]), Backedge.second);
+    }
+
+    // Back to registers
+    std::vector<AllocaInst *> Slots;
+    for (AllocaInst *Slot : FV->Slots)
+      if (isAllocaPromotable(Slot))
+        Slots.push_back(Slot);
+    DominatorTree DT(F);
+    PromoteMemToReg(Slots, DT);
+  }
+  Functions.clear();
+}
@@ -0,0 +1,74 @@
+//==============================================================================
+// FILE:
+//    burstSampler.h
+//
+// DESCRIPTION:
+//    Declares the Arnold-Ryder two-version code transformation used by the
+//    burst sampling mode and the runtime toggle of DynamicInstCounter.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_BURST_SAMPLER_H
+#define LLVM_DYNIC_BURST_SAMPLER_H
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Module.h"
+
+#include <memory>
+#include <vector>
+
+class CountingToggle;
+
+class BurstSampler {
+public:
+  // Every thread runs the clean code for Period checks, then the instrumented
+  // code for Length checks, and so on (Period == 0: no bursts). If Toggle is
+  // given, the instrumented code only runs while counting is enabled.
+  BurstSampler(llvm::Module &M, uint64_t Period, uint64_t Length,
+               CountingToggle *Toggle = nullptr);
+  ~BurstSampler();
+
+  // Makes the functions added next switch version right after returning from
+  // a call to Callee, instead of waiting for the next check.
+  void addSwitchPoint(llvm::Function *Callee) { SwitchCallees.insert(Callee); }
+
+  // Demotes the registers of F that live across blocks to stack slots and
+  // keeps a clean (never instrumented) copy of it. Must be called before F is
+  // instrumented. Returns false if F cannot be duplicated (EH pads,
+  // indirectbr, callbr): F is then always instrumented.
+  bool addFunction(llvm::Function &F);
+
+  // Whether F is the clean copy of a function added so far
+  bool isCleanCopy(const llvm::Function &F) const { return CleanCopies.count(&F); }
+
+  // Whether I was inserted by addFunction (demotion code, branches splitting
+  // blocks at the switch points), and thus must not be counted. Loads that
+  // replace a demoted PHI are counted as a "phi".
+  static bool isDemoted(const llvm::Instruction &I, llvm::StringRef &Opcode);
+
+  // Merges the clean copy of every function added so far back into the
+  // (instrumented) function, injects the checks switching between the two
+  // versions on function entry and loop backedges, and promotes the stack
+  // slots back to registers.
+  void instrument();
+
+private:
+  struct FunctionVersions;
+
+  llvm::Function *getSwitchFunction();
+  void emitCheck(llvm::BasicBlock *Check, llvm::BasicBlock *Instrumented,
+                 llvm::BasicBlock *Clean);
+
+  llvm::Module &M;
+  uint64_t Period;
+  uint64_t Length;
+  CountingToggle *Toggle;
+  llvm::GlobalVariable *Countdown = nullptr;
+  llvm::GlobalVariable *Active = nullptr;
+
+  std::vector<std::unique_ptr<FunctionVersions>> Functions;
+  llvm::SmallPtrSet<const llvm::Function *, 32> CleanCopies;
+  llvm::SmallPtrSet<const llvm::Function *, 4> SwitchCallees;
+};
+
+#endif
@@ -0,0 +1,619 @@
+//========================================================================
+// FILE:
+//    callingContextTree.cpp
+//
+// DESCRIPTION:
+//    Calling-context tree (CCT). Every thread builds a tree of the call paths
+//    it executes, with one node per (calling context, callee) pair holding
+//    the number of calls and a private copy of the counters of the callee.
+//
+//    The current node of a thread (LLVM_cct_current) is the top of its shadow
+//    stack. On entry, an instrumented function finds the child of the current
+//    node for itself, makes it current and keeps the caller's node in a
+//    register; its counter updates go to the node instead of the counter
+//    table. Every return restores the caller's node, and landing pads restore
+//    the node of their function after an exception. The last child entered
+//    is moved to the front of the children of its parent, so that the common
+//    case (a caller calling the same function again) is an inline check;
+//    other lookups go through LLVM_cct_lookup. A recursive call reuses the
+//    node of the ancestor running the same function, which keeps the tree
+//    finite.
+//
+//    Nodes are carved out of per-thread arenas, refilled with calloc on the
+//    slow path only, and never freed. At the end of the program, the nodes of
+//    every thread are added back to the counter table (so the other reports
+//    are unchanged), and the trees are printed with the inclusive and
+//    exclusive instruction counts of every context, hottest first. The trees
+//    of threads still running are read without synchronization.
+//
+// License: MIT
+//========================================================================
+#include "callingContextTree.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/InstIterator.h"
+
+using namespace llvm;
+
+// Size of the arena chunks nodes are allocated from
+static const uint64_t ArenaSize = 1 << 20;
+
+enum NodeField {
+  ParentField,
+  DescField,
+  ChildField,
+  SiblingField,
+  CallsField,
+  InclusiveField,
+  ExclusiveField
+};
+
+CallingContextTree::CallingContextTree(Module &M) : M(M) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  NodeTy = StructType::get(CTX, {PtrTy, PtrTy, PtrTy, PtrTy, Int64Ty, Int64Ty, Int64Ty});
+  DescTy = StructType::get(CTX, {PtrTy, Int64Ty, PtrTy, PtrTy});
+
+  Constant *NullPtr = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  auto createThreadLocal = [&](const Twine &Name) {
+    return new GlobalVariable(M, PtrTy, false, GlobalValue::InternalLinkage, NullPtr, Name,
+                              nullptr, GlobalValue::GeneralDynamicTLSModel);
+  };
+  Current = createThreadLocal("LLVM_cct_current");
+  Root = createThreadLocal("LLVM_cct_root");
+  ArenaNext = createThreadLocal("LLVM_cct_arena_next");
+  ArenaEnd = createThreadLocal("LLVM_cct_arena_end");
+  Roots = new GlobalVariable(M, PtrTy, false, GlobalValue::InternalLinkage, NullPtr,
+                             "LLVM_cct_roots");
+  RootDesc = new GlobalVariable(
+      M, DescTy, true, GlobalValue::InternalLinkage,
+      ConstantStruct::get(DescTy, {NullPtr, ConstantInt::get(Int64Ty, 0), NullPtr, NullPtr}),
+      "LLVM_cct_root_desc");
+}
+
+void CallingContextTree::addTerm(Function &F, Constant *Counter, int64_t Weight) {
+  Weights[&F][Counter] += Weight;
+}
+
+Value *CallingContextTree::emitFieldPtr(IRBuilder<> &Builder, Value *Node, unsigned Field) {
+  return Builder.CreateStructGEP(NodeTy, Node, Field);
+}
+
+// ptr LLVM_cct_alloc(i64 size): bump allocation in the arena of the thread
+Function *CallingContextTree::getAllocFunction() {
+  if (Function *F = M.getFunction("LLVM_cct_alloc"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee Calloc =
+      M.getOrInsertFunction("calloc", FunctionType::get(PtrTy, {Int64Ty, Int64Ty}, false));
+  Function *F = Function::Create(FunctionType::get(PtrTy, {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_cct_alloc", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Bump = BasicBlock::Create(CTX, "bump", F);
+  BasicBlock *Refill = BasicBlock::Create(CTX, "refill", F);
+  Value *Size = F->getArg(0);
+
+  IRBuilder<> Builder(Entry);
+  Value *Next = Builder.CreateLoad(PtrTy, ArenaNext);
+  Value *NewNext = Builder.CreateGEP(Builder.getInt8Ty(), Next, Size);
+  Value *End = Builder.CreateLoad(PtrTy, ArenaEnd);
+  Builder.CreateCondBr(Builder.CreateICmpUGT(NewNext, End), Refill, Bump);
+
+  Builder.SetInsertPoint(Bump);
+  Builder.CreateStore(NewNext, ArenaNext);
+  Builder.CreateRet(Next);
+
+  // Nodes larger than a chunk get a chunk of their own
+  Builder.SetInsertPoint(Refill);
+  Value *ChunkSize = Builder.CreateSelect(
+      Builder.CreateICmpUGT(Size, Builder.getInt64(ArenaSize)), Size, Builder.getInt64(ArenaSize));
+  Value *Chunk = Builder.CreateCall(Calloc, {Builder.getInt64(1), ChunkSize});
+  Builder.CreateStore(Builder.CreateGEP(Builder.getInt8Ty(), Chunk, Size), ArenaNext);
+  Builder.CreateStore(Builder.CreateGEP(Builder.getInt8Ty(), Chunk, ChunkSize), ArenaEnd);
+  Builder.CreateRet(Chunk);
+  return F;
+}
+
+// ptr LLVM_cct_lookup(ptr parent, ptr desc): returns the node of the function
+// described by `desc` called from `parent` (the root of the thread if null),
+// moved to the front of the children of `parent`. Recursive calls get the
+// node of the closest ancestor running the same function.
+Function *CallingContextTree::getLookupFunction() {
+  if (Function *F = M.getFunction("LLVM_cct_lookup"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Constant *NullPtr = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  Function *Alloc = getAllocFunction();
+  Function *F = Function::Create(FunctionType::get(PtrTy, {PtrTy, PtrTy}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_cct_lookup", M);
+  F->addFnAttr(Attribute::NoInline);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *GetRoot = BasicBlock::Create(CTX, "root", F);
+  BasicBlock *NewRoot = BasicBlock::Create(CTX, "root.new", F);
+  BasicBlock *Register = BasicBlock::Create(CTX, "root.register", F);
+  BasicBlock *Registered = BasicBlock::Create(CTX, "root.registered", F);
+  BasicBlock *HasRoot = BasicBlock::Create(CTX, "root.done", F);
+  BasicBlock *Search = BasicBlock::Create(CTX, "search", F);
+  BasicBlock *Test = BasicBlock::Create(CTX, "search.test", F);
+  BasicBlock *SearchNext = BasicBlock::Create(CTX, "search.next", F);
+  BasicBlock *Found = BasicBlock::Create(CTX, "found", F);
+  BasicBlock *MoveToFront = BasicBlock::Create(CTX, "found.move", F);
+  BasicBlock *Ancestors = BasicBlock::Create(CTX, "ancestors", F);
+  BasicBlock *AncestorTest = BasicBlock::Create(CTX, "ancestors.test", F);
+  BasicBlock *AncestorNext = BasicBlock::Create(CTX, "ancestors.next", F);
+  BasicBlock *AncestorFound = BasicBlock::Create(CTX, "ancestors.found", F);
+  BasicBlock *Create = BasicBlock::Create(CTX, "create", F);
+  Value *Desc = F->getArg(1);
+  uint64_t NodeSize = M.getDataLayout().getTypeAllocSize(NodeTy);
+
+  IRBuilder<> Builder(Entry);
+  Builder.CreateCondBr(Builder.CreateIsNull(F->getArg(0)), GetRoot, HasRoot);
+
+  // The root of the thread is created on its first call, and registered in
+  // LLVM_cct_roots
+  Builder.SetInsertPoint(GetRoot);
+  Value *ThreadRoot = Builder.CreateLoad(PtrTy, Root);
+  Builder.CreateCondBr(Builder.CreateIsNull(ThreadRoot), NewRoot, HasRoot);
+
+  Builder.SetInsertPoint(NewRoot);
+  Value *Created = Builder.CreateCall(Alloc, {Builder.getInt64(NodeSize)});
+  Builder.CreateStore(RootDesc, emitFieldPtr(Builder, Created, DescField));
+  Value *FirstRoot = Builder.CreateLoad(PtrTy, Roots);
+  Builder.CreateBr(Register);
+
+  Builder.SetInsertPoint(Register);
+  PHINode *OldRoots = Builder.CreatePHI(PtrTy, 2, "roots");
+  OldRoots->addIncoming(FirstRoot, NewRoot);
+  Builder.CreateStore(OldRoots, emitFieldPtr(Builder, Created, SiblingField));
+  Value *Exchange = Builder.CreateAtomicCmpXchg(Roots, OldRoots, Created, MaybeAlign(8),
+                                                AtomicOrdering::SequentiallyConsistent,
+                                                AtomicOrdering::SequentiallyConsistent);
+  OldRoots->addIncoming(Builder.CreateExtractValue(Exchange, 0), Register);
+  Builder.CreateCondBr(Builder.CreateExtractValue(Exchange, 1), Registered, Register);
+
+  Builder.SetInsertPoint(Registered);
+  Builder.CreateStore(Created, Root);
+  Builder.CreateBr(HasRoot);
+
+  Builder.SetInsertPoint(HasRoot);
+  PHINode *Parent = Builder.CreatePHI(PtrTy, 3, "parent");
+  Parent->addIncoming(F->getArg(0), Entry);
+  Parent->addIncoming(ThreadRoot, GetRoot);
+  Parent->addIncoming(Created, Registered);
+  Value *ChildPtr = emitFieldPtr(Builder, Parent, ChildField);
+  Value *Head = Builder.CreateLoad(PtrTy, ChildPtr, "head");
+  Builder.CreateBr(Search);
+
+  // Children of the parent
+  Builder.SetInsertPoint(Search);
+  PHINode *Prev = Builder.CreatePHI(PtrTy, 2, "prev");
+  PHINode *Node = Builder.CreatePHI(PtrTy, 2, "node");
+  Prev->addIncoming(NullPtr, HasRoot);
+  Node->addIncoming(Head, HasRoot);
+  Builder.CreateCondBr(Builder.CreateIsNull(Node), Ancestors, Test);
+
+  Builder.SetInsertPoint(Test);
+  Value *NodeDesc = Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, DescField));
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NodeDesc, Desc), Found, SearchNext);
+
+  Builder.SetInsertPoint(SearchNext);
+  Prev->addIncoming(Node, SearchNext);
+  Node->addIncoming(Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, SiblingField)), SearchNext);
+  Builder.CreateBr(Search);
+
+  Builder.SetInsertPoint(Found);
+  Builder.CreateCondBr(Builder.CreateIsNull(Prev), AncestorFound, MoveToFront);
+
+  Builder.SetInsertPoint(MoveToFront);
+  Value *NodeSibling = emitFieldPtr(Builder, Node, SiblingField);
+  Builder.CreateStore(Builder.CreateLoad(PtrTy, NodeSibling), emitFieldPtr(Builder, Prev, SiblingField));
+  Builder.CreateStore(Head, NodeSibling);
+  Builder.CreateStore(Node, ChildPtr);
+  Builder.CreateBr(AncestorFound);
+
+  // Recursion: the closest ancestor running the same function (the parent included)
+  Builder.SetInsertPoint(Ancestors);
+  PHINode *Ancestor = Builder.CreatePHI(PtrTy, 2, "ancestor");
+  Ancestor->addIncoming(Parent, Search);
+  Builder.CreateCondBr(Builder.CreateIsNull(Ancestor), Create, AncestorTest);
+
+  Builder.SetInsertPoint(AncestorTest);
+  Value *AncestorDesc =
+      Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Ancestor, DescField));
+  Builder.CreateCondBr(Builder.CreateICmpEQ(AncestorDesc, Desc), AncestorFound, AncestorNext);
+
+  Builder.SetInsertPoint(AncestorNext);
+  Ancestor->addIncoming(Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Ancestor, ParentField)),
+                        AncestorNext);
+  Builder.CreateBr(Ancestors);
+
+  Builder.SetInsertPoint(AncestorFound);
+  PHINode *Result = Builder.CreatePHI(PtrTy, 3, "result");
+  Result->addIncoming(Node, Found);
+  Result->addIncoming(Node, MoveToFront);
+  Result->addIncoming(Ancestor, AncestorTest);
+  Builder.CreateRet(Result);
+
+  // New child, in front of its siblings
+  Builder.SetInsertPoint(Create);
+  Value *NumSlots = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(DescTy, Desc, 1));
+  Value *Size = Builder.CreateAdd(Builder.getInt64(NodeSize),
+                                  Builder.CreateMul(NumSlots, Builder.getInt64(8)));
+  Value *New = Builder.CreateCall(Alloc, {Size});
+  Builder.CreateStore(Parent, emitFieldPtr(Builder, New, ParentField));
+  Builder.CreateStore(Desc, emitFieldPtr(Builder, New, DescField));
+  Builder.CreateStore(Head, emitFieldPtr(Builder, New, SiblingField));
+  Builder.CreateStore(New, ChildPtr);
+  Builder.CreateRet(New);
+  return F;
+}
+
+void CallingContextTree::instrument(ArrayRef<Function *> Functions,
+                                    ArrayRef<GlobalVariable *> Counters) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Constant *NullPtr = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  SmallPtrSet<GlobalVariable *, 32> IsCounter(Counters.begin(), Counters.end());
+  Function *Lookup = getLookupFunction();
+
+  for (Function *F : Functions) {
+    if (F->isDeclaration())
+      continue;
+
+    // The counters updated by F become slots of its nodes
+    MapVector<GlobalVariable *, unsigned> Slots;
+    for (Instruction &I : instructions(*F))
+      for (Value *Op : I.operands())
+        if (auto *GV = dyn_cast<GlobalVariable>(Op))
+          if (IsCounter.count(GV) && GV->getValueType() == Int64Ty)
+            Slots.insert({GV, Slots.size()});
+
+    // Descriptor of F: name, and counter and weight of every slot
+    auto &FunctionWeights = Weights[F];
+    std::vector<Constant *> CounterInits, WeightInits;
+    for (auto &Slot : Slots) {
+      CounterInits.push_back(Slot.first);
+      WeightInits.push_back(ConstantInt::get(Int64Ty, FunctionWeights.lookup(Slot.first),
+                                             /*IsSigned=*/true));
+    }
+    auto createTable = [&](Type *ElemTy, ArrayRef<Constant *> Inits, const Twine &Name) -> Constant * {
+      if (Inits.empty())
+        return NullPtr;
+      ArrayType *Ty = ArrayType::get(ElemTy, Inits.size());
+      return new GlobalVariable(M, Ty, true, GlobalValue::InternalLinkage,
+                                ConstantArray::get(Ty, Inits), Name);
+    };
+    Constant *Name = ConstantDataArray::getString(CTX, F->getName());
+    auto *NameVar = new GlobalVariable(M, Name->getType(), true, GlobalValue::PrivateLinkage,
+                                       Name, "LLVM_cct_name");
+    NameVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    auto *Desc = new GlobalVariable(
+        M, DescTy, true, GlobalValue::InternalLinkage,
+        ConstantStruct::get(DescTy, {NameVar, ConstantInt::get(Int64Ty, Slots.size()),
+                                     createTable(PtrTy, CounterInits,
+                                                 "LLVM_cct_counters_" + F->getName()),
+                                     createTable(Int64Ty, WeightInits,
+                                                 "LLVM_cct_weights_" + F->getName())}),
+        "LLVM_cct_desc_" + F->getName());
+
+    // Prologue, in a new entry block (static allocas are moved to it):
+    //    caller = current
+    //    node = caller && caller->child && caller->child->desc == desc
+    //             ? caller->child : LLVM_cct_lookup(caller, desc)
+    //    node->calls++; current = node
+    BasicBlock *OldEntry = &F->getEntryBlock();
+    BasicBlock *Entry = BasicBlock::Create(CTX, "cct.entry", F, OldEntry);
+    BasicBlock *Fast = BasicBlock::Create(CTX, "cct.fast", F, OldEntry);
+    BasicBlock *Check = BasicBlock::Create(CTX, "cct.check", F, OldEntry);
+    BasicBlock *Slow = BasicBlock::Create(CTX, "cct.lookup", F, OldEntry);
+    BasicBlock *Done = BasicBlock::Create(CTX, "cct.enter", F, OldEntry);
+    for (Instruction &I : make_early_inc_range(*OldEntry))
+      if (auto *AI = dyn_cast<AllocaInst>(&I))
+        if (AI->isStaticAlloca())
+          AI->moveBefore(*Entry, Entry->end());
+
+    IRBuilder<> Builder(Entry);
+    Value *Caller = Builder.CreateLoad(PtrTy, Current, "cct.caller");
+    Builder.CreateCondBr(Builder.CreateIsNull(Caller), Slow, Fast);
+
+    Builder.SetInsertPoint(Fast);
+    Value *First = Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Caller, ChildField));
+    Builder.CreateCondBr(Builder.CreateIsNull(First), Slow, Check);
+
+    Builder.SetInsertPoint(Check);
+    Value *FirstDesc = Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, First, DescField));
+    Builder.CreateCondBr(Builder.CreateICmpEQ(FirstDesc, Desc), Done, Slow);
+
+    Builder.SetInsertPoint(Slow);
+    Value *Found = Builder.CreateCall(Lookup, {Caller, Desc});
+    Builder.CreateBr(Done);
+
+    Builder.SetInsertPoint(Done);
+    PHINode *Node = Builder.CreatePHI(PtrTy, 2, "cct.node");
+    Node->addIncoming(First, Check);
+    Node->addIncoming(Found, Slow);
+    Value *CallsPtr = emitFieldPtr(Builder, Node, CallsField);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, CallsPtr),
+                                          Builder.getInt64(1)),
+                        CallsPtr);
+    Builder.CreateStore(Node, Current);
+    Value *SlotBase = Builder.CreateConstInBoundsGEP1_64(NodeTy, Node, 1, "cct.counters");
+    for (auto &Slot : Slots) {
+      Value *SlotPtr = Builder.CreateConstInBoundsGEP1_64(Int64Ty, SlotBase, Slot.second);
+      Slot.first->replaceUsesWithIf(SlotPtr, [F](Use &U) {
+        auto *I = dyn_cast<Instruction>(U.getUser());
+        return I && I->getFunction() == F;
+      });
+    }
+    Builder.CreateBr(OldEntry);
+
+    // Epilogues: the caller's node is current again on return (before a musttail call,
+    // whose callee returns to the caller directly), and the node of F after an exception
+    for (BasicBlock &BB : *F) {
+      if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+        Instruction *InsertPt = Ret;
+        if (CallInst *TailCall = BB.getTerminatingMustTailCall())
+          InsertPt = TailCall;
+        new StoreInst(Caller, Current, InsertPt);
+      }
+      if (BB.isEHPad() && BB.getFirstInsertionPt() != BB.end())
+        new StoreInst(Node, Current, &*BB.getFirstInsertionPt());
+    }
+  }
+}
+
+// i64 LLVM_cct_fold_node(ptr node): adds the counters of `node` and of its
+// descendants to the counter table, records their inclusive and exclusive
+// counts, and sorts every list of children by decreasing inclusive count.
+// Returns the inclusive count of `node`.
+Function *CallingContextTree::getFoldNodeFunction() {
+  if (Function *F = M.getFunction("LLVM_cct_fold_node"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Constant *NullPtr = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  Function *F = Function::Create(FunctionType::get(Int64Ty, {PtrTy}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_cct_fold_node", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Slots = BasicBlock::Create(CTX, "slots", F);
+  BasicBlock *SlotsEnd = BasicBlock::Create(CTX, "slots.end", F);
+  BasicBlock *Children = BasicBlock::Create(CTX, "children", F);
+  BasicBlock *Fold = BasicBlock::Create(CTX, "children.fold", F);
+  BasicBlock *Insert = BasicBlock::Create(CTX, "insert", F);
+  BasicBlock *InsertTest = BasicBlock::Create(CTX, "insert.test", F);
+  BasicBlock *InsertNext = BasicBlock::Create(CTX, "insert.next", F);
+  BasicBlock *InsertHere = BasicBlock::Create(CTX, "insert.here", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  Value *Node = F->getArg(0);
+
+  IRBuilder<> Builder(Entry);
+  Value *Desc = Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, DescField));
+  Value *NumSlots = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(DescTy, Desc, 1));
+  Value *Counters = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescTy, Desc, 2));
+  Value *SlotWeights = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescTy, Desc, 3));
+  Value *SlotBase = Builder.CreateConstInBoundsGEP1_64(NodeTy, Node, 1);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NumSlots, Builder.getInt64(0)), SlotsEnd, Slots);
+
+  // counter[i] += slot[i]; exclusive += slot[i] * weight[i]
+  Builder.SetInsertPoint(Slots);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "i");
+  PHINode *Sum = Builder.CreatePHI(Int64Ty, 2, "sum");
+  Idx->addIncoming(Builder.getInt64(0), Entry);
+  Sum->addIncoming(Builder.getInt64(0), Entry);
+  Value *Count = Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, SlotBase, Idx));
+  Value *Counter = Builder.CreateLoad(PtrTy, Builder.CreateInBoundsGEP(PtrTy, Counters, Idx));
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Counter), Count), Counter);
+  Value *Weight = Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, SlotWeights, Idx));
+  Value *NewSum = Builder.CreateAdd(Sum, Builder.CreateMul(Count, Weight));
+  Value *NextIdx = Builder.CreateAdd(Idx, Builder.getInt64(1));
+  Idx->addIncoming(NextIdx, Slots);
+  Sum->addIncoming(NewSum, Slots);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextIdx, NumSlots), Slots, SlotsEnd);
+
+  Builder.SetInsertPoint(SlotsEnd);
+  PHINode *ExclusiveCount = Builder.CreatePHI(Int64Ty, 2, "exclusive");
+  ExclusiveCount->addIncoming(Builder.getInt64(0), Entry);
+  ExclusiveCount->addIncoming(NewSum, Slots);
+  Builder.CreateStore(ExclusiveCount, emitFieldPtr(Builder, Node, ExclusiveField));
+  Value *ChildPtr = emitFieldPtr(Builder, Node, ChildField);
+  Value *Head = Builder.CreateLoad(PtrTy, ChildPtr);
+  Builder.CreateStore(NullPtr, ChildPtr);
+  Builder.CreateBr(Children);
+
+  // Fold every child, and insert it back in the list of children (sorted)
+  Builder.SetInsertPoint(Children);
+  PHINode *C = Builder.CreatePHI(PtrTy, 2, "child");
+  PHINode *Total = Builder.CreatePHI(Int64Ty, 2, "inclusive");
+  C->addIncoming(Head, SlotsEnd);
+  Total->addIncoming(ExclusiveCount, SlotsEnd);
+  Builder.CreateCondBr(Builder.CreateIsNull(C), Exit, Fold);
+
+  Builder.SetInsertPoint(Fold);
+  Value *CSibling = emitFieldPtr(Builder, C, SiblingField);
+  Value *Next = Builder.CreateLoad(PtrTy, CSibling);
+  Value *ChildTotal = Builder.CreateCall(F, {C});
+  Value *NewTotal = Builder.CreateAdd(Total, ChildTotal);
+  Builder.CreateBr(Insert);
+
+  Builder.SetInsertPoint(Insert);
+  PHINode *Link = Builder.CreatePHI(PtrTy, 2, "link");
+  Link->addIncoming(ChildPtr, Fold);
+  Value *Other = Builder.CreateLoad(PtrTy, Link);
+  Builder.CreateCondBr(Builder.CreateIsNull(Other), InsertHere, InsertTest);
+
+  Builder.SetInsertPoint(InsertTest);
+  Value *OtherTotal = Builder.CreateLoad(Int64Ty, emitFieldPtr(Builder, Other, InclusiveField));
+  Builder.CreateCondBr(Builder.CreateICmpSGE(OtherTotal, ChildTotal), InsertNext, InsertHere);
+
+  Builder.SetInsertPoint(InsertNext);
+  Link->addIncoming(emitFieldPtr(Builder, Other, SiblingField), InsertNext);
+  Builder.CreateBr(Insert);
+
+  Builder.SetInsertPoint(InsertHere);
+  Builder.CreateStore(Other, CSibling);
+  Builder.CreateStore(C, Link);
+  C->addIncoming(Next, InsertHere);
+  Total->addIncoming(NewTotal, InsertHere);
+  Builder.CreateBr(Children);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateStore(Total, emitFieldPtr(Builder, Node, InclusiveField));
+  Builder.CreateRet(Total);
+  return F;
+}
+
+Function *CallingContextTree::createFoldFunction() {
+  auto &CTX = M.getContext();
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Function *FoldNode = getFoldNodeFunction();
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                 GlobalValue::InternalLinkage, "LLVM_cct_fold", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "roots", F);
+  BasicBlock *Body = BasicBlock::Create(CTX, "roots.fold", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+
+  IRBuilder<> Builder(Entry);
+  Value *First = Builder.CreateLoad(PtrTy, Roots);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Node = Builder.CreatePHI(PtrTy, 2, "root");
+  Node->addIncoming(First, Entry);
+  Builder.CreateCondBr(Builder.CreateIsNull(Node), Exit, Body);
+
+  Builder.SetInsertPoint(Body);
+  Builder.CreateCall(FoldNode, {Node});
+  Node->addIncoming(Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, SiblingField)), Body);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// void LLVM_cct_print(ptr node, i32 depth, i64 scale): prints the children of
+// `node` and their descendants
+Function *CallingContextTree::getPrintFunction() {
+  if (Function *F = M.getFunction("LLVM_cct_print"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  Function *F = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), {PtrTy, Int32Ty, Int64Ty}, false),
+      GlobalValue::InternalLinkage, "LLVM_cct_print", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "children", F);
+  BasicBlock *Body = BasicBlock::Create(CTX, "children.print", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  Value *Depth = F->getArg(1);
+  Value *Scale = F->getArg(2);
+
+  IRBuilder<> Builder(Entry);
+  Value *Format = Builder.CreateGlobalStringPtr("%-12lu %-12lu %-10lu %*s%s\n");
+  Value *Indent = Builder.CreateGlobalStringPtr("");
+  Value *First = Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, F->getArg(0), ChildField));
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Node = Builder.CreatePHI(PtrTy, 2, "child");
+  Node->addIncoming(First, Entry);
+  Builder.CreateCondBr(Builder.CreateIsNull(Node), Exit, Body);
+
+  Builder.SetInsertPoint(Body);
+  Value *Desc = Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, DescField));
+  Value *Name = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescTy, Desc, 0));
+  auto loadCount = [&](unsigned Field) {
+    return Builder.CreateLoad(Int64Ty, emitFieldPtr(Builder, Node, Field));
+  };
+  Builder.CreateCall(Printf, {Format, Builder.CreateMul(loadCount(InclusiveField), Scale),
+                              Builder.CreateMul(loadCount(ExclusiveField), Scale), loadCount(CallsField),
+                              Builder.CreateShl(Depth, 1), Indent, Name});
+  Builder.CreateCall(F, {Node, Builder.CreateAdd(Depth, Builder.getInt32(1)), Scale});
+  Node->addIncoming(Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, SiblingField)), Body);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+Function *CallingContextTree::createReportFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  Function *Print = getPrintFunction();
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_cct_report", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Check = BasicBlock::Create(CTX, "roots.check", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "roots", F);
+  BasicBlock *Body = BasicBlock::Create(CTX, "roots.print", F);
+  BasicBlock *Thread = BasicBlock::Create(CTX, "roots.thread", F);
+  BasicBlock *Tree = BasicBlock::Create(CTX, "roots.tree", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  Value *Scale = F->getArg(0);
+
+  IRBuilder<> Builder(Entry);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                 "-------------------------------------------------\n"
+                                 "CALLING CONTEXTS\n"
+                                 "INCLUSIVE    EXCLUSIVE    #N CALLS   CONTEXT\n"
+                                 "-------------------------------------------------\n")});
+  Value *First = Builder.CreateLoad(PtrTy, Roots);
+  Builder.CreateCondBr(Builder.CreateIsNull(First), Exit, Check);
+
+  // Threads are only told apart when there are several of them
+  Builder.SetInsertPoint(Check);
+  Value *Several = Builder.CreateIsNotNull(
+      Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, First, SiblingField)));
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Node = Builder.CreatePHI(PtrTy, 2, "root");
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "thread");
+  Node->addIncoming(First, Check);
+  Idx->addIncoming(Builder.getInt64(0), Check);
+  Builder.CreateCondBr(Builder.CreateIsNull(Node), Exit, Body);
+
+  Builder.SetInsertPoint(Body);
+  Builder.CreateCondBr(Several, Thread, Tree);
+
+  Builder.SetInsertPoint(Thread);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("thread %lu: %lu instructions\n"),
+                              Idx,
+                              Builder.CreateMul(Builder.CreateLoad(
+                                                    Int64Ty, emitFieldPtr(Builder, Node, InclusiveField)),
+                                                Scale)});
+  Builder.CreateBr(Tree);
+
+  Builder.SetInsertPoint(Tree);
+  Builder.CreateCall(Print, {Node, Builder.CreateSelect(Several, Builder.getInt32(1),
+                                                        Builder.getInt32(0)),
+                             Scale});
+  Node->addIncoming(Builder.CreateLoad(PtrTy, emitFieldPtr(Builder, Node, SiblingField)), Tree);
+  Idx->addIncoming(Builder.CreateAdd(Idx, Builder.getInt64(1)), Tree);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
@@ -0,0 +1,67 @@
+//==============================================================================
+// FILE:
+//    callingContextTree.h
+//
+// DESCRIPTION:
+//    Declares the calling-context tree of DynamicInstCounter: the instruction
+//    counts of every call path, inclusive and exclusive of the callees.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_CALLING_CONTEXT_TREE_H
+#define LLVM_DYNIC_CALLING_CONTEXT_TREE_H
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+class CallingContextTree {
+public:
+  explicit CallingContextTree(llvm::Module &M);
+
+  // Records that the instructions executed by F include Weight times the
+  // value of the 64-bit counter Counter.
+  void addTerm(llvm::Function &F, llvm::Constant *Counter, int64_t Weight);
+
+  // Makes every function of Functions enter its calling context on entry and
+  // leave it on return. The counters of Counters that a function updates are
+  // moved into its context nodes.
+  void instrument(llvm::ArrayRef<llvm::Function *> Functions,
+                  llvm::ArrayRef<llvm::GlobalVariable *> Counters);
+
+  // Creates `void LLVM_cct_fold()`, which adds the counts of the context
+  // nodes of every thread to the counters. Must run before they are read.
+  llvm::Function *createFoldFunction();
+
+  // Creates `void LLVM_cct_report(i64 scale)`, which prints the tree of every
+  // thread, its instruction counts multiplied by scale. Must run after the
+  // fold function.
+  llvm::Function *createReportFunction();
+
+private:
+  llvm::Value *emitFieldPtr(llvm::IRBuilder<> &Builder, llvm::Value *Node,
+                            unsigned Field);
+  llvm::Function *getAllocFunction();
+  llvm::Function *getLookupFunction();
+  llvm::Function *getFoldNodeFunction();
+  llvm::Function *getPrintFunction();
+
+  llvm::Module &M;
+  // Context node: { parent, descriptor, first child, next sibling, calls,
+  // inclusive count, exclusive count }, followed by the counters of the
+  // function. Roots link the trees of the threads through their sibling.
+  llvm::StructType *NodeTy;
+  // Function descriptor: { name, number of counters, counters, weights }
+  llvm::StructType *DescTy;
+  llvm::GlobalVariable *RootDesc;
+  llvm::GlobalVariable *Current;
+  llvm::GlobalVariable *Root;
+  llvm::GlobalVariable *Roots;
+  llvm::GlobalVariable *ArenaNext;
+  llvm::GlobalVariable *ArenaEnd;
+  // Instructions accounted for by every counter, for every function
+  llvm::MapVector<llvm::Function *, llvm::MapVector<llvm::Constant *, int64_t>>
+      Weights;
+};
+
+#endif
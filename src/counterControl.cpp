@@ -0,0 +1,609 @@
+//========================================================================
+// FILE:
+//    counterControl.cpp
+//
+// DESCRIPTION:
+//    On-demand reports of a running program.
+//
+//    SIGUSR1 writes the opcode totals to stderr, and SIGUSR2 writes them and
+//    resets the counters. The signal handlers belong to the module registry,
+//    which installs them once for the whole process and calls the dump and
+//    reset functions of every registered module (see moduleRegistry.cpp).
+//    The control socket, a Unix domain stream socket served by a background
+//    thread, answers the commands `dump` and `reset` with the reports of its
+//    module, one command per connection.
+//
+//    Reports are built by the signal handlers themselves, so they only use
+//    async-signal-safe code: the totals are evaluated on the stack through a
+//    constant table of (slot, weight, opcode) terms sorted by slot, formatted
+//    by hand (no printf, no malloc) into a buffer of bounded size, and sent
+//    with write(2) every time it fills up. Every counter of the table is read once,
+//    with a relaxed atomic load, or swapped with zero (atomicrmw xchg) to
+//    reset it, so the totals of a report come from a single read of every
+//    counter, and every update is counted in exactly one report or the final
+//    results. This requires atomic increments, even in single-threaded
+//    programs: a reset landing between the load and the store of a plain
+//    increment, which is what a signal handler does to the thread it
+//    interrupts, would be undone. The pass makes them atomic whenever the
+//    reports are enabled (see dynamicInstCounter.cpp).
+//
+//    Counts kept elsewhere than in the counter table are not seen, nor reset:
+//    counts of threads with thread-local counters (added at thread exit) and
+//    counters promoted to registers (flushed at loop exits).
+//
+// License: MIT
+//========================================================================
+#include "counterControl.h"
+
+#include "counterTable.h"
+#include "irUtils.h"
+#include "rawProfile.h"
+
+#include "llvm/TargetParser/Triple.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+// Width of the count column, like "%-10lu"
+constexpr uint64_t CountWidth = 10;
+// Decimal digits of the largest 64-bit count
+constexpr uint64_t MaxDigits = 20;
+// Size of the report buffer (reports are written in chunks of at most this
+// size, so that signal handlers do not need a stack as large as the report)
+constexpr uint64_t ChunkSize = 4096;
+} // namespace
+
+CounterControl::CounterControl(Module &M, StringRef SocketPattern,
+                               ArrayRef<std::string> Opcodes, bool Sampled)
+    : M(M), SocketPattern(SocketPattern), Opcodes(Opcodes),
+      Sampled(Sampled) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Triple TT(M.getTargetTriple());
+  bool BSD = TT.isOSDarwin() || TT.isOSFreeBSD() || TT.isOSNetBSD() || TT.isOSOpenBSD() ||
+             TT.isOSDragonFly();
+  ArrayType *PathTy = ArrayType::get(Type::getInt8Ty(CTX), BSD ? 104 : 108);
+  Period = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int64Ty, 1), "LLVM_control_period");
+  Socket = new GlobalVariable(M, Int32Ty, false, GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int32Ty, -1, /*IsSigned=*/true),
+                              "LLVM_control_socket");
+  SocketPath = new GlobalVariable(M, PathTy, false, GlobalValue::InternalLinkage,
+                                  Constant::getNullValue(PathTy), "LLVM_control_socket_path");
+  Owner = new GlobalVariable(M, Int32Ty, false, GlobalValue::InternalLinkage,
+                             ConstantInt::get(Int32Ty, 0), "LLVM_control_owner");
+  // pthread_t is at most 64 bits on the supported targets
+  Thread = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int64Ty, 0), "LLVM_control_thread_id");
+
+  // Report text: the header of the final results, then the opcode names
+  // padded like "%-20s " (every Stride bytes), each followed by its count
+  std::string Header = "=================================================\n"
+                       "LLVM Dynamic Instruction Counter results\n"
+                       "=================================================\n";
+  Header += Sampled ? "INST                 #N CALLS (runtime, estimated)\n"
+                    : "INST                 #N CALLS (runtime)\n";
+  Header += "-------------------------------------------------\n";
+  Stride = 20;
+  for (auto &Opcode : Opcodes)
+    Stride = std::max<uint64_t>(Stride, Opcode.size());
+  Stride++;
+  std::string Names;
+  for (auto &Opcode : Opcodes)
+    Names += Opcode + std::string(Stride - Opcode.size(), ' ');
+  HeaderText = createText(Header, "LLVM_control_header");
+  NamesText = createText(Names, "LLVM_control_names");
+}
+
+GlobalVariable *CounterControl::createText(StringRef Text, const Twine &Name) {
+  Constant *Init = ConstantDataArray::getString(M.getContext(), Text, /*AddNull=*/false);
+  auto *GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init, Name);
+  GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return GV;
+}
+
+void CounterControl::addTerm(Constant *Counter, unsigned OpcodeIdx, int64_t Weight) {
+  if (Weight == 0)
+    return;
+  const DataLayout &DL = M.getDataLayout();
+  APInt Offset(DL.getIndexTypeSizeInBits(Counter->getType()), 0);
+  auto *Placeholder = cast<GlobalVariable>(
+      Counter->stripAndAccumulateConstantOffsets(DL, Offset, /*AllowNonInbounds=*/true));
+  Terms.push_back({Placeholder->getName().str(), Offset.getZExtValue() / 8,
+                   {0, Weight, OpcodeIdx}});
+}
+
+// i64 LLVM_control_format(ptr out, i64 count): writes count in decimal, left
+// aligned in CountWidth columns, and a newline. Returns the number of bytes.
+Function *CounterControl::createFormatFunction() {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Function *F = Function::Create(FunctionType::get(Int64Ty, {PtrTy, Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_control_format", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Digit = BasicBlock::Create(CTX, "digit", F);
+  BasicBlock *Copy = BasicBlock::Create(CTX, "copy", F);
+  Value *Out = F->getArg(0);
+
+  // Digits are produced backwards, at the end of a scratch buffer
+  IRBuilder<> Builder(Entry);
+  Value *Digits = Builder.CreateAlloca(ArrayType::get(Int8Ty, MaxDigits), nullptr, "digits");
+  Builder.CreateBr(Digit);
+
+  Builder.SetInsertPoint(Digit);
+  PHINode *Rest = Builder.CreatePHI(Int64Ty, 2, "rest");
+  PHINode *Pos = Builder.CreatePHI(Int64Ty, 2, "pos");
+  Rest->addIncoming(F->getArg(1), Entry);
+  Pos->addIncoming(Builder.getInt64(MaxDigits), Entry);
+  Value *NextPos = Builder.CreateSub(Pos, Builder.getInt64(1));
+  Builder.CreateStore(
+      Builder.CreateTrunc(Builder.CreateAdd(Builder.CreateURem(Rest, Builder.getInt64(10)),
+                                            Builder.getInt64('0')),
+                          Int8Ty),
+      Builder.CreateInBoundsGEP(Int8Ty, Digits, NextPos));
+  Value *NextRest = Builder.CreateUDiv(Rest, Builder.getInt64(10));
+  Rest->addIncoming(NextRest, Digit);
+  Pos->addIncoming(NextPos, Digit);
+  Builder.CreateCondBr(Builder.CreateIsNull(NextRest), Copy, Digit);
+
+  Builder.SetInsertPoint(Copy);
+  Value *Len = Builder.CreateSub(Builder.getInt64(MaxDigits), NextPos);
+  Builder.CreateMemCpy(Out, MaybeAlign(1), Builder.CreateInBoundsGEP(Int8Ty, Digits, NextPos),
+                       MaybeAlign(1), Len);
+  Value *Width = Builder.CreateSelect(Builder.CreateICmpULT(Len, Builder.getInt64(CountWidth)),
+                                      Builder.getInt64(CountWidth), Len);
+  Builder.CreateMemSet(Builder.CreateInBoundsGEP(Int8Ty, Out, Len), Builder.getInt8(' '),
+                       Builder.CreateSub(Width, Len), MaybeAlign(1));
+  Builder.CreateStore(Builder.getInt8('\n'), Builder.CreateInBoundsGEP(Int8Ty, Out, Width));
+  Builder.CreateRet(Builder.CreateAdd(Width, Builder.getInt64(1)));
+  return F;
+}
+
+// void LLVM_control_dump(i32 fd) / LLVM_control_reset(i32 fd): evaluates the
+// opcode totals (resetting the counters) and writes the report to fd
+Function *CounterControl::createReportFunction(bool Reset, GlobalVariable *Table,
+                                               uint64_t NumCounters, GlobalVariable *TermTable) {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  uint64_t NumOpcodes = std::max<uint64_t>(Opcodes.size(), 1);
+  auto *TermsTy = cast<ArrayType>(TermTable->getValueType());
+  uint64_t NumTerms = TermsTy->getNumElements();
+  StringRef Footer = "Counters reset\n";
+  uint64_t HeaderSize = HeaderText->getValueType()->getArrayNumElements();
+  uint64_t LineSize = Stride + MaxDigits + 1;
+  uint64_t BufferSize = std::max(ChunkSize, LineSize);
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int32Ty}, false),
+                                 GlobalValue::InternalLinkage,
+                                 Reset ? "LLVM_control_reset" : "LLVM_control_dump", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *Zero = Builder.getInt64(0);
+  ArrayType *TotalsTy = ArrayType::get(Int64Ty, NumOpcodes);
+  Value *Totals = Builder.CreateAlloca(TotalsTy, nullptr, "totals");
+  Value *Buffer = Builder.CreateAlloca(ArrayType::get(Int8Ty, BufferSize), nullptr, "buffer");
+  // First slot not read yet, and value of the last slot read
+  Value *Cursor = Builder.CreateAlloca(Int64Ty, nullptr, "cursor");
+  Value *Current = Builder.CreateAlloca(Int64Ty, nullptr, "current");
+  Value *Pos = Builder.CreateAlloca(Int64Ty, nullptr, "pos");
+  Builder.CreateMemSet(Totals, Builder.getInt8(0), NumOpcodes * 8, MaybeAlign(8));
+  Builder.CreateStore(Zero, Cursor);
+  Builder.CreateStore(Zero, Current);
+
+  // The counters are updated concurrently: every slot is read (or swapped
+  // with zero) exactly once, in table order, and its terms applied
+  auto counterAt = [&](Value *Slot) {
+    return Builder.CreateInBoundsGEP(Table->getValueType(), Table, {Zero, Slot});
+  };
+  auto resetSlots = [&](Value *End) {
+    emitLoop(Builder, Builder.CreateLoad(Int64Ty, Cursor), End, "skip", [&](Value *Slot) {
+      Builder.CreateAtomicRMW(AtomicRMWInst::Xchg, counterAt(Slot), Zero, MaybeAlign(8),
+                              AtomicOrdering::Monotonic);
+    });
+  };
+  if (Table && NumTerms) {
+    emitLoop(Builder, Zero, Builder.getInt64(NumTerms), "terms", [&](Value *TermIdx) {
+      auto field = [&](unsigned Field) {
+        return Builder.CreateLoad(
+            Int64Ty, Builder.CreateInBoundsGEP(TermsTy, TermTable,
+                                               {Zero, TermIdx, Builder.getInt32(Field)}));
+      };
+      Value *Slot = field(0);
+      BasicBlock *Read = BasicBlock::Create(CTX, "read", F);
+      BasicBlock *Add = BasicBlock::Create(CTX, "add", F);
+      Builder.CreateCondBr(Builder.CreateICmpUGE(Slot, Builder.CreateLoad(Int64Ty, Cursor)),
+                           Read, Add);
+      Builder.SetInsertPoint(Read);
+      Value *Counter;
+      if (Reset) {
+        resetSlots(Slot);
+        Counter = Builder.CreateAtomicRMW(AtomicRMWInst::Xchg, counterAt(Slot), Zero,
+                                          MaybeAlign(8), AtomicOrdering::Monotonic);
+      } else {
+        LoadInst *Load = Builder.CreateLoad(Int64Ty, counterAt(Slot));
+        Load->setAtomic(AtomicOrdering::Monotonic);
+        Load->setAlignment(Align(8));
+        Counter = Load;
+      }
+      Builder.CreateStore(Counter, Current);
+      Builder.CreateStore(Builder.CreateAdd(Slot, Builder.getInt64(1)), Cursor);
+      Builder.CreateBr(Add);
+      Builder.SetInsertPoint(Add);
+      Value *Total = Builder.CreateInBoundsGEP(TotalsTy, Totals, {Zero, field(2)});
+      Builder.CreateStore(
+          Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Total),
+                            Builder.CreateMul(Builder.CreateLoad(Int64Ty, Current), field(1))),
+          Total);
+    });
+  }
+  if (Table && Reset)
+    resetSlots(Builder.getInt64(NumCounters));
+
+  // Report, scaled by the sampling period: the lines are buffered, and the
+  // buffer written whenever the next line may not fit
+  Value *Fd = F->getArg(0);
+  Builder.CreateCall(WriteAll, {Fd, HeaderText, Builder.getInt64(HeaderSize)});
+  Builder.CreateStore(Zero, Pos);
+  Value *P = Builder.CreateLoad(Int64Ty, Period);
+  emitLoop(Builder, Zero, Builder.getInt64(Opcodes.size()), "lines", [&](Value *OpcodeIdx) {
+    BasicBlock *Flush = BasicBlock::Create(CTX, "flush", F);
+    BasicBlock *Fill = BasicBlock::Create(CTX, "fill", F);
+    Value *Used = Builder.CreateLoad(Int64Ty, Pos);
+    Builder.CreateCondBr(Builder.CreateICmpUGT(Used, Builder.getInt64(BufferSize - LineSize)),
+                         Flush, Fill);
+    Builder.SetInsertPoint(Flush);
+    Builder.CreateCall(WriteAll, {Fd, Buffer, Used});
+    Builder.CreateStore(Zero, Pos);
+    Builder.CreateBr(Fill);
+    Builder.SetInsertPoint(Fill);
+    Value *Line = Builder.CreateInBoundsGEP(Int8Ty, Buffer, Builder.CreateLoad(Int64Ty, Pos));
+    Builder.CreateMemCpy(
+        Line, MaybeAlign(1),
+        Builder.CreateInBoundsGEP(Int8Ty, NamesText,
+                                  Builder.CreateMul(OpcodeIdx, Builder.getInt64(Stride))),
+        MaybeAlign(1), Stride);
+    Value *Count = Builder.CreateMul(
+        Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(TotalsTy, Totals, {Zero, OpcodeIdx})),
+        P);
+    Value *Len = Builder.CreateCall(
+        Format, {Builder.CreateConstInBoundsGEP1_64(Int8Ty, Line, Stride), Count});
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Pos), Builder.CreateAdd(Len, Builder.getInt64(Stride))),
+        Pos);
+  });
+  Builder.CreateCall(WriteAll, {Fd, Buffer, Builder.CreateLoad(Int64Ty, Pos)});
+  if (Reset)
+    Builder.CreateCall(WriteAll, {Fd, createText(Footer, "LLVM_control_reset_note"),
+                                  Builder.getInt64(Footer.size())});
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// void LLVM_control_write(i32 fd, ptr data, i64 size): writes the data to
+// fd. Short writes (pipes, sockets) are resumed, errors give up.
+Function *CounterControl::createWriteFunction() {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee Write = M.getOrInsertFunction(
+      "write", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty}, false));
+  Function *F =
+      Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int32Ty, PtrTy, Int64Ty}, false),
+                       GlobalValue::InternalLinkage, "LLVM_control_write", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "write", F);
+  BasicBlock *Next = BasicBlock::Create(CTX, "next", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  Value *Size = F->getArg(2);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateCondBr(Builder.CreateIsNull(Size), Exit, Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Written = Builder.CreatePHI(Int64Ty, 2, "written");
+  Written->addIncoming(Builder.getInt64(0), Entry);
+  Value *Result = Builder.CreateCall(
+      Write, {F->getArg(0), Builder.CreateInBoundsGEP(Int8Ty, F->getArg(1), Written),
+              Builder.CreateSub(Size, Written)});
+  Builder.CreateCondBr(Builder.CreateICmpSLE(Result, Builder.getInt64(0)), Exit, Next);
+  Builder.SetInsertPoint(Next);
+  Value *NewWritten = Builder.CreateAdd(Written, Result);
+  Written->addIncoming(NewWritten, Next);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NewWritten, Size), Loop, Exit);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// ptr LLVM_control_thread(ptr): serves the connections to the control socket
+Function *CounterControl::createSocketThread() {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Constant *Null = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  FunctionCallee Accept = M.getOrInsertFunction(
+      "accept", FunctionType::get(Int32Ty, {Int32Ty, PtrTy, PtrTy}, false));
+  FunctionCallee Read = M.getOrInsertFunction(
+      "read", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty}, false));
+  FunctionCallee Write = M.getOrInsertFunction(
+      "write", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty}, false));
+  FunctionCallee Close = M.getOrInsertFunction("close", FunctionType::get(Int32Ty, {Int32Ty}, false));
+  FunctionCallee Memcmp = M.getOrInsertFunction(
+      "memcmp", FunctionType::get(Int32Ty, {PtrTy, PtrTy, Int64Ty}, false));
+  FunctionCallee Memchr = M.getOrInsertFunction(
+      "memchr", FunctionType::get(PtrTy, {PtrTy, Int32Ty, Int64Ty}, false));
+
+  Function *F = Function::Create(FunctionType::get(PtrTy, {PtrTy}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_control_thread", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+  BasicBlock *Failed = BasicBlock::Create(CTX, "failed", F);
+  BasicBlock *Serve = BasicBlock::Create(CTX, "serve", F);
+  BasicBlock *Receive = BasicBlock::Create(CTX, "receive", F);
+  BasicBlock *Received = BasicBlock::Create(CTX, "received", F);
+  BasicBlock *NotReceived = BasicBlock::Create(CTX, "not_received", F);
+  BasicBlock *Parse = BasicBlock::Create(CTX, "parse", F);
+  BasicBlock *NotDump = BasicBlock::Create(CTX, "not_dump", F);
+  BasicBlock *DoDump = BasicBlock::Create(CTX, "dump", F);
+  BasicBlock *DoReset = BasicBlock::Create(CTX, "reset", F);
+  BasicBlock *Unknown = BasicBlock::Create(CTX, "unknown", F);
+  BasicBlock *Next = BasicBlock::Create(CTX, "next", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+
+  IRBuilder<> Builder(Entry);
+  const uint64_t CommandSize = 16;
+  Value *Command = Builder.CreateAlloca(ArrayType::get(Int8Ty, CommandSize), nullptr, "command");
+  Builder.CreateBr(Loop);
+
+  // Interrupted by a signal (e.g. a report): wait again
+  Builder.SetInsertPoint(Loop);
+  Value *Conn = Builder.CreateCall(Accept, {Builder.CreateLoad(Int32Ty, Socket), Null, Null});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Conn, Builder.getInt32(0)), Failed, Serve);
+  Builder.SetInsertPoint(Failed);
+  const int Interrupted = 4; // EINTR
+  auto isInterrupted = [&]() {
+    return Builder.CreateICmpEQ(Builder.CreateLoad(Int32Ty, emitErrnoLocation(Builder)),
+                                Builder.getInt32(Interrupted));
+  };
+  Builder.CreateCondBr(isInterrupted(), Loop, Exit);
+
+  // The command is read until a newline, the end of the connection or a full
+  // buffer (a stream socket may deliver it in several pieces)
+  Builder.SetInsertPoint(Serve);
+  Builder.CreateMemSet(Command, Builder.getInt8(0), CommandSize, MaybeAlign(1));
+  Builder.CreateBr(Receive);
+  Builder.SetInsertPoint(Receive);
+  PHINode *Len = Builder.CreatePHI(Int64Ty, 3, "len");
+  Len->addIncoming(Builder.getInt64(0), Serve);
+  Value *Piece = Builder.CreateInBoundsGEP(Int8Ty, Command, Len);
+  Value *Got = Builder.CreateCall(
+      Read, {Conn, Piece, Builder.CreateSub(Builder.getInt64(CommandSize - 1), Len)});
+  Builder.CreateCondBr(Builder.CreateICmpSGT(Got, Builder.getInt64(0)), Received, NotReceived);
+  Builder.SetInsertPoint(NotReceived);
+  Len->addIncoming(Len, NotReceived);
+  Builder.CreateCondBr(
+      Builder.CreateAnd(Builder.CreateICmpSLT(Got, Builder.getInt64(0)), isInterrupted()), Receive,
+      Parse);
+  Builder.SetInsertPoint(Received);
+  Value *NewLen = Builder.CreateAdd(Len, Got);
+  Len->addIncoming(NewLen, Received);
+  Value *Newline = Builder.CreateCall(Memchr, {Piece, Builder.getInt32('\n'), Got});
+  Builder.CreateCondBr(
+      Builder.CreateOr(Builder.CreateIsNotNull(Newline),
+                       Builder.CreateICmpEQ(NewLen, Builder.getInt64(CommandSize - 1))),
+      Parse, Receive);
+
+  Builder.SetInsertPoint(Parse);
+  auto isCommand = [&](StringRef Name) {
+    return Builder.CreateIsNull(Builder.CreateCall(
+        Memcmp, {Command, Builder.CreateGlobalStringPtr(Name, "LLVM_control_command_" + Name),
+                 Builder.getInt64(Name.size())}));
+  };
+  Builder.CreateCondBr(isCommand("dump"), DoDump, NotDump);
+  Builder.SetInsertPoint(NotDump);
+  Builder.CreateCondBr(isCommand("reset"), DoReset, Unknown);
+  Builder.SetInsertPoint(DoDump);
+  Builder.CreateCall(Dump, {Conn});
+  Builder.CreateBr(Next);
+  Builder.SetInsertPoint(DoReset);
+  Builder.CreateCall(Reset, {Conn});
+  Builder.CreateBr(Next);
+  Builder.SetInsertPoint(Unknown);
+  StringRef Usage = "unknown command (dump, reset)\n";
+  Builder.CreateCall(Write, {Conn, Builder.CreateGlobalStringPtr(Usage, "LLVM_control_usage"),
+                             Builder.getInt64(Usage.size())});
+  Builder.CreateBr(Next);
+  Builder.SetInsertPoint(Next);
+  Builder.CreateCall(Close, {Conn});
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRet(Null);
+  return F;
+}
+
+Function *CounterControl::createStartFunction(const CounterTable &Counters, GlobalVariable *Table,
+                                              uint64_t NumCounters) {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int16Ty = Type::getInt16Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  Constant *Null = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+
+  // Terms in table order, now that the counters have their slot
+  std::vector<Term> SortedTerms;
+  for (auto &Pending : Terms) {
+    SortedTerms.push_back(Pending.Entry);
+    SortedTerms.back().Slot = Counters.getSlot(Pending.Placeholder) + Pending.Offset;
+  }
+  Terms.clear();
+  llvm::stable_sort(SortedTerms, [](const Term &A, const Term &B) { return A.Slot < B.Slot; });
+
+  // Constant table: { i64 slot, i64 weight, i64 opcode } LLVM_control_terms[]
+  StructType *TermTy = StructType::get(CTX, {Int64Ty, Int64Ty, Int64Ty});
+  std::vector<Constant *> TermInits;
+  for (const Term &T : SortedTerms)
+    TermInits.push_back(ConstantStruct::get(
+        TermTy, {ConstantInt::get(Int64Ty, T.Slot),
+                 ConstantInt::get(Int64Ty, T.Weight, /*IsSigned=*/true),
+                 ConstantInt::get(Int64Ty, T.Opcode)}));
+  ArrayType *TermsTy = ArrayType::get(TermTy, TermInits.size());
+  auto *TermTable = new GlobalVariable(M, TermsTy, true, GlobalValue::InternalLinkage,
+                                       ConstantArray::get(TermsTy, TermInits),
+                                       "LLVM_control_terms");
+  Format = createFormatFunction();
+  WriteAll = createWriteFunction();
+  Dump = createReportFunction(/*Reset=*/false, Table, NumCounters, TermTable);
+  Reset = createReportFunction(/*Reset=*/true, Table, NumCounters, TermTable);
+
+  Function *F = Function::Create(FunctionType::get(VoidTy, {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_control_start", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateStore(F->getArg(0), Period);
+
+  if (SocketPattern.empty()) {
+    Builder.CreateBr(Exit);
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+    return F;
+  }
+
+  FunctionCallee Strlen =
+      M.getOrInsertFunction("strlen", FunctionType::get(Int64Ty, {PtrTy}, false));
+  FunctionCallee SocketF = M.getOrInsertFunction(
+      "socket", FunctionType::get(Int32Ty, {Int32Ty, Int32Ty, Int32Ty}, false));
+  FunctionCallee Unlink = M.getOrInsertFunction("unlink", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Bind = M.getOrInsertFunction(
+      "bind", FunctionType::get(Int32Ty, {Int32Ty, PtrTy, Int32Ty}, false));
+  FunctionCallee Listen = M.getOrInsertFunction(
+      "listen", FunctionType::get(Int32Ty, {Int32Ty, Int32Ty}, false));
+  FunctionCallee Close = M.getOrInsertFunction("close", FunctionType::get(Int32Ty, {Int32Ty}, false));
+  FunctionCallee Getpid = M.getOrInsertFunction("getpid", FunctionType::get(Int32Ty, false));
+  FunctionCallee Perror = M.getOrInsertFunction("perror", FunctionType::get(VoidTy, {PtrTy}, false));
+  FunctionCallee Write = M.getOrInsertFunction(
+      "write", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty}, false));
+  FunctionCallee PthreadCreate = M.getOrInsertFunction(
+      "pthread_create", FunctionType::get(Int32Ty, {PtrTy, PtrTy, PtrTy, PtrTy}, false));
+
+  // struct sockaddr_un: sun_len (BSD only) and sun_family, then sun_path
+  Triple TT(M.getTargetTriple());
+  bool BSD = TT.isOSDarwin() || TT.isOSFreeBSD() || TT.isOSNetBSD() || TT.isOSOpenBSD() ||
+             TT.isOSDragonFly();
+  const int UnixFamily = 1, StreamSocket = 1, Backlog = 8; // AF_UNIX, SOCK_STREAM
+  uint64_t PathSize = SocketPath->getValueType()->getArrayNumElements();
+  ArrayType *AddrTy = ArrayType::get(Int8Ty, 2 + PathSize);
+  BasicBlock *TooLong = BasicBlock::Create(CTX, "too_long", F);
+  BasicBlock *Create = BasicBlock::Create(CTX, "create", F);
+  BasicBlock *Bound = BasicBlock::Create(CTX, "bind", F);
+  BasicBlock *Listening = BasicBlock::Create(CTX, "listen", F);
+  BasicBlock *Start = BasicBlock::Create(CTX, "start", F);
+  BasicBlock *Fail = BasicBlock::Create(CTX, "fail", F);
+  BasicBlock *Cleanup = BasicBlock::Create(CTX, "cleanup", F);
+
+  Value *Path = emitProfilePath(Builder, SocketPattern);
+  Value *Addr = Builder.CreateAlloca(AddrTy, nullptr, "addr");
+  Value *PathLen = Builder.CreateCall(Strlen, {Path});
+  Builder.CreateCondBr(Builder.CreateICmpUGE(PathLen, Builder.getInt64(PathSize)), TooLong, Create);
+
+  Builder.SetInsertPoint(TooLong);
+  StringRef Message = "dynic: the control socket path is too long\n";
+  Builder.CreateCall(Write, {Builder.getInt32(2),
+                             Builder.CreateGlobalStringPtr(Message, "LLVM_control_too_long"),
+                             Builder.getInt64(Message.size())});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Create);
+  Value *Fd = Builder.CreateCall(SocketF, {Builder.getInt32(UnixFamily), Builder.getInt32(StreamSocket),
+                                           Builder.getInt32(0)});
+  Builder.CreateMemSet(Addr, Builder.getInt8(0), 2 + PathSize, MaybeAlign(2));
+  if (BSD) {
+    Builder.CreateStore(Builder.getInt8(2 + PathSize), Addr);
+    Builder.CreateStore(Builder.getInt8(UnixFamily), Builder.CreateConstInBoundsGEP1_64(Int8Ty, Addr, 1));
+  } else {
+    Builder.CreateStore(ConstantInt::get(Int16Ty, UnixFamily), Addr);
+  }
+  Value *SunPath = Builder.CreateConstInBoundsGEP1_64(Int8Ty, Addr, 2);
+  Builder.CreateMemCpy(SunPath, MaybeAlign(1), Path, MaybeAlign(1), PathLen);
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Fd, Builder.getInt32(0)), Fail, Bound);
+
+  // A socket left by a previous run is replaced
+  Builder.SetInsertPoint(Bound);
+  Builder.CreateCall(Unlink, {Path});
+  Value *Bind_ = Builder.CreateCall(Bind, {Fd, Addr, Builder.getInt32(2 + PathSize)});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Bind_, Builder.getInt32(0)), Cleanup, Listening);
+
+  Builder.SetInsertPoint(Listening);
+  Value *Listen_ = Builder.CreateCall(Listen, {Fd, Builder.getInt32(Backlog)});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Listen_, Builder.getInt32(0)), Cleanup, Start);
+
+  Builder.SetInsertPoint(Start);
+  Builder.CreateStore(Fd, Socket);
+  Builder.CreateMemCpy(SocketPath, MaybeAlign(1), SunPath, MaybeAlign(1), PathSize);
+  Builder.CreateStore(Builder.CreateCall(Getpid), Owner);
+  Builder.CreateCall(PthreadCreate, {Thread, Null, createSocketThread(), Null});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Cleanup);
+  Builder.CreateCall(Perror, {Path});
+  Builder.CreateCall(Close, {Fd});
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Fail);
+  Builder.CreateCall(Perror, {Path});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+Function *CounterControl::createStopFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee Getpid = M.getOrInsertFunction("getpid", FunctionType::get(Int32Ty, false));
+  FunctionCallee Unlink = M.getOrInsertFunction("unlink", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Shutdown = M.getOrInsertFunction(
+      "shutdown", FunctionType::get(Int32Ty, {Int32Ty, Int32Ty}, false));
+  FunctionCallee PthreadJoin = M.getOrInsertFunction(
+      "pthread_join", FunctionType::get(Int32Ty, {Type::getInt64Ty(CTX), PtrTy}, false));
+  const int ShutReadWrite = 2; // SHUT_RDWR
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                 GlobalValue::InternalLinkage, "LLVM_control_stop", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Remove = BasicBlock::Create(CTX, "remove", F);
+  BasicBlock *Join = BasicBlock::Create(CTX, "join", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Builder.CreateLoad(Int32Ty, Owner),
+                                            Builder.CreateCall(Getpid)),
+                       Remove, Exit);
+  // Shutting the socket down wakes the thread up from accept where this is
+  // supported (Linux): only then is it waited for
+  Builder.SetInsertPoint(Remove);
+  Builder.CreateCall(Unlink, {SocketPath});
+  Value *Down = Builder.CreateCall(
+      Shutdown, {Builder.CreateLoad(Int32Ty, Socket), Builder.getInt32(ShutReadWrite)});
+  Builder.CreateCondBr(Builder.CreateIsNull(Down), Join, Exit);
+  Builder.SetInsertPoint(Join);
+  Builder.CreateCall(PthreadJoin, {Builder.CreateLoad(Type::getInt64Ty(CTX), Thread),
+                                   ConstantPointerNull::get(cast<PointerType>(PtrTy))});
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
@@ -0,0 +1,99 @@
+//==============================================================================
+// FILE:
+//    counterControl.h
+//
+// DESCRIPTION:
+//    Declares the on-demand reports of DynamicInstCounter: while the program
+//    runs, SIGUSR1 prints the opcode totals, SIGUSR2 prints them and resets
+//    the counters (through the module registry), and the same requests can
+//    be sent to a Unix domain socket.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTER_CONTROL_H
+#define LLVM_DYNIC_COUNTER_CONTROL_H
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+#include <vector>
+
+class CounterTable;
+
+class CounterControl {
+public:
+  // SocketPattern, if not empty, names the control socket (%p: process ID,
+  // %h: host name, %%: %). The reports list the opcodes of Opcodes, with
+  // estimated counts if the counters are Sampled.
+  CounterControl(llvm::Module &M, llvm::StringRef SocketPattern,
+                 llvm::ArrayRef<std::string> Opcodes, bool Sampled);
+
+  // Records that the executions of opcode OpcodeIdx include Weight times the
+  // value of Counter, a counter of the counter table (before its layout).
+  void addTerm(llvm::Constant *Counter, unsigned OpcodeIdx, int64_t Weight);
+
+  // Creates `void LLVM_control_start(i64 period)`, which starts the socket
+  // thread, the counts being multiplied by period, and the report functions.
+  // Table is the counter table laid out by Counters (nullptr if there
+  // are no counters), with NumCounters counters.
+  llvm::Function *createStartFunction(const CounterTable &Counters,
+                                      llvm::GlobalVariable *Table,
+                                      uint64_t NumCounters);
+
+  // Creates `void LLVM_control_stop()`, which removes the socket and stops
+  // the thread serving it
+  llvm::Function *createStopFunction();
+
+  // `void LLVM_control_dump(i32 fd)` and `void LLVM_control_reset(i32 fd)`,
+  // which write the report to fd (resetting the counters): the hooks of the
+  // signal handlers of the module registry. Created by createStartFunction.
+  llvm::Function *getDump() const { return Dump; }
+  llvm::Function *getReset() const { return Reset; }
+
+private:
+  struct Term {
+    uint64_t Slot;
+    int64_t Weight;
+    unsigned Opcode;
+  };
+
+  llvm::GlobalVariable *createText(llvm::StringRef Text, const llvm::Twine &Name);
+  llvm::Function *createReportFunction(bool Reset, llvm::GlobalVariable *Table,
+                                       uint64_t NumCounters, llvm::GlobalVariable *TermTable);
+  llvm::Function *createFormatFunction();
+  llvm::Function *createWriteFunction();
+  llvm::Function *createSocketThread();
+
+  llvm::Module &M;
+  std::string SocketPattern;
+  std::vector<std::string> Opcodes;
+  bool Sampled;
+  // Counters by placeholder name and offset in the placeholder (in counters),
+  // with their terms: the counters themselves are replaced by the layout
+  struct PendingTerm {
+    std::string Placeholder;
+    uint64_t Offset;
+    Term Entry;
+  };
+  std::vector<PendingTerm> Terms;
+  // Report text: header, and opcode names padded to Stride bytes
+  llvm::GlobalVariable *HeaderText = nullptr;
+  llvm::GlobalVariable *NamesText = nullptr;
+  uint64_t Stride = 0;
+  llvm::Function *Format = nullptr;
+  llvm::Function *WriteAll = nullptr;
+  llvm::Function *Dump = nullptr;
+  llvm::Function *Reset = nullptr;
+  // Runtime state: sampling period, listening socket, path of the socket,
+  // process that created it (forked children must not remove it) and thread
+  // serving it
+  llvm::GlobalVariable *Period = nullptr;
+  llvm::GlobalVariable *Socket = nullptr;
+  llvm::GlobalVariable *SocketPath = nullptr;
+  llvm::GlobalVariable *Owner = nullptr;
+  llvm::GlobalVariable *Thread = nullptr;
+};
+
+#endif
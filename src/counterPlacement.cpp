@@ -0,0 +1,416 @@
+//========================================================================
+// FILE:
+//    counterPlacement.cpp
+//
+// DESCRIPTION:
+//    Counter placement strategies for the block-level counting modes.
+//
+//    Edge placement follows Knuth's optimal instrumentation: the CFG of a
+//    function is extended with a virtual EXIT node (fed by every exit block)
+//    and a virtual EXIT -> entry edge, so that the execution counts of the
+//    edges form a circulation. Given a spanning tree of this graph, every
+//    non-tree edge (chord) closes exactly one cycle with the tree, and the
+//    count of every tree edge is the signed sum of the counts of the chords
+//    whose cycle goes through it. Hence only chords need a counter. The tree
+//    is a maximum spanning tree w.r.t. the static edge frequencies, so that
+//    counters land on cold edges.
+//
+//    Loop hoisting relies on ScalarEvolution: if the backedge-taken count BTC
+//    of a loop is computable, its header runs BTC + 1 times every time the
+//    loop is entered. The blocks that run once per iteration then get their
+//    count from a single counter incremented by BTC + 1 in the preheader.
+//
+//    Control equivalence reuses the edge placement: the count of every block
+//    is a linear combination of the chord counts, and two blocks whose
+//    combinations are identical run the same number of times in every
+//    execution (they are cycle equivalent). Those blocks are ordered by
+//    dominance and can share the counter of the first one.
+//
+// License: MIT
+//========================================================================
+#include "counterPlacement.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <numeric>
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// Block placement
+//-----------------------------------------------------------------------------
+CounterPlacement placeBlockCounters(Function &F) {
+  CounterPlacement Placement;
+  for (auto &BB : F) {
+    Placement.BlockCounts[&BB].push_back({Placement.Sites.size(), 1});
+    Placement.Sites.push_back({&BB, nullptr, false});
+  }
+  return Placement;
+}
+
+//-----------------------------------------------------------------------------
+// Block placement with loop hoisting
+//-----------------------------------------------------------------------------
+namespace {
+// A block whose count is derived from the trip counter of its loop
+struct HoistedBlock {
+  unsigned TripCounter;
+  llvm::BasicBlock *Preheader;
+  // The block is skipped by the last trip (the loop exits from its header)
+  bool SkipsLastTrip;
+};
+
+void addTerm(CounterCombination &Combination, unsigned Counter, int64_t Coeff) {
+  auto It = std::find_if(Combination.begin(), Combination.end(),
+                         [&](auto &T) { return T.first == Counter; });
+  if (It == Combination.end())
+    Combination.push_back({Counter, Coeff});
+  else
+    It->second += Coeff;
+}
+} // namespace
+
+CounterPlacement placeHoistedBlockCounters(Function &F, LoopInfo &LI,
+                                           ScalarEvolution &SE,
+                                           DominatorTree &DT) {
+  CounterPlacement Placement;
+  DenseMap<BasicBlock *, HoistedBlock> Hoisted;
+  SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "dynic");
+  Type *Int64Ty = Type::getInt64Ty(F.getContext());
+
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    // Only loops in simplified form, exiting either from the latch (every
+    // trip runs the blocks dominating the latch) or from the header (the last
+    // trip only runs the header)
+    BasicBlock *Preheader = L->getLoopPreheader();
+    BasicBlock *Latch = L->getLoopLatch();
+    BasicBlock *Exiting = L->getExitingBlock();
+    if (!Preheader || !Latch || !Exiting ||
+        (Exiting != Latch && Exiting != L->getHeader()))
+      continue;
+
+    const SCEV *BTC = SE.getBackedgeTakenCount(L);
+    Instruction *InsertPt = Preheader->getTerminator();
+    if (isa<SCEVCouldNotCompute>(BTC) || !Expander.isSafeToExpandAt(BTC, InsertPt))
+      continue;
+
+    const SCEV *Trips = SE.getAddExpr(SE.getTruncateOrZeroExtend(BTC, Int64Ty),
+                                      SE.getOne(Int64Ty));
+    Value *Step = Expander.expandCodeFor(Trips, Int64Ty, InsertPt);
+    unsigned TripCounter = Placement.Sites.size();
+    Placement.Sites.push_back({Preheader, L->getHeader(), true, Step});
+
+    for (BasicBlock *BB : L->blocks())
+      if (LI.getLoopFor(BB) == L && DT.dominates(BB, Latch))
+        Hoisted[BB] = {TripCounter, Preheader,
+                       Exiting != Latch && BB != L->getHeader()};
+  }
+
+  // Every other block gets its own counter
+  for (auto &BB : F)
+    if (!Hoisted.count(&BB)) {
+      Placement.BlockCounts[&BB].push_back({Placement.Sites.size(), 1});
+      Placement.Sites.push_back({&BB, nullptr, false});
+    }
+
+  // count(BB) = trips, or trips - count(preheader) if the last trip skips BB
+  std::function<CounterCombination(BasicBlock *)> CountOf = [&](BasicBlock *BB) {
+    auto It = Hoisted.find(BB);
+    if (It == Hoisted.end())
+      return Placement.BlockCounts[BB];
+    CounterCombination Count = {{It->second.TripCounter, 1}};
+    if (It->second.SkipsLastTrip)
+      for (auto &Term : CountOf(It->second.Preheader))
+        addTerm(Count, Term.first, -Term.second);
+    return Count;
+  };
+  for (auto &BB : F)
+    if (Hoisted.count(&BB))
+      Placement.BlockCounts[&BB] = CountOf(&BB);
+
+  return Placement;
+}
+
+//-----------------------------------------------------------------------------
+// Edge placement
+//-----------------------------------------------------------------------------
+namespace {
+unsigned findRoot(std::vector<unsigned> &Parent, unsigned N) {
+  while (Parent[N] != N)
+    N = Parent[N] = Parent[Parent[N]];
+  return N;
+}
+} // namespace
+
+bool canSplitEdges(Function &F) {
+  for (auto &BB : F) {
+    if (BB.isEHPad())
+      return false;
+    auto *TI = BB.getTerminator();
+    if (isa<IndirectBrInst>(TI) || isa<CallBrInst>(TI))
+      return false;
+  }
+  return true;
+}
+
+std::vector<bool> findMaxSpanningTree(unsigned NumNodes,
+                                      const std::vector<WeightedEdge> &Edges) {
+  // Hot edges first
+  std::vector<unsigned> Order(Edges.size());
+  std::iota(Order.begin(), Order.end(), 0);
+  std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+    return Edges[A].Weight > Edges[B].Weight;
+  });
+
+  std::vector<bool> InTree(Edges.size(), false);
+  std::vector<unsigned> UnionFind(NumNodes);
+  std::iota(UnionFind.begin(), UnionFind.end(), 0);
+  for (unsigned E : Order) {
+    unsigned RootSrc = findRoot(UnionFind, Edges[E].Src);
+    unsigned RootDst = findRoot(UnionFind, Edges[E].Dst);
+    if (RootSrc == RootDst)
+      continue;
+    UnionFind[RootSrc] = RootDst;
+    InTree[E] = true;
+  }
+  return InTree;
+}
+
+CounterPlacement placeEdgeCounters(Function &F, BlockFrequencyInfo &BFI,
+                                   BranchProbabilityInfo &BPI) {
+  if (!canSplitEdges(F))
+    return placeBlockCounters(F);
+
+  // Number the blocks and collect the edges of the extended CFG. Parallel
+  // edges (e.g. switch cases with the same destination) are merged.
+  std::vector<BasicBlock *> Blocks;
+  DenseMap<BasicBlock *, unsigned> BlockIdx;
+  for (auto &BB : F) {
+    BlockIdx[&BB] = Blocks.size();
+    Blocks.push_back(&BB);
+  }
+  const unsigned Exit = Blocks.size();
+
+  std::vector<WeightedEdge> Edges;
+  // The virtual EXIT -> entry edge cannot be instrumented: force it into the
+  // spanning tree by giving it the highest weight
+  Edges.push_back({Exit, 0, UINT64_MAX});
+  for (unsigned Src = 0; Src < Exit; Src++) {
+    BasicBlock *BB = Blocks[Src];
+    uint64_t Freq = BFI.getBlockFreq(BB).getFrequency();
+    if (succ_empty(BB)) {
+      Edges.push_back({Src, Exit, Freq});
+      continue;
+    }
+    SmallPtrSet<BasicBlock *, 4> Visited;
+    for (BasicBlock *Succ : successors(BB))
+      if (Visited.insert(Succ).second)
+        Edges.push_back({Src, BlockIdx[Succ],
+                         BPI.getEdgeProbability(BB, Succ).scale(Freq)});
+  }
+  std::vector<bool> InTree = findMaxSpanningTree(Exit + 1, Edges);
+
+  // Root the tree at EXIT: for every node, remember the tree edge leading to
+  // its parent and its depth
+  std::vector<std::vector<unsigned>> TreeAdj(Exit + 1);
+  for (unsigned E = 0; E < Edges.size(); E++)
+    if (InTree[E]) {
+      TreeAdj[Edges[E].Src].push_back(E);
+      TreeAdj[Edges[E].Dst].push_back(E);
+    }
+
+  std::vector<int> ParentEdge(Exit + 1, -1);
+  std::vector<unsigned> Depth(Exit + 1, 0);
+  std::vector<bool> Reached(Exit + 1, false);
+  std::vector<unsigned> Worklist = {Exit};
+  Reached[Exit] = true;
+  while (!Worklist.empty()) {
+    unsigned N = Worklist.back();
+    Worklist.pop_back();
+    for (unsigned E : TreeAdj[N]) {
+      unsigned Other = Edges[E].Src == N ? Edges[E].Dst : Edges[E].Src;
+      if (Reached[Other])
+        continue;
+      Reached[Other] = true;
+      ParentEdge[Other] = E;
+      Depth[Other] = Depth[N] + 1;
+      Worklist.push_back(Other);
+    }
+  }
+
+  auto parentOf = [&](unsigned N) {
+    const WeightedEdge &E = Edges[ParentEdge[N]];
+    return E.Src == N ? E.Dst : E.Src;
+  };
+
+  // Every chord gets a counter. The chord C = (A -> B) closes the cycle
+  // A -> B ~> A, where B ~> A is the tree path between B and A: tree edges
+  // traversed forward carry +count(C), tree edges traversed backward carry
+  // -count(C).
+  CounterPlacement Placement;
+  std::vector<CounterCombination> EdgeCounts(Edges.size());
+  for (unsigned C = 0; C < Edges.size(); C++) {
+    if (InTree[C])
+      continue;
+    unsigned Counter = Placement.Sites.size();
+    BasicBlock *Succ = Edges[C].Dst == Exit ? nullptr : Blocks[Edges[C].Dst];
+    Placement.Sites.push_back({Blocks[Edges[C].Src], Succ, true});
+    EdgeCounts[C].push_back({Counter, 1});
+
+    // Walk up from B (B ~> LCA) and from A (LCA ~> A)
+    unsigned Up = Edges[C].Dst, Down = Edges[C].Src;
+    while (Up != Down) {
+      if (Depth[Up] >= Depth[Down]) {
+        unsigned E = ParentEdge[Up];
+        EdgeCounts[E].push_back({Counter, Edges[E].Src == Up ? 1 : -1});
+        Up = parentOf(Up);
+      } else {
+        unsigned E = ParentEdge[Down];
+        EdgeCounts[E].push_back({Counter, Edges[E].Dst == Down ? 1 : -1});
+        Down = parentOf(Down);
+      }
+    }
+  }
+
+  // The count of a block is the sum of the counts of its outgoing edges
+  for (unsigned N = 0; N < Exit; N++)
+    Placement.BlockCounts[Blocks[N]];
+  for (unsigned E = 0; E < Edges.size(); E++) {
+    if (Edges[E].Src == Exit)
+      continue;
+    CounterCombination &BlockCount = Placement.BlockCounts[Blocks[Edges[E].Src]];
+    for (auto &Term : EdgeCounts[E])
+      addTerm(BlockCount, Term.first, Term.second);
+  }
+  for (auto &BlockCount : Placement.BlockCounts)
+    llvm::erase_if(BlockCount.second, [](auto &T) { return T.second == 0; });
+
+  return Placement;
+}
+
+//-----------------------------------------------------------------------------
+// Control equivalence
+//-----------------------------------------------------------------------------
+DenseMap<BasicBlock *, BasicBlock *>
+findControlEquivalentBlocks(Function &F, DominatorTree &DT,
+                            PostDominatorTree &PDT, BlockFrequencyInfo &BFI,
+                            BranchProbabilityInfo &BPI) {
+  // Group the blocks by (canonical) count combination
+  CounterPlacement Edges = placeEdgeCounters(F, BFI, BPI);
+  std::map<CounterCombination, SmallVector<BasicBlock *, 4>> Classes;
+  for (auto &BlockCount : Edges.BlockCounts) {
+    CounterCombination Key = BlockCount.second;
+    llvm::sort(Key);
+    Classes[Key].push_back(BlockCount.first);
+  }
+
+  DenseMap<BasicBlock *, BasicBlock *> Leaders;
+  for (auto &Class : Classes) {
+    auto &Members = Class.second;
+    BasicBlock *Leader = Members.front();
+    for (BasicBlock *BB : Members)
+      if (DT.dominates(BB, Leader))
+        Leader = BB;
+    for (BasicBlock *BB : Members)
+      Leaders[BB] = DT.dominates(Leader, BB) && PDT.dominates(BB, Leader) ? Leader : BB;
+  }
+  return Leaders;
+}
+
+unsigned shareControlEquivalentCounters(
+    CounterPlacement &Placement,
+    const DenseMap<BasicBlock *, BasicBlock *> &Leaders) {
+  // Counters of the members that only count their own block are redundant
+  DenseMap<unsigned, BasicBlock *> Redundant; // counter -> leader
+  for (auto &BlockCount : Placement.BlockCounts) {
+    BasicBlock *BB = BlockCount.first;
+    auto It = Leaders.find(BB);
+    CounterCombination &Count = BlockCount.second;
+    if (It == Leaders.end() || It->second == BB || Count.size() != 1 ||
+        Count[0].second != 1)
+      continue;
+    const CounterSite &Site = Placement.Sites[Count[0].first];
+    if (!Site.OnEdge && Site.Block == BB)
+      Redundant[Count[0].first] = It->second;
+  }
+  if (Redundant.empty())
+    return 0;
+
+  // Substitute the redundant counters with the count of their leader (which
+  // may in turn refer to redundant counters, e.g. through hoisted loops)
+  std::function<CounterCombination(const CounterCombination &)> Substitute =
+      [&](const CounterCombination &Count) {
+        CounterCombination Result;
+        for (auto &Term : Count) {
+          auto It = Redundant.find(Term.first);
+          if (It == Redundant.end()) {
+            addTerm(Result, Term.first, Term.second);
+            continue;
+          }
+          for (auto &LeaderTerm : Substitute(Placement.BlockCounts[It->second]))
+            addTerm(Result, LeaderTerm.first, Term.second * LeaderTerm.second);
+        }
+        return Result;
+      };
+  MapVector<BasicBlock *, CounterCombination> BlockCounts;
+  for (auto &BlockCount : Placement.BlockCounts)
+    BlockCounts[BlockCount.first] = Substitute(BlockCount.second);
+
+  // Renumber the remaining counters
+  std::vector<unsigned> NewIdx(Placement.Sites.size());
+  std::vector<CounterSite> Sites;
+  for (unsigned C = 0; C < Placement.Sites.size(); C++) {
+    NewIdx[C] = Sites.size();
+    if (!Redundant.count(C))
+      Sites.push_back(Placement.Sites[C]);
+  }
+  for (auto &BlockCount : BlockCounts)
+    for (auto &Term : BlockCount.second)
+      Term.first = NewIdx[Term.first];
+
+  unsigned Removed = Placement.Sites.size() - Sites.size();
+  Placement.Sites = std::move(Sites);
+  Placement.BlockCounts = std::move(BlockCounts);
+  return Removed;
+}
+
+//-----------------------------------------------------------------------------
+// Counter site insertion points
+//-----------------------------------------------------------------------------
+Instruction *getSiteInsertionPoint(const CounterSite &Site) {
+  BasicBlock *BB = Site.Block;
+  if (!Site.OnEdge)
+    return &*BB->getFirstInsertionPt();
+
+  // Edge leaving an exit block, or edge whose source has no other successor:
+  // count it at the end of the source block
+  if (!Site.Succ || BB->getUniqueSuccessor() == Site.Succ)
+    return BB->getTerminator();
+
+  // Edge whose destination has no other predecessor: count it at the
+  // beginning of the destination block
+  if (Site.Succ->getUniquePredecessor() == BB)
+    return &*Site.Succ->getFirstInsertionPt();
+
+  // Critical edge: split it (all the parallel edges are redirected to the new
+  // block)
+  BasicBlock *NewBB = SplitCriticalEdge(
+      BB->getTerminator(), GetSuccessorNumber(BB, Site.Succ),
+      CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+  assert(NewBB && "edge placement on a non-splittable edge");
+  return NewBB->getTerminator();
+}
@@ -0,0 +1,114 @@
+//==============================================================================
+// FILE:
+//    counterPlacement.h
+//
+// DESCRIPTION:
+//    Declares the counter placement strategies used by the block-level counting
+//    modes of DynamicInstCounter. A placement decides where counter increments
+//    are injected in a function (counter sites) and how the execution count of
+//    every basic block is rebuilt from the values of those counters.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTER_PLACEMENT_H
+#define LLVM_DYNIC_COUNTER_PLACEMENT_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class DominatorTree;
+class LoopInfo;
+class PostDominatorTree;
+class ScalarEvolution;
+} // namespace llvm
+
+// Where a counter increment is injected:
+//  - Succ == nullptr && !OnEdge: at the beginning of Block
+//  - OnEdge:                     on the CFG edge Block -> Succ (Succ == nullptr
+//                                denotes the edge leaving an exit block)
+// The counter is incremented by Step (an i64 value available at the site), or
+// by 1 if Step is nullptr.
+struct CounterSite {
+  llvm::BasicBlock *Block;
+  llvm::BasicBlock *Succ;
+  bool OnEdge;
+  llvm::Value *Step = nullptr;
+};
+
+// A linear combination of counters: (counter index, coefficient) pairs
+using CounterCombination = llvm::SmallVector<std::pair<unsigned, int64_t>, 4>;
+
+struct CounterPlacement {
+  // Counter sites, one counter each
+  std::vector<CounterSite> Sites;
+  // Execution count of every basic block of the function, as a linear
+  // combination of the counters above
+  llvm::MapVector<llvm::BasicBlock *, CounterCombination> BlockCounts;
+};
+
+// One counter at the beginning of every basic block.
+CounterPlacement placeBlockCounters(llvm::Function &F);
+
+// Like placeBlockCounters, but the blocks that run exactly once per iteration
+// of a loop whose trip count is computable by ScalarEvolution share a single
+// counter, incremented by the trip count in the loop preheader. The trip count
+// is expanded in the preheader.
+CounterPlacement placeHoistedBlockCounters(llvm::Function &F,
+                                           llvm::LoopInfo &LI,
+                                           llvm::ScalarEvolution &SE,
+                                           llvm::DominatorTree &DT);
+
+// Knuth's optimal edge counter placement: a maximum spanning tree of the CFG
+// (plus a virtual EXIT -> entry edge) is built using the static edge
+// frequencies, and only the edges that are not part of the tree (chords) get a
+// counter. The count of every tree edge, and hence of every block, follows
+// from flow conservation. Functions whose CFG edges cannot be split (EH pads,
+// indirectbr, callbr) fall back to placeBlockCounters.
+CounterPlacement placeEdgeCounters(llvm::Function &F,
+                                   llvm::BlockFrequencyInfo &BFI,
+                                   llvm::BranchProbabilityInfo &BPI);
+
+// Groups the blocks of F that always run the same number of times (control
+// equivalent blocks: A dominates B, B post-dominates A, and every cycle of the
+// CFG going through one of them goes through the other). Returns the leader of
+// the class of every block, i.e. the member that dominates all the others.
+llvm::DenseMap<llvm::BasicBlock *, llvm::BasicBlock *>
+findControlEquivalentBlocks(llvm::Function &F, llvm::DominatorTree &DT,
+                            llvm::PostDominatorTree &PDT,
+                            llvm::BlockFrequencyInfo &BFI,
+                            llvm::BranchProbabilityInfo &BPI);
+
+// Removes the per-block counters of the blocks that are not the leader of
+// their control equivalence class: their count is the count of the leader.
+// Returns the number of counters removed.
+unsigned shareControlEquivalentCounters(
+    CounterPlacement &Placement,
+    const llvm::DenseMap<llvm::BasicBlock *, llvm::BasicBlock *> &Leaders);
+
+// Returns the instruction before which the increment for Site has to be
+// injected. Critical edges are split on demand.
+llvm::Instruction *getSiteInsertionPoint(const CounterSite &Site);
+
+// Whether every CFG edge of F can be split (no EH pads, indirectbr, callbr)
+bool canSplitEdges(llvm::Function &F);
+
+// An edge of a graph on which a spanning tree is computed
+struct WeightedEdge {
+  unsigned Src;
+  unsigned Dst;
+  uint64_t Weight;
+};
+
+// Kruskal's algorithm: returns, for every edge, whether it belongs to a maximum
+// spanning tree (forest) of the undirected graph with NumNodes nodes.
+std::vector<bool> findMaxSpanningTree(unsigned NumNodes,
+                                      const std::vector<WeightedEdge> &Edges);
+
+#endif
@@ -0,0 +1,125 @@
+//========================================================================
+// FILE:
+//    counterPromotion.cpp
+//
+// DESCRIPTION:
+//    Register promotion of the counters updated inside loops.
+//
+//    Counters are globals, so the optimizer has to keep every increment in
+//    memory. Inside an outermost loop, the increments of a counter are
+//    redirected to a local delta (an alloca zeroed in the preheader), which
+//    mem2reg turns into a chain of SSA values. The delta is added back to the
+//    counter (and zeroed) wherever the counter may be observed:
+//      * at the beginning of every exit block of the loop;
+//      * before every call that is not an intrinsic, since the callee may
+//        print or update the counter (e.g. recursion);
+//      * before every instruction leaving the function from inside the loop.
+//    Flushing deltas rather than caching the counter value keeps the counts
+//    exact even when the counter is updated elsewhere in the meantime.
+//
+// License: MIT
+//========================================================================
+#include "counterPromotion.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+using namespace llvm;
+
+namespace {
+// Whether a counter may be observed before I runs
+bool mayObserveCounters(Instruction &I) {
+  if (auto *Call = dyn_cast<CallBase>(&I))
+    return !isa<IntrinsicInst>(Call);
+  return I.isTerminator() && I.getNumSuccessors() == 0;
+}
+
+// Whether the deltas can be flushed at the beginning of every exit of L
+bool canPromoteLoop(Loop &L) {
+  if (!L.getLoopPreheader() || !L.hasDedicatedExits())
+    return false;
+  SmallVector<BasicBlock *, 8> ExitBlocks;
+  L.getExitBlocks(ExitBlocks);
+  for (BasicBlock *Exit : ExitBlocks)
+    if (Exit->getFirstInsertionPt() == Exit->end())
+      return false;
+  return true;
+}
+
+// Counter += Delta, and Delta = 0 if Reset
+void flushDelta(IRBuilder<> &Builder, Value *Counter, AllocaInst *Delta, bool Reset) {
+  Type *Ty = Delta->getAllocatedType();
+  Value *Pending = Builder.CreateLoad(Ty, Delta);
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Ty, Counter), Pending), Counter);
+  if (Reset)
+    Builder.CreateStore(ConstantInt::get(Ty, 0), Delta);
+}
+} // namespace
+
+unsigned promoteCounters(Function &F, ArrayRef<StoreInst *> Increments,
+                         LoopInfo &LI, DominatorTree &DT) {
+  // Group the increments by outermost loop and counter
+  MapVector<Loop *, MapVector<Value *, SmallVector<StoreInst *, 8>>> LoopIncrements;
+  for (StoreInst *Store : Increments) {
+    Loop *L = LI.getLoopFor(Store->getParent());
+    if (!L)
+      continue;
+    while (Loop *Parent = L->getParentLoop())
+      L = Parent;
+    if (canPromoteLoop(*L))
+      LoopIncrements[L][Store->getPointerOperand()].push_back(Store);
+  }
+  if (LoopIncrements.empty())
+    return 0;
+
+  BasicBlock::iterator AllocaPt = F.getEntryBlock().getFirstInsertionPt();
+  std::vector<AllocaInst *> Deltas;
+  unsigned Promoted = 0;
+  for (auto &LoopEntry : LoopIncrements) {
+    Loop *L = LoopEntry.first;
+
+    // Redirect the increments to the deltas
+    MapVector<Value *, AllocaInst *> LoopDeltas;
+    for (auto &CounterEntry : LoopEntry.second) {
+      Value *Counter = CounterEntry.first;
+      Type *Ty = CounterEntry.second.front()->getValueOperand()->getType();
+      AllocaInst *Delta = new AllocaInst(Ty, F.getParent()->getDataLayout().getAllocaAddrSpace(),
+                                         Counter->getName() + ".delta", &*AllocaPt);
+      new StoreInst(ConstantInt::get(Ty, 0), Delta, L->getLoopPreheader()->getTerminator());
+      for (StoreInst *Store : CounterEntry.second) {
+        cast<LoadInst>(cast<Instruction>(Store->getValueOperand())->getOperand(1))
+            ->setOperand(0, Delta);
+        Store->setOperand(1, Delta);
+        Promoted++;
+      }
+      LoopDeltas[Counter] = Delta;
+      Deltas.push_back(Delta);
+    }
+
+    // Flush them wherever the counters may be observed
+    SmallVector<Instruction *, 8> FlushPts;
+    for (BasicBlock *BB : L->blocks())
+      for (Instruction &I : *BB)
+        if (mayObserveCounters(I))
+          FlushPts.push_back(&I);
+    for (Instruction *I : FlushPts) {
+      IRBuilder<> Builder(I);
+      for (auto &DeltaEntry : LoopDeltas)
+        flushDelta(Builder, DeltaEntry.first, DeltaEntry.second, /*Reset=*/true);
+    }
+    SmallVector<BasicBlock *, 8> ExitBlocks;
+    L->getUniqueExitBlocks(ExitBlocks);
+    for (BasicBlock *Exit : ExitBlocks) {
+      IRBuilder<> Builder(&*Exit->getFirstInsertionPt());
+      for (auto &DeltaEntry : LoopDeltas)
+        flushDelta(Builder, DeltaEntry.first, DeltaEntry.second, /*Reset=*/false);
+    }
+  }
+
+  PromoteMemToReg(Deltas, DT);
+  return Promoted;
+}
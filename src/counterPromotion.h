@@ -0,0 +1,33 @@
+//==============================================================================
+// FILE:
+//    counterPromotion.h
+//
+// DESCRIPTION:
+//    Declares the counter promotion stage of DynamicInstCounter, which keeps
+//    the counters updated inside loops in SSA registers.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTER_PROMOTION_H
+#define LLVM_DYNIC_COUNTER_PROMOTION_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+namespace llvm {
+class DominatorTree;
+class LoopInfo;
+} // namespace llvm
+
+// Promotes the counter increments of F (stores of `Counter + Step` into
+// Counter, as injected by the pass) that are inside loops: every outermost loop
+// accumulates the increments of each counter in a register, which is added to
+// the counter at the loop exits, before returning, and before the calls that
+// may observe the counter. Loops without a preheader or dedicated exits are
+// left alone. Returns the number of increments promoted.
+unsigned promoteCounters(llvm::Function &F,
+                         llvm::ArrayRef<llvm::StoreInst *> Increments,
+                         llvm::LoopInfo &LI, llvm::DominatorTree &DT);
+
+#endif
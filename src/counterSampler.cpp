@@ -0,0 +1,131 @@
+//========================================================================
+// FILE:
+//    counterSampler.cpp
+//
+// DESCRIPTION:
+//    Countdown-based sampling of the counter increments.
+//
+//    Every thread owns a countdown (LLVM_sample_countdown), decremented by
+//    each instrumented site. When it expires, the site increments its counter
+//    and the countdown is reloaded with a random period, uniformly drawn in
+//    [1, 2P - 1] (mean P) by a per-thread xorshift generator, so that sampling
+//    does not lock onto periodic program behaviour. Each counter thus holds
+//    about 1/P of its exact value: the report multiplies the counters by P and
+//    derives error bounds from the number of samples.
+//
+//    The mean period P (LLVM_sample_period) defaults to the value given at
+//    compile time, and is overridden at startup by the DYNIC_SAMPLE_PERIOD
+//    environment variable.
+//
+// License: MIT
+//========================================================================
+#include "counterSampler.h"
+
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+CounterSampler::CounterSampler(Module &M, uint64_t DefaultPeriod) : M(M) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+
+  Period = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int64Ty, std::max<uint64_t>(DefaultPeriod, 1)),
+                              "LLVM_sample_period");
+  Countdown = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                                 ConstantInt::get(Int64Ty, 0), "LLVM_sample_countdown",
+                                 nullptr, GlobalValue::GeneralDynamicTLSModel);
+  State = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                             ConstantInt::get(Int64Ty, 0), "LLVM_sample_state", nullptr,
+                             GlobalValue::GeneralDynamicTLSModel);
+
+  // Runtime period: LLVM_sample_period = strtoull(getenv("DYNIC_SAMPLE_PERIOD")) if > 0
+  FunctionCallee Getenv =
+      M.getOrInsertFunction("getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Strtoull = M.getOrInsertFunction(
+      "strtoull", FunctionType::get(Int64Ty, {PtrTy, PtrTy, Type::getInt32Ty(CTX)}, false));
+  Function *Init = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                    GlobalValue::InternalLinkage, "LLVM_sample_init", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Init);
+  BasicBlock *Parse = BasicBlock::Create(CTX, "parse", Init);
+  BasicBlock *Set = BasicBlock::Create(CTX, "set", Init);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", Init);
+  IRBuilder<> Builder(Entry);
+  Value *Env = Builder.CreateCall(
+      Getenv, {Builder.CreateGlobalStringPtr("DYNIC_SAMPLE_PERIOD", "LLVM_sample_env")});
+  Builder.CreateCondBr(Builder.CreateIsNull(Env), Exit, Parse);
+  Builder.SetInsertPoint(Parse);
+  Value *Parsed = Builder.CreateCall(
+      Strtoull, {Env, ConstantPointerNull::get(cast<PointerType>(PtrTy)), Builder.getInt32(10)});
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Parsed, Builder.getInt64(0)), Exit, Set);
+  Builder.SetInsertPoint(Set);
+  Builder.CreateStore(Parsed, Period);
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Init, /*Priority=*/0);
+}
+
+// i64 LLVM_sample_reload(): draws the next countdown
+Function *CounterSampler::getReloadFunction() {
+  if (Function *F = M.getFunction("LLVM_sample_reload"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Function *F = Function::Create(FunctionType::get(Int64Ty, false),
+                                 GlobalValue::InternalLinkage, "LLVM_sample_reload", M);
+  F->addFnAttr(Attribute::NoInline);
+  F->addFnAttr(Attribute::Cold);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Seed = BasicBlock::Create(CTX, "seed", F);
+  BasicBlock *Draw = BasicBlock::Create(CTX, "draw", F);
+  IRBuilder<> Builder(Entry);
+
+  // xorshift64 state, seeded from the address of the thread-local countdown
+  Value *OldState = Builder.CreateLoad(Int64Ty, State);
+  Builder.CreateCondBr(Builder.CreateIsNull(OldState), Seed, Draw);
+  Builder.SetInsertPoint(Seed);
+  Value *NewSeed = Builder.CreateXor(Builder.CreatePtrToInt(Countdown, Int64Ty),
+                                     Builder.getInt64(0x9E3779B97F4A7C15ULL));
+  Builder.CreateBr(Draw);
+
+  Builder.SetInsertPoint(Draw);
+  PHINode *X = Builder.CreatePHI(Int64Ty, 2, "x");
+  X->addIncoming(OldState, Entry);
+  X->addIncoming(NewSeed, Seed);
+  Value *Next = Builder.CreateXor(X, Builder.CreateShl(X, 13));
+  Next = Builder.CreateXor(Next, Builder.CreateLShr(Next, 7));
+  Next = Builder.CreateXor(Next, Builder.CreateShl(Next, 17));
+  Builder.CreateStore(Next, State);
+
+  // 1 + x % (2P - 1)
+  Value *P = Builder.CreateLoad(Int64Ty, Period);
+  Value *Range = Builder.CreateSub(Builder.CreateShl(P, 1), Builder.getInt64(1));
+  Builder.CreateRet(Builder.CreateAdd(Builder.CreateURem(Next, Range), Builder.getInt64(1)));
+  return F;
+}
+
+void CounterSampler::sampleIncrement(StoreInst *Increment) {
+  auto *Add = cast<Instruction>(Increment->getValueOperand());
+  auto *Load = cast<Instruction>(Add->getOperand(1));
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+
+  // if (--countdown <= 0) { counter += step; countdown = reload(); }
+  IRBuilder<> Builder(Load);
+  Value *Left = Builder.CreateSub(Builder.CreateLoad(Int64Ty, Countdown), Builder.getInt64(1));
+  Builder.CreateStore(Left, Countdown);
+  Instruction *Then = SplitBlockAndInsertIfThen(
+      Builder.CreateICmpSLE(Left, Builder.getInt64(0)), Load, /*Unreachable=*/false);
+  Load->moveBefore(Then);
+  Add->moveBefore(Then);
+  Increment->moveBefore(Then);
+  Builder.SetInsertPoint(Then);
+  Builder.CreateStore(Builder.CreateCall(getReloadFunction()), Countdown);
+}
+
+Value *CounterSampler::emitPeriod(IRBuilder<> &Builder) {
+  return Builder.CreateLoad(Builder.getInt64Ty(), Period);
+}
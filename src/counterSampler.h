@@ -0,0 +1,40 @@
+//==============================================================================
+// FILE:
+//    counterSampler.h
+//
+// DESCRIPTION:
+//    Declares the countdown-based sampler used by the sampling mode of
+//    DynamicInstCounter.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTER_SAMPLER_H
+#define LLVM_DYNIC_COUNTER_SAMPLER_H
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+class CounterSampler {
+public:
+  // DefaultPeriod is the mean sampling period, unless overridden at runtime
+  // by the DYNIC_SAMPLE_PERIOD environment variable.
+  CounterSampler(llvm::Module &M, uint64_t DefaultPeriod);
+
+  // Guards the counter increment ending with Increment (`store (add Step,
+  // (load Counter)), Counter`): every execution decrements the thread-local
+  // countdown, and the counter is only incremented when it expires.
+  void sampleIncrement(llvm::StoreInst *Increment);
+
+  // Emits a load of the mean sampling period in use
+  llvm::Value *emitPeriod(llvm::IRBuilder<> &Builder);
+
+private:
+  llvm::Function *getReloadFunction();
+
+  llvm::Module &M;
+  llvm::GlobalVariable *Period;
+  llvm::GlobalVariable *Countdown;
+  llvm::GlobalVariable *State;
+};
+
+#endif
@@ -0,0 +1,100 @@
+//========================================================================
+// FILE:
+//    counterTable.cpp
+//
+// DESCRIPTION:
+//    Layout of the counter table.
+//
+//    Counters are created as placeholder globals while the module is being
+//    instrumented, so that every stage (promotion, thread safety, ...) can
+//    handle them as distinct objects. Once instrumentation is done, they are
+//    packed into LLVM_counters, a single 64-bit array aligned to a cache line
+//    and placed in its own section (so that the counters of every module end
+//    up next to each other and can be found by the runtime). Counters are
+//    sorted by decreasing static hotness: the counters updated in hot loops
+//    share as few cache lines as possible, and the cold ones (including the
+//    sparse path counter arrays) do not pollute them.
+//
+//    For continuous raw profiles, the table is also aligned and padded to
+//    whole pages, so that the runtime can map the profile file over it.
+//
+// License: MIT
+//========================================================================
+#include "counterTable.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/TargetParser/Triple.h"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace llvm;
+
+namespace {
+// Section of the counter table on the target object file format
+StringRef getCounterSectionName(const Module &M) {
+  Triple TT(M.getTargetTriple());
+  if (TT.isOSBinFormatMachO())
+    return "__DATA,__dynic_cnts";
+  if (TT.isOSBinFormatCOFF())
+    return ".dynicc";
+  return "dynic_counters";
+}
+} // namespace
+
+GlobalVariable *CounterTable::createCounters(const Twine &Name, uint64_t Size) {
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  Type *Ty = Size == 1 ? Int64Ty : ArrayType::get(Int64Ty, Size);
+  auto *Placeholder = new GlobalVariable(M, Ty, /*isConstant=*/false,
+                                         GlobalValue::InternalLinkage,
+                                         Constant::getNullValue(Ty), Name);
+  Placeholder->setAlignment(MaybeAlign(8));
+  EntryIdx[Placeholder] = Entries.size();
+  Entries.push_back({Placeholder, Size});
+  return Placeholder;
+}
+
+void CounterTable::addHotness(GlobalVariable *Counters, double Updates) {
+  Entries[EntryIdx.lookup(Counters)].Hotness += Updates;
+}
+
+GlobalVariable *CounterTable::layout(uint64_t PageSize) {
+  if (Entries.empty())
+    return nullptr;
+
+  // Hottest first; ties keep the creation order, so that the counters of a
+  // function stay together. Arrays are laid out by the hotness of each slot.
+  std::vector<unsigned> Order(Entries.size());
+  std::iota(Order.begin(), Order.end(), 0);
+  std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+    return Entries[A].Hotness / Entries[A].Size > Entries[B].Hotness / Entries[B].Size;
+  });
+  std::vector<uint64_t> Slots(Entries.size());
+  NumCounters = 0;
+  for (unsigned Idx : Order) {
+    Slots[Idx] = NumCounters;
+    SlotsByName[Entries[Idx].Placeholder->getName()] = NumCounters;
+    NumCounters += Entries[Idx].Size;
+  }
+
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  uint64_t TableSize = PageSize ? alignTo(NumCounters * 8, PageSize) / 8 : NumCounters;
+  ArrayType *TableTy = ArrayType::get(Int64Ty, TableSize);
+  auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/false,
+                                   GlobalValue::InternalLinkage,
+                                   Constant::getNullValue(TableTy), "LLVM_counters");
+  Table->setAlignment(MaybeAlign(std::max<uint64_t>(PageSize, 64)));
+  Table->setSection(getCounterSectionName(M));
+
+  Constant *Zero = ConstantInt::get(Int64Ty, 0);
+  for (unsigned Idx = 0; Idx < Entries.size(); Idx++) {
+    Constant *Slot = ConstantExpr::getInBoundsGetElementPtr(
+        TableTy, Table, ArrayRef<Constant *>{Zero, ConstantInt::get(Int64Ty, Slots[Idx])});
+    Entries[Idx].Placeholder->replaceAllUsesWith(Slot);
+    Entries[Idx].Placeholder->eraseFromParent();
+  }
+  Entries.clear();
+  EntryIdx.clear();
+  return Table;
+}
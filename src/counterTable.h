@@ -0,0 +1,61 @@
+//==============================================================================
+// FILE:
+//    counterTable.h
+//
+// DESCRIPTION:
+//    Declares the counter table of DynamicInstCounter: every 64-bit counter
+//    injected in a module lives in a single array, in a dedicated section.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTER_TABLE_H
+#define LLVM_DYNIC_COUNTER_TABLE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+class CounterTable {
+public:
+  explicit CounterTable(llvm::Module &M) : M(M) {}
+
+  // Returns a placeholder for Size consecutive 64-bit counters (an i64 global
+  // if Size is 1, an [Size x i64] global otherwise). Placeholders can be used
+  // as regular globals until layout() replaces them with their slot.
+  llvm::GlobalVariable *createCounters(const llvm::Twine &Name,
+                                       uint64_t Size = 1);
+
+  // Records that Counters is expected to be updated Updates more times (a
+  // static estimate, only compared with the other counters of the table).
+  void addHotness(llvm::GlobalVariable *Counters, double Updates);
+
+  // Creates the table, hottest counters first, and replaces every placeholder
+  // with its slot. Returns the table, or nullptr if no counter was created.
+  // With a PageSize, the table is aligned to it and padded to a whole number
+  // of pages, so that it can be mapped onto a file.
+  llvm::GlobalVariable *layout(uint64_t PageSize = 0);
+
+  // Number of counters of the table created by layout(), without padding
+  uint64_t getNumCounters() const { return NumCounters; }
+
+  // Slot of the first counter of the placeholder named Name in the table
+  // created by layout()
+  uint64_t getSlot(llvm::StringRef Name) const { return SlotsByName.lookup(Name); }
+
+private:
+  struct Entry {
+    llvm::GlobalVariable *Placeholder;
+    uint64_t Size;
+    double Hotness = 0;
+  };
+
+  llvm::Module &M;
+  std::vector<Entry> Entries;
+  llvm::DenseMap<llvm::GlobalVariable *, unsigned> EntryIdx;
+  llvm::StringMap<uint64_t> SlotsByName;
+  uint64_t NumCounters = 0;
+};
+
+#endif
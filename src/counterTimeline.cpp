@@ -0,0 +1,394 @@
+//========================================================================
+// FILE:
+//    counterTimeline.cpp
+//
+// DESCRIPTION:
+//    Timeline of the opcode counts.
+//
+//    A constructor starts a background thread, which sleeps for the interval,
+//    evaluates the opcode totals from the counter table (relaxed loads of
+//    the counters, through a constant table of (counter, weight, opcode)
+//    terms, like the function report), and stores the difference with the
+//    previous totals in a ring buffer (signed: a snapshot taken in the middle
+//    of an edge mode update can see a count decrease, which the next one
+//    makes up for). Full ring buffers are written out by
+//    the thread itself, so the program threads never wait for it: they keep
+//    updating the counters as usual, and never see the sampler. At exit, the
+//    destructor asks the thread to stop and waits for it (at most one
+//    interval), so that the last snapshot covers the end of the program.
+//
+//    A forked child inherits the file but not the thread: the header is
+//    flushed before the thread starts and the thread flushes every batch of
+//    records, so the child has nothing buffered to write again, and its
+//    destructor leaves the thread and the file alone (the timeline only
+//    covers the process that started it).
+//
+//    The file is a CSV table (time in milliseconds, instructions, then one
+//    column per opcode), or, with raw profiles, binary records read by
+//    dynic-read together with the manifest (opcode names are not compiled
+//    into the program).
+//
+//    Counts kept elsewhere than in the counter table are only seen once they
+//    are added to it: counts of threads with thread-local counters (added at
+//    thread exit) and counters promoted to registers (flushed at loop exits).
+//
+// License: MIT
+//========================================================================
+#include "counterTimeline.h"
+
+#include "irUtils.h"
+#include "rawProfile.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+
+namespace {
+// Number of records of the ring buffer
+constexpr uint64_t RingSize = 64;
+
+} // namespace
+
+CounterTimeline::CounterTimeline(Module &M, StringRef Pattern, unsigned IntervalMs,
+                                 ArrayRef<std::string> Opcodes, bool Binary)
+    : M(M), Pattern(Pattern), IntervalMs(std::max(IntervalMs, 1u)), Opcodes(Opcodes),
+      Binary(Binary) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  auto createGlobal = [&](Type *Ty, const Twine &Name) {
+    return new GlobalVariable(M, Ty, false, GlobalValue::InternalLinkage,
+                              Constant::getNullValue(Ty), Name);
+  };
+  uint64_t RecordWords = 1 + Opcodes.size();
+  File = createGlobal(PtrTy, "LLVM_timeline_file");
+  // pthread_t is at most 64 bits on the supported targets
+  Thread = createGlobal(Int64Ty, "LLVM_timeline_thread_id");
+  Started = createGlobal(Type::getInt1Ty(CTX), "LLVM_timeline_started");
+  Owner = createGlobal(Int32Ty, "LLVM_timeline_owner");
+  Stop = createGlobal(Int32Ty, "LLVM_timeline_stop_request");
+  StartTime = createGlobal(Int64Ty, "LLVM_timeline_start_time");
+  Period = createGlobal(Int64Ty, "LLVM_timeline_period");
+  NumRecords = createGlobal(Int64Ty, "LLVM_timeline_records");
+  Ring = createGlobal(ArrayType::get(Int64Ty, RingSize * RecordWords), "LLVM_timeline_ring");
+  Previous = createGlobal(ArrayType::get(Int64Ty, std::max<uint64_t>(Opcodes.size(), 1)),
+                          "LLVM_timeline_previous");
+}
+
+void CounterTimeline::addTerm(Constant *Counter, unsigned OpcodeIdx, int64_t Weight) {
+  Terms[{Counter, OpcodeIdx}] += Weight;
+}
+
+Constant *CounterTimeline::getHeaderWords(uint64_t Hash) {
+  // The sampling period is stored at startup
+  uint64_t Words[HeaderWords] = {Magic, Version, Hash, Opcodes.size(), 1, IntervalMs};
+  return ConstantDataArray::get(M.getContext(), Words);
+}
+
+void CounterTimeline::setManifestHash(uint64_t Hash) {
+  if (Header)
+    Header->setInitializer(getHeaderWords(Hash));
+}
+
+// Milliseconds of the monotonic clock
+Value *CounterTimeline::emitNow(IRBuilder<> &Builder) {
+  Type *Int64Ty = Builder.getInt64Ty();
+  Type *PtrTy = PointerType::getUnqual(Builder.getContext());
+  // CLOCK_MONOTONIC differs between Linux, Darwin and FreeBSD
+  Triple TT(M.getTargetTriple());
+  int MonotonicClock = TT.isOSDarwin() ? 6 : TT.isOSFreeBSD() ? 4 : 1;
+  FunctionCallee ClockGettime = M.getOrInsertFunction(
+      "clock_gettime",
+      FunctionType::get(Builder.getInt32Ty(), {Builder.getInt32Ty(), PtrTy}, false));
+  StructType *TimespecTy = StructType::get(Int64Ty, Int64Ty);
+  BasicBlock &Entry = Builder.GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> AllocaBuilder(&Entry, Entry.begin());
+  Value *Now = AllocaBuilder.CreateAlloca(TimespecTy, nullptr, "now");
+  Builder.CreateCall(ClockGettime, {Builder.getInt32(MonotonicClock), Now});
+  Value *Sec = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(TimespecTy, Now, 0));
+  Value *NSec = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(TimespecTy, Now, 1));
+  return Builder.CreateAdd(Builder.CreateMul(Sec, Builder.getInt64(1000)),
+                           Builder.CreateUDiv(NSec, Builder.getInt64(1000000)));
+}
+
+// void LLVM_timeline_snapshot(): appends a record to the ring buffer
+Function *CounterTimeline::createSnapshotFunction() {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  uint64_t NumOpcodes = Opcodes.size();
+  uint64_t RecordWords = 1 + NumOpcodes;
+
+  // Constant table: { ptr counter, i64 weight, i64 opcode } LLVM_timeline_terms[]
+  StructType *TermTy = StructType::get(CTX, {PtrTy, Int64Ty, Int64Ty});
+  std::vector<Constant *> TermInits;
+  for (auto &Term : Terms)
+    if (Term.second != 0)
+      TermInits.push_back(ConstantStruct::get(
+          TermTy, {Term.first.first, ConstantInt::get(Int64Ty, Term.second, /*IsSigned=*/true),
+                   ConstantInt::get(Int64Ty, Term.first.second)}));
+  Terms.clear();
+  ArrayType *TermsTy = ArrayType::get(TermTy, TermInits.size());
+  auto *TermTable = new GlobalVariable(M, TermsTy, true, GlobalValue::InternalLinkage,
+                                       ConstantArray::get(TermsTy, TermInits),
+                                       "LLVM_timeline_terms");
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                 GlobalValue::InternalLinkage, "LLVM_timeline_snapshot", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *Zero = Builder.getInt64(0);
+  Value *Record = Builder.CreateInBoundsGEP(
+      Int64Ty, Ring, Builder.CreateMul(Builder.CreateLoad(Int64Ty, NumRecords),
+                                       Builder.getInt64(RecordWords)));
+  Builder.CreateStore(Builder.CreateSub(emitNow(Builder), Builder.CreateLoad(Int64Ty, StartTime)),
+                      Record);
+
+  // Current totals, in the opcode slots of the record
+  Value *Totals = Builder.CreateConstInBoundsGEP1_64(Int64Ty, Record, 1);
+  Builder.CreateMemSet(Totals, Builder.getInt8(0), NumOpcodes * 8, MaybeAlign(8));
+  emitLoop(Builder, Zero, Builder.getInt64(TermInits.size()), "terms", [&](Value *TermIdx) {
+    auto field = [&](unsigned Field, Type *Ty) {
+      return Builder.CreateLoad(
+          Ty, Builder.CreateInBoundsGEP(TermsTy, TermTable,
+                                        {Zero, TermIdx, Builder.getInt32(Field)}));
+    };
+    // The counters are updated concurrently
+    LoadInst *Counter = Builder.CreateLoad(Int64Ty, field(0, PtrTy));
+    Counter->setAtomic(AtomicOrdering::Monotonic);
+    Counter->setAlignment(Align(8));
+    Value *Total = Builder.CreateInBoundsGEP(Int64Ty, Totals, field(2, Int64Ty));
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Total),
+                                          Builder.CreateMul(Counter, field(1, Int64Ty))),
+                        Total);
+  });
+
+  // Deltas, scaled by the sampling period
+  Value *P = Builder.CreateLoad(Int64Ty, Period);
+  emitLoop(Builder, Zero, Builder.getInt64(NumOpcodes), "deltas", [&](Value *OpcodeIdx) {
+    Value *Total = Builder.CreateInBoundsGEP(Int64Ty, Totals, OpcodeIdx);
+    Value *Prev = Builder.CreateInBoundsGEP(Previous->getValueType(), Previous, {Zero, OpcodeIdx});
+    Value *Current = Builder.CreateLoad(Int64Ty, Total);
+    Builder.CreateStore(Builder.CreateMul(Builder.CreateSub(Current, Builder.CreateLoad(Int64Ty, Prev)), P),
+                        Total);
+    Builder.CreateStore(Current, Prev);
+  });
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, NumRecords), Builder.getInt64(1)),
+                      NumRecords);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// void LLVM_timeline_flush(): writes out the records of the ring buffer
+Function *CounterTimeline::createFlushFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  uint64_t RecordWords = 1 + Opcodes.size();
+  FunctionCallee Fwrite = M.getOrInsertFunction(
+      "fwrite", FunctionType::get(Int64Ty, {PtrTy, Int64Ty, Int64Ty, PtrTy}, false));
+  FunctionCallee Fprintf =
+      M.getOrInsertFunction("fprintf", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, true));
+  FunctionCallee Fflush =
+      M.getOrInsertFunction("fflush", FunctionType::get(Int32Ty, {PtrTy}, false));
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                 GlobalValue::InternalLinkage, "LLVM_timeline_flush", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *Zero = Builder.getInt64(0);
+  Value *Out = Builder.CreateLoad(PtrTy, File);
+  Value *Count = Builder.CreateLoad(Int64Ty, NumRecords);
+  if (Binary) {
+    Builder.CreateCall(Fwrite, {Ring, Builder.getInt64(RecordWords * 8), Count, Out});
+  } else {
+    // time_ms,instructions,<opcode>...
+    Value *First = Builder.CreateGlobalStringPtr("%lu,%ld", "LLVM_timeline_row");
+    Value *Next = Builder.CreateGlobalStringPtr(",%ld", "LLVM_timeline_column");
+    Value *End = Builder.CreateGlobalStringPtr("\n", "LLVM_timeline_eol");
+    emitLoop(Builder, Zero, Count, "rows", [&](Value *RecordIdx) {
+      Value *Record = Builder.CreateInBoundsGEP(
+          Int64Ty, Ring, Builder.CreateMul(RecordIdx, Builder.getInt64(RecordWords)));
+      Value *Sum = Zero;
+      for (unsigned Idx = 0; Idx < Opcodes.size(); Idx++)
+        Sum = Builder.CreateAdd(
+            Sum, Builder.CreateLoad(Int64Ty, Builder.CreateConstInBoundsGEP1_64(Int64Ty, Record, 1 + Idx)));
+      Builder.CreateCall(Fprintf, {Out, First, Builder.CreateLoad(Int64Ty, Record), Sum});
+      emitLoop(Builder, Builder.getInt64(1), Builder.getInt64(RecordWords), "columns",
+               [&](Value *Word) {
+                 Builder.CreateCall(Fprintf, {Out, Next,
+                                              Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(
+                                                                              Int64Ty, Record, Word))});
+               });
+      Builder.CreateCall(Fprintf, {Out, End});
+    });
+  }
+  Builder.CreateCall(Fflush, {Out});
+  Builder.CreateStore(Zero, NumRecords);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+Function *CounterTimeline::createStartFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  Function *Snapshot = createSnapshotFunction();
+  Function *Flush = createFlushFunction();
+  FunctionCallee Nanosleep =
+      M.getOrInsertFunction("nanosleep", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false));
+  FunctionCallee Fopen =
+      M.getOrInsertFunction("fopen", FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+  FunctionCallee Fclose =
+      M.getOrInsertFunction("fclose", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Fwrite = M.getOrInsertFunction(
+      "fwrite", FunctionType::get(Int64Ty, {PtrTy, Int64Ty, Int64Ty, PtrTy}, false));
+  FunctionCallee Fputs =
+      M.getOrInsertFunction("fputs", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false));
+  FunctionCallee Fflush =
+      M.getOrInsertFunction("fflush", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Getpid = M.getOrInsertFunction("getpid", FunctionType::get(Int32Ty, false));
+  FunctionCallee Perror = M.getOrInsertFunction("perror", FunctionType::get(VoidTy, {PtrTy}, false));
+  FunctionCallee PthreadCreate = M.getOrInsertFunction(
+      "pthread_create", FunctionType::get(Int32Ty, {PtrTy, PtrTy, PtrTy, PtrTy}, false));
+
+  // ptr LLVM_timeline_thread(ptr): sleeps and takes snapshots until asked to stop
+  Function *ThreadF = Function::Create(FunctionType::get(PtrTy, {PtrTy}, false),
+                                       GlobalValue::InternalLinkage, "LLVM_timeline_thread", M);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", ThreadF);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "loop", ThreadF);
+    BasicBlock *Take = BasicBlock::Create(CTX, "take", ThreadF);
+    BasicBlock *Write = BasicBlock::Create(CTX, "write", ThreadF);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", ThreadF);
+    IRBuilder<> Builder(Entry);
+    StructType *TimespecTy = StructType::get(Int64Ty, Int64Ty);
+    Value *Interval = Builder.CreateAlloca(TimespecTy, nullptr, "interval");
+    Builder.CreateStore(Builder.getInt64(IntervalMs / 1000),
+                        Builder.CreateStructGEP(TimespecTy, Interval, 0));
+    Builder.CreateStore(Builder.getInt64(IntervalMs % 1000 * 1000000),
+                        Builder.CreateStructGEP(TimespecTy, Interval, 1));
+    Builder.CreateBr(Loop);
+
+    Builder.SetInsertPoint(Loop);
+    Builder.CreateCall(Nanosleep, {Interval, ConstantPointerNull::get(cast<PointerType>(PtrTy))});
+    LoadInst *Stopping = Builder.CreateLoad(Int32Ty, Stop);
+    Stopping->setAtomic(AtomicOrdering::Acquire);
+    Stopping->setAlignment(Align(4));
+    Builder.CreateCondBr(Builder.CreateIsNull(Stopping), Take, Done);
+
+    Builder.SetInsertPoint(Take);
+    Builder.CreateCall(Snapshot);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Builder.CreateLoad(Int64Ty, NumRecords),
+                                              Builder.getInt64(RingSize)),
+                         Write, Loop);
+    Builder.SetInsertPoint(Write);
+    Builder.CreateCall(Flush);
+    Builder.CreateBr(Loop);
+
+    // Last snapshot, once the program is done
+    Builder.SetInsertPoint(Done);
+    Builder.CreateCall(Snapshot);
+    Builder.CreateCall(Flush);
+    Builder.CreateCall(Fclose, {Builder.CreateLoad(PtrTy, File)});
+    Builder.CreateRet(ConstantPointerNull::get(cast<PointerType>(PtrTy)));
+  }
+
+  Function *F = Function::Create(FunctionType::get(VoidTy, {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_timeline_start", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Start = BasicBlock::Create(CTX, "start", F);
+  BasicBlock *Fail = BasicBlock::Create(CTX, "fail", F);
+  BasicBlock *Running = BasicBlock::Create(CTX, "running", F);
+  BasicBlock *NoThread = BasicBlock::Create(CTX, "no.thread", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateStore(F->getArg(0), Period);
+  Value *Path = emitProfilePath(Builder, Pattern);
+  Value *Out = Builder.CreateCall(
+      Fopen, {Path, Builder.CreateGlobalStringPtr(Binary ? "wb" : "w", "LLVM_timeline_mode")});
+  Builder.CreateCondBr(Builder.CreateIsNull(Out), Fail, Start);
+
+  Builder.SetInsertPoint(Fail);
+  Builder.CreateCall(Perror, {Path});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Start);
+  Builder.CreateStore(Out, File);
+  if (Binary) {
+    // The manifest hash is set once the manifest is written
+    ArrayType *HeaderTy = ArrayType::get(Int64Ty, HeaderWords);
+    Header = new GlobalVariable(
+        M, HeaderTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        getHeaderWords(/*Hash=*/0), "LLVM_timeline_header");
+    Builder.CreateStore(F->getArg(0), Builder.CreateConstInBoundsGEP2_64(HeaderTy, Header, 0, 4));
+    Builder.CreateCall(Fwrite, {Header, Builder.getInt64(HeaderWords * 8), Builder.getInt64(1), Out});
+  } else {
+    std::string Columns = "time_ms,instructions";
+    for (auto &Opcode : Opcodes)
+      Columns += "," + Opcode;
+    Builder.CreateCall(Fputs, {Builder.CreateGlobalStringPtr(Columns + "\n", "LLVM_timeline_columns"),
+                               Out});
+  }
+  // Nothing stays buffered for the children forked later to write again
+  Builder.CreateCall(Fflush, {Out});
+  Builder.CreateStore(Builder.CreateCall(Getpid), Owner);
+  Builder.CreateStore(emitNow(Builder), StartTime);
+  Value *Error =
+      Builder.CreateCall(PthreadCreate, {Thread, ConstantPointerNull::get(cast<PointerType>(PtrTy)),
+                                         ThreadF, ConstantPointerNull::get(cast<PointerType>(PtrTy))});
+  Builder.CreateCondBr(Builder.CreateIsNull(Error), Running, NoThread);
+
+  Builder.SetInsertPoint(Running);
+  Builder.CreateStore(Builder.getTrue(), Started);
+  Builder.CreateBr(Exit);
+
+  // pthread_create returns its error instead of setting errno
+  Builder.SetInsertPoint(NoThread);
+  Builder.CreateStore(Error, emitErrnoLocation(Builder));
+  Builder.CreateCall(Perror, {Path});
+  Builder.CreateCall(Fclose, {Out});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+Function *CounterTimeline::createStopFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee PthreadJoin = M.getOrInsertFunction(
+      "pthread_join", FunctionType::get(Int32Ty, {Int64Ty, PtrTy}, false));
+  FunctionCallee Getpid = M.getOrInsertFunction("getpid", FunctionType::get(Int32Ty, false));
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                 GlobalValue::InternalLinkage, "LLVM_timeline_stop", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Owned = BasicBlock::Create(CTX, "owned", F);
+  BasicBlock *Join = BasicBlock::Create(CTX, "join", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  // The thread only runs if the file could be opened and the thread created
+  Builder.CreateCondBr(Builder.CreateLoad(Type::getInt1Ty(CTX), Started), Owned, Exit);
+  // and only in the process that created it, not in its forked children
+  Builder.SetInsertPoint(Owned);
+  Builder.CreateCondBr(
+      Builder.CreateICmpEQ(Builder.CreateCall(Getpid), Builder.CreateLoad(Int32Ty, Owner)), Join,
+      Exit);
+  Builder.SetInsertPoint(Join);
+  StoreInst *Request = Builder.CreateStore(Builder.getInt32(1), Stop);
+  Request->setAtomic(AtomicOrdering::Release);
+  Request->setAlignment(Align(4));
+  Builder.CreateCall(PthreadJoin, {Builder.CreateLoad(Int64Ty, Thread),
+                                   ConstantPointerNull::get(cast<PointerType>(PtrTy))});
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
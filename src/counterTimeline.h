@@ -0,0 +1,84 @@
+//==============================================================================
+// FILE:
+//    counterTimeline.h
+//
+// DESCRIPTION:
+//    Declares the timeline of DynamicInstCounter: a background thread that
+//    periodically records how many instructions of every opcode ran since
+//    its previous snapshot, and streams the records to a time-series file.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTER_TIMELINE_H
+#define LLVM_DYNIC_COUNTER_TIMELINE_H
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+#include <vector>
+
+class CounterTimeline {
+public:
+  // Snapshots are taken every IntervalMs milliseconds and written to the file
+  // named by Pattern (%p: process ID, %h: host name, %%: %), as CSV with a
+  // column per opcode of Opcodes, or as binary records if Binary is set.
+  CounterTimeline(llvm::Module &M, llvm::StringRef Pattern, unsigned IntervalMs,
+                  llvm::ArrayRef<std::string> Opcodes, bool Binary);
+
+  // Records that the executions of opcode OpcodeIdx include Weight times the
+  // value of the 64-bit counter Counter.
+  void addTerm(llvm::Constant *Counter, unsigned OpcodeIdx, int64_t Weight);
+
+  // Creates `void LLVM_timeline_start(i64 period)`, which opens the file and
+  // starts the thread, its counts being multiplied by period. Must be called
+  // before the counters are laid out.
+  llvm::Function *createStartFunction();
+
+  // Creates `void LLVM_timeline_stop()`, which takes the last snapshot and
+  // waits for the thread to write out every record. It does nothing in the
+  // children forked by the program, which do not have the thread.
+  llvm::Function *createStopFunction();
+
+  // Identifies the manifest in the header of binary timelines
+  void setManifestHash(uint64_t Hash);
+
+  // Binary timeline header: magic, format version, manifest hash, number of
+  // opcodes, sampling period and interval in milliseconds, as 64-bit words.
+  // Records follow: time in milliseconds, then the count of every opcode.
+  static constexpr uint64_t Magic = 0x4c4d5443494e5944; // "DYNICTML"
+  static constexpr uint64_t Version = 1;
+  static constexpr unsigned HeaderWords = 6;
+
+private:
+  llvm::Function *createSnapshotFunction();
+  llvm::Function *createFlushFunction();
+  llvm::Constant *getHeaderWords(uint64_t Hash);
+  llvm::Value *emitNow(llvm::IRBuilder<> &Builder);
+
+  llvm::Module &M;
+  std::string Pattern;
+  unsigned IntervalMs;
+  std::vector<std::string> Opcodes;
+  bool Binary;
+  // (counter, opcode) -> weight
+  llvm::MapVector<std::pair<llvm::Constant *, unsigned>, int64_t> Terms;
+  // Runtime state: output file, thread, whether it started, process that
+  // started it, stop request, start time (ms),
+  // sampling period, records of the ring buffer not written yet, ring
+  // buffer, and opcode totals of the previous snapshot
+  llvm::GlobalVariable *File = nullptr;
+  llvm::GlobalVariable *Thread = nullptr;
+  llvm::GlobalVariable *Started = nullptr;
+  llvm::GlobalVariable *Owner = nullptr;
+  llvm::GlobalVariable *Stop = nullptr;
+  llvm::GlobalVariable *StartTime = nullptr;
+  llvm::GlobalVariable *Period = nullptr;
+  llvm::GlobalVariable *NumRecords = nullptr;
+  llvm::GlobalVariable *Ring = nullptr;
+  llvm::GlobalVariable *Previous = nullptr;
+  llvm::GlobalVariable *Header = nullptr;
+};
+
+#endif
@@ -0,0 +1,218 @@
+//========================================================================
+// FILE:
+//    countingToggle.cpp
+//
+// DESCRIPTION:
+//    Runtime switch for counting. Every function that has a clean copy (see
+//    burstSampler.cpp) gets a one-byte flag, LLVM_enabled, checked on
+//    function entry and on loop backedges to choose between its instrumented
+//    and its clean code. While counting is off, the program runs the clean
+//    code and only pays for these (well predicted) checks.
+//
+//    The flags are listed, with the function names, in LLVM_toggle_functions,
+//    and are set by the module implementations of the runtime API, called by
+//    the API for every instrumented module (see moduleRegistry.cpp):
+//      void dynic_enable(int on):                    every function
+//      int dynic_enable_function(const char *, int): the functions with this
+//                                                    name (returns how many)
+//    Counting starts disabled, unless DYNIC_ENABLED is set to a non-zero
+//    value. If DYNIC_TOGGLE_SIGNAL holds a signal number, that signal
+//    switches counting on and off for the whole process. (With
+//    -dynamic-ic-runtime, libdynic_rt reads both variables instead, for every
+//    module it registers.)
+//
+// License: MIT
+//========================================================================
+#include "countingToggle.h"
+
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+CountingToggle::CountingToggle(Module &M) : M(M) {
+  Type *Int8Ty = Type::getInt8Ty(M.getContext());
+  State = new GlobalVariable(M, Int8Ty, false, GlobalValue::InternalLinkage,
+                             ConstantInt::get(Int8Ty, 0), "LLVM_toggle_state");
+}
+
+Value *CountingToggle::emitEnabled(IRBuilder<> &Builder, Function &F) {
+  GlobalVariable *&Flag = Flags[&F];
+  if (!Flag) {
+    Type *Int8Ty = Builder.getInt8Ty();
+    Flag = new GlobalVariable(M, Int8Ty, false, GlobalValue::InternalLinkage,
+                              ConstantInt::get(Int8Ty, 0), "LLVM_enabled");
+  }
+  LoadInst *Enabled = Builder.CreateLoad(Builder.getInt8Ty(), Flag);
+  Enabled->setAtomic(AtomicOrdering::Monotonic);
+  return Builder.CreateICmpNE(Enabled, Builder.getInt8(0));
+}
+
+// void LLVM_toggle_enable(int on): sets the flag of every function
+Function *CountingToggle::createEnableFunction(GlobalVariable *Table, uint64_t Size) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int32Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_toggle_enable", M);
+
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Value *On = Builder.CreateZExt(Builder.CreateICmpNE(F->getArg(0), Builder.getInt32(0)),
+                                 Builder.getInt8Ty());
+  Builder.CreateStore(On, State)->setAtomic(AtomicOrdering::Monotonic);
+  Builder.CreateCondBr(Builder.getInt1(Size != 0), Loop, Exit);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "i");
+  Idx->addIncoming(Builder.getInt64(0), Entry);
+  Value *Flag = Builder.CreateLoad(
+      PtrTy, Builder.CreateInBoundsGEP(Table->getValueType(), Table,
+                                       {Builder.getInt64(0), Idx, Builder.getInt32(1)}));
+  Builder.CreateStore(On, Flag)->setAtomic(AtomicOrdering::Monotonic);
+  Value *Next = Builder.CreateAdd(Idx, Builder.getInt64(1));
+  Idx->addIncoming(Next, Loop);
+  Builder.CreateCondBr(Builder.CreateICmpULT(Next, Builder.getInt64(Size)), Loop, Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// int LLVM_toggle_enable_function(const char *name, int on): sets the flag of
+// the functions called name
+Function *CountingToggle::createEnableFunctionByName(GlobalVariable *Table, uint64_t Size) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Function *F = Function::Create(FunctionType::get(Int32Ty, {PtrTy, Int32Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_toggle_enable_function", M);
+  FunctionCallee Strcmp =
+      M.getOrInsertFunction("strcmp", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false));
+
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+  BasicBlock *Set = BasicBlock::Create(CTX, "set", F);
+  BasicBlock *Latch = BasicBlock::Create(CTX, "latch", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Value *On = Builder.CreateZExt(Builder.CreateICmpNE(F->getArg(1), Builder.getInt32(0)),
+                                 Builder.getInt8Ty());
+  Builder.CreateCondBr(Builder.getInt1(Size != 0), Loop, Exit);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "i");
+  PHINode *Count = Builder.CreatePHI(Int32Ty, 2, "count");
+  Idx->addIncoming(Builder.getInt64(0), Entry);
+  Count->addIncoming(Builder.getInt32(0), Entry);
+  Value *Name = Builder.CreateLoad(
+      PtrTy, Builder.CreateInBoundsGEP(Table->getValueType(), Table,
+                                       {Builder.getInt64(0), Idx, Builder.getInt32(0)}));
+  Value *Match = Builder.CreateICmpEQ(Builder.CreateCall(Strcmp, {F->getArg(0), Name}),
+                                      Builder.getInt32(0));
+  Builder.CreateCondBr(Match, Set, Latch);
+
+  Builder.SetInsertPoint(Set);
+  Value *Flag = Builder.CreateLoad(
+      PtrTy, Builder.CreateInBoundsGEP(Table->getValueType(), Table,
+                                       {Builder.getInt64(0), Idx, Builder.getInt32(1)}));
+  Builder.CreateStore(On, Flag)->setAtomic(AtomicOrdering::Monotonic);
+  Value *Incremented = Builder.CreateAdd(Count, Builder.getInt32(1));
+  Builder.CreateBr(Latch);
+
+  Builder.SetInsertPoint(Latch);
+  PHINode *NewCount = Builder.CreatePHI(Int32Ty, 2, "count.next");
+  NewCount->addIncoming(Count, Loop);
+  NewCount->addIncoming(Incremented, Set);
+  Value *Next = Builder.CreateAdd(Idx, Builder.getInt64(1));
+  Idx->addIncoming(Next, Latch);
+  Count->addIncoming(NewCount, Latch);
+  Builder.CreateCondBr(Builder.CreateICmpULT(Next, Builder.getInt64(Size)), Loop, Exit);
+
+  Builder.SetInsertPoint(Exit);
+  PHINode *Result = Builder.CreatePHI(Int32Ty, 2, "result");
+  Result->addIncoming(Builder.getInt32(0), Entry);
+  Result->addIncoming(NewCount, Latch);
+  Builder.CreateRet(Result);
+  return F;
+}
+
+Function *CountingToggle::finalize(bool EmitInit) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+
+  // { const char *name; char *flag; } LLVM_toggle_functions[]
+  StructType *EntryTy = StructType::get(CTX, {PtrTy, PtrTy});
+  std::vector<Constant *> Entries;
+  for (auto &[F, Flag] : Flags) {
+    Constant *Name = ConstantDataArray::getString(CTX, F->getName());
+    auto *NameGV = new GlobalVariable(M, Name->getType(), true, GlobalValue::PrivateLinkage,
+                                      Name, "LLVM_toggle_name");
+    NameGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    Entries.push_back(ConstantStruct::get(EntryTy, {NameGV, Flag}));
+  }
+  ArrayType *TableTy = ArrayType::get(EntryTy, Entries.size());
+  auto *Table = new GlobalVariable(M, TableTy, true, GlobalValue::InternalLinkage,
+                                   ConstantArray::get(TableTy, Entries),
+                                   "LLVM_toggle_functions");
+  Function *Enable = createEnableFunction(Table, Entries.size());
+  EnableByName = createEnableFunctionByName(Table, Entries.size());
+  if (!EmitInit)
+    return Enable;
+
+  // Signal handler: flips the state of the whole process (every module, through
+  // dynic_enable)
+  Function *Handler = Function::Create(FunctionType::get(VoidTy, {Int32Ty}, false),
+                                       GlobalValue::InternalLinkage, "LLVM_toggle_handler", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", Handler));
+  FunctionCallee EnableAll =
+      M.getOrInsertFunction("dynic_enable", FunctionType::get(VoidTy, {Int32Ty}, false));
+  LoadInst *Current = Builder.CreateLoad(Builder.getInt8Ty(), State);
+  Current->setAtomic(AtomicOrdering::Monotonic);
+  Builder.CreateCall(EnableAll, {Builder.CreateZExt(
+                                 Builder.CreateICmpEQ(Current, Builder.getInt8(0)), Int32Ty)});
+  Builder.CreateRetVoid();
+
+  // Constructor:
+  //   if ((env = getenv("DYNIC_ENABLED")) && atoi(env)) LLVM_toggle_enable(1);
+  //   if ((env = getenv("DYNIC_TOGGLE_SIGNAL"))) signal(atoi(env), LLVM_toggle_handler);
+  FunctionCallee Getenv =
+      M.getOrInsertFunction("getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Atoi = M.getOrInsertFunction("atoi", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Signal = M.getOrInsertFunction(
+      "signal", FunctionType::get(PtrTy, {Int32Ty, PtrTy}, false));
+  Function *Init = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage, "LLVM_toggle_init", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Init);
+  BasicBlock *Parse = BasicBlock::Create(CTX, "parse", Init);
+  BasicBlock *Set = BasicBlock::Create(CTX, "set", Init);
+  BasicBlock *Signals = BasicBlock::Create(CTX, "signals", Init);
+  BasicBlock *Install = BasicBlock::Create(CTX, "install", Init);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", Init);
+  Builder.SetInsertPoint(Entry);
+  Value *Env = Builder.CreateCall(
+      Getenv, {Builder.CreateGlobalStringPtr("DYNIC_ENABLED", "LLVM_toggle_env")});
+  Builder.CreateCondBr(Builder.CreateIsNull(Env), Signals, Parse);
+  Builder.SetInsertPoint(Parse);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Builder.CreateCall(Atoi, {Env}), Builder.getInt32(0)),
+                       Signals, Set);
+  Builder.SetInsertPoint(Set);
+  Builder.CreateCall(Enable, {Builder.getInt32(1)});
+  Builder.CreateBr(Signals);
+  Builder.SetInsertPoint(Signals);
+  Value *SignalEnv = Builder.CreateCall(
+      Getenv, {Builder.CreateGlobalStringPtr("DYNIC_TOGGLE_SIGNAL", "LLVM_toggle_signal_env")});
+  Builder.CreateCondBr(Builder.CreateIsNull(SignalEnv), Exit, Install);
+  Builder.SetInsertPoint(Install);
+  Builder.CreateCall(Signal, {Builder.CreateCall(Atoi, {SignalEnv}), Handler});
+  Builder.CreateBr(Exit);
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Init, /*Priority=*/0);
+  return Enable;
+}
@@ -0,0 +1,48 @@
+//==============================================================================
+// FILE:
+//    countingToggle.h
+//
+// DESCRIPTION:
+//    Declares the runtime switch that turns counting on and off, for the whole
+//    process or per function, without recompiling.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_COUNTING_TOGGLE_H
+#define LLVM_DYNIC_COUNTING_TOGGLE_H
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+class CountingToggle {
+public:
+  explicit CountingToggle(llvm::Module &M);
+
+  // Emits a (relaxed atomic) load of the flag of F: an i1 telling whether
+  // counting is enabled for F
+  llvm::Value *emitEnabled(llvm::IRBuilder<> &Builder, llvm::Function &F);
+
+  // Emits the table of the flags created so far, the module implementations
+  // of the runtime API
+  //   void dynic_enable(int on);
+  //   int dynic_enable_function(const char *name, int on);
+  // and, with EmitInit (libdynic_rt does it itself otherwise), the constructor
+  // reading DYNIC_ENABLED and DYNIC_TOGGLE_SIGNAL. Returns the implementation
+  // of dynic_enable.
+  llvm::Function *finalize(bool EmitInit = true);
+
+  // Implementation of dynic_enable_function (once finalized)
+  llvm::Function *getEnableFunctionByName() const { return EnableByName; }
+
+private:
+  llvm::Function *createEnableFunction(llvm::GlobalVariable *Table, uint64_t Size);
+  llvm::Function *createEnableFunctionByName(llvm::GlobalVariable *Table, uint64_t Size);
+
+  llvm::Module &M;
+  llvm::GlobalVariable *State;
+  llvm::Function *EnableByName = nullptr;
+  llvm::MapVector<llvm::Function *, llvm::GlobalVariable *> Flags;
+};
+
+#endif
@@ -0,0 +1,286 @@
+//========================================================================
+// FILE:
+//    cycleEstimate.cpp
+//
+// DESCRIPTION:
+//    Estimated cycles report. Every instruction is given its reciprocal
+//    throughput and latency costs by the cost model (TargetTransformInfo)
+//    of the chosen target and CPU, once per block at compile time: the costs
+//    of the blocks are folded into one weight per (counter, function, loop
+//    or opcode), like the opcode totals, so that the program runs the same
+//    counters as when counting blocks.
+//
+//    The CPU, when chosen, replaces the target-cpu of every function while
+//    its costs are computed, and its target-features are cleared meanwhile,
+//    so that the features of the CPU the module was compiled for (e.g.
+//    -march) do not leak into the costs of another CPU. With
+//    -dynamic-ic-classify, the opcode rows are the instruction classes of
+//    the opcode report. Instructions without a valid cost (e.g. calls
+//    the target cannot lower) cost nothing, and so do demoted PHIs, like the
+//    PHIs they replace. The costs are estimates: they ignore the
+//    dependencies between instructions, the overlap of their latencies and
+//    everything the called functions do.
+//
+// License: MIT
+//========================================================================
+#include "cycleEstimate.h"
+#include "burstSampler.h"
+#include "instructionClass.h"
+#include "irUtils.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+
+namespace {
+// Cost of I, 0 if invalid (or negative, which some targets return for free
+// instructions)
+int64_t getCost(const TargetTransformInfo &TTI, const Instruction &I,
+                TargetTransformInfo::TargetCostKind Kind) {
+  if (auto Cost = TTI.getInstructionCost(&I, Kind).getValue())
+    return std::max<int64_t>(*Cost, 0);
+  return 0;
+}
+} // namespace
+
+CycleEstimate::CycleEstimate(Module &M, bool Classify) : M(M), Classify(Classify) {}
+
+CycleEstimate::~CycleEstimate() = default;
+
+bool CycleEstimate::selectTarget(StringRef TripleName, StringRef CPUName) {
+  std::string TT =
+      Triple::normalize(TripleName.empty() ? M.getTargetTriple() : TripleName.str());
+  if (TT.empty()) {
+    errs() << "-dynamic-ic-cycles: the module has no target triple, choose one with "
+              "-dynamic-ic-cost-triple\n";
+    return false;
+  }
+  // (the targets are those registered by the tool loading the plugin)
+  std::string Error;
+  const Target *T = TargetRegistry::lookupTarget(TT, Error);
+  if (!T) {
+    errs() << "-dynamic-ic-cycles: " << Error << "\n";
+    return false;
+  }
+  TM.reset(T->createTargetMachine(TT, CPUName, "", TargetOptions(), std::nullopt));
+  if (!TM) {
+    errs() << "-dynamic-ic-cycles: cannot create a target machine for " << TT << "\n";
+    return false;
+  }
+  CPU = CPUName.str();
+  return true;
+}
+
+void CycleEstimate::addFunction(Function &F, LoopInfo &LI) {
+  unsigned FunctionScope = Scopes.size();
+  Scopes.push_back({F.getName().str(), 0, {}});
+  // Loops are named after their header (or its position in F), and its source
+  // line if known
+  DenseMap<const BasicBlock *, unsigned> BlockIdx;
+  for (BasicBlock &BB : F) {
+    unsigned Idx = BlockIdx.size();
+    BlockIdx[&BB] = Idx;
+  }
+  DenseMap<const Loop *, unsigned> LoopScopes;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    BasicBlock *Header = L->getHeader();
+    std::string Name = "loop " + (Header->hasName() ? Header->getName().str()
+                                                    : "#" + std::to_string(BlockIdx[Header]));
+    if (DebugLoc Loc = L->getStartLoc())
+      Name += " (line " + std::to_string(Loc.getLine()) + ")";
+    LoopScopes[L] = Scopes.size();
+    Scopes.push_back({Name, L->getLoopDepth(), {}});
+  }
+
+  // The chosen CPU replaces the one of F, and its features (both restored
+  // once the costs are known)
+  Attribute FunctionCPU = F.getFnAttribute("target-cpu");
+  Attribute FunctionFeatures = F.getFnAttribute("target-features");
+  if (!CPU.empty()) {
+    F.addFnAttr("target-cpu", CPU);
+    F.removeFnAttr("target-features");
+  }
+  TargetTransformInfo TTI = TM->getTargetTransformInfo(F);
+  for (BasicBlock &BB : F) {
+    auto &Enclosing = BlockScopes[&BB];
+    Enclosing.push_back(FunctionScope);
+    for (Loop *L = LI.getLoopFor(&BB); L; L = L->getParentLoop())
+      Enclosing.push_back(LoopScopes.lookup(L));
+
+    Cost &BlockC = BlockCost[&BB];
+    auto &OpcodeCost = BlockOpcodeCost[&BB];
+    for (Instruction &I : BB) {
+      // Demotion code and demoted PHIs are not part of the program
+      StringRef DemotedOpcode;
+      if (BurstSampler::isDemoted(I, DemotedOpcode))
+        continue;
+      Cost C{getCost(TTI, I, TargetTransformInfo::TCK_RecipThroughput),
+             getCost(TTI, I, TargetTransformInfo::TCK_Latency)};
+      if (!C.Throughput && !C.Latency)
+        continue;
+      BlockC.Throughput += C.Throughput;
+      BlockC.Latency += C.Latency;
+      Cost &Opcode = OpcodeCost[Classify ? getInstructionClass(I, I.getOpcodeName())
+                                         : std::string(I.getOpcodeName())];
+      Opcode.Throughput += C.Throughput;
+      Opcode.Latency += C.Latency;
+    }
+  }
+  if (CPU.empty())
+    return;
+  if (FunctionCPU.isValid())
+    F.addFnAttr(FunctionCPU);
+  else
+    F.removeFnAttr("target-cpu");
+  if (FunctionFeatures.isValid())
+    F.addFnAttr(FunctionFeatures);
+}
+
+void CycleEstimate::addTerm(Row &R, Constant *Counter, int64_t Weight, const Cost &C) {
+  Cost &Term = R.Terms[Counter];
+  Term.Throughput += Weight * C.Throughput;
+  Term.Latency += Weight * C.Latency;
+}
+
+void CycleEstimate::addBlock(BasicBlock &BB, Constant *Counter, int64_t Weight) {
+  Cost BlockC = BlockCost.lookup(&BB);
+  if (!BlockC.Throughput && !BlockC.Latency)
+    return;
+  for (unsigned ScopeIdx : BlockScopes.lookup(&BB))
+    addTerm(Scopes[ScopeIdx], Counter, Weight, BlockC);
+  for (auto &Opcode : BlockOpcodeCost[&BB]) {
+    Row &R = Opcodes[Opcode.first];
+    R.Name = Opcode.first;
+    addTerm(R, Counter, Weight, Opcode.second);
+  }
+}
+
+Function *CycleEstimate::createReportFunction() {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+
+  // Terms: { ptr counter, i64 throughput, i64 latency }, grouped by row, and
+  // rows: { ptr name, i32 indent, i32 width, i32 first term, i32 end term },
+  // the scopes then the opcodes (rows that never cost anything are left out)
+  StructType *TermTy = StructType::get(CTX, {PtrTy, Int64Ty, Int64Ty});
+  StructType *RowTy = StructType::get(CTX, {PtrTy, Int32Ty, Int32Ty, Int32Ty, Int32Ty});
+  std::vector<Constant *> TermInits, RowInits;
+  auto addRow = [&](const Row &R) {
+    if (R.Terms.empty())
+      return;
+    unsigned First = TermInits.size();
+    for (auto &Term : R.Terms)
+      TermInits.push_back(ConstantStruct::get(
+          TermTy, {Term.first, ConstantInt::get(Int64Ty, Term.second.Throughput),
+                   ConstantInt::get(Int64Ty, Term.second.Latency)}));
+    Constant *Name = ConstantDataArray::getString(CTX, R.Name);
+    auto *NameVar = new GlobalVariable(M, Name->getType(), true, GlobalValue::PrivateLinkage,
+                                       Name, "LLVM_cycles_row");
+    int Indent = 2 * R.Depth;
+    RowInits.push_back(ConstantStruct::get(
+        RowTy, {NameVar, ConstantInt::get(Int32Ty, Indent),
+                ConstantInt::get(Int32Ty, std::max(30 - Indent, 0)),
+                ConstantInt::get(Int32Ty, First), ConstantInt::get(Int32Ty, TermInits.size())}));
+  };
+  for (const Row &R : Scopes)
+    addRow(R);
+  uint64_t NumScopes = RowInits.size();
+  for (auto &Opcode : Opcodes)
+    addRow(Opcode.second);
+  ArrayType *TermsTy = ArrayType::get(TermTy, TermInits.size());
+  auto *TermTable = new GlobalVariable(M, TermsTy, true, GlobalValue::PrivateLinkage,
+                                       ConstantArray::get(TermsTy, TermInits),
+                                       "LLVM_cycles_terms");
+  ArrayType *RowsTy = ArrayType::get(RowTy, RowInits.size());
+  auto *RowTable = new GlobalVariable(M, RowsTy, true, GlobalValue::PrivateLinkage,
+                                      ConstantArray::get(RowsTy, RowInits), "LLVM_cycles_rows");
+
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  Function *Report = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int64Ty}, false),
+                                      GlobalValue::InternalLinkage, "LLVM_cycles_report", M);
+  Value *Scale = Report->getArg(0);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", Report));
+  Value *Zero = Builder.getInt64(0);
+  AllocaInst *Throughput = Builder.CreateAlloca(Int64Ty, nullptr, "throughput");
+  AllocaInst *Latency = Builder.CreateAlloca(Int64Ty, nullptr, "latency");
+  AllocaInst *TotalThroughput = Builder.CreateAlloca(Int64Ty, nullptr, "total.throughput");
+  AllocaInst *TotalLatency = Builder.CreateAlloca(Int64Ty, nullptr, "total.latency");
+  Builder.CreateStore(Zero, TotalThroughput);
+  Builder.CreateStore(Zero, TotalLatency);
+  auto addTo = [&](AllocaInst *Sum, Value *Cycles) {
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Sum), Cycles), Sum);
+  };
+  std::string Target = TM->getTargetTriple().str() + ", " +
+                       (CPU.empty() ? std::string("CPU of the functions") : CPU);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "ESTIMATED CYCLES (" + Target + ")\n"
+                                  "SCOPE                          THROUGHPUT   LATENCY\n"
+                                  "-------------------------------------------------\n")});
+
+  // Rows that ran; the opcodes add up to the total
+  Value *RowFormat = Builder.CreateGlobalStringPtr("%*s%-*s %-12lu %-12lu\n");
+  auto emitRows = [&](Value *Begin, Value *End, const Twine &Name, bool AddToTotal) {
+    emitLoop(Builder, Begin, End, Name, [&](Value *RowIdx) {
+      auto rowField = [&](unsigned Field, Type *Ty) {
+        return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(RowsTy, RowTable,
+                                                                {Zero, RowIdx,
+                                                                 Builder.getInt32(Field)}));
+      };
+      Builder.CreateStore(Zero, Throughput);
+      Builder.CreateStore(Zero, Latency);
+      Value *First = Builder.CreateZExt(rowField(3, Int32Ty), Int64Ty);
+      Value *Last = Builder.CreateZExt(rowField(4, Int32Ty), Int64Ty);
+      emitLoop(Builder, First, Last, Name + ".terms", [&](Value *TermIdx) {
+        auto termField = [&](unsigned Field, Type *Ty) {
+          return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(TermsTy, TermTable,
+                                                                  {Zero, TermIdx,
+                                                                   Builder.getInt32(Field)}));
+        };
+        Value *Counter = Builder.CreateLoad(Int64Ty, termField(0, PtrTy));
+        addTo(Throughput, Builder.CreateMul(Counter, termField(1, Int64Ty)));
+        addTo(Latency, Builder.CreateMul(Counter, termField(2, Int64Ty)));
+      });
+      Value *RowThroughput = Builder.CreateMul(Builder.CreateLoad(Int64Ty, Throughput), Scale);
+      Value *RowLatency = Builder.CreateMul(Builder.CreateLoad(Int64Ty, Latency), Scale);
+
+      BasicBlock *Print = BasicBlock::Create(CTX, Name + ".print", Report);
+      BasicBlock *Next = BasicBlock::Create(CTX, Name + ".next", Report);
+      Builder.CreateCondBr(Builder.CreateIsNull(Builder.CreateOr(RowThroughput, RowLatency)),
+                           Next, Print);
+      Builder.SetInsertPoint(Print);
+      Builder.CreateCall(Printf, {RowFormat, rowField(1, Int32Ty),
+                                  Builder.CreateGlobalStringPtr(""), rowField(2, Int32Ty),
+                                  rowField(0, PtrTy), RowThroughput, RowLatency});
+      if (AddToTotal) {
+        addTo(TotalThroughput, RowThroughput);
+        addTo(TotalLatency, RowLatency);
+      }
+      Builder.CreateBr(Next);
+      Builder.SetInsertPoint(Next);
+    });
+  };
+  emitRows(Zero, Builder.getInt64(NumScopes), "scope", false);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "INST                           THROUGHPUT   LATENCY\n"
+                                  "-------------------------------------------------\n")});
+  emitRows(Builder.getInt64(NumScopes), Builder.getInt64(RowInits.size()), "opcode", true);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "%-30s %-12lu %-12lu\n"),
+                              Builder.CreateGlobalStringPtr("TOTAL"),
+                              Builder.CreateLoad(Int64Ty, TotalThroughput),
+                              Builder.CreateLoad(Int64Ty, TotalLatency)});
+  Builder.CreateRetVoid();
+  return Report;
+}
@@ -0,0 +1,87 @@
+//==============================================================================
+// FILE:
+//    cycleEstimate.h
+//
+// DESCRIPTION:
+//    Declares the estimated cycles report of DynamicInstCounter: every
+//    counted instruction weighted by its throughput and latency costs in the
+//    cost model (TargetTransformInfo) of a chosen target, per function, loop
+//    and opcode.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_CYCLE_ESTIMATE_H
+#define LLVM_DYNIC_CYCLE_ESTIMATE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class LoopInfo;
+} // namespace llvm
+
+class CycleEstimate {
+public:
+  // With Classify, the opcode rows are instruction classes (see
+  // instructionClass.h), like the opcode report.
+  CycleEstimate(llvm::Module &M, bool Classify);
+  ~CycleEstimate();
+
+  // Selects the target of the cost model: TripleName (the triple of the
+  // module if empty) and CPU (the CPU of every function if empty). Prints
+  // the errors.
+  bool selectTarget(llvm::StringRef TripleName, llvm::StringRef CPU);
+
+  // Records the scopes of F (F itself and its loops), and the costs of its
+  // blocks. Call before adding the blocks of F.
+  void addFunction(llvm::Function &F, llvm::LoopInfo &LI);
+
+  // Records that the executions of BB include Weight times the value of the
+  // 64-bit counter Counter.
+  void addBlock(llvm::BasicBlock &BB, llvm::Constant *Counter, int64_t Weight);
+
+  // Creates `void LLVM_cycles_report(i64 scale)`, which prints the estimated
+  // throughput and latency cycles of every function, loop and opcode that
+  // ran, its counts multiplied by scale.
+  llvm::Function *createReportFunction();
+
+private:
+  // Reciprocal throughput and latency, in cycles
+  struct Cost {
+    int64_t Throughput = 0;
+    int64_t Latency = 0;
+  };
+  // Opcode (or instruction class) -> T, in insertion order
+  template <typename T>
+  using StringMapVector = llvm::MapVector<std::string, T, std::map<std::string, unsigned>>;
+  // Functions and loops (every function followed by its loops, outermost
+  // first), then opcodes, in report order
+  struct Row {
+    std::string Name;
+    unsigned Depth = 0;
+    // counter -> cost per unit of the counter
+    llvm::MapVector<llvm::Constant *, Cost> Terms;
+  };
+  void addTerm(Row &R, llvm::Constant *Counter, int64_t Weight, const Cost &C);
+
+  llvm::Module &M;
+  std::unique_ptr<llvm::TargetMachine> TM;
+  bool Classify;
+  std::string CPU;
+  std::vector<Row> Scopes;
+  StringMapVector<Row> Opcodes;
+  // Scopes of every block (its function and enclosing loops), its cost, and
+  // the cost of each of its opcodes, every time it runs
+  llvm::DenseMap<llvm::BasicBlock *, std::vector<unsigned>> BlockScopes;
+  llvm::DenseMap<llvm::BasicBlock *, Cost> BlockCost;
+  llvm::DenseMap<llvm::BasicBlock *, StringMapVector<Cost>> BlockOpcodeCost;
+};
+
+#endif
@@ -8,77 +8,588 @@
 //
 //    This is achieved by first doing a static analysis over the module in order to
 //    find all the different opcodes present in the given program.
-//    Then, for each opcode found, a global counter is injected into the module and
+//    Then, for each opcode found, a 64-bit counter is injected into the module and
 //    it will be incremented every time the corresponding opcode is executed at 
 //    runtime.
 //    Finally, results are printed by injecting a sequence of printf calls at the
 //    end of the program.
 //
+//    Four counting modes are available (selected with -dynamic-ic-mode):
+//      * inst: every instruction increments the counter of its opcode (exact,
+//              but slow on compute-heavy programs)
+//      * bb:   every basic block increments its own counter. A static opcode
+//              histogram is computed for each block at compile time and the
+//              per-opcode totals are obtained at the end of the program by
+//              multiplying block counters and histograms. With
+//              -dynamic-ic-hoist-loops, the blocks of loops whose trip count is
+//              computable by ScalarEvolution are counted once per loop entry.
+//              With -dynamic-ic-share-equivalent, control equivalent blocks
+//              share the counter of the block dominating them.
+//      * edge: only the CFG edges that are not part of a maximum spanning tree
+//              (weighted by the static block frequencies) get a counter. Block
+//              counts are rebuilt from flow conservation when printing the
+//              results (see counterPlacement.cpp).
+//      * path: Ball-Larus path profiling. Executed acyclic paths are counted
+//              per function, and decoded at the end of the program to rebuild
+//              the per-opcode totals and to print the hottest paths (see
+//              pathProfiler.cpp).
+//
+//    With -dynamic-ic-promote-counters, the counters updated inside loops are kept
+//    in registers and flushed at loop exits and calls (see counterPromotion.cpp).
+//    -dynamic-ic-threads=atomic|tls makes the counter updates thread-safe (see
+//    threadSafeCounters.cpp). -dynamic-ic-sample-period=<P> only performs about
+//    one counter update every P, and prints estimates (see counterSampler.cpp).
+//    -dynamic-ic-burst-period=<N> runs a clean copy of the code, switching to
+//    the instrumented one for short bursts (see burstSampler.cpp).
+//    -dynamic-ic-toggle runs the instrumented code only while counting is enabled
+//    at runtime, through an API or a signal (see countingToggle.cpp).
+//
+//    -dynamic-ic-contexts also prints the calling-context tree of the program, with the
+//    inclusive and exclusive counts of every call path (see callingContextTree.cpp).
+//    -dynamic-ic-lines also prints a gcov-style listing of the source files, with the
+//    instructions executed by every line, from the debug locations of the input (see
+//    sourceLineReport.cpp).
+//    -dynamic-ic-top-functions=<N> also prints the N functions executing the most
+//    instructions, with their per-opcode breakdown (see functionReport.cpp).
+//
+//    Programs calling dynic_roi_begin / dynic_roi_end get a report of the counts of
+//    every region of interest (see regionProfiler.cpp). Where the counting mode
+//    allows it, counting is only enabled inside regions, as with -dynamic-ic-toggle.
+//
+//    All counters are 64-bit slots of a single table, LLVM_counters, placed in its
+//    own section and sorted by static hotness (see counterTable.cpp).
+//
+//    -dynamic-ic-raw-profile=<pattern> prints nothing: the counter table is written to
+//    a binary file at exit, and the pass writes a manifest describing every counter, which
+//    dynic-read combines with the raw profiles to print the reports (see rawProfile.cpp).
+//    With -dynamic-ic-continuous, the raw profile is mapped onto the counter table at
+//    startup instead, so that it survives crashes. -dynamic-ic-timeline=<pattern> writes the
+//    per-opcode counts of every interval to a time-series file, from a background thread
+//    (see counterTimeline.cpp). -dynamic-ic-control prints the results on SIGUSR1, and
+//    prints them and resets the counters on SIGUSR2; -dynamic-ic-control-socket=<pattern>
+//    serves the same requests on a Unix domain socket (see counterControl.cpp).
+//
+//    Every instrumented module (translation unit or shared library) registers with a
+//    runtime shared by the process: the runtime API reaches every module, and the module
+//    unregistered last prints a single report of the per-opcode totals of every module,
+//    including the libraries already unloaded, followed by the reports specific to every
+//    module (see moduleRegistry.cpp).
+//    -dynamic-ic-runtime generates no report code: every module hands a description of
+//    its counter table over to libdynic_rt, which combines them and writes the reports
+//    (see runtimeLibrary.cpp and dynicRuntime.cpp).
+//
 // USAGE:
 //      $ opt -load-pass-plugin <BUILD_DIR>/lib/libdynamicInstCounter.so `\`
-//        -passes=-"dynamic-ic" <bitcode-file> -o instrumentend.bin
+//        -passes=-"dynamic-ic" [-dynamic-ic-mode=inst|bb|edge|path] <bitcode-file> `\`
+//        -o instrumentend.bin
 //      $ lli instrumented.bin
 //
 // License: MIT
 //========================================================================
 #include "dynamicInstCounter.h"
+#include "counterPlacement.h"
+#include "burstSampler.h"
+#include "callingContextTree.h"
+#include "counterControl.h"
+#include "counterPromotion.h"
+#include "counterSampler.h"
+#include "counterTable.h"
+#include "counterTimeline.h"
+#include "countingToggle.h"
+#include "cycleEstimate.h"
+#include "functionReport.h"
+#include "instructionClass.h"
+#include "irUtils.h"
+#include "memoryTraffic.h"
+#include "moduleRegistry.h"
+#include "pathProfiler.h"
+#include "rawProfile.h"
+#include "regionProfiler.h"
+#include "runtimeLibrary.h"
+#include "sourceLineReport.h"
+#include "threadSafeCounters.h"
 
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "dynamic-ic"
 
 //-----------------------------------------------------------------------------
-// Function for global counter injection. It declares a new global variable
-// of type INT and initializes it to 0.
+// Command line options
 //-----------------------------------------------------------------------------
-Constant *CreateGlobalCounter(Module &M, StringRef GlobalVarName) {
-  auto &CTX = M.getContext();
+enum class CountingMode { Instruction, BasicBlock, Edge, Path };
+enum class ThreadSafety { None, Atomic, ThreadLocal };
+
+static cl::opt<CountingMode> CountingModeOpt(
+    "dynamic-ic-mode", cl::desc("How dynamic instructions are counted"),
+    cl::values(clEnumValN(CountingMode::Instruction, "inst",
+                          "One counter increment per executed instruction "
+                          "(exact, default)"),
+               clEnumValN(CountingMode::BasicBlock, "bb",
+                          "One counter increment per executed basic block, "
+                          "combined with static per-block opcode histograms"),
+               clEnumValN(CountingMode::Edge, "edge",
+                          "Counters on the CFG edges that are not part of a "
+                          "maximum spanning tree; block counts are rebuilt "
+                          "from flow conservation"),
+               clEnumValN(CountingMode::Path, "path",
+                          "Ball-Larus acyclic path profiling; opcode totals "
+                          "are rebuilt by decoding the executed paths")),
+    cl::init(CountingMode::Instruction));
+
+static cl::opt<bool> HoistLoops(
+    "dynamic-ic-hoist-loops",
+    cl::desc("Count the blocks of loops with a trip count computable by "
+             "ScalarEvolution once per loop entry, in the preheader (bb mode)"),
+    cl::init(false));
+
+static cl::opt<bool> ShareEquivalent(
+    "dynamic-ic-share-equivalent",
+    cl::desc("Control equivalent blocks share a single counter (block-level "
+             "modes)"),
+    cl::init(false));
+
+static cl::opt<bool> PromoteCounters(
+    "dynamic-ic-promote-counters",
+    cl::desc("Keep the counters updated inside loops in registers, flushing "
+             "them at loop exits and calls"),
+    cl::init(false));
+
+static cl::opt<uint64_t> SamplePeriod(
+    "dynamic-ic-sample-period",
+    cl::desc("Sample the counter updates with this mean period (0: count every "
+             "update); overridden at runtime by DYNIC_SAMPLE_PERIOD"),
+    cl::init(0));
+
+static cl::opt<uint64_t> BurstPeriod(
+    "dynamic-ic-burst-period",
+    cl::desc("Run a clean copy of every function, switching to the instrumented "
+             "copy after this many checks (function entries and loop backedges; "
+             "0: always instrumented)"),
+    cl::init(0));
+
+static cl::opt<uint64_t> BurstLength(
+    "dynamic-ic-burst-length",
+    cl::desc("Number of checks an instrumented burst lasts"),
+    cl::init(1));
+
+static cl::opt<bool> Toggle(
+    "dynamic-ic-toggle",
+    cl::desc("Only count while counting is enabled at runtime (dynic_enable, "
+             "dynic_enable_function, DYNIC_ENABLED, DYNIC_TOGGLE_SIGNAL)"),
+    cl::init(false));
+
+static cl::opt<unsigned> RegionsMax(
+    "dynamic-ic-roi-max-regions",
+    cl::desc("Maximum number of distinct regions of interest recorded"),
+    cl::init(64));
+
+static cl::opt<unsigned> RegionsMaxDepth(
+    "dynamic-ic-roi-max-depth",
+    cl::desc("Maximum nesting depth of the regions of interest recorded"),
+    cl::init(16));
+
+static cl::opt<ThreadSafety> ThreadSafetyOpt(
+    "dynamic-ic-threads",
+    cl::desc("How counters are updated in multi-threaded programs"),
+    cl::values(clEnumValN(ThreadSafety::None, "none",
+                          "Plain load/add/store (single-threaded programs, "
+                          "default)"),
+               clEnumValN(ThreadSafety::Atomic, "atomic",
+                          "Relaxed atomicrmw add on the shared counters"),
+               clEnumValN(ThreadSafety::ThreadLocal, "tls",
+                          "Thread-local counters, added to the shared ones "
+                          "at thread exit and before printing the results")),
+    cl::init(ThreadSafety::None));
+
+static cl::opt<uint64_t> PathArrayLimit(
+    "dynamic-ic-path-array-limit",
+    cl::desc("Functions with more acyclic paths than this use a hash table "
+             "for their path counters (path mode)"),
+    cl::init(4096));
+
+static cl::opt<uint64_t> PathHashSize(
+    "dynamic-ic-path-hash-size",
+    cl::desc("Number of slots of a path counter hash table (path mode)"),
+    cl::init(1024));
+
+static cl::opt<unsigned> TopPaths(
+    "dynamic-ic-top-paths",
+    cl::desc("Number of hot paths printed at the end of the program (path mode)"),
+    cl::init(10));
+
+static cl::opt<bool> Contexts(
+    "dynamic-ic-contexts",
+    cl::desc("Count the instructions of every calling context, and print the "
+             "calling-context tree at the end of the program (inst, bb and edge "
+             "modes)"),
+    cl::init(false));
+
+static cl::opt<bool> Lines(
+    "dynamic-ic-lines",
+    cl::desc("Print the instructions executed by every source line, from the debug "
+             "locations of the input (bb and edge modes)"),
+    cl::init(false));
+
+static cl::opt<bool> Memory(
+    "dynamic-ic-memory",
+    cl::desc("Print the bytes read and written by every function and loop (bb and edge "
+             "modes)"),
+    cl::init(false));
+
+static cl::opt<std::string> Roofline(
+    "dynamic-ic-roofline",
+    cl::desc("Print the operations, bytes and arithmetic intensity of every loop nest, "
+             "against the peaks of the machine described by this file (bb and edge modes)"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<double> RooflineMinShare(
+    "dynamic-ic-roofline-min-share",
+    cl::desc("Percentage of the operations or of the bytes of the module a loop nest needs "
+             "to be listed in the roofline (0 = every loop nest that ran)"),
+    cl::value_desc("percent"), cl::init(1.0));
+
+static cl::opt<bool> Cycles(
+    "dynamic-ic-cycles",
+    cl::desc("Print the estimated throughput and latency cycles of every function, loop and "
+             "opcode, from the cost model of the target (bb and edge modes)"),
+    cl::init(false));
+
+static cl::opt<std::string> CostTriple(
+    "dynamic-ic-cost-triple",
+    cl::desc("Target triple of the cost model of -dynamic-ic-cycles (default: the triple of "
+             "the module)"),
+    cl::value_desc("triple"), cl::init(""));
+
+static cl::opt<std::string> CostCPU(
+    "dynamic-ic-cost-cpu",
+    cl::desc("CPU of the cost model of -dynamic-ic-cycles (default: the CPU of every function)"),
+    cl::value_desc("cpu"), cl::init(""));
 
-  // This will insert a declaration into M
-  Constant *NewGlobalVar = M.getOrInsertGlobal(GlobalVarName, IntegerType::getInt32Ty(CTX));
+static cl::opt<unsigned> TopFunctions(
+    "dynamic-ic-top-functions",
+    cl::desc("Number of functions executing the most instructions printed at the end of "
+             "the program, with their per-opcode counts (0 = no function report)"),
+    cl::init(0));
 
-  // This will change the declaration into definition (and initialize to 0)
-  GlobalVariable *NewGV = M.getNamedGlobal(GlobalVarName);
-  NewGV->setLinkage(GlobalValue::CommonLinkage);
-  NewGV->setAlignment(MaybeAlign(4));
-  NewGV->setInitializer(llvm::ConstantInt::get(CTX, APInt(32, 0)));
+static cl::opt<std::string> RawProfilePattern(
+    "dynamic-ic-raw-profile",
+    cl::desc("Write the counters to this binary file at the end of the program instead of "
+             "printing the results (%p: process ID, %h: host name, %m: module hash), to be read "
+             "by dynic-read with the manifest"),
+    cl::value_desc("pattern"), cl::init(""));
 
-  return NewGlobalVar;
+static cl::opt<std::string> ManifestPath(
+    "dynamic-ic-manifest",
+    cl::desc("Manifest describing the counters of the raw profiles (-dynamic-ic-raw-profile)"),
+    cl::value_desc("file"), cl::init("dynic.manifest"));
+
+static cl::opt<std::string> TimelinePattern(
+    "dynamic-ic-timeline",
+    cl::desc("Write the instructions executed during every interval to this time-series "
+             "file (%p: process ID, %h: host name, %m: module hash), from a background thread: "
+             "CSV, or binary for dynic-read with -dynamic-ic-raw-profile"),
+    cl::value_desc("pattern"), cl::init(""));
+
+static cl::opt<unsigned> TimelineInterval(
+    "dynamic-ic-timeline-interval",
+    cl::desc("Interval between the snapshots of -dynamic-ic-timeline, in milliseconds"),
+    cl::init(100));
+
+static cl::opt<bool> ControlSignals(
+    "dynamic-ic-control",
+    cl::desc("Print the results to stderr on SIGUSR1, and print them and reset the counters "
+             "on SIGUSR2, while the program runs"),
+    cl::init(false));
+
+static cl::opt<std::string> ControlSocket(
+    "dynamic-ic-control-socket",
+    cl::desc("Serve the commands `dump` and `reset` (like SIGUSR1 and SIGUSR2) on this Unix "
+             "domain socket (%p: process ID, %h: host name, %m: module hash)"),
+    cl::value_desc("pattern"), cl::init(""));
+
+static cl::opt<bool> Continuous(
+    "dynamic-ic-continuous",
+    cl::desc("Map the raw profile onto the counters at startup, so that it is kept up to "
+             "date even if the program crashes or is killed (-dynamic-ic-raw-profile)"),
+    cl::init(false));
+
+static cl::opt<bool> UseRuntime(
+    "dynamic-ic-runtime",
+    cl::desc("Hand the counters over to libdynic_rt (link with -ldynic_rt), which writes the "
+             "reports, instead of printing them from generated code"),
+    cl::init(false));
+
+static cl::opt<bool> Classify(
+    "dynamic-ic-classify",
+    cl::desc("Count instructions by opcode, type and vector width, and calls by callee (or "
+             "intrinsic), instead of by opcode, and print the lane-weighted counts"),
+    cl::init(false));
+
+//-----------------------------------------------------------------------------
+// Static estimate of how many times BB runs, used to pack hot counters together.
+// Frequencies are relative to the function entry, scaled by the profiled entry
+// count of the function when available.
+//-----------------------------------------------------------------------------
+double EstimateBlockRuns(BasicBlock *BB, BlockFrequencyInfo &BFI) {
+  double Runs = static_cast<double>(BFI.getBlockFreq(BB).getFrequency()) / BFI.getEntryFreq();
+  if (auto EntryCount = BB->getParent()->getEntryCount())
+    Runs *= EntryCount->getCount();
+  return Runs;
+}
+
+//-----------------------------------------------------------------------------
+// Inject `Counter += Step` (`Counter += 1` if Step is null) at the insertion
+// point of Builder. Returns the store to Counter.
+//-----------------------------------------------------------------------------
+StoreInst *CreateCounterIncrement(IRBuilder<> &Builder, Constant *Counter, Value *Step = nullptr) {
+  LoadInst *ld_inst = Builder.CreateLoad(Builder.getInt64Ty(), Counter);
+  Value *step = Step ? Step : Builder.getInt64(1);
+  Value *add_inst = Builder.CreateAdd(step, ld_inst);
+  return Builder.CreateStore(add_inst, Counter);
 }
 
 //-----------------------------------------------------------------------------
 // DynamicInstCounter implementation
 //-----------------------------------------------------------------------------
-bool DynamicInstCounter::runOnModule(Module &M) {
+bool DynamicInstCounter::runOnModule(Module &M, FunctionAnalysisManager &FAM) {
 
   // Declaration of hashmaps used inside this pass
   llvm::StringSet<> presentOpcodes;             // set of opcodes present in the program
-  llvm::StringMap<Constant *> opcodeCounterMap; // linkage of opcode name to its injected counter
   llvm::StringMap<Constant *> opcodeNameMap;    // linkage of opcode name to its injected string
+  llvm::StringMap<MapVector<Constant *, int64_t>> opcodeTermsMap; // linkage of opcode name to the
+                                                // counters contributing to it, each one with the
+                                                // static number of instructions it accounts for
+  llvm::MapVector<BasicBlock *, StringMap<uint64_t>> blockHistograms; // static opcode histogram
+                                                // of every basic block (block-level modes)
+  std::vector<std::pair<CounterSite, Constant *>> counterSites; // block-level counters
+                                                // and where they are incremented
+  llvm::MapVector<Function *, std::vector<StoreInst *>> counterIncrements; // injected
+                                                // counter increments of every function
 
   // Get the global context (CTX) of the module
   auto &CTX = M.getContext();
+  CounterTable Counters(M);                     // 64-bit counters of every mode
+  bool BlockLevel = CountingModeOpt != CountingMode::Instruction;
+
+  // libdynic_rt only evaluates the counters from the description of the module: the reports
+  // generated in IR, and the other consumers of the counter table, cannot be combined with
+  // it (checked before changing anything)
+  if (UseRuntime) {
+    SmallVector<StringRef, 8> unsupported;
+    if (CountingModeOpt == CountingMode::Path)
+      unsupported.push_back("-dynamic-ic-mode=path");
+    if (!RawProfilePattern.empty())
+      unsupported.push_back("-dynamic-ic-raw-profile");
+    if (Contexts)
+      unsupported.push_back("-dynamic-ic-contexts");
+    if (Lines)
+      unsupported.push_back("-dynamic-ic-lines");
+    if (Memory)
+      unsupported.push_back("-dynamic-ic-memory");
+    if (!Roofline.empty())
+      unsupported.push_back("-dynamic-ic-roofline");
+    if (Cycles)
+      unsupported.push_back("-dynamic-ic-cycles");
+    if (!TimelinePattern.empty())
+      unsupported.push_back("-dynamic-ic-timeline");
+    if (ControlSignals)
+      unsupported.push_back("-dynamic-ic-control");
+    if (!ControlSocket.empty())
+      unsupported.push_back("-dynamic-ic-control-socket");
+    if (!unsupported.empty()) {
+      CTX.emitError("-dynamic-ic-runtime cannot be combined with " + join(unsupported, ", "));
+      return false;
+    }
+  }
 
 
   // STEP 1: Static analysis
   // ----------------------------------------
   // Firstly, we need to find all the different opcodes present in the given program.
   // Every instruction is analyzed and the occurring opcodes are stored in a set.
+  // In block-level modes, the number of instructions of each opcode is also recorded for
+  // every basic block (static opcode histogram).
   // REMARK: Some opcodes could be added in the set but will never be called at runtime!
+  // With -dynamic-ic-classify, the "opcodes" are the finer instruction classes instead
+  // (opcode, type and vector width, callee), with their number of lanes.
+  llvm::StringMap<unsigned> opcodeLanes;
+  auto opcodeKey = [](const Instruction &I, StringRef Opcode) {
+    return Classify ? getInstructionClass(I, Opcode) : Opcode.str();
+  };
 
   // Iterate over all instructions in the module
   for (auto &F : M)
       for (auto &BB : F)
-          for (auto &I : BB)
-              if(presentOpcodes.find(I.getOpcodeName()) == presentOpcodes.end())
-                presentOpcodes.insert(I.getOpcodeName());
+          for (auto &I : BB) {
+              std::string opcodeName = opcodeKey(I, I.getOpcodeName());
+              if(presentOpcodes.find(opcodeName) == presentOpcodes.end())
+                presentOpcodes.insert(opcodeName);
+              if (Classify)
+                opcodeLanes[opcodeName] = getInstructionLanes(I);
+              if (BlockLevel)
+                blockHistograms[&BB][opcodeName]++;
+          }
+
+  // Sampling weighs every increment as adding 1 (see samplingError.h): hoisted loops add
+  // their trip counts
+  bool Hoist = HoistLoops;
+  if (Hoist && SamplePeriod && CountingModeOpt != CountingMode::Path) {
+    errs() << "-dynamic-ic-hoist-loops is not supported with -dynamic-ic-sample-period, "
+              "ignored\n";
+    Hoist = false;
+  }
+  // Two-version code: functions are demoted to stack form and get a clean copy before
+  // being instrumented (clean copies are skipped by the steps below)
+  // (regions of interest use the toggle to compile out counting outside them, when the
+  // counting mode allows it)
+  std::unique_ptr<CountingToggle> Toggles;
+  std::unique_ptr<BurstSampler> Bursts;
+  bool UsesRegions = RegionProfiler::isUsed(M);
+  // Raw profile: nothing is printed, the counters are dumped for dynic-read (see STEP 7)
+  std::unique_ptr<RawProfile> Raw;
+  if (!RawProfilePattern.empty() && CountingModeOpt == CountingMode::Path)
+    errs() << "-dynamic-ic-raw-profile is not supported in path mode, ignored\n";
+  else if (!RawProfilePattern.empty())
+    Raw = std::make_unique<RawProfile>(M, RawProfilePattern, Continuous);
+  else if (Continuous)
+    errs() << "-dynamic-ic-continuous needs -dynamic-ic-raw-profile, ignored\n";
+  // Runtime library: the reports are written by libdynic_rt (see STEP 6)
+  std::unique_ptr<RuntimeLibrary> Runtime;
+  if (UseRuntime)
+    Runtime = std::make_unique<RuntimeLibrary>(M);
+  // Region reports need the path decoding and the printed reports (libdynic_rt defines
+  // dynic_roi_begin and dynic_roi_end itself: the module only compiles out counting outside
+  // the regions)
+  bool RegionReport = UsesRegions && !Runtime;
+  if (UsesRegions && (CountingModeOpt == CountingMode::Path || Raw)) {
+    errs() << "Regions of interest are not supported in path mode and with raw profiles: "
+              "dynic_roi_begin and dynic_roi_end do nothing in this module\n";
+    UsesRegions = RegionReport = false;
+  }
+  bool TwoVersionsSupported =
+      CountingModeOpt != CountingMode::Edge && CountingModeOpt != CountingMode::Path &&
+      !Hoist && !ShareEquivalent && !PromoteCounters;
+  if ((BurstPeriod || Toggle) && !TwoVersionsSupported) {
+    errs() << "-dynamic-ic-burst-period and -dynamic-ic-toggle are only supported in inst "
+              "and bb modes, without hoisted loops, shared or promoted counters: ignored\n";
+  } else if (TwoVersionsSupported && (BurstPeriod || Toggle || UsesRegions)) {
+    if (Toggle || UsesRegions)
+      Toggles = std::make_unique<CountingToggle>(M);
+    Bursts = std::make_unique<BurstSampler>(M, BurstPeriod, BurstLength, Toggles.get());
+    // Version switches right after turning counting on or off
+    for (StringRef Name : {"dynic_roi_begin", "dynic_roi_end", "dynic_enable",
+                           "dynic_enable_function"})
+      if (Function *Callee = M.getFunction(Name))
+        Bursts->addSwitchPoint(Callee);
+    std::vector<Function *> functions;
+    for (auto &F : M)
+      functions.push_back(&F);
+    unsigned numDuplicated = 0;
+    for (Function *F : functions) {
+      if (!Bursts->addFunction(*F))
+        continue;
+      numDuplicated++;
+      // The blocks of F may have been split at the switch points: their histograms are
+      // recomputed, without the demotion code (except the loads replacing PHIs)
+      if (BlockLevel)
+        for (auto &BB : *F) {
+          auto &histogram = blockHistograms[&BB];
+          histogram.clear();
+          for (auto &I : BB) {
+            StringRef opcodeName = I.getOpcodeName();
+            StringRef demotedOpcode;
+            if (BurstSampler::isDemoted(I, demotedOpcode)) {
+              if (demotedOpcode.empty())
+                continue;
+              opcodeName = demotedOpcode;
+            }
+            histogram[opcodeKey(I, opcodeName)]++;
+          }
+        }
+    }
+    errs() << "Functions duplicated (clean + instrumented): " << numDuplicated << "\n";
+  }
+
+  // Calling-context tree: counters are moved to context nodes at runtime, so it cannot be
+  // combined with the features reading the counters while the program runs
+  std::unique_ptr<CallingContextTree> Tree;
+  std::vector<Function *> programFunctions;
+  if (Raw && (Contexts || Lines || Memory || !Roofline.empty() || Cycles || TopFunctions))
+    errs() << "-dynamic-ic-contexts, -dynamic-ic-lines, -dynamic-ic-memory, "
+              "-dynamic-ic-roofline, -dynamic-ic-cycles and -dynamic-ic-top-functions are "
+              "ignored with raw profiles (dynic-read prints the function report)\n";
+  bool contexts = Contexts && !Raw, lines = Lines && !Raw;
+  bool memory = Memory && !Raw, cycles = Cycles && !Raw;
+  MachinePeaks Peaks;
+  bool roofline = !Roofline.empty() && !Raw && Peaks.read(Roofline);
+  // (the runtime library prints the function report itself)
+  unsigned topFunctions = Raw || Runtime ? 0 : TopFunctions;
+  if (contexts && (CountingModeOpt == CountingMode::Path || Bursts || UsesRegions)) {
+    errs() << "-dynamic-ic-contexts is not supported in path mode, with two-version code "
+              "(bursts, toggle) and with regions of interest: ignored\n";
+  } else if (contexts) {
+    Tree = std::make_unique<CallingContextTree>(M);
+    for (auto &F : M)
+      if (!F.isDeclaration())
+        programFunctions.push_back(&F);
+  }
+  // Source lines are counted from the block counts
+  std::unique_ptr<SourceLineReport> LineReport;
+  if (lines && (!BlockLevel || CountingModeOpt == CountingMode::Path))
+    errs() << "-dynamic-ic-lines is only supported in bb and edge modes: ignored\n";
+  else if (lines)
+    LineReport = std::make_unique<SourceLineReport>(M);
+  // So are the memory traffic and the roofline (plus counters of the accesses whose size is
+  // only known at runtime)
+  std::unique_ptr<MemoryTraffic> MemoryReport;
+  if ((memory || roofline) && (!BlockLevel || CountingModeOpt == CountingMode::Path))
+    errs() << "-dynamic-ic-memory and -dynamic-ic-roofline are only supported in bb and edge "
+              "modes: ignored\n";
+  else if (memory || roofline)
+    MemoryReport = std::make_unique<MemoryTraffic>(M);
+  // And so are the estimated cycles, from the costs of the blocks
+  std::unique_ptr<CycleEstimate> CycleReport;
+  if (cycles && (!BlockLevel || CountingModeOpt == CountingMode::Path)) {
+    errs() << "-dynamic-ic-cycles is only supported in bb and edge modes: ignored\n";
+  } else if (cycles) {
+    CycleReport = std::make_unique<CycleEstimate>(M, Classify);
+    if (!CycleReport->selectTarget(CostTriple, CostCPU)) {
+      errs() << "-dynamic-ic-cycles: no cost model, ignored\n";
+      CycleReport.reset();
+    }
+  }
+
+  // The timeline reads the counter table while the program runs
+  if (!TimelinePattern.empty() && (CountingModeOpt == CountingMode::Path || Tree))
+    errs() << "-dynamic-ic-timeline is not supported in path mode and with "
+              "-dynamic-ic-contexts: ignored\n";
+  bool timeline = !TimelinePattern.empty() && CountingModeOpt != CountingMode::Path && !Tree;
+  // So do the on-demand reports
+  bool UsesControl = ControlSignals || !ControlSocket.empty();
+  if (UsesControl && (CountingModeOpt == CountingMode::Path || Tree))
+    errs() << "-dynamic-ic-control and -dynamic-ic-control-socket are not supported in path "
+              "mode and with -dynamic-ic-contexts: ignored\n";
+  bool control = UsesControl && CountingModeOpt != CountingMode::Path && !Tree;
+
+  // inst mode counts every function separately for the per-function reports
+  bool PerFunctionCounters = topFunctions || Tree || Raw || Runtime;
 
   // Print out all opcodes present in the program
   errs() << "Opcodes found in given program (static analysis): \n\t";
@@ -90,49 +601,304 @@ bool DynamicInstCounter::runOnModule(Module &M) {
 
   // STEP 2: Counters injection
   // ----------------------------------------
-  // For each opcode found and stored in the set, a global counter is injected into the module:
-  // it will be used to keep track of how many times the corresponding opcode is executed 
-  // at runtime.
+  // In inst mode, a counter is injected into the module for each opcode found and
+  // stored in the set: it will be used to keep track of how many times the corresponding
+  // opcode is executed at runtime.
+  // In block-level modes, counters are injected according to the placement of the selected
+  // mode (one per basic block in bb mode, one per spanning tree chord in edge mode, one per
+  // counted loop, incremented by its trip count, when bb mode hoists loops). The
+  // execution count of every block is a linear combination of those counters, so the
+  // runtime count of an opcode is the sum of the counters weighted by the static number of
+  // instructions of that opcode they account for.
+  // In path mode, a path counter table is injected for every function instead (functions
+  // that cannot be path profiled fall back to one counter per basic block).
   // A global string is also injected for each opcode in order to properly print the results
   // at the end of the program.
 
   // Inject the following global variables for each present opcode <opcode_name> in the program:
-  // -> LLVM_inst_counter_<opcode_name>:  counter for a specific opcode (linked in opcodeCounterMap)
+  // -> LLVM_inst_counter_<opcode_name>:  counter for a specific opcode (inst mode only, without
+  //                                      a function report: see STEP 3 otherwise)
   // -> LLVM_inst_str_<opcode_name>:      string for a specific opcode (linked in opcodeNameMap)
   for (auto &opcode : presentOpcodes) {
     std::string opcodeName = opcode.first().str().c_str();
 
     // Inject counter
-    std::string counterName = "LLVM_inst_counter_" + opcodeName;
-    Constant *countvar = CreateGlobalCounter(M, counterName);
-    opcodeCounterMap[opcodeName] = countvar;
+    if (!BlockLevel && !PerFunctionCounters) {
+      std::string counterName = "LLVM_inst_counter_" + opcodeName;
+      Constant *countvar = Counters.createCounters(counterName);
+      opcodeTermsMap[opcodeName][countvar] = 1;
+    }
 
-    // Inject string
+    // Inject string (none with a raw profile: dynic-read takes the names from the manifest)
+    if (Raw)
+      continue;
     llvm::Constant *str = llvm::ConstantDataArray::getString(CTX, opcodeName);
-    Constant *strvar = M.getOrInsertGlobal("LLVM_inst_str_" + opcodeName, str->getType());
-    dyn_cast<GlobalVariable>(strvar)->setInitializer(str); // <-- ?!?!
+    Constant *strvar = new GlobalVariable(M, str->getType(), /*isConstant=*/true,
+                                          GlobalValue::PrivateLinkage, str,
+                                          "LLVM_inst_str_" + opcodeName);
     opcodeNameMap[opcodeName] = strvar;
   }
 
+  // Inject the following global variable for each counter site of every function <fn>:
+  // -> LLVM_bb_counter_<fn>_<n>:   counter for the n-th basic block of <fn> (bb mode)
+  // -> LLVM_edge_counter_<fn>_<n>: counter for the n-th chord edge of <fn> (edge mode)
+  // -> LLVM_loop_counter_<fn>_<n>: trip counter of a hoisted loop of <fn> (bb mode)
+  std::vector<std::string> opcodeList;
+  std::vector<Constant *> opcodeNames;
+  llvm::StringMap<unsigned> opcodeIndexMap;
+  for (auto &opcode : presentOpcodes) {
+    opcodeIndexMap[opcode.first()] = opcodeList.size();
+    opcodeList.push_back(opcode.first().str());
+    opcodeNames.push_back(opcodeNameMap[opcode.first()]);
+  }
+  FunctionReport Functions(M, opcodeNames);
+  PathProfiler Paths(M, opcodeList, blockHistograms, Counters, PathArrayLimit, PathHashSize);
+
+  unsigned numBlocks = 0, sharedCounters = 0;
+  for (auto &F : M) {
+    if (!BlockLevel || F.isDeclaration() || (Bursts && Bursts->isCleanCopy(F)))
+      continue;
+
+    numBlocks += F.size();
+    if (CountingModeOpt == CountingMode::Path &&
+        Paths.addFunction(F, FAM.getResult<BlockFrequencyAnalysis>(F),
+                          FAM.getResult<BranchProbabilityAnalysis>(F)))
+      continue;
+
+    CounterPlacement Placement;
+    if (CountingModeOpt == CountingMode::Edge)
+      Placement = placeEdgeCounters(F, FAM.getResult<BlockFrequencyAnalysis>(F),
+                                    FAM.getResult<BranchProbabilityAnalysis>(F));
+    else if (CountingModeOpt == CountingMode::BasicBlock && Hoist)
+      Placement = placeHoistedBlockCounters(F, FAM.getResult<LoopAnalysis>(F),
+                                            FAM.getResult<ScalarEvolutionAnalysis>(F),
+                                            FAM.getResult<DominatorTreeAnalysis>(F));
+    else
+      Placement = placeBlockCounters(F);
+
+    if (MemoryReport)
+      MemoryReport->addFunction(F, FAM.getResult<LoopAnalysis>(F));
+    if (CycleReport)
+      CycleReport->addFunction(F, FAM.getResult<LoopAnalysis>(F));
+
+    if (ShareEquivalent) {
+      auto Leaders = findControlEquivalentBlocks(F, FAM.getResult<DominatorTreeAnalysis>(F),
+                                                 FAM.getResult<PostDominatorTreeAnalysis>(F),
+                                                 FAM.getResult<BlockFrequencyAnalysis>(F),
+                                                 FAM.getResult<BranchProbabilityAnalysis>(F));
+      sharedCounters += shareControlEquivalentCounters(Placement, Leaders);
+    }
+
+    auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    auto &BPI = FAM.getResult<BranchProbabilityAnalysis>(F);
+    // Blocks are named in the manifest by their name, or their position in F
+    DenseMap<BasicBlock *, unsigned> blockIndex;
+    if (Raw)
+      for (auto &BB : F) {
+        unsigned index = blockIndex.size();
+        blockIndex[&BB] = index;
+      }
+    auto blockLabel = [&](BasicBlock *BB) {
+      return BB->hasName() ? BB->getName().str() : "#" + std::to_string(blockIndex.lookup(BB));
+    };
+    std::vector<Constant *> counters;
+    for (auto &Site : Placement.Sites) {
+      std::string counterKind = Site.Step ? "loop" : Site.OnEdge ? "edge" : "bb";
+      std::string counterName = "LLVM_" + counterKind + "_counter_" + F.getName().str() + "_" +
+                                std::to_string(counters.size());
+      GlobalVariable *counter = Counters.createCounters(counterName);
+      double runs = EstimateBlockRuns(Site.Block, BFI);
+      if (Site.OnEdge && Site.Succ)
+        runs *= static_cast<double>(BPI.getEdgeProbability(Site.Block, Site.Succ).getNumerator()) /
+                BranchProbability::getDenominator();
+      Counters.addHotness(counter, runs);
+      if (Raw)
+        Raw->addCounter(counter, F, counterKind,
+                        Site.OnEdge && Site.Succ ? blockLabel(Site.Block) + " -> " + blockLabel(Site.Succ)
+                                                 : blockLabel(Site.Block));
+      if (Runtime)
+        Runtime->addCounter(counter, F);
+      counters.push_back(counter);
+      counterSites.push_back({Site, counters.back()});
+    }
+
+    for (auto &blockCount : Placement.BlockCounts) {
+      if (LineReport)
+        for (auto &term : blockCount.second)
+          LineReport->addBlock(*blockCount.first, counters[term.first], term.second);
+      if (MemoryReport)
+        for (auto &term : blockCount.second)
+          MemoryReport->addBlock(*blockCount.first, counters[term.first], term.second);
+      if (CycleReport)
+        for (auto &term : blockCount.second)
+          CycleReport->addBlock(*blockCount.first, counters[term.first], term.second);
+      for (auto &opcode : blockHistograms[blockCount.first])
+        for (auto &term : blockCount.second) {
+          int64_t weight = term.second * static_cast<int64_t>(opcode.second);
+          opcodeTermsMap[opcode.first()][counters[term.first]] += weight;
+          if (topFunctions)
+            Functions.addTerm(F, opcodeIndexMap[opcode.first()], counters[term.first], weight);
+          if (Tree)
+            Tree->addTerm(F, counters[term.first], weight);
+        }
+    }
+  }
+
+  // Memory accesses whose size is only known at runtime: one byte counter each
+  std::vector<std::pair<Instruction *, Constant *>> byteCounters;
+  if (MemoryReport)
+    for (Instruction *I : MemoryReport->getRuntimeAccesses()) {
+      Function &F = *I->getFunction();
+      GlobalVariable *counter = Counters.createCounters(
+          "LLVM_bytes_counter_" + F.getName().str() + "_" + std::to_string(byteCounters.size()));
+      auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+      Counters.addHotness(counter, EstimateBlockRuns(I->getParent(), BFI));
+      MemoryReport->addRuntimeCounter(*I, counter);
+      byteCounters.push_back({I, counter});
+    }
+
+  if (BlockLevel) {
+    unsigned hoistedLoops = llvm::count_if(counterSites, [](auto &site) { return site.first.Step; });
+    errs() << "Counters injected: " << counterSites.size() << " (" << numBlocks
+           << " basic blocks, " << hoistedLoops << " hoisted loops, " << sharedCounters
+           << " counters shared by control equivalent blocks)\n";
+  }
+
 
   // STEP 3: Increments injection
   // ----------------------------------------
-  // For each opcode found in the module, a new instruction is injected *immediately before* 
-  // to increment the corresponding opcode counter.
-  // REMARK: This can be optimized with a different approach. See README for more informations
+  // inst mode: for each instruction found in the module, a new set of instructions is
+  // injected *immediately before* to increment the corresponding opcode counter (PHIs and
+  // EH pads are counted at the first insertion point of their block instead).
+  // block-level modes: a single increment is injected at every counter site (beginning of
+  // a block or CFG edge; critical edges are split). With a function report, every function
+  // gets its own opcode counters in inst mode:
+  // -> LLVM_inst_counter_<fn>_<opcode_name>
+
+  // path mode: the path register is updated on the spanning tree chords, and the counter of
+  // the current path is incremented when leaving the function or taking a backedge.
+
+  for (auto &counterSite : counterSites) {
+    Instruction *InsertPt = getSiteInsertionPoint(counterSite.first);
+    IRBuilder<> Builder(InsertPt);
+    counterIncrements[InsertPt->getFunction()].push_back(
+        CreateCounterIncrement(Builder, counterSite.second, counterSite.first.Step));
+  }
+  for (auto &byteCounter : byteCounters) {
+    IRBuilder<> Builder(byteCounter.first);
+    counterIncrements[byteCounter.first->getFunction()].push_back(CreateCounterIncrement(
+        Builder, byteCounter.second, MemoryTraffic::emitAccessSize(Builder, *byteCounter.first)));
+  }
+  Paths.instrument();
 
   for (auto &F : M) {
+      if (BlockLevel || F.isDeclaration() || (Bursts && Bursts->isCleanCopy(F)))
+        continue;
+      auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+      llvm::StringMap<Constant *> functionCounters;
       for (auto &BB : F) {
-          for (auto &I : BB) {
-            std::string opcodeName = I.getOpcodeName();
-            IRBuilder<> Builder(&I);
-            LoadInst * ld_inst = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), opcodeCounterMap[opcodeName]);
-            Value * add_inst = Builder.CreateAdd(Builder.getInt32(1), ld_inst);
-            Builder.CreateStore(add_inst, opcodeCounterMap[opcodeName]);
+          // Blocks without insertion point (e.g. catchswitch) cannot be instrumented
+          if (BB.getFirstInsertionPt() == BB.end())
+            continue;
+          double runs = EstimateBlockRuns(&BB, BFI);
+
+          // Collect the instructions first, so that injected ones are not visited
+          SmallVector<Instruction *, 32> instructions;
+          for (auto &I : BB)
+            instructions.push_back(&I);
+
+          for (Instruction *I : instructions) {
+            StringRef demotedOpcode;
+            if (BurstSampler::isDemoted(*I, demotedOpcode) && demotedOpcode.empty())
+              continue;
+            std::string opcodeName =
+                opcodeKey(*I, demotedOpcode.empty() ? I->getOpcodeName() : demotedOpcode);
+            Instruction *InsertPt = I;
+            if (isa<PHINode>(I) || I->isEHPad())
+              InsertPt = &*BB.getFirstInsertionPt();
+            IRBuilder<> Builder(InsertPt);
+            Constant *counter;
+            if (!PerFunctionCounters) {
+              counter = opcodeTermsMap[opcodeName].front().first;
+            } else if (!(counter = functionCounters.lookup(opcodeName))) {
+              counter = Counters.createCounters("LLVM_inst_counter_" + F.getName().str() + "_" +
+                                                opcodeName);
+              functionCounters[opcodeName] = counter;
+              opcodeTermsMap[opcodeName][counter] = 1;
+              if (Raw)
+                Raw->addCounter(cast<GlobalVariable>(counter), F, "inst", "-");
+              if (Runtime)
+                Runtime->addCounter(cast<GlobalVariable>(counter), F);
+              if (topFunctions)
+                Functions.addTerm(F, opcodeIndexMap[opcodeName], counter, 1);
+              if (Tree)
+                Tree->addTerm(F, counter, 1);
+            }
+            Counters.addHotness(cast<GlobalVariable>(counter), runs);
+            counterIncrements[&F].push_back(CreateCounterIncrement(Builder, counter));
           }
       }
   }
 
+  // Sampling: every increment only happens when the thread-local countdown expires
+  std::unique_ptr<CounterSampler> Sampler;
+  if (SamplePeriod && CountingModeOpt == CountingMode::Path) {
+    errs() << "-dynamic-ic-sample-period is not supported in path mode, ignored\n";
+  } else if (SamplePeriod) {
+    Sampler = std::make_unique<CounterSampler>(M, SamplePeriod);
+    for (auto &Increments : counterIncrements)
+      for (StoreInst *Store : Increments.second)
+        Sampler->sampleIncrement(Store);
+  }
+
+  // Counters updated by the increments above
+  SetVector<GlobalVariable *> counters;
+  for (auto &Increments : counterIncrements)
+    for (StoreInst *Store : Increments.second)
+      counters.insert(cast<GlobalVariable>(Store->getPointerOperand()));
+
+  // Counter promotion: the CFG may have changed since the analyses were computed (split
+  // edges), so they are recomputed
+  if (PromoteCounters) {
+    unsigned numPromoted = 0;
+    for (auto &Increments : counterIncrements) {
+      Function &F = *Increments.first;
+      FAM.invalidate(F, PreservedAnalyses::none());
+      numPromoted += promoteCounters(F, Increments.second, FAM.getResult<LoopAnalysis>(F),
+                                     FAM.getResult<DominatorTreeAnalysis>(F));
+      FAM.invalidate(F, PreservedAnalyses::none());
+    }
+    errs() << "Counter increments promoted to registers: " << numPromoted << "\n";
+  }
+
+  // Thread safety: rewrite all the counter updates (including promoted ones). Thread-local
+  // counters need the final counter table (see STEP 7)
+  bool ThreadSafe = ThreadSafetyOpt != ThreadSafety::None;
+  if (ThreadSafe && CountingModeOpt == CountingMode::Path) {
+    errs() << "-dynamic-ic-threads is not supported in path mode, ignored\n";
+    ThreadSafe = false;
+  }
+  // The on-demand reports swap the counters with zero while they are updated, possibly
+  // from a signal handler interrupting the increment: a plain load/add/store would undo the
+  // reset, even in a single-threaded program
+  bool Atomic = ThreadSafe && ThreadSafetyOpt == ThreadSafety::Atomic;
+  if (control && !ThreadSafe) {
+    errs() << "-dynamic-ic-control and -dynamic-ic-control-socket make the counter increments "
+              "atomic (-dynamic-ic-threads=atomic)\n";
+    Atomic = true;
+  }
+  if (Atomic)
+    makeIncrementsAtomic(counters.getArrayRef());
+
+  // Calling contexts: the counters of every function are redirected to its context nodes
+  if (Tree)
+    Tree->instrument(programFunctions, counters.getArrayRef());
+
+  // Two-version code: merge the clean copies back and inject the checks
+  if (Bursts)
+    Bursts->instrument();
+  Function *EnableCounting = Toggles ? Toggles->finalize(/*EmitInit=*/!Runtime) : nullptr;
+
 
   // STEP 4: Inject printf declaration
   // ----------------------------------------
@@ -153,59 +919,341 @@ bool DynamicInstCounter::runOnModule(Module &M) {
   PrintfF->addParamAttr(0, Attribute::ReadOnly);
 
 
-  // STEP 5: Inject printf strings (format & header)
+  // STEP 5: Inject printf strings (format)
   // ----------------------------------------
-  llvm::Constant *ResultFormatStr = llvm::ConstantDataArray::getString(CTX, "%-20s %-10lu\n");
-  Constant *ResultFormatStrVar = M.getOrInsertGlobal("ResultFormatStrIR", ResultFormatStr->getType());
-  dyn_cast<GlobalVariable>(ResultFormatStrVar)->setInitializer(ResultFormatStr);
+  // (sampling mode: estimated count followed by the half-width of its 95% confidence interval)
+  // (the header and the totals of the whole program are printed by the module registry, see
+  // STEP 6; raw profile and runtime library: no strings, dynic-read and the library print
+  // the same header)
+  Constant *ResultFormatStrVar = nullptr;
+  if (!Raw && !Runtime) {
+    llvm::Constant *ResultFormatStr = llvm::ConstantDataArray::getString(
+        CTX, Sampler ? "%-20s %-10lu +/- %lu\n" : "%-20s %-10lu\n");
+    ResultFormatStrVar = new GlobalVariable(M, ResultFormatStr->getType(), /*isConstant=*/true,
+                                            GlobalValue::PrivateLinkage, ResultFormatStr,
+                                            "ResultFormatStrIR");
+  }
 
-  std::string out = "";
-  out += "=================================================\n";
-  out += "LLVM Dynamic Instruction Counter results\n";
-  out += "=================================================\n";
-  out += "INST                 #N CALLS (runtime)\n";
-  out += "-------------------------------------------------\n";
-  llvm::Constant *ResultHeaderStr = llvm::ConstantDataArray::getString(CTX, out.c_str());
-  Constant *ResultHeaderStrVar = M.getOrInsertGlobal("ResultHeaderStrIR", ResultHeaderStr->getType());
-  dyn_cast<GlobalVariable>(ResultHeaderStrVar)->setInitializer(ResultHeaderStr);
 
+  // The runtime count of every opcode is the sum of its counters, each one multiplied
+  // by the static number of instructions it accounts for (always 1 in inst mode, possibly
+  // negative in edge mode, where the count of a block can be a difference of counters).
+  // In sampling mode, counters hold about 1/P of their value (P = mean period): the total is
+  // scaled by P, and its variance is the sum of the variances of its terms (see
+  // samplingError.h; hoisted counters, which would break it, are disabled when sampling).
+  // Emit(opcode index, total, variance) is called for every opcode.
+  auto emitOpcodeTotals = [&](IRBuilder<> &Builder,
+                              function_ref<void(unsigned, Value *, Value *)> Emit) {
+    Value *Period = Sampler ? Sampler->emitPeriod(Builder) : nullptr;
+    for (unsigned opcodeIdx = 0; opcodeIdx < opcodeList.size(); opcodeIdx++) {
+      std::string opcodeName = opcodeList[opcodeIdx];
+      Value *Total = Builder.getInt64(0);
+      Value *Variance = Builder.getInt64(0);
+      if (CountingModeOpt == CountingMode::Path)
+        Total = Paths.emitOpcodeTotal(Builder, opcodeIdx);
+      for (auto &term : opcodeTermsMap[opcodeName]) {
+        if (term.second == 0)
+          continue;
+        Value *Counter = Builder.CreateLoad(Builder.getInt64Ty(), term.first);
+        Value *Count = Counter;
+        if (term.second != 1)
+          Count = Builder.CreateMul(Count, Builder.getInt64(term.second));
+        Total = isa<Constant>(Total) ? Count : Builder.CreateAdd(Total, Count);
+        if (Sampler)
+          Variance = Builder.CreateAdd(
+              Variance, Builder.CreateMul(Counter, Builder.getInt64(term.second * term.second)));
+      }
+      if (!Sampler) {
+        Emit(opcodeIdx, Total, Variance);
+        continue;
+      }
+      Variance = Builder.CreateMul(
+          Variance, Builder.CreateMul(Period, Builder.CreateSub(Period, Builder.getInt64(1))));
+      Emit(opcodeIdx, Builder.CreateMul(Total, Period), Variance);
+    }
+  };
 
   // STEP 6: Define a printf wrapper that will print the results
   // -----------------------------------------------------------
   FunctionType *PrintfWrapperTy = FunctionType::get(llvm::Type::getVoidTy(CTX), {}, /*IsVarArgs=*/false);
-  Function *PrintfWrapperF = dyn_cast<Function>(M.getOrInsertFunction("printf_wrapper", PrintfWrapperTy).getCallee());
+  Function *PrintfWrapperF = Function::Create(PrintfWrapperTy, GlobalValue::InternalLinkage,
+                                              "printf_wrapper", M);
 
   // Create the entry basic block for printf_wrapper ...
   llvm::BasicBlock *RetBlock = llvm::BasicBlock::Create(CTX, "enter", PrintfWrapperF);
   IRBuilder<> Builder(RetBlock);
 
-  // ... and start inserting calls to printf
-  // (printf requires i8*, so cast the input strings accordingly)
-  llvm::Value *ResultHeaderStrPtr = Builder.CreatePointerCast(ResultHeaderStrVar, PrintfArgTy);
-  llvm::Value *ResultFormatStrPtr = Builder.CreatePointerCast(ResultFormatStrVar, PrintfArgTy);
+  // The timeline is started by a constructor, and takes its last snapshot first (see STEP 7)
+  std::vector<Function *> startupFunctions;
+  std::unique_ptr<CounterTimeline> Timeline;
+  if (timeline) {
+    Timeline = std::make_unique<CounterTimeline>(M, TimelinePattern, TimelineInterval, opcodeList,
+                                                 Raw != nullptr);
+    for (unsigned opcodeIdx = 0; opcodeIdx < opcodeList.size(); opcodeIdx++)
+      for (auto &term : opcodeTermsMap[opcodeList[opcodeIdx]])
+        Timeline->addTerm(term.first, opcodeIdx, term.second);
+    startupFunctions.push_back(Timeline->createStartFunction());
+    Builder.CreateCall(Timeline->createStopFunction());
+  }
+  // On-demand reports: started once the counters have their slot (see STEP 7)
+  std::unique_ptr<CounterControl> Control;
+  if (control) {
+    Control = std::make_unique<CounterControl>(M, ControlSocket, opcodeList, Sampler != nullptr);
+    for (unsigned opcodeIdx = 0; opcodeIdx < opcodeList.size(); opcodeIdx++)
+      for (auto &term : opcodeTermsMap[opcodeList[opcodeIdx]])
+        Control->addTerm(term.first, opcodeIdx, term.second);
+    if (!ControlSocket.empty())
+      Builder.CreateCall(Control->createStopFunction());
+  }
 
-  Builder.CreateCall(Printf, {ResultHeaderStrPtr});
+  // With calling contexts, add the counts of the context nodes to the counters first
+  if (Tree)
+    Builder.CreateCall(Tree->createFoldFunction());
 
-  LoadInst *LoadCounter;
-  for (auto &opcode : opcodeCounterMap) {
-    std::string opcodeName = opcode.first().str().c_str();
-    LoadCounter = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), opcodeCounterMap[opcodeName]);
-    Builder.CreateCall(Printf, {ResultFormatStrPtr, opcodeNameMap[opcodeName], LoadCounter});
+  // In path mode, decode the executed paths first (into per-function totals, which are the
+  // terms of the path profiled functions in the function report)
+  if (CountingModeOpt == CountingMode::Path) {
+    Paths.emitPathDecoding(Builder);
+    for (auto &F : M) {
+      if (!topFunctions || F.isDeclaration())
+        continue;
+      llvm::StringSet<> functionOpcodes;
+      for (auto &BB : F)
+        for (auto &opcode : blockHistograms.lookup(&BB))
+          functionOpcodes.insert(opcode.first());
+      for (auto &opcode : functionOpcodes)
+        if (Constant *Total = Paths.getFunctionOpcodeTotal(F, opcodeIndexMap[opcode.first()]))
+          Functions.addTerm(F, opcodeIndexMap[opcode.first()], Total, 1);
+    }
+  }
+
+  // Reports specific to this module: `void LLVM_module_reports(ptr totals)`, totals being the
+  // opcode totals of the module (null with a raw profile or the runtime library), whose
+  // output the module registry keeps to print it after the combined totals (the report of
+  // the regions of interest is added in STEP 7)
+  bool laneReport = Classify && !Raw && !Runtime && !opcodeList.empty();
+  if (LineReport && !LineReport->getNumLines()) {
+    errs() << "-dynamic-ic-lines: the input has no debug locations, no source line report\n";
+    LineReport.reset();
+  }
+  Function *ModuleReportsF = nullptr;
+  if (laneReport || CountingModeOpt == CountingMode::Path || topFunctions || Tree ||
+      LineReport || (MemoryReport && (memory || roofline)) || CycleReport || RegionReport) {
+    ModuleReportsF = Function::Create(
+        FunctionType::get(Type::getVoidTy(CTX), {PointerType::getUnqual(CTX)}, false),
+        GlobalValue::InternalLinkage, "LLVM_module_reports", M);
+    IRBuilder<> ReportBuilder(BasicBlock::Create(CTX, "entry", ModuleReportsF));
+    // Lane-weighted counts of the classes of this module
+    if (laneReport) {
+      std::vector<unsigned> lanes;
+      for (const std::string &opcodeName : opcodeList)
+        lanes.push_back(opcodeLanes.lookup(opcodeName));
+      ReportBuilder.CreateCall(createLaneReportFunction(M, opcodeNames, lanes),
+                               {ModuleReportsF->getArg(0)});
+    }
+
+    if (CountingModeOpt == CountingMode::Path)
+      Paths.emitTopPaths(ReportBuilder, Printf, TopPaths);
+
+    // Per-function and per-context reports (scaled by the sampling period, like the totals)
+    Value *Period = Sampler ? Sampler->emitPeriod(ReportBuilder) : ReportBuilder.getInt64(1);
+    if (topFunctions)
+      ReportBuilder.CreateCall(Functions.createReportFunction(topFunctions), {Period});
+    if (Tree)
+      ReportBuilder.CreateCall(Tree->createReportFunction(), {Period});
+    if (LineReport)
+      ReportBuilder.CreateCall(LineReport->createReportFunction(), {Period});
+    if (MemoryReport && memory)
+      ReportBuilder.CreateCall(MemoryReport->createReportFunction(), {Period});
+    if (MemoryReport && roofline)
+      ReportBuilder.CreateCall(MemoryReport->createRooflineFunction(Peaks, RooflineMinShare),
+                               {Period});
+    if (CycleReport)
+      ReportBuilder.CreateCall(CycleReport->createReportFunction(), {Period});
+    ReportBuilder.CreateRetVoid();
+  }
+
+  // ... and hand the opcode totals over to the module registry, which adds them to the
+  // totals of the other modules, and prints the results if this module is the last one
+  // (raw profile: the module hands over nothing, the terms of the opcode totals go to the
+  // manifest instead, see STEP 7; runtime library: the terms go to the description of the
+  // module, and libdynic_rt takes the place of the module registry)
+  std::unique_ptr<ModuleRegistry> Registry;
+  if (!Runtime)
+    Registry = std::make_unique<ModuleRegistry>(
+        M, Raw ? ArrayRef<Constant *>() : ArrayRef<Constant *>(opcodeNames));
+  if (Runtime) {
+    for (unsigned opcodeIdx = 0; opcodeIdx < opcodeList.size(); opcodeIdx++)
+      for (auto &term : opcodeTermsMap[opcodeList[opcodeIdx]])
+        Runtime->addTerm(term.first, opcodeIdx, term.second);
+    Runtime->emitUnregister(Builder);
+    if (ModuleReportsF)
+      Builder.CreateCall(ModuleReportsF, {ConstantPointerNull::get(PointerType::getUnqual(CTX))});
+  } else if (Raw) {
+    for (unsigned opcodeIdx = 0; opcodeIdx < opcodeList.size(); opcodeIdx++)
+      for (auto &term : opcodeTermsMap[opcodeList[opcodeIdx]])
+        Raw->addTerm(term.first, opcodeIdx, term.second);
+    Registry->emitUnregister(Builder, nullptr, nullptr, Builder.getInt64(0), ModuleReportsF);
+  } else {
+    IRBuilder<> AllocaBuilder(&PrintfWrapperF->getEntryBlock(),
+                              PrintfWrapperF->getEntryBlock().begin());
+    ArrayType *TotalsTy = ArrayType::get(Builder.getInt64Ty(), opcodeList.size());
+    Value *Totals = AllocaBuilder.CreateAlloca(TotalsTy, nullptr, "totals");
+    Value *Variances = AllocaBuilder.CreateAlloca(TotalsTy, nullptr, "variances");
+    emitOpcodeTotals(Builder, [&](unsigned opcodeIdx, Value *Total, Value *Variance) {
+      Builder.CreateStore(Total, Builder.CreateConstInBoundsGEP2_64(TotalsTy, Totals, 0, opcodeIdx));
+      Builder.CreateStore(Variance,
+                          Builder.CreateConstInBoundsGEP2_64(TotalsTy, Variances, 0, opcodeIdx));
+    });
+    Registry->emitUnregister(Builder, Totals, Variances,
+                            Sampler ? Sampler->emitPeriod(Builder) : Builder.getInt64(0),
+                            ModuleReportsF);
   }
 
   // Finally, insert return instruction
   Builder.CreateRetVoid();
 
+  // Regions of interest: the same per-opcode report, for the opcode totals of a region
+  // (differences of snapshots of the totals and of the sums making up their variances, both
+  // linear in the counters, taken by `void LLVM_roi_totals(ptr)`)
+  std::unique_ptr<RegionProfiler> Regions;
+  Function *RegionTotalsF = nullptr;
+  Function *PrintRegionCountsF = nullptr;
+  if (RegionReport) {
+    unsigned numOpcodes = opcodeList.size();
+    ArrayType *SnapshotTy = ArrayType::get(Builder.getInt64Ty(), 2 * numOpcodes);
+    FunctionType *RegionFTy =
+        FunctionType::get(Type::getVoidTy(CTX), {PointerType::getUnqual(CTX)}, false);
+    Regions = std::make_unique<RegionProfiler>(M, RegionsMax, RegionsMaxDepth);
+    RegionTotalsF =
+        Function::Create(RegionFTy, GlobalValue::InternalLinkage, "LLVM_roi_totals", M);
+    IRBuilder<> TotalsBuilder(BasicBlock::Create(CTX, "entry", RegionTotalsF));
+    Value *Snapshot = RegionTotalsF->getArg(0);
+    emitOpcodeTotals(TotalsBuilder, [&](unsigned opcodeIdx, Value *Total, Value *Variance) {
+      TotalsBuilder.CreateStore(
+          Total, TotalsBuilder.CreateConstInBoundsGEP2_64(SnapshotTy, Snapshot, 0, opcodeIdx));
+      TotalsBuilder.CreateStore(Variance, TotalsBuilder.CreateConstInBoundsGEP2_64(
+                                              SnapshotTy, Snapshot, 0, numOpcodes + opcodeIdx));
+    });
+    TotalsBuilder.CreateRetVoid();
+    PrintRegionCountsF =
+        Function::Create(RegionFTy, GlobalValue::InternalLinkage, "LLVM_roi_print_counts", M);
+    IRBuilder<> RegionBuilder(BasicBlock::Create(CTX, "entry", PrintRegionCountsF));
+    Value *Counts = PrintRegionCountsF->getArg(0);
+    Value *RegionFormat = RegionBuilder.CreatePointerCast(ResultFormatStrVar, PrintfArgTy);
+    for (unsigned opcodeIdx = 0; opcodeIdx < numOpcodes; opcodeIdx++) {
+      Value *Name = opcodeNameMap[opcodeList[opcodeIdx]];
+      Value *Total = RegionBuilder.CreateLoad(
+          Builder.getInt64Ty(),
+          RegionBuilder.CreateConstInBoundsGEP2_64(SnapshotTy, Counts, 0, opcodeIdx));
+      if (!Sampler) {
+        RegionBuilder.CreateCall(Printf, {RegionFormat, Name, Total});
+        continue;
+      }
+      Value *Variance = RegionBuilder.CreateLoad(
+          Builder.getInt64Ty(),
+          RegionBuilder.CreateConstInBoundsGEP2_64(SnapshotTy, Counts, 0, numOpcodes + opcodeIdx));
+      RegionBuilder.CreateCall(
+          Printf, {RegionFormat, Name, Total, emitSamplingBound(RegionBuilder, Variance)});
+    }
+    RegionBuilder.CreateRetVoid();
+  }
+  if (UsesRegions)
+    errs() << "Regions of interest: "
+           << (EnableCounting ? "counting only enabled inside regions\n"
+                              : "counting also enabled outside regions (not supported by the counting mode)\n");
+
 
-  // STEP 7: Call `printf_wrapper` at the very end of this module
+  // STEP 7: Lay out the counter table and call `printf_wrapper` at the very end of
+  // this module
   // ------------------------------------------------------------
+  // Every counter is replaced by its slot in LLVM_counters, hottest first. With
+  // thread-local counters, the instrumented functions then update a per-thread copy of the
+  // table, and `printf_wrapper` adds the counts of its own thread first (runtime library:
+  // the copies are handed over to libdynic_rt, which folds them). With a raw profile,
+  // the manifest records the final slots, and `printf_wrapper` only dumps the table (unless
+  // it is already mapped onto the profile, which happens before main).
+  GlobalVariable *CounterTableVar = Counters.layout(Raw ? Raw->getPageSize() : 0);
+  Function *FoldThreadCounters = nullptr;
+  if (ThreadSafe && ThreadSafetyOpt == ThreadSafety::ThreadLocal && CounterTableVar) {
+    std::vector<Function *> functions;
+    for (auto &Increments : counterIncrements)
+      functions.push_back(Increments.first);
+    FoldThreadCounters = makeCountersThreadLocal(
+        M, CounterTableVar, functions, Runtime ? Runtime->getDescriptor() : nullptr);
+    if (FoldThreadCounters) {
+      IRBuilder<> FoldBuilder(&*PrintfWrapperF->getEntryBlock().getFirstInsertionPt());
+      FoldBuilder.CreateCall(FoldThreadCounters,
+                             {ConstantPointerNull::get(PointerType::getUnqual(CTX))});
+    }
+  }
+  if (Regions) {
+    Function *RegionReportF = Regions->finalize(2 * opcodeList.size(), RegionTotalsF,
+                                                PrintRegionCountsF, FoldThreadCounters,
+                                                EnableCounting);
+    for (auto &BB : *ModuleReportsF)
+      if (isa<ReturnInst>(BB.getTerminator()))
+        CallInst::Create(RegionReportF, "", BB.getTerminator());
+    Registry->setRegionHooks(Regions->getBegin(), Regions->getEnd());
+  }
+  if (Toggles && Registry)
+    Registry->setToggleHooks(EnableCounting, Toggles->getEnableFunctionByName());
+  if (Raw) {
+    uint64_t numCounters = Counters.getNumCounters();
+    if (Raw->writeManifest(ManifestPath, opcodeList, Counters, numCounters, Sampler != nullptr)) {
+      if (Raw->getPageSize() && CounterTableVar)
+        startupFunctions.insert(startupFunctions.begin(),
+                                Raw->createMapFunction(CounterTableVar, numCounters));
+      if (Timeline)
+        Timeline->setManifestHash(Raw->getHash());
+      Function *RawDumpF = Raw->createDumpFunction(CounterTableVar, numCounters);
+      for (auto &BB : *PrintfWrapperF)
+        if (isa<ReturnInst>(BB.getTerminator())) {
+          IRBuilder<> DumpBuilder(BB.getTerminator());
+          DumpBuilder.CreateCall(RawDumpF, {Sampler ? Sampler->emitPeriod(DumpBuilder)
+                                                    : DumpBuilder.getInt64(1)});
+        }
+      errs() << "Raw profile: " << RawProfilePattern << " (manifest: " << ManifestPath << ")\n";
+    }
+  }
+  if (Control) {
+    startupFunctions.push_back(
+        Control->createStartFunction(Counters, CounterTableVar, Counters.getNumCounters()));
+    // SIGUSR1 and SIGUSR2 are handled by the module registry, for every module
+    if (ControlSignals)
+      Registry->setControlHooks(Control->getDump(), Control->getReset());
+  }
+  // Runtime library: the description of the module refers to the final slots
+  if (Runtime) {
+    Runtime->setToggleHooks(EnableCounting,
+                            Toggles ? Toggles->getEnableFunctionByName() : nullptr);
+    startupFunctions.push_back(Runtime->createRegisterFunction(
+        Counters, CounterTableVar, Counters.getNumCounters(), opcodeList, Sampler != nullptr,
+        TopFunctions));
+  }
+  // Runtime started at startup (`void (i64 period)`), after the initialization of the
+  // sampling period (also a priority 0 constructor)
+  if (!startupFunctions.empty()) {
+    Function *InitF = Function::Create(PrintfWrapperTy, GlobalValue::InternalLinkage,
+                                       "LLVM_dynic_init", M);
+    IRBuilder<> InitBuilder(BasicBlock::Create(CTX, "entry", InitF));
+    Value *Period = Sampler ? Sampler->emitPeriod(InitBuilder) : InitBuilder.getInt64(1);
+    for (Function *StartupF : startupFunctions)
+      InitBuilder.CreateCall(StartupF, {Period});
+    InitBuilder.CreateRetVoid();
+    appendToGlobalCtors(M, InitF, /*Priority=*/0);
+  }
+  // Runtime API and registration of the module
+  if (Registry)
+    Registry->finalize();
   appendToGlobalDtors(M, PrintfWrapperF, /*Priority=*/0);
 
   return true;
 }
 
-PreservedAnalyses DynamicInstCounter::run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
-  bool Changed = runOnModule(M);
+PreservedAnalyses DynamicInstCounter::run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  bool Changed = runOnModule(M, FAM);
   return (Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all());
 }
 
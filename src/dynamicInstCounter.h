@@ -17,7 +17,7 @@
 struct DynamicInstCounter : public llvm::PassInfoMixin<DynamicInstCounter> {
   llvm::PreservedAnalyses run(llvm::Module &M,
                               llvm::ModuleAnalysisManager &);
-  bool runOnModule(llvm::Module &M);
+  bool runOnModule(llvm::Module &M, llvm::FunctionAnalysisManager &FAM);
 
   // Without isRequired returning true, this pass will be skipped for functions
   // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
@@ -0,0 +1,384 @@
+//========================================================================
+// FILE:
+//    dynicRead.cpp
+//
+// DESCRIPTION:
+//    dynic-read: prints the results of programs instrumented with
+//    -dynamic-ic-raw-profile, from the manifests written by the pass and one
+//    or more raw profiles (the counts of several runs are added up). A
+//    program made of several instrumented modules (translation units, shared
+//    libraries) has a manifest and a raw profile per module: every raw
+//    profile is matched with its manifest by hash, and the per-opcode totals
+//    of the modules are combined. They are printed like the instrumented
+//    program would have, optionally followed by the function report and the
+//    value of every counter with the function and block it counts. With
+//    -timeline, binary timelines (-dynamic-ic-timeline) are converted to CSV
+//    instead.
+//
+//    Standalone on purpose: it only depends on the standard library, so it
+//    can run where the profiles are collected.
+//
+// USAGE:
+//      $ dynic-read [-top-functions=<N>] [-counters] <manifest>... <raw-profile>...
+//      $ dynic-read -timeline <manifest>... <timeline>
+//
+// License: MIT
+//========================================================================
+#include "samplingError.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace {
+// Must match rawProfile.h
+constexpr uint64_t RawMagic = 0x57415243494e5944; // "DYNICRAW"
+constexpr uint64_t Version = 2; // of the manifest and the raw profiles
+constexpr unsigned RawHeaderWords = 6;
+// Must match counterTimeline.h
+constexpr uint64_t TimelineMagic = 0x4c4d5443494e5944; // "DYNICTML"
+constexpr uint64_t TimelineVersion = 1;
+constexpr unsigned TimelineHeaderWords = 6;
+
+struct Counter {
+  unsigned Function = 0;
+  std::string Kind;
+  std::string Block;
+};
+
+struct Term {
+  uint64_t Slot;
+  unsigned Opcode;
+  int64_t Weight;
+};
+
+struct Manifest {
+  std::string Module;
+  uint64_t Hash = 0;
+  uint64_t NumCounters = 0;
+  bool Sampled = false;
+  std::vector<std::string> Opcodes;
+  std::vector<std::string> Functions;
+  std::vector<Counter> Counters;
+  std::vector<Term> Terms;
+};
+
+[[noreturn]] void fail(const std::string &Message) {
+  fprintf(stderr, "dynic-read: %s\n", Message.c_str());
+  exit(1);
+}
+
+std::vector<std::string> splitFields(const std::string &Line) {
+  std::vector<std::string> Fields;
+  std::stringstream SS(Line);
+  std::string Field;
+  while (std::getline(SS, Field, '\t'))
+    Fields.push_back(Field);
+  return Fields;
+}
+
+Manifest readManifest(const char *Path) {
+  std::ifstream File(Path);
+  if (!File)
+    fail(std::string("cannot open the manifest ") + Path);
+  Manifest Result;
+  std::string Line;
+  bool Versioned = false;
+  auto badRecord = [&]() { fail(std::string("malformed manifest ") + Path + ": " + Line); };
+  auto index = [&](const std::string &Field, size_t Size) {
+    uint64_t Idx = strtoull(Field.c_str(), nullptr, 10);
+    if (Idx >= Size)
+      badRecord();
+    return Idx;
+  };
+  while (std::getline(File, Line)) {
+    std::vector<std::string> Fields = splitFields(Line);
+    if (Fields.empty())
+      continue;
+    const std::string &Record = Fields[0];
+    if (Record == "dynic-manifest" && Fields.size() == 2) {
+      if (strtoull(Fields[1].c_str(), nullptr, 10) != Version)
+        fail(std::string("unsupported manifest version in ") + Path);
+      Versioned = true;
+    } else if (Record == "hash" && Fields.size() == 2) {
+      Result.Hash = strtoull(Fields[1].c_str(), nullptr, 16);
+    } else if (Record == "module") {
+      Result.Module = Fields.size() > 1 ? Fields[1] : "";
+    } else if (Record == "counters" && Fields.size() == 3) {
+      Result.NumCounters = strtoull(Fields[1].c_str(), nullptr, 10);
+      Result.Sampled = Fields[2] == "1";
+      Result.Counters.resize(Result.NumCounters);
+    } else if (Record == "opcode" && Fields.size() == 3) {
+      Result.Opcodes.push_back(Fields[2]);
+    } else if (Record == "function" && Fields.size() == 3) {
+      Result.Functions.push_back(Fields[2]);
+    } else if (Record == "counter" && Fields.size() == 5) {
+      Counter &C = Result.Counters[index(Fields[1], Result.NumCounters)];
+      C.Function = index(Fields[2], Result.Functions.size());
+      C.Kind = Fields[3];
+      C.Block = Fields[4];
+    } else if (Record == "term" && Fields.size() == 4) {
+      Result.Terms.push_back({index(Fields[1], Result.NumCounters),
+                              static_cast<unsigned>(index(Fields[2], Result.Opcodes.size())),
+                              strtoll(Fields[3].c_str(), nullptr, 10)});
+    } else {
+      badRecord();
+    }
+  }
+  if (!Versioned)
+    fail(std::string(Path) + " is not a dynic manifest");
+  return Result;
+}
+
+// Whether the file at Path is a manifest (rather than a raw profile or a
+// timeline)
+bool isManifest(const char *Path) {
+  std::ifstream File(Path);
+  std::string Line;
+  return File && std::getline(File, Line) && !Line.compare(0, 15, "dynic-manifest\t");
+}
+
+// A module (its manifest) and the counts of its raw profiles
+struct Module {
+  Manifest Layout;
+  std::vector<uint64_t> Counts;
+  uint64_t Period = 0; // 0 if it has no raw profile
+};
+
+// Module the header of a raw profile or a timeline was written by
+Module &findModule(std::vector<Module> &Modules, const char *Path, uint64_t Hash) {
+  for (Module &M : Modules)
+    if (M.Layout.Hash == Hash)
+      return M;
+  fail(std::string(Path) + " was written by another build than the manifests");
+}
+
+// Adds the counters of the raw profile at Path to the counts of its module
+void readRawProfile(const char *Path, std::vector<Module> &Modules) {
+  FILE *File = fopen(Path, "rb");
+  if (!File)
+    fail(std::string("cannot open the raw profile ") + Path);
+  uint64_t Header[RawHeaderWords];
+  if (fread(Header, sizeof(Header), 1, File) != 1 || Header[0] != RawMagic)
+    fail(std::string(Path) + " is not a dynic raw profile");
+  if (Header[1] != Version)
+    fail(std::string("unsupported raw profile version in ") + Path);
+  Module &M = findModule(Modules, Path, Header[2]);
+  if (Header[3] != M.Layout.NumCounters)
+    fail(std::string(Path) + " was written by another build than the manifests");
+  if (M.Period && Header[4] != M.Period)
+    fail("the raw profiles of " + M.Layout.Module + " were sampled with different periods");
+  M.Period = Header[4];
+  // Counters start at a page boundary in continuous profiles
+  std::vector<uint64_t> Values(M.Layout.NumCounters);
+  if (fseek(File, static_cast<long>(Header[5]), SEEK_SET))
+    fail(std::string(Path) + " is truncated");
+  if (!Values.empty() && fread(Values.data(), sizeof(uint64_t), Values.size(), File) != Values.size())
+    fail(std::string(Path) + " is truncated");
+  fclose(File);
+  M.Counts.resize(Values.size());
+  for (size_t Slot = 0; Slot < Values.size(); Slot++)
+    M.Counts[Slot] += Values[Slot];
+}
+
+// Same output as the results printed by the instrumented programs: the totals
+// of the modules are combined by opcode name
+void printOpcodeTotals(const std::vector<Module> &Modules) {
+  std::vector<std::string> Opcodes;
+  std::vector<uint64_t> Totals, Variances;
+  bool Sampled = false;
+  uint64_t Period = 0; // ~0 if the modules were sampled with different periods
+  for (const Module &M : Modules) {
+    if (!M.Period || !M.Layout.Sampled)
+      continue;
+    Sampled = true;
+    Period = !Period || Period == M.Period ? M.Period : ~0ULL;
+  }
+  // Error of the estimates: see samplingError.h
+  for (const Module &M : Modules) {
+    if (!M.Period)
+      continue;
+    std::vector<size_t> Index;
+    for (const std::string &Opcode : M.Layout.Opcodes) {
+      size_t Idx = std::find(Opcodes.begin(), Opcodes.end(), Opcode) - Opcodes.begin();
+      if (Idx == Opcodes.size()) {
+        Opcodes.push_back(Opcode);
+        Totals.push_back(0);
+        Variances.push_back(0);
+      }
+      Index.push_back(Idx);
+    }
+    for (const Term &T : M.Layout.Terms) {
+      uint64_t Count = M.Counts[T.Slot];
+      Totals[Index[T.Opcode]] += Count * static_cast<uint64_t>(T.Weight) * M.Period;
+      Variances[Index[T.Opcode]] += getSamplingVariance(Count, T.Weight, M.Period);
+    }
+  }
+
+  printf("=================================================\n");
+  printf("LLVM Dynamic Instruction Counter results\n");
+  printf("=================================================\n");
+  printf(Sampled ? "INST                 #N CALLS (runtime, estimated)\n"
+                 : "INST                 #N CALLS (runtime)\n");
+  printf("-------------------------------------------------\n");
+  if (Sampled && Period != ~0ULL)
+    printf("Sampling period: %" PRIu64 "\n", Period);
+  for (size_t Opcode = 0; Opcode < Opcodes.size(); Opcode++) {
+    if (!Sampled) {
+      printf("%-20s %-10" PRIu64 "\n", Opcodes[Opcode].c_str(), Totals[Opcode]);
+      continue;
+    }
+    printf("%-20s %-10" PRIu64 " +/- %" PRIu64 "\n", Opcodes[Opcode].c_str(), Totals[Opcode],
+           getSamplingBound(Variances[Opcode]));
+  }
+}
+
+// Same output as -dynamic-ic-top-functions (see functionReport.cpp), for the
+// functions of every module
+void printFunctions(const std::vector<Module> &Modules, unsigned N) {
+  // Per-opcode counts of every function, and records {total, module, function}
+  std::vector<std::vector<std::vector<uint64_t>>> OpcodeCounts;
+  std::vector<std::tuple<uint64_t, size_t, size_t>> Records;
+  uint64_t GrandTotal = 0;
+  for (size_t Idx = 0; Idx < Modules.size(); Idx++) {
+    const Module &M = Modules[Idx];
+    OpcodeCounts.emplace_back(M.Layout.Functions.size(),
+                              std::vector<uint64_t>(M.Layout.Opcodes.size()));
+    if (!M.Period)
+      continue;
+    for (const Term &T : M.Layout.Terms)
+      OpcodeCounts[Idx][M.Layout.Counters[T.Slot].Function][T.Opcode] +=
+          M.Counts[T.Slot] * static_cast<uint64_t>(T.Weight) * M.Period;
+    for (size_t Function = 0; Function < M.Layout.Functions.size(); Function++) {
+      uint64_t Total = 0;
+      for (uint64_t Count : OpcodeCounts[Idx][Function])
+        Total += Count;
+      Records.push_back({Total, Idx, Function});
+      GrandTotal += Total;
+    }
+  }
+  std::stable_sort(Records.begin(), Records.end(),
+                   [](auto &A, auto &B) { return std::get<0>(A) > std::get<0>(B); });
+
+  size_t NumPrinted = N ? std::min<size_t>(N, Records.size()) : Records.size();
+  printf("-------------------------------------------------\n"
+         "FUNCTIONS (top %zu of %zu)\n"
+         "FUNCTION             #N INSTS   SHARE\n"
+         "-------------------------------------------------\n",
+         NumPrinted, Records.size());
+  double Divisor = GrandTotal ? static_cast<double>(GrandTotal) : 1;
+  for (size_t Idx = 0; Idx < NumPrinted; Idx++) {
+    auto [Total, ModuleIdx, Function] = Records[Idx];
+    const Manifest &Manifest = Modules[ModuleIdx].Layout;
+    printf("%-20s %-10" PRIu64 " %6.2f%%\n", Manifest.Functions[Function].c_str(), Total,
+           Total * 100.0 / Divisor);
+    for (size_t Opcode = 0; Opcode < Manifest.Opcodes.size(); Opcode++)
+      if (uint64_t Count = OpcodeCounts[ModuleIdx][Function][Opcode])
+        printf("  %-18s %-10" PRIu64 "\n", Manifest.Opcodes[Opcode].c_str(), Count);
+  }
+}
+
+// The counters of every module with a raw profile (preceded by the name of the
+// module if there are several)
+void printCounters(const std::vector<Module> &Modules) {
+  printf("-------------------------------------------------\n"
+         "COUNTERS\n"
+         "SLOT     VALUE        KIND  FUNCTION / BLOCK\n"
+         "-------------------------------------------------\n");
+  for (const Module &M : Modules) {
+    if (!M.Period)
+      continue;
+    if (Modules.size() > 1)
+      printf("%s\n", M.Layout.Module.c_str());
+    for (size_t Slot = 0; Slot < M.Counts.size(); Slot++) {
+      const Counter &C = M.Layout.Counters[Slot];
+      printf("%-8zu %-12" PRIu64 " %-5s %s %s\n", Slot, M.Counts[Slot], C.Kind.c_str(),
+             M.Layout.Functions.empty() ? "" : M.Layout.Functions[C.Function].c_str(),
+             C.Block.c_str());
+    }
+  }
+}
+// Same output as the CSV timelines written without raw profiles
+void printTimeline(const char *Path, std::vector<Module> &Modules) {
+  FILE *File = fopen(Path, "rb");
+  if (!File)
+    fail(std::string("cannot open the timeline ") + Path);
+  uint64_t Header[TimelineHeaderWords];
+  if (fread(Header, sizeof(Header), 1, File) != 1 || Header[0] != TimelineMagic)
+    fail(std::string(Path) + " is not a dynic timeline");
+  if (Header[1] != TimelineVersion)
+    fail(std::string("unsupported timeline version in ") + Path);
+  const Manifest &Manifest = findModule(Modules, Path, Header[2]).Layout;
+  if (Header[3] != Manifest.Opcodes.size())
+    fail(std::string(Path) + " was written by another build than the manifest");
+
+  printf("time_ms,instructions");
+  for (const std::string &Opcode : Manifest.Opcodes)
+    printf(",%s", Opcode.c_str());
+  printf("\n");
+  // Time, then signed counts (see counterTimeline.cpp)
+  std::vector<int64_t> Record(1 + Manifest.Opcodes.size());
+  while (fread(Record.data(), sizeof(int64_t), Record.size(), File) == Record.size()) {
+    int64_t Instructions = 0;
+    for (size_t Idx = 1; Idx < Record.size(); Idx++)
+      Instructions += Record[Idx];
+    printf("%" PRId64 ",%" PRId64, Record[0], Instructions);
+    for (size_t Idx = 1; Idx < Record.size(); Idx++)
+      printf(",%" PRId64, Record[Idx]);
+    printf("\n");
+  }
+  fclose(File);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  bool Functions = false, Counters = false, Timeline = false;
+  unsigned TopFunctions = 0;
+  std::vector<const char *> Paths;
+  for (int Idx = 1; Idx < argc; Idx++) {
+    if (!strncmp(argv[Idx], "-top-functions=", 15)) {
+      Functions = true;
+      TopFunctions = strtoul(argv[Idx] + 15, nullptr, 10);
+    } else if (!strcmp(argv[Idx], "-counters")) {
+      Counters = true;
+    } else if (!strcmp(argv[Idx], "-timeline")) {
+      Timeline = true;
+    } else {
+      Paths.push_back(argv[Idx]);
+    }
+  }
+  // Manifests come first
+  std::vector<Module> Modules;
+  size_t NumManifests = 0;
+  while (NumManifests < Paths.size() && isManifest(Paths[NumManifests]))
+    Modules.push_back({readManifest(Paths[NumManifests++]), {}, 0});
+  if (!NumManifests || NumManifests == Paths.size() ||
+      (Timeline && Paths.size() != NumManifests + 1)) {
+    fprintf(stderr,
+            "usage: %s [-top-functions=<N>] [-counters] <manifest>... <raw-profile>...\n"
+            "       %s -timeline <manifest>... <timeline>\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+
+  if (Timeline) {
+    printTimeline(Paths.back(), Modules);
+    return 0;
+  }
+  for (size_t Idx = NumManifests; Idx < Paths.size(); Idx++)
+    readRawProfile(Paths[Idx], Modules);
+
+  printOpcodeTotals(Modules);
+  if (Functions)
+    printFunctions(Modules, TopFunctions);
+  if (Counters)
+    printCounters(Modules);
+  return 0;
+}
@@ -0,0 +1,684 @@
+//========================================================================
+// FILE:
+//    dynicRuntime.cpp
+//
+// DESCRIPTION:
+//    libdynic_rt: runtime library of the programs instrumented with
+//    -dynamic-ic-runtime. Instead of evaluating and printing the reports in
+//    generated code, every instrumented module (translation unit or shared
+//    library) describes its counter table (see dynicRuntime.h) and registers
+//    it at startup. When a module unregisters (at exit, or when its library
+//    is unloaded), its counters are evaluated and added to the combined
+//    results, by opcode name; the module unregistered last writes them.
+//
+//    The results are configured at runtime by environment variables:
+//      DYNIC_OUTPUT:        file to write them to instead of stdout (%p:
+//                           process ID, %h: host name, %%: %)
+//      DYNIC_FORMAT:        text (default, same output as the instrumented
+//                           programs), csv or json
+//      DYNIC_TOP_FUNCTIONS: number of functions of the function report
+//                           (default: -dynamic-ic-top-functions; 0: none)
+//
+//    The library also owns the parts of the runtime that concern the whole
+//    process:
+//      * the counting toggles: dynic_enable and dynic_enable_function are
+//        dispatched to the registered modules without locking, so that they
+//        can be called from signal handlers (they must not run concurrently
+//        with the unloading of an instrumented library). Counting starts
+//        disabled, unless DYNIC_ENABLED is set to a non-zero value, and the
+//        signal in DYNIC_TOGGLE_SIGNAL switches it on and off; modules
+//        registered later follow the current state;
+//      * the thread-local counters (-dynamic-ic-threads=tls): every thread
+//        hands its copy of the counters of a module over to the library, which
+//        adds it to the counters when the thread exits (pthread key
+//        destructor), and when the calling thread reads them (the destructors
+//        of the main thread do not run on exit). Copies of modules that are
+//        no longer registered are skipped;
+//      * the regions of interest: dynic_roi_begin and dynic_roi_end snapshot
+//        the opcode totals of the whole program (as in regionProfiler.cpp,
+//        without its limits on the number of regions), and turn counting on
+//        and off at the outermost region. They take a lock, and are meant to
+//        be called by one thread at a time.
+//
+//    Standalone on purpose: it only depends on the C and C++ standard
+//    libraries and on POSIX threads, so that it can be linked into any
+//    instrumented program.
+//
+// USAGE:
+//      $ cc instrumented.o -L<BUILD_DIR>/lib -ldynic_rt
+//
+// License: MIT
+//========================================================================
+#include "dynicRuntime.h"
+#include "samplingError.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+constexpr unsigned MaxModules = 256;
+constexpr uint32_t NoFunction = UINT32_MAX;
+constexpr size_t NoRegion = SIZE_MAX;
+
+// Registered modules (null: free slot), read by the API without locking,
+// their sampling periods and the serial number of their registration
+std::atomic<const dynic_rt_module *> Modules[MaxModules];
+uint64_t Periods[MaxModules];
+uint64_t Serials[MaxModules];
+uint64_t NextSerial = 1;
+std::mutex Lock;
+
+// Counting state of the modules with toggles, set by dynic_enable
+std::atomic<int> CountingOn{0};
+bool SignalInstalled = false;
+
+// Slot of Module, or MaxModules if it is not registered (Lock held)
+unsigned findSlot(const dynic_rt_module *Module) {
+  for (unsigned Slot = 0; Slot < MaxModules; Slot++)
+    if (Modules[Slot].load(std::memory_order_relaxed) == Module)
+      return Slot;
+  return MaxModules;
+}
+
+//-----------------------------------------------------------------------------
+// Thread-local counters
+//-----------------------------------------------------------------------------
+// Copy of the counters of a module owned by a thread. Serial 0: the module
+// was not registered yet when the thread handed the copy over.
+struct ThreadCopy {
+  const dynic_rt_module *Module;
+  uint64_t Serial;
+  uint64_t *Counters;
+};
+
+// Copies handed over by the calling thread (trivially destructible: the
+// vector is deleted by the destructor of Key, which may run after the
+// destructors of the C++ thread_local objects)
+thread_local std::vector<ThreadCopy> *Copies = nullptr;
+pthread_key_t Key;
+bool KeyCreated = false;
+
+// Adds Copy to the counters of its module, unless the module was unregistered
+// since (Lock held)
+void foldCopy(const ThreadCopy &Copy) {
+  unsigned Slot = findSlot(Copy.Module);
+  if (Slot == MaxModules || (Copy.Serial && Copy.Serial != Serials[Slot]))
+    return;
+  for (uint64_t Idx = 0; Idx < Copy.Module->num_counters; Idx++) {
+    if (uint64_t Count = Copy.Counters[Idx]) {
+      __atomic_fetch_add(&Copy.Module->counters[Idx], Count, __ATOMIC_RELAXED);
+      Copy.Counters[Idx] = 0;
+    }
+  }
+}
+
+// Folds the copies of the calling thread (of Module only, if not null) into
+// the counters (Lock held)
+void foldThreadCopies(const dynic_rt_module *Module) {
+  if (!Copies)
+    return;
+  for (const ThreadCopy &Copy : *Copies)
+    if (!Module || Copy.Module == Module)
+      foldCopy(Copy);
+}
+
+// Destructor of Key, when a thread that handed copies over exits
+void foldExitingThread(void *ThreadCopies) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto *List = static_cast<std::vector<ThreadCopy> *>(ThreadCopies);
+  for (const ThreadCopy &Copy : *List)
+    foldCopy(Copy);
+  delete List;
+  Copies = nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// Counting toggles
+//-----------------------------------------------------------------------------
+void setCounting(int On) {
+  CountingOn.store(On != 0, std::memory_order_relaxed);
+  for (auto &Slot : Modules)
+    if (const dynic_rt_module *Module = Slot.load(std::memory_order_acquire))
+      if (Module->enable)
+        Module->enable(On);
+}
+
+// DYNIC_TOGGLE_SIGNAL handler
+void toggleCounting(int) { setCounting(!CountingOn.load(std::memory_order_relaxed)); }
+
+struct FunctionTotals {
+  std::string Name;
+  uint64_t Total = 0;
+  // Indexed like Results::Opcodes
+  std::vector<uint64_t> Counts;
+};
+
+// Region of interest, identified by its name and its parent (the region open
+// when it begins)
+struct Region {
+  std::string Name;
+  size_t Parent; // NoRegion at top level
+  uint64_t Executions = 0;
+  // Indexed like Results::Opcodes (possibly shorter)
+  std::vector<uint64_t> Counts, Variances;
+};
+
+// Region being executed, with the totals of the program when it began
+struct OpenRegion {
+  size_t Idx;
+  std::vector<uint64_t> Totals, Variances;
+};
+
+// Combined results of the modules unregistered so far, and regions of
+// interest (children are always recorded after their parent)
+struct Results {
+  unsigned NumRegistered = 0;
+  bool Sampled = false;
+  uint64_t Period = 0; // ~0 if the modules were sampled with different periods
+  uint64_t TopFunctions = 0;
+  std::vector<std::string> Opcodes;
+  std::vector<uint64_t> Totals, Variances;
+  std::vector<FunctionTotals> Functions;
+  std::vector<Region> Regions;
+  std::vector<OpenRegion> Stack;
+};
+
+// Never destroyed: modules may unregister after the static destructors of
+// the library
+Results &getResults() {
+  static Results *R = new Results();
+  return *R;
+}
+
+// Index in R.Opcodes of every opcode of Module (added if new)
+std::vector<size_t> mapOpcodes(Results &R, const dynic_rt_module &Module) {
+  std::vector<size_t> Index;
+  for (uint64_t Opcode = 0; Opcode < Module.num_opcodes; Opcode++) {
+    const char *Name = Module.opcodes[Opcode];
+    size_t Idx = std::find(R.Opcodes.begin(), R.Opcodes.end(), Name) - R.Opcodes.begin();
+    if (Idx == R.Opcodes.size()) {
+      R.Opcodes.push_back(Name);
+      R.Totals.push_back(0);
+      R.Variances.push_back(0);
+      for (FunctionTotals &F : R.Functions)
+        F.Counts.push_back(0);
+    }
+    Index.push_back(Idx);
+  }
+  return Index;
+}
+
+// Adds the counts of Module, sampled with Period, to Totals and Variances
+// (indexed like Index), and to the totals of its functions Functions, if not
+// null (error of the estimates: see samplingError.h)
+void addCounts(const dynic_rt_module &Module, uint64_t Period, const std::vector<size_t> &Index,
+               uint64_t *Totals, uint64_t *Variances, FunctionTotals *Functions) {
+  bool Sampled = Module.flags & DYNIC_RT_SAMPLED;
+  for (uint64_t Idx = 0; Idx < Module.num_terms; Idx++) {
+    const dynic_rt_term &T = Module.terms[Idx];
+    uint64_t Count = Module.counters[T.slot];
+    uint64_t Total = Count * static_cast<uint64_t>(T.weight) * Period;
+    Totals[Index[T.opcode]] += Total;
+    if (Sampled)
+      Variances[Index[T.opcode]] += getSamplingVariance(Count, T.weight, Period);
+    uint32_t Function = Module.counter_functions ? Module.counter_functions[T.slot] : NoFunction;
+    if (!Functions || Function == NoFunction)
+      continue;
+    FunctionTotals &F = Functions[Function];
+    F.Counts[Index[T.opcode]] += Total;
+    F.Total += Total;
+  }
+}
+
+// Adds the counts of Module, sampled with Period, to R
+void addModule(Results &R, const dynic_rt_module &Module, uint64_t Period) {
+  if (Module.flags & DYNIC_RT_SAMPLED) {
+    R.Period = !R.Sampled || R.Period == Period ? Period : ~0ULL;
+    R.Sampled = true;
+  }
+  R.TopFunctions = std::max(R.TopFunctions, Module.top_functions);
+
+  std::vector<size_t> Index = mapOpcodes(R, Module);
+  size_t FirstFunction = R.Functions.size();
+  for (uint64_t Function = 0; Function < Module.num_functions; Function++) {
+    R.Functions.push_back({Module.functions[Function], 0, {}});
+    R.Functions.back().Counts.resize(R.Opcodes.size());
+  }
+  addCounts(Module, Period, Index, R.Totals.data(), R.Variances.data(),
+            R.Functions.data() + FirstFunction);
+}
+
+// Opcode totals of the whole program so far, and the sums making up their
+// variances: the modules unregistered so far, and the counters of the
+// registered ones (with the copies of the calling thread; Lock held)
+void takeSnapshot(Results &R, std::vector<uint64_t> &Totals, std::vector<uint64_t> &Variances) {
+  foldThreadCopies(nullptr);
+  std::vector<std::pair<unsigned, std::vector<size_t>>> Registered;
+  for (unsigned Slot = 0; Slot < MaxModules; Slot++)
+    if (const dynic_rt_module *Module = Modules[Slot].load(std::memory_order_relaxed))
+      Registered.push_back({Slot, mapOpcodes(R, *Module)});
+  Totals = R.Totals;
+  Variances = R.Variances;
+  for (auto &[Slot, Index] : Registered)
+    addCounts(*Modules[Slot].load(std::memory_order_relaxed), Periods[Slot], Index,
+              Totals.data(), Variances.data(), nullptr);
+}
+
+// DYNIC_OUTPUT, expanded (empty if not set)
+std::string getOutputPath() {
+  const char *Pattern = getenv("DYNIC_OUTPUT");
+  if (!Pattern)
+    return "";
+  std::string Path;
+  for (const char *C = Pattern; *C; C++) {
+    if (*C != '%' || !C[1]) {
+      Path += *C;
+      continue;
+    }
+    C++;
+    if (*C == 'p') {
+      Path += std::to_string(getpid());
+    } else if (*C == 'h') {
+      char Host[256] = {0};
+      gethostname(Host, sizeof(Host) - 1);
+      Path += Host;
+    } else {
+      if (*C != '%')
+        Path += '%';
+      Path += *C;
+    }
+  }
+  return Path;
+}
+
+// Functions of the report, most instructions first
+std::vector<const FunctionTotals *> getTopFunctions(const Results &R, uint64_t N) {
+  std::vector<const FunctionTotals *> Top;
+  for (const FunctionTotals &F : R.Functions)
+    Top.push_back(&F);
+  std::stable_sort(Top.begin(), Top.end(),
+                   [](auto *A, auto *B) { return A->Total > B->Total; });
+  if (N < Top.size())
+    Top.resize(N);
+  return Top;
+}
+
+// Count of opcode Opcode in Counts (which may be shorter than R.Opcodes)
+uint64_t getCount(const std::vector<uint64_t> &Counts, size_t Opcode) {
+  return Opcode < Counts.size() ? Counts[Opcode] : 0;
+}
+
+// Names of Region and of its ancestors, outermost first, separated by '/'
+std::string getRegionPath(const Results &R, size_t Region) {
+  std::string Path = R.Regions[Region].Name;
+  for (size_t Parent = R.Regions[Region].Parent; Parent != NoRegion;
+       Parent = R.Regions[Parent].Parent)
+    Path = R.Regions[Parent].Name + "/" + Path;
+  return Path;
+}
+
+// Name as the contents of a JSON string
+std::string escapeJSON(const std::string &Name) {
+  std::string Escaped;
+  for (char C : Name) {
+    if (C == '"' || C == '\\') {
+      Escaped += '\\';
+      Escaped += C;
+    } else if (static_cast<unsigned char>(C) < 0x20) {
+      char Code[8];
+      snprintf(Code, sizeof(Code), "\\u%04x", C);
+      Escaped += Code;
+    } else {
+      Escaped += C;
+    }
+  }
+  return Escaped;
+}
+
+// Name as a CSV field: quoted if it holds a separator, a quote or a line break
+std::string quoteCSV(const std::string &Name) {
+  if (Name.find_first_of(",\"\r\n") == std::string::npos)
+    return Name;
+  std::string Quoted = "\"";
+  for (char C : Name) {
+    if (C == '"')
+      Quoted += '"';
+    Quoted += C;
+  }
+  return Quoted + "\"";
+}
+
+// Per-opcode counts, in the format of the totals
+void writeTextCounts(FILE *Out, const Results &R, const std::vector<uint64_t> &Counts,
+                     const std::vector<uint64_t> &Variances) {
+  for (size_t Opcode = 0; Opcode < R.Opcodes.size(); Opcode++) {
+    if (!R.Sampled)
+      fprintf(Out, "%-20s %-10" PRIu64 "\n", R.Opcodes[Opcode].c_str(), getCount(Counts, Opcode));
+    else
+      fprintf(Out, "%-20s %-10" PRIu64 " +/- %" PRIu64 "\n", R.Opcodes[Opcode].c_str(),
+              getCount(Counts, Opcode), getSamplingBound(getCount(Variances, Opcode)));
+  }
+}
+
+// Region, then its children, indented by depth (as in regionProfiler.cpp)
+void writeTextRegion(FILE *Out, const Results &R, size_t Idx, int Depth) {
+  const Region &Current = R.Regions[Idx];
+  fprintf(Out, "%*s%s: %" PRIu64 " executions\n", 2 * Depth, "", Current.Name.c_str(),
+          Current.Executions);
+  writeTextCounts(Out, R, Current.Counts, Current.Variances);
+  for (size_t Child = Idx + 1; Child < R.Regions.size(); Child++)
+    if (R.Regions[Child].Parent == Idx)
+      writeTextRegion(Out, R, Child, Depth + 1);
+}
+
+// Same output as the instrumented programs (and dynic-read)
+void writeText(FILE *Out, const Results &R, uint64_t TopFunctions) {
+  fprintf(Out, "=================================================\n"
+               "LLVM Dynamic Instruction Counter results\n"
+               "=================================================\n");
+  fprintf(Out, R.Sampled ? "INST                 #N CALLS (runtime, estimated)\n"
+                         : "INST                 #N CALLS (runtime)\n");
+  fprintf(Out, "-------------------------------------------------\n");
+  if (R.Sampled && R.Period != ~0ULL)
+    fprintf(Out, "Sampling period: %" PRIu64 "\n", R.Period);
+  writeTextCounts(Out, R, R.Totals, R.Variances);
+
+  if (TopFunctions) {
+    uint64_t GrandTotal = 0;
+    for (const FunctionTotals &F : R.Functions)
+      GrandTotal += F.Total;
+    double Divisor = GrandTotal ? static_cast<double>(GrandTotal) : 1;
+    std::vector<const FunctionTotals *> Top = getTopFunctions(R, TopFunctions);
+    fprintf(Out,
+            "-------------------------------------------------\n"
+            "FUNCTIONS (top %zu of %zu)\n"
+            "FUNCTION             #N INSTS   SHARE\n"
+            "-------------------------------------------------\n",
+            Top.size(), R.Functions.size());
+    for (const FunctionTotals *F : Top) {
+      fprintf(Out, "%-20s %-10" PRIu64 " %6.2f%%\n", F->Name.c_str(), F->Total,
+              F->Total * 100.0 / Divisor);
+      for (size_t Opcode = 0; Opcode < R.Opcodes.size(); Opcode++)
+        if (F->Counts[Opcode])
+          fprintf(Out, "  %-18s %-10" PRIu64 "\n", R.Opcodes[Opcode].c_str(), F->Counts[Opcode]);
+    }
+  }
+
+  if (R.Regions.empty())
+    return;
+  fprintf(Out, "-------------------------------------------------\n"
+               "REGIONS\n"
+               "-------------------------------------------------\n");
+  for (size_t Idx = 0; Idx < R.Regions.size(); Idx++)
+    if (R.Regions[Idx].Parent == NoRegion)
+      writeTextRegion(Out, R, Idx, 0);
+}
+
+// Opcode indices, by decreasing count in Counts
+std::vector<size_t> sortOpcodes(const Results &R, const std::vector<uint64_t> &Counts) {
+  std::vector<size_t> Order(R.Opcodes.size());
+  for (size_t Idx = 0; Idx < Order.size(); Idx++)
+    Order[Idx] = Idx;
+  std::stable_sort(Order.begin(), Order.end(), [&](size_t A, size_t B) {
+    return getCount(Counts, A) > getCount(Counts, B);
+  });
+  return Order;
+}
+
+// One row per opcode total, then per function, sorted by count, with their
+// share of all the instructions. Every region then gets a row with its number
+// of executions (named by its path), followed by the rows of the opcodes it
+// executed (named <path>/<opcode>), with their share of its instructions.
+void writeCSV(FILE *Out, const Results &R, uint64_t TopFunctions) {
+  uint64_t GrandTotal = 0;
+  for (uint64_t Total : R.Totals)
+    GrandTotal += Total;
+  double Divisor = GrandTotal ? static_cast<double>(GrandTotal) : 1;
+
+  fprintf(Out, "kind,name,count,share,error\n");
+  for (size_t Opcode : sortOpcodes(R, R.Totals))
+    fprintf(Out, "opcode,%s,%" PRIu64 ",%.4f,%" PRIu64 "\n", quoteCSV(R.Opcodes[Opcode]).c_str(),
+            R.Totals[Opcode], R.Totals[Opcode] * 100.0 / Divisor,
+            R.Sampled ? getSamplingBound(R.Variances[Opcode]) : 0);
+  for (const FunctionTotals *F : getTopFunctions(R, TopFunctions))
+    fprintf(Out, "function,%s,%" PRIu64 ",%.4f,\n", quoteCSV(F->Name).c_str(), F->Total,
+            F->Total * 100.0 / Divisor);
+
+  for (size_t Idx = 0; Idx < R.Regions.size(); Idx++) {
+    const Region &Current = R.Regions[Idx];
+    std::string Path = getRegionPath(R, Idx);
+    uint64_t RegionTotal = 0;
+    for (uint64_t Count : Current.Counts)
+      RegionTotal += Count;
+    double RegionDivisor = RegionTotal ? static_cast<double>(RegionTotal) : 1;
+    fprintf(Out, "region,%s,%" PRIu64 ",,\n", quoteCSV(Path).c_str(), Current.Executions);
+    for (size_t Opcode : sortOpcodes(R, Current.Counts)) {
+      uint64_t Count = getCount(Current.Counts, Opcode);
+      if (!Count)
+        continue;
+      fprintf(Out, "region_opcode,%s,%" PRIu64 ",%.4f,%" PRIu64 "\n",
+              quoteCSV(Path + "/" + R.Opcodes[Opcode]).c_str(), Count,
+              Count * 100.0 / RegionDivisor,
+              R.Sampled ? getSamplingBound(getCount(Current.Variances, Opcode)) : 0);
+    }
+  }
+}
+
+// {"name": count, ...} of the opcodes executed according to Counts
+void writeJSONCounts(FILE *Out, const Results &R, const std::vector<uint64_t> &Counts) {
+  fprintf(Out, "{");
+  bool First = true;
+  for (size_t Opcode = 0; Opcode < R.Opcodes.size(); Opcode++) {
+    if (!getCount(Counts, Opcode))
+      continue;
+    fprintf(Out, "%s\"%s\": %" PRIu64, First ? "" : ", ", escapeJSON(R.Opcodes[Opcode]).c_str(),
+            Counts[Opcode]);
+    First = false;
+  }
+  fprintf(Out, "}");
+}
+
+// Regions whose parent is Parent, with their children, at indentation Indent
+void writeJSONRegions(FILE *Out, const Results &R, size_t Parent, int Indent) {
+  fprintf(Out, "[");
+  bool First = true;
+  for (size_t Idx = Parent == NoRegion ? 0 : Parent + 1; Idx < R.Regions.size(); Idx++) {
+    const Region &Current = R.Regions[Idx];
+    if (Current.Parent != Parent)
+      continue;
+    fprintf(Out, "%s\n%*s{\"name\": \"%s\", \"executions\": %" PRIu64 ", \"opcodes\": ",
+            First ? "" : ",", Indent + 2, "", escapeJSON(Current.Name).c_str(),
+            Current.Executions);
+    writeJSONCounts(Out, R, Current.Counts);
+    fprintf(Out, ", \"regions\": ");
+    writeJSONRegions(Out, R, Idx, Indent + 2);
+    fprintf(Out, "}");
+    First = false;
+  }
+  if (!First)
+    fprintf(Out, "\n%*s", Indent, "");
+  fprintf(Out, "]");
+}
+
+void writeJSON(FILE *Out, const Results &R, uint64_t TopFunctions) {
+  uint64_t GrandTotal = 0;
+  for (uint64_t Total : R.Totals)
+    GrandTotal += Total;
+  double Divisor = GrandTotal ? static_cast<double>(GrandTotal) : 1;
+  fprintf(Out, "{\n  \"sampled\": %s,\n", R.Sampled ? "true" : "false");
+  if (R.Sampled && R.Period != ~0ULL)
+    fprintf(Out, "  \"period\": %" PRIu64 ",\n", R.Period);
+  fprintf(Out, "  \"total\": %" PRIu64 ",\n  \"opcodes\": [", GrandTotal);
+  for (size_t Opcode = 0; Opcode < R.Opcodes.size(); Opcode++) {
+    fprintf(Out, "%s\n    {\"name\": \"%s\", \"count\": %" PRIu64 ", \"share\": %.4f",
+            Opcode ? "," : "", escapeJSON(R.Opcodes[Opcode]).c_str(), R.Totals[Opcode],
+            R.Totals[Opcode] * 100.0 / Divisor);
+    if (R.Sampled)
+      fprintf(Out, ", \"error\": %" PRIu64, getSamplingBound(R.Variances[Opcode]));
+    fprintf(Out, "}");
+  }
+  fprintf(Out, "\n  ],\n  \"functions\": [");
+  bool First = true;
+  for (const FunctionTotals *F : getTopFunctions(R, TopFunctions)) {
+    fprintf(Out, "%s\n    {\"name\": \"%s\", \"count\": %" PRIu64 ", \"share\": %.4f, \"opcodes\": ",
+            First ? "" : ",", escapeJSON(F->Name).c_str(), F->Total, F->Total * 100.0 / Divisor);
+    writeJSONCounts(Out, R, F->Counts);
+    fprintf(Out, "}");
+    First = false;
+  }
+  fprintf(Out, "\n  ],\n  \"regions\": ");
+  writeJSONRegions(Out, R, NoRegion, 2);
+  fprintf(Out, "\n}\n");
+}
+
+void writeResults(const Results &R) {
+  uint64_t TopFunctions = R.TopFunctions;
+  if (const char *Env = getenv("DYNIC_TOP_FUNCTIONS"))
+    TopFunctions = strtoull(Env, nullptr, 10);
+  const char *Format = getenv("DYNIC_FORMAT");
+  if (!Format || !*Format)
+    Format = "text";
+
+  FILE *Out = stdout;
+  std::string Path = getOutputPath();
+  if (!Path.empty() && !(Out = fopen(Path.c_str(), "w"))) {
+    fprintf(stderr, "dynic_rt: cannot open %s, writing the results to stdout\n", Path.c_str());
+    Out = stdout;
+  }
+  if (!strcmp(Format, "csv")) {
+    writeCSV(Out, R, TopFunctions);
+  } else if (!strcmp(Format, "json")) {
+    writeJSON(Out, R, TopFunctions);
+  } else {
+    if (strcmp(Format, "text"))
+      fprintf(stderr, "dynic_rt: unknown DYNIC_FORMAT %s (text, csv, json), using text\n", Format);
+    writeText(Out, R, TopFunctions);
+  }
+  if (Out != stdout)
+    fclose(Out);
+  else
+    fflush(Out);
+}
+} // namespace
+
+extern "C" {
+void __dynic_rt_register(const dynic_rt_module *Module, uint64_t Period) {
+  if (Module->version != DYNIC_RT_VERSION) {
+    fprintf(stderr, "dynic_rt: %s was instrumented for another version of the library, "
+                    "not counted\n", Module->name);
+    return;
+  }
+  std::lock_guard<std::mutex> Guard(Lock);
+  // The toggles start in the state given by DYNIC_ENABLED, and the signal handler is
+  // installed with the first module that has toggles
+  if (NextSerial == 1) {
+    const char *Env = getenv("DYNIC_ENABLED");
+    CountingOn.store(Env && atoi(Env), std::memory_order_relaxed);
+  }
+  if (Module->enable && !SignalInstalled) {
+    if (const char *Env = getenv("DYNIC_TOGGLE_SIGNAL"))
+      signal(atoi(Env), toggleCounting);
+    SignalInstalled = true;
+  }
+  unsigned Slot = findSlot(nullptr);
+  if (Slot == MaxModules) {
+    fprintf(stderr, "dynic_rt: too many instrumented modules, %s not counted\n", Module->name);
+    return;
+  }
+  Periods[Slot] = Period ? Period : 1;
+  Serials[Slot] = NextSerial++;
+  Modules[Slot].store(Module, std::memory_order_release);
+  getResults().NumRegistered++;
+  if (Module->enable && CountingOn.load(std::memory_order_relaxed))
+    Module->enable(1);
+}
+
+void __dynic_rt_unregister(const dynic_rt_module *Module) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  unsigned Slot = findSlot(Module);
+  if (Slot == MaxModules)
+    return;
+  foldThreadCopies(Module);
+  Modules[Slot].store(nullptr, std::memory_order_release);
+  Results &R = getResults();
+  addModule(R, *Module, Periods[Slot]);
+  if (--R.NumRegistered == 0) {
+    writeResults(R);
+    R = Results();
+  }
+}
+
+void __dynic_rt_thread_counters(const dynic_rt_module *Module, uint64_t *Counters) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  if (!KeyCreated) {
+    if (pthread_key_create(&Key, foldExitingThread))
+      return;
+    KeyCreated = true;
+  }
+  if (!Copies) {
+    Copies = new std::vector<ThreadCopy>();
+    pthread_setspecific(Key, Copies);
+  }
+  unsigned Slot = findSlot(Module);
+  Copies->push_back({Module, Slot == MaxModules ? 0 : Serials[Slot], Counters});
+}
+
+void dynic_enable(int On) { setCounting(On); }
+
+int dynic_enable_function(const char *Name, int On) {
+  int Count = 0;
+  for (auto &Slot : Modules)
+    if (const dynic_rt_module *Module = Slot.load(std::memory_order_acquire))
+      if (Module->enable_function)
+        Count += Module->enable_function(Name, On);
+  return Count;
+}
+
+void dynic_roi_begin(const char *Name) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Results &R = getResults();
+  size_t Parent = R.Stack.empty() ? NoRegion : R.Stack.back().Idx;
+  size_t Idx = 0;
+  while (Idx < R.Regions.size() &&
+         (R.Regions[Idx].Parent != Parent || R.Regions[Idx].Name != Name))
+    Idx++;
+  if (Idx == R.Regions.size())
+    R.Regions.push_back({Name, Parent});
+  R.Stack.push_back({Idx, {}, {}});
+  takeSnapshot(R, R.Stack.back().Totals, R.Stack.back().Variances);
+  if (R.Stack.size() == 1)
+    setCounting(1);
+}
+
+void dynic_roi_end(void) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  Results &R = getResults();
+  // Unbalanced dynic_roi_end: ignored
+  if (R.Stack.empty())
+    return;
+  std::vector<uint64_t> Totals, Variances;
+  takeSnapshot(R, Totals, Variances);
+  OpenRegion &Open = R.Stack.back();
+  Region &Current = R.Regions[Open.Idx];
+  Current.Counts.resize(Totals.size());
+  Current.Variances.resize(Totals.size());
+  for (size_t Opcode = 0; Opcode < Totals.size(); Opcode++) {
+    Current.Counts[Opcode] += Totals[Opcode] - getCount(Open.Totals, Opcode);
+    Current.Variances[Opcode] += Variances[Opcode] - getCount(Open.Variances, Opcode);
+  }
+  Current.Executions++;
+  R.Stack.pop_back();
+  if (R.Stack.empty())
+    setCounting(0);
+}
+}
@@ -0,0 +1,84 @@
+/*==============================================================================
+ * FILE:
+ *    dynicRuntime.h
+ *
+ * DESCRIPTION:
+ *    Interface of libdynic_rt, the runtime library of the programs
+ *    instrumented with -dynamic-ic-runtime. Every instrumented module
+ *    describes its counter table with a constant dynic_rt_module, registers it
+ *    from a constructor and unregisters it from a destructor; the library
+ *    combines the counts of every module and writes the results once the last
+ *    one is gone. Also declares the runtime API, which the library implements
+ *    (dispatching the counting toggles to every registered module). Usable
+ *    from C.
+ *
+ * License: MIT
+ *============================================================================*/
+#ifndef LLVM_DYNIC_RUNTIME_H
+#define LLVM_DYNIC_RUNTIME_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Layout version of dynic_rt_module (must match runtimeLibrary.h) */
+#define DYNIC_RT_VERSION 1
+
+/* dynic_rt_module flags */
+#define DYNIC_RT_SAMPLED 1 /* counters are sampled, counts are estimates */
+
+/* Weight of a counter in the total of an opcode */
+struct dynic_rt_term {
+  uint64_t slot;
+  uint64_t opcode;
+  int64_t weight;
+};
+
+/* Description of an instrumented module, emitted by the pass */
+struct dynic_rt_module {
+  uint64_t version;
+  const char *name;
+  uint64_t *counters;
+  uint64_t num_counters;
+  uint64_t num_opcodes;
+  const char *const *opcodes;
+  uint64_t num_terms;
+  const struct dynic_rt_term *terms;
+  uint64_t num_functions;
+  const char *const *functions;
+  /* Function of every counter (index in functions, or UINT32_MAX) */
+  const uint32_t *counter_functions;
+  uint64_t flags;
+  /* Functions printed in the function report (-dynamic-ic-top-functions) */
+  uint64_t top_functions;
+  /* Implementations of dynic_enable and dynic_enable_function (or null) */
+  void (*enable)(int on);
+  int (*enable_function)(const char *name, int on);
+};
+
+/* Called by the instrumented modules: period is the sampling period (1 if
+ * not sampled). The counters of a module are read when it unregisters. */
+void __dynic_rt_register(const struct dynic_rt_module *module, uint64_t period);
+void __dynic_rt_unregister(const struct dynic_rt_module *module);
+/* Called by every thread the first time it runs an instrumented function of
+ * a module with thread-local counters (-dynamic-ic-threads=tls): counters is
+ * the thread-local copy of the counters of the module, which the library adds
+ * to them when the thread exits (and before reading them). */
+void __dynic_rt_thread_counters(const struct dynic_rt_module *module, uint64_t *counters);
+
+/* Runtime API: dynic_enable and dynic_enable_function call the
+ * implementation of every registered module (see countingToggle.cpp);
+ * regions of interest (see regionProfiler.cpp) are recorded by the library,
+ * for the counts of all the modules. */
+void dynic_enable(int on);
+int dynic_enable_function(const char *name, int on);
+void dynic_roi_begin(const char *name);
+void dynic_roi_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+//========================================================================
+// FILE:
+//    functionReport.cpp
+//
+// DESCRIPTION:
+//    Per-function report. The execution count of an opcode in a function is
+//    a linear combination of counters, like its module-wide total: the
+//    terms of every function are emitted as a constant table, and a report
+//    function evaluates them at the end of the program, sorts the functions
+//    by executed instructions with qsort, and prints the hottest ones with
+//    their share of the total and their per-opcode breakdown.
+//
+//    The report is data driven: its code does not grow with the number of
+//    functions, and the tables only hold one entry per function and one
+//    per (counter, opcode) pair.
+//
+// License: MIT
+//========================================================================
+#include "functionReport.h"
+#include "irUtils.h"
+
+#include "llvm/IR/IRBuilder.h"
+
+using namespace llvm;
+
+void FunctionReport::addTerm(Function &F, unsigned OpcodeIdx, Constant *Counter,
+                             int64_t Weight) {
+  Terms[&F][{Counter, OpcodeIdx}] += Weight;
+}
+
+// i32 LLVM_function_record_cmp(record *a, record *b): qsort comparator ordering
+// function records by decreasing count
+static Function *createRecordCompareFunction(Module &M) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Function *F = Function::Create(FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_function_record_cmp", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *A = Builder.CreateLoad(Int64Ty, F->getArg(0));
+  Value *B = Builder.CreateLoad(Int64Ty, F->getArg(1));
+  Value *Greater = Builder.CreateZExt(Builder.CreateICmpUGT(B, A), Int32Ty);
+  Value *Less = Builder.CreateZExt(Builder.CreateICmpULT(B, A), Int32Ty);
+  Builder.CreateRet(Builder.CreateSub(Greater, Less));
+  return F;
+}
+
+Function *FunctionReport::createReportFunction(unsigned N) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *DoubleTy = Type::getDoubleTy(CTX);
+
+  // Constant tables:
+  //   { ptr counter, i64 weight, i32 opcode } LLVM_function_terms[]
+  //   { ptr name, i32 first term, i32 end term } LLVM_function_table[]
+  StructType *TermTy = StructType::get(CTX, {PtrTy, Int64Ty, Int32Ty});
+  StructType *EntryTy = StructType::get(CTX, {PtrTy, Int32Ty, Int32Ty});
+  std::vector<Constant *> TermInits, EntryInits;
+  for (auto &[F, FunctionTerms] : Terms) {
+    uint32_t First = TermInits.size();
+    for (auto &[Term, Weight] : FunctionTerms) {
+      if (Weight == 0)
+        continue;
+      TermInits.push_back(ConstantStruct::get(
+          TermTy, {Term.first, ConstantInt::get(Int64Ty, Weight, /*IsSigned=*/true),
+                   ConstantInt::get(Int32Ty, Term.second)}));
+    }
+    Constant *Name = ConstantDataArray::getString(CTX, F->getName());
+    auto *NameVar = new GlobalVariable(M, Name->getType(), true, GlobalValue::PrivateLinkage,
+                                       Name, "LLVM_function_name");
+    NameVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    EntryInits.push_back(ConstantStruct::get(
+        EntryTy, {NameVar, ConstantInt::get(Int32Ty, First),
+                  ConstantInt::get(Int32Ty, TermInits.size())}));
+  }
+  Terms.clear();
+  auto createTable = [&](Type *ElemTy, ArrayRef<Constant *> Inits, const Twine &Name) {
+    ArrayType *Ty = ArrayType::get(ElemTy, Inits.size());
+    return new GlobalVariable(M, Ty, true, GlobalValue::InternalLinkage,
+                              ConstantArray::get(Ty, Inits), Name);
+  };
+  GlobalVariable *TermTable = createTable(TermTy, TermInits, "LLVM_function_terms");
+  GlobalVariable *FunctionTable = createTable(EntryTy, EntryInits, "LLVM_function_table");
+  GlobalVariable *Names = createTable(PtrTy, OpcodeNames, "LLVM_function_opcode_names");
+  uint64_t NumFunctions = EntryInits.size();
+  uint64_t NumOpcodes = OpcodeNames.size();
+
+  // Runtime tables: { i64 count, i64 function } records, and per-opcode counts
+  StructType *RecordTy = StructType::get(CTX, {Int64Ty, Int64Ty});
+  ArrayType *RecordsTy = ArrayType::get(RecordTy, std::max<uint64_t>(NumFunctions, 1));
+  auto *Records = new GlobalVariable(M, RecordsTy, false, GlobalValue::InternalLinkage,
+                                     Constant::getNullValue(RecordsTy), "LLVM_function_records");
+  ArrayType *OpcodeCountsTy = ArrayType::get(Int64Ty, std::max<uint64_t>(NumOpcodes, 1));
+  auto *OpcodeCounts = new GlobalVariable(M, OpcodeCountsTy, false, GlobalValue::InternalLinkage,
+                                          Constant::getNullValue(OpcodeCountsTy),
+                                          "LLVM_function_opcodes");
+
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  FunctionCallee Qsort = M.getOrInsertFunction(
+      "qsort", FunctionType::get(Type::getVoidTy(CTX), {PtrTy, Int64Ty, Int64Ty, PtrTy}, false));
+  Function *Report = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int64Ty}, false),
+                                      GlobalValue::InternalLinkage, "LLVM_function_report", M);
+  Value *Scale = Report->getArg(0);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", Report));
+  Value *Zero = Builder.getInt64(0);
+  AllocaInst *Sum = Builder.CreateAlloca(Int64Ty, nullptr, "sum");
+  AllocaInst *GrandTotal = Builder.CreateAlloca(Int64Ty, nullptr, "total");
+  Builder.CreateStore(Zero, GrandTotal);
+
+  auto loadEntryField = [&](Value *FunctionIdx, unsigned Field) {
+    return Builder.CreateLoad(Field ? Int32Ty : PtrTy,
+                              Builder.CreateInBoundsGEP(FunctionTable->getValueType(),
+                                                        FunctionTable,
+                                                        {Zero, FunctionIdx,
+                                                         Builder.getInt32(Field)}));
+  };
+  // Visit(opcode index, counter * weight) for every term of a function
+  auto emitTermLoop = [&](Value *FunctionIdx, const Twine &Name,
+                          function_ref<void(Value *, Value *)> Visit) {
+    Value *First = Builder.CreateZExt(loadEntryField(FunctionIdx, 1), Int64Ty);
+    Value *End = Builder.CreateZExt(loadEntryField(FunctionIdx, 2), Int64Ty);
+    emitLoop(Builder, First, End, Name, [&](Value *TermIdx) {
+      auto field = [&](unsigned Field, Type *Ty) {
+        return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(TermTable->getValueType(),
+                                                                TermTable,
+                                                                {Zero, TermIdx,
+                                                                 Builder.getInt32(Field)}));
+      };
+      Value *Counter = Builder.CreateLoad(Int64Ty, field(0, PtrTy));
+      Value *Weight = field(1, Int64Ty);
+      Visit(Builder.CreateZExt(field(2, Int32Ty), Int64Ty), Builder.CreateMul(Counter, Weight));
+    });
+  };
+
+  // Count the instructions of every function
+  emitLoop(Builder, Zero, Builder.getInt64(NumFunctions), "count", [&](Value *FunctionIdx) {
+    Builder.CreateStore(Zero, Sum);
+    emitTermLoop(FunctionIdx, "count.terms", [&](Value *, Value *Count) {
+      Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Sum), Count), Sum);
+    });
+    Value *Total = Builder.CreateMul(Builder.CreateLoad(Int64Ty, Sum), Scale);
+    Value *Record = Builder.CreateInBoundsGEP(RecordsTy, Records, {Zero, FunctionIdx});
+    Builder.CreateStore(Total, Builder.CreateStructGEP(RecordTy, Record, 0));
+    Builder.CreateStore(FunctionIdx, Builder.CreateStructGEP(RecordTy, Record, 1));
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, GrandTotal), Total),
+                        GrandTotal);
+  });
+
+  // Sort them, and print the hottest ones
+  uint64_t NumPrinted = N ? std::min<uint64_t>(N, NumFunctions) : NumFunctions;
+  Builder.CreateCall(Qsort, {Records, Builder.getInt64(NumFunctions),
+                             Builder.getInt64(M.getDataLayout().getTypeAllocSize(RecordTy)),
+                             createRecordCompareFunction(M)});
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "FUNCTIONS (top %lu of %lu)\n"
+                                  "FUNCTION             #N INSTS   SHARE\n"
+                                  "-------------------------------------------------\n"),
+                              Builder.getInt64(NumPrinted), Builder.getInt64(NumFunctions)});
+  Value *Total = Builder.CreateLoad(Int64Ty, GrandTotal);
+  Value *Divisor = Builder.CreateUIToFP(
+      Builder.CreateSelect(Builder.CreateICmpEQ(Total, Zero), Builder.getInt64(1), Total),
+      DoubleTy);
+  Value *FunctionFormat = Builder.CreateGlobalStringPtr("%-20s %-10lu %6.2f%%\n");
+  Value *OpcodeFormat = Builder.CreateGlobalStringPtr("  %-18s %-10lu\n");
+  emitLoop(Builder, Zero, Builder.getInt64(NumPrinted), "print", [&](Value *RecordIdx) {
+    Value *Record = Builder.CreateInBoundsGEP(RecordsTy, Records, {Zero, RecordIdx});
+    Value *Count = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RecordTy, Record, 0));
+    Value *FunctionIdx =
+        Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RecordTy, Record, 1));
+    Value *Share = Builder.CreateFDiv(
+        Builder.CreateFMul(Builder.CreateUIToFP(Count, DoubleTy), ConstantFP::get(DoubleTy, 100)),
+        Divisor);
+    Builder.CreateCall(Printf, {FunctionFormat, loadEntryField(FunctionIdx, 0), Count, Share});
+
+    // Per-opcode breakdown (opcodes that did not run are left out)
+    Builder.CreateMemSet(OpcodeCounts, Builder.getInt8(0), NumOpcodes * 8, MaybeAlign(8));
+    emitTermLoop(FunctionIdx, "print.terms", [&](Value *OpcodeIdx, Value *Count) {
+      Value *Ptr = Builder.CreateInBoundsGEP(OpcodeCountsTy, OpcodeCounts, {Zero, OpcodeIdx});
+      Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Ptr), Count), Ptr);
+    });
+    emitLoop(Builder, Zero, Builder.getInt64(NumOpcodes), "print.opcodes", [&](Value *OpcodeIdx) {
+      Value *OpcodeCount = Builder.CreateLoad(
+          Int64Ty, Builder.CreateInBoundsGEP(OpcodeCountsTy, OpcodeCounts, {Zero, OpcodeIdx}));
+      BasicBlock *PrintOpcode = BasicBlock::Create(CTX, "print.opcode", Report);
+      BasicBlock *Next = BasicBlock::Create(CTX, "print.opcode.next", Report);
+      Builder.CreateCondBr(Builder.CreateICmpEQ(OpcodeCount, Zero), Next, PrintOpcode);
+      Builder.SetInsertPoint(PrintOpcode);
+      Value *Name = Builder.CreateLoad(
+          PtrTy, Builder.CreateInBoundsGEP(Names->getValueType(), Names, {Zero, OpcodeIdx}));
+      Builder.CreateCall(Printf, {OpcodeFormat, Name, Builder.CreateMul(OpcodeCount, Scale)});
+      Builder.CreateBr(Next);
+      Builder.SetInsertPoint(Next);
+    });
+  });
+  Builder.CreateRetVoid();
+  return Report;
+}
@@ -0,0 +1,46 @@
+//==============================================================================
+// FILE:
+//    functionReport.h
+//
+// DESCRIPTION:
+//    Declares the per-function report of DynamicInstCounter: the functions
+//    executing the most instructions, with their share of the total and
+//    their per-opcode breakdown.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_FUNCTION_REPORT_H
+#define LLVM_DYNIC_FUNCTION_REPORT_H
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/Module.h"
+
+#include <vector>
+
+class FunctionReport {
+public:
+  // OpcodeNames are the strings of the opcodes reported by the pass, in
+  // report order.
+  FunctionReport(llvm::Module &M, llvm::ArrayRef<llvm::Constant *> OpcodeNames)
+      : M(M), OpcodeNames(OpcodeNames.begin(), OpcodeNames.end()) {}
+
+  // Records that the executions of the opcode with index OpcodeIdx in F
+  // include Weight times the value of the 64-bit counter Counter.
+  void addTerm(llvm::Function &F, unsigned OpcodeIdx, llvm::Constant *Counter,
+               int64_t Weight);
+
+  // Creates `void LLVM_function_report(i64 scale)`, which prints the N
+  // functions executing the most instructions (all of them if N is 0),
+  // their counts multiplied by scale.
+  llvm::Function *createReportFunction(unsigned N);
+
+private:
+  llvm::Module &M;
+  std::vector<llvm::Constant *> OpcodeNames;
+  // (counter, opcode index) -> weight, for every function
+  llvm::MapVector<llvm::Function *,
+                  llvm::MapVector<std::pair<llvm::Constant *, unsigned>, int64_t>>
+      Terms;
+};
+
+#endif
@@ -0,0 +1,174 @@
+//========================================================================
+// FILE:
+//    instructionClass.cpp
+//
+// DESCRIPTION:
+//    Instruction classes of -dynamic-ic-classify. Opcodes alone lump
+//    together `fadd float`, `fadd double` and `fadd <8 x float>`: classes
+//    also tell the type an instruction operates on, and so whether and how
+//    wide it is vectorized, and split calls by callee. They are plain names,
+//    counted like opcodes by every mode and report.
+//
+//    Types are printed like in IR, except structures (just "struct"), so
+//    that names never contain commas (they are also CSV headers).
+//
+//    The lane-weighted report multiplies the count of every class by its
+//    number of lanes: the scalar operations performed, whether by scalar or
+//    by vector instructions.
+//
+// License: MIT
+//========================================================================
+#include "instructionClass.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// Type the instruction operates on (nullptr if none)
+static Type *getOperatedType(const Instruction &I) {
+  if (auto *Store = dyn_cast<StoreInst>(&I))
+    return Store->getValueOperand()->getType();
+  if (isa<CmpInst>(I))
+    return I.getOperand(0)->getType();
+  // Calls without result (e.g. masked stores): their first vector argument
+  if (auto *Call = dyn_cast<CallBase>(&I); Call && I.getType()->isVoidTy()) {
+    for (const Use &Arg : Call->args())
+      if (Arg->getType()->isVectorTy())
+        return Arg->getType();
+    return nullptr;
+  }
+  Type *Ty = I.getType();
+  if (Ty->isVoidTy() || Ty->isLabelTy() || Ty->isTokenTy() || Ty->isMetadataTy())
+    return nullptr;
+  return Ty;
+}
+
+static void printType(raw_ostream &OS, Type *Ty) {
+  if (auto *VecTy = dyn_cast<VectorType>(Ty)) {
+    OS << "<" << (isa<ScalableVectorType>(VecTy) ? "vscale x " : "")
+       << VecTy->getElementCount().getKnownMinValue() << " x ";
+    printType(OS, VecTy->getElementType());
+    OS << ">";
+  } else if (auto *ArrTy = dyn_cast<ArrayType>(Ty)) {
+    OS << "[" << ArrTy->getNumElements() << " x ";
+    printType(OS, ArrTy->getElementType());
+    OS << "]";
+  } else if (Ty->isStructTy()) {
+    OS << "struct";
+  } else {
+    Ty->print(OS);
+  }
+}
+
+std::string getInstructionClass(const Instruction &I, StringRef Opcode) {
+  std::string Class;
+  raw_string_ostream OS(Class);
+  OS << Opcode;
+  if (Type *Ty = getOperatedType(I)) {
+    OS << " ";
+    printType(OS, Ty);
+  }
+  // Demoted PHIs (loads, counted as "phi") are not calls
+  if (auto *Call = dyn_cast<CallBase>(&I); Call && Opcode == I.getOpcodeName()) {
+    if (Call->isInlineAsm())
+      OS << " asm";
+    else if (const Function *Callee = Call->getCalledFunction())
+      OS << " @"
+         << (Callee->isIntrinsic() ? Intrinsic::getBaseName(Callee->getIntrinsicID())
+                                   : Callee->getName());
+    else
+      OS << " indirect";
+  }
+  return OS.str();
+}
+
+unsigned getInstructionLanes(const Instruction &I) {
+  if (auto *VecTy = dyn_cast_or_null<VectorType>(getOperatedType(I)))
+    return VecTy->getElementCount().getKnownMinValue();
+  return 1;
+}
+
+Function *createLaneReportFunction(Module &M, ArrayRef<Constant *> Names,
+                                   ArrayRef<unsigned> Lanes) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *DoubleTy = Type::getDoubleTy(CTX);
+
+  // { ptr name, i64 lanes } of every class, in the order of the totals
+  StructType *ClassTy = StructType::get(CTX, {PtrTy, Int64Ty});
+  std::vector<Constant *> Classes;
+  for (size_t Idx = 0; Idx < Names.size(); Idx++)
+    Classes.push_back(ConstantStruct::get(ClassTy, {Names[Idx], ConstantInt::get(Int64Ty, Lanes[Idx])}));
+  ArrayType *ClassesTy = ArrayType::get(ClassTy, Classes.size());
+  auto *ClassTable = new GlobalVariable(M, ClassesTy, true, GlobalValue::PrivateLinkage,
+                                        ConstantArray::get(ClassesTy, Classes),
+                                        "LLVM_lane_classes");
+  ArrayType *TotalsTy = ArrayType::get(Int64Ty, Classes.size());
+
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  Function *Report = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {PtrTy}, false),
+                                      GlobalValue::InternalLinkage, "LLVM_lane_report", M);
+  Value *Totals = Report->getArg(0);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Report);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "class", Report);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "class.end", Report);
+  IRBuilder<> Builder(Entry);
+  Value *Zero = Builder.getInt64(0);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "LANE-WEIGHTED OPERATIONS\n"
+                                  "INST                 #N OPS     LANES\n"
+                                  "-------------------------------------------------\n")});
+  Builder.CreateBr(Loop);
+
+  // Print every class, adding up all the operations and those of vector classes
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "class.idx");
+  PHINode *AllOps = Builder.CreatePHI(Int64Ty, 2, "all");
+  PHINode *VectorOps = Builder.CreatePHI(Int64Ty, 2, "vector");
+  auto field = [&](unsigned Field, Type *Ty) {
+    return Builder.CreateLoad(
+        Ty, Builder.CreateInBoundsGEP(ClassesTy, ClassTable, {Zero, Idx, Builder.getInt32(Field)}));
+  };
+  Value *ClassLanes = field(1, Int64Ty);
+  Value *Ops = Builder.CreateMul(
+      Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(TotalsTy, Totals, {Zero, Idx})),
+      ClassLanes);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("%-20s %-10lu %lu\n"),
+                              field(0, PtrTy), Ops, ClassLanes});
+  Value *NextAllOps = Builder.CreateAdd(AllOps, Ops);
+  Value *NextVectorOps = Builder.CreateAdd(
+      VectorOps, Builder.CreateSelect(Builder.CreateICmpUGT(ClassLanes, Builder.getInt64(1)),
+                                      Ops, Zero));
+  Value *Next = Builder.CreateAdd(Idx, Builder.getInt64(1));
+  Builder.CreateCondBr(Builder.CreateICmpULT(Next, Builder.getInt64(Classes.size())), Loop, Exit);
+  Idx->addIncoming(Zero, Entry);
+  Idx->addIncoming(Next, Loop);
+  AllOps->addIncoming(Zero, Entry);
+  AllOps->addIncoming(NextAllOps, Loop);
+  VectorOps->addIncoming(Zero, Entry);
+  VectorOps->addIncoming(NextVectorOps, Loop);
+
+  Builder.SetInsertPoint(Exit);
+  Value *Divisor = Builder.CreateUIToFP(
+      Builder.CreateSelect(Builder.CreateICmpEQ(NextAllOps, Zero), Builder.getInt64(1),
+                           NextAllOps),
+      DoubleTy);
+  Value *Share = Builder.CreateFDiv(
+      Builder.CreateFMul(Builder.CreateUIToFP(NextVectorOps, DoubleTy),
+                         ConstantFP::get(DoubleTy, 100)),
+      Divisor);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "%-20s %-10lu %6.2f%% in vector instructions\n"),
+                              Builder.CreateGlobalStringPtr("TOTAL"), NextAllOps, Share});
+  Builder.CreateRetVoid();
+  return Report;
+}
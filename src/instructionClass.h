@@ -0,0 +1,38 @@
+//==============================================================================
+// FILE:
+//    instructionClass.h
+//
+// DESCRIPTION:
+//    Declares the finer instruction classes of -dynamic-ic-classify (opcode,
+//    type and vector width, callee of calls) and their lane-weighted report.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_INSTRUCTION_CLASS_H
+#define LLVM_DYNIC_INSTRUCTION_CLASS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+
+// Name of the class of I, counted as an instruction of opcode Opcode:
+// "<opcode> <type>", where type is the type I operates on (result type,
+// stored type for stores, compared type for comparisons; none if void),
+// followed by " @<callee>" for calls (the base name of intrinsics, or
+// "indirect" and "asm"). E.g. "fadd <8 x float>", "call double @sqrt",
+// "call <4 x i32> @llvm.masked.load".
+std::string getInstructionClass(const llvm::Instruction &I, llvm::StringRef Opcode);
+
+// Number of lanes of the type I operates on: the elements of a vector (the
+// minimum for scalable vectors), 1 otherwise.
+unsigned getInstructionLanes(const llvm::Instruction &I);
+
+// Creates `void LLVM_lane_report(ptr totals)`, which prints the count of every
+// class times its number of lanes, from the array of i64 totals of the
+// classes Names, and the share of those operations run by vector instructions.
+llvm::Function *createLaneReportFunction(llvm::Module &M,
+                                         llvm::ArrayRef<llvm::Constant *> Names,
+                                         llvm::ArrayRef<unsigned> Lanes);
+
+#endif
@@ -0,0 +1,138 @@
+//========================================================================
+// FILE:
+//    irUtils.cpp
+//
+// DESCRIPTION:
+//    IR helpers shared by the reports and runtimes emitted by
+//    DynamicInstCounter.
+//
+// License: MIT
+//========================================================================
+#include "irUtils.h"
+#include "samplingError.h"
+
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+
+void emitLoop(IRBuilder<> &Builder, Value *Begin, Value *End, const Twine &Name,
+              function_ref<void(Value *)> Body) {
+  auto &CTX = Builder.getContext();
+  Function *F = Builder.GetInsertBlock()->getParent();
+  BasicBlock *Preheader = Builder.GetInsertBlock();
+  BasicBlock *Loop = BasicBlock::Create(CTX, Name, F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, Name + ".end", F);
+  Builder.CreateCondBr(Builder.CreateICmpULT(Begin, End), Loop, Exit);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Begin->getType(), 2, Name + ".idx");
+  Idx->addIncoming(Begin, Preheader);
+  Body(Idx);
+  Value *Next = Builder.CreateAdd(Idx, ConstantInt::get(Begin->getType(), 1));
+  Idx->addIncoming(Next, Builder.GetInsertBlock());
+  Builder.CreateCondBr(Builder.CreateICmpULT(Next, End), Loop, Exit);
+  Builder.SetInsertPoint(Exit);
+}
+
+Value *emitErrnoLocation(IRBuilder<> &Builder) {
+  Module &M = *Builder.GetInsertBlock()->getModule();
+  Triple TT(M.getTargetTriple());
+  StringRef Name = "__errno_location";
+  if (TT.isOSDarwin() || TT.isOSFreeBSD() || TT.isOSDragonFly())
+    Name = "__error";
+  else if (TT.isOSNetBSD() || TT.isOSOpenBSD() || TT.isAndroid())
+    Name = "__errno";
+  Type *PtrTy = PointerType::getUnqual(Builder.getContext());
+  return Builder.CreateCall(M.getOrInsertFunction(Name, FunctionType::get(PtrTy, false)));
+}
+
+std::pair<int, int> getUserSignals(const Module &M) {
+  Triple TT(M.getTargetTriple());
+  bool SPARC = TT.getArch() == Triple::sparc || TT.getArch() == Triple::sparcel ||
+               TT.getArch() == Triple::sparcv9;
+  if (TT.isOSDarwin() || TT.isOSFreeBSD() || TT.isOSNetBSD() || TT.isOSOpenBSD() ||
+      TT.isOSDragonFly() || SPARC)
+    return {30, 31};
+  if (TT.isMIPS())
+    return {16, 17};
+  return {10, 12};
+}
+
+namespace {
+// struct sigaction: handler, mask and flags, whose order, sizes and values
+// differ between the C libraries
+struct SigactionLayout {
+  FunctionCallee Sigaction;
+  StructType *ActionTy;
+  unsigned HandlerField = 0, FlagsField = 2;
+  int Restart = 0x2; // SA_RESTART
+};
+
+SigactionLayout getSigactionLayout(Module &M) {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Triple TT(M.getTargetTriple());
+  StringRef Name = "sigaction";
+  SigactionLayout L;
+  if (TT.isOSDarwin() || TT.isOSOpenBSD()) {
+    L.ActionTy = StructType::get(CTX, {PtrTy, Int32Ty, Int32Ty});
+  } else if (TT.isOSFreeBSD() || TT.isOSDragonFly()) {
+    L.ActionTy = StructType::get(CTX, {PtrTy, Int32Ty, ArrayType::get(Int8Ty, 16)});
+    L.FlagsField = 1;
+  } else if (TT.isOSNetBSD()) {
+    L.ActionTy = StructType::get(CTX, {PtrTy, ArrayType::get(Int8Ty, 16), Int32Ty});
+    Name = "__sigaction14";
+  } else if (TT.isMIPS()) {
+    L.ActionTy = StructType::get(CTX, {Int32Ty, PtrTy, ArrayType::get(Int8Ty, 128)});
+    L.HandlerField = 1;
+    L.FlagsField = 0;
+    L.Restart = 0x10000000;
+  } else {
+    L.ActionTy = StructType::get(CTX, {PtrTy, ArrayType::get(Int8Ty, 128), Int32Ty, PtrTy});
+    L.Restart = 0x10000000;
+  }
+  L.Sigaction =
+      M.getOrInsertFunction(Name, FunctionType::get(Int32Ty, {Int32Ty, PtrTy, PtrTy}, false));
+  return L;
+}
+
+// Allocated in the entry block, so that it is not allocated again in loops
+Value *emitSigactionAlloca(IRBuilder<> &Builder, const SigactionLayout &L) {
+  Module &M = *Builder.GetInsertBlock()->getModule();
+  Function *F = Builder.GetInsertBlock()->getParent();
+  IRBuilder<> AllocaBuilder(&F->getEntryBlock(), F->getEntryBlock().begin());
+  Value *Action = AllocaBuilder.CreateAlloca(L.ActionTy, nullptr, "action");
+  Builder.CreateMemSet(Action, Builder.getInt8(0), M.getDataLayout().getTypeAllocSize(L.ActionTy),
+                       MaybeAlign());
+  return Action;
+}
+} // namespace
+
+void emitSignalHandler(IRBuilder<> &Builder, Value *Signal, Value *Handler) {
+  SigactionLayout L = getSigactionLayout(*Builder.GetInsertBlock()->getModule());
+  Value *Action = emitSigactionAlloca(Builder, L);
+  // The mask is left empty
+  Builder.CreateStore(Handler, Builder.CreateStructGEP(L.ActionTy, Action, L.HandlerField));
+  Builder.CreateStore(Builder.getInt32(L.Restart),
+                      Builder.CreateStructGEP(L.ActionTy, Action, L.FlagsField));
+  Builder.CreateCall(L.Sigaction, {Signal, Action,
+                                   ConstantPointerNull::get(PointerType::getUnqual(Builder.getContext()))});
+}
+
+Value *emitGetSignalHandler(IRBuilder<> &Builder, Value *Signal) {
+  auto *PtrTy = PointerType::getUnqual(Builder.getContext());
+  SigactionLayout L = getSigactionLayout(*Builder.GetInsertBlock()->getModule());
+  Value *Action = emitSigactionAlloca(Builder, L);
+  Builder.CreateCall(L.Sigaction, {Signal, ConstantPointerNull::get(PtrTy), Action});
+  return Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(L.ActionTy, Action, L.HandlerField));
+}
+
+Value *emitSamplingBound(IRBuilder<> &Builder, Value *Variance) {
+  Value *StdDev = Builder.CreateUnaryIntrinsic(
+      Intrinsic::sqrt, Builder.CreateUIToFP(Variance, Builder.getDoubleTy()));
+  return Builder.CreateFPToUI(
+      Builder.CreateFMul(StdDev, ConstantFP::get(Builder.getDoubleTy(), SamplingConfidence)),
+      Builder.getInt64Ty());
+}
@@ -0,0 +1,45 @@
+//==============================================================================
+// FILE:
+//    irUtils.h
+//
+// DESCRIPTION:
+//    Declares the IR helpers shared by the reports and runtimes emitted by
+//    DynamicInstCounter.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_IR_UTILS_H
+#define LLVM_DYNIC_IR_UTILS_H
+
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/IR/IRBuilder.h"
+
+#include <utility>
+
+// Emits `for (Idx = Begin; Idx < End; Idx++) Body(Idx);` at the insertion
+// point of Builder, which is left after the loop. Body may create blocks.
+void emitLoop(llvm::IRBuilder<> &Builder, llvm::Value *Begin, llvm::Value *End,
+              const llvm::Twine &Name, llvm::function_ref<void(llvm::Value *)> Body);
+
+// Emits, at the insertion point of Builder, the address of errno, whose
+// accessor depends on the C library of the target of the module.
+llvm::Value *emitErrnoLocation(llvm::IRBuilder<> &Builder);
+
+// Numbers of SIGUSR1 and SIGUSR2 on the target of M.
+std::pair<int, int> getUserSignals(const llvm::Module &M);
+
+// Emits, at the insertion point of Builder, the installation of Handler (a
+// `void(i32)` function, or null for the default action) for Signal (an i32),
+// with sigaction and SA_RESTART, so that the system calls it interrupts are
+// resumed.
+void emitSignalHandler(llvm::IRBuilder<> &Builder, llvm::Value *Signal, llvm::Value *Handler);
+
+// Emits, at the insertion point of Builder, the query of the handler of
+// Signal (an i32) with sigaction, and returns it (a pointer).
+llvm::Value *emitGetSignalHandler(llvm::IRBuilder<> &Builder, llvm::Value *Signal);
+
+// Emits the half-width of the 95% confidence interval of an estimate whose
+// variance is Variance (an i64, see samplingError.h), as an i64.
+llvm::Value *emitSamplingBound(llvm::IRBuilder<> &Builder, llvm::Value *Variance);
+
+#endif
@@ -0,0 +1,594 @@
+//========================================================================
+// FILE:
+//    memoryTraffic.cpp
+//
+// DESCRIPTION:
+//    Memory traffic report. The access size of loads, stores, atomics,
+//    memory intrinsics with a constant length and masked vector accesses
+//    with a constant mask is known at compile time: the bytes read and
+//    written by every block are folded into one weight per (counter, scope)
+//    pair, like the opcode totals, where scopes are functions and loops.
+//    The other accesses (memcpy, memmove and memset of variable length,
+//    masked loads, stores, gathers and scatters with a variable mask) add
+//    their size to a counter of their own when they run: the length, or the
+//    active lanes of the mask times the element size.
+//
+//    Masked accesses count the bytes of their active lanes only. Scalable
+//    vectors count their minimum size, and scalable masked accesses all of
+//    their lanes. Calls to other functions (e.g. the memcpy of the C
+//    library, rather than the intrinsic) are not counted.
+//
+//    The report lists every function that accessed memory, followed by its
+//    loops, outermost first, with the bytes each one read and wrote.
+//
+//    The roofline folds the floating-point and integer operations of the
+//    blocks the same way, weighted by their lanes (fused multiply-adds count
+//    two operations per lane), and puts every loop nest (outermost loop) that
+//    ran against the peaks of a machine read from a file: its arithmetic
+//    intensity (operations per byte read or written), the performance it can
+//    attain at that intensity, and whether the operations or the bytes would
+//    take longer at their peak rate.
+//
+// License: MIT
+//========================================================================
+#include "memoryTraffic.h"
+#include "burstSampler.h"
+#include "instructionClass.h"
+#include "irUtils.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace {
+// Memory access of an instruction: Size bytes read and/or written, or a
+// size only known at runtime
+struct MemoryAccess {
+  bool Reads = false;
+  bool Writes = false;
+  bool AtRuntime = false;
+  uint64_t Size = 0;
+};
+
+// Masked accesses: index of their mask, whether they read memory
+bool getMaskedAccess(const IntrinsicInst &II, unsigned &MaskIdx, bool &Reads) {
+  switch (II.getIntrinsicID()) {
+  case Intrinsic::masked_load:
+  case Intrinsic::masked_gather:
+    MaskIdx = 2;
+    Reads = true;
+    return true;
+  case Intrinsic::masked_store:
+  case Intrinsic::masked_scatter:
+    MaskIdx = 3;
+    Reads = false;
+    return true;
+  case Intrinsic::masked_expandload:
+    MaskIdx = 1;
+    Reads = true;
+    return true;
+  case Intrinsic::masked_compressstore:
+    MaskIdx = 2;
+    Reads = false;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Vector type accessed by a masked access
+VectorType *getMaskedType(const IntrinsicInst &II, bool Reads) {
+  return cast<VectorType>(Reads ? II.getType() : II.getArgOperand(0)->getType());
+}
+
+MemoryAccess getAccess(const Instruction &I, const DataLayout &DL) {
+  MemoryAccess Access;
+  auto sizeOf = [&](Type *Ty) { return DL.getTypeStoreSize(Ty).getKnownMinValue(); };
+  if (auto *Load = dyn_cast<LoadInst>(&I)) {
+    Access.Reads = true;
+    Access.Size = sizeOf(Load->getType());
+  } else if (auto *Store = dyn_cast<StoreInst>(&I)) {
+    Access.Writes = true;
+    Access.Size = sizeOf(Store->getValueOperand()->getType());
+  } else if (auto *RMW = dyn_cast<AtomicRMWInst>(&I)) {
+    Access.Reads = Access.Writes = true;
+    Access.Size = sizeOf(RMW->getValOperand()->getType());
+  } else if (auto *CmpXchg = dyn_cast<AtomicCmpXchgInst>(&I)) {
+    // (the store may not happen: counted as if it did)
+    Access.Reads = Access.Writes = true;
+    Access.Size = sizeOf(CmpXchg->getCompareOperand()->getType());
+  } else if (auto *MemI = dyn_cast<AnyMemIntrinsic>(&I)) {
+    Access.Reads = isa<AnyMemTransferInst>(MemI);
+    Access.Writes = true;
+    if (auto *Length = dyn_cast<ConstantInt>(MemI->getLength()))
+      Access.Size = Length->getZExtValue();
+    else
+      Access.AtRuntime = true;
+  } else if (auto *II = dyn_cast<IntrinsicInst>(&I)) {
+    unsigned MaskIdx;
+    bool Reads;
+    if (!getMaskedAccess(*II, MaskIdx, Reads))
+      return Access;
+    Access.Reads = Reads;
+    Access.Writes = !Reads;
+    VectorType *Ty = getMaskedType(*II, Reads);
+    uint64_t ElementSize = sizeOf(Ty->getElementType());
+    auto *Mask = dyn_cast<Constant>(II->getArgOperand(MaskIdx));
+    if (isa<ScalableVectorType>(Ty)) {
+      Access.Size = Mask && Mask->isNullValue() ? 0 : sizeOf(Ty);
+    } else if (Mask) {
+      // Active lanes of a constant mask
+      unsigned NumLanes = cast<FixedVectorType>(Ty)->getNumElements();
+      for (unsigned Lane = 0; Lane < NumLanes && !Access.AtRuntime; Lane++) {
+        auto *Bit = dyn_cast_or_null<ConstantInt>(Mask->getAggregateElement(Lane));
+        if (!Bit)
+          Access.AtRuntime = true;
+        else if (Bit->isOne())
+          Access.Size += ElementSize;
+      }
+    } else {
+      Access.AtRuntime = true;
+    }
+  }
+  return Access;
+}
+
+// Floating-point and integer operations of I: one per lane of arithmetic
+// instructions, two for fused multiply-adds, one per reduced lane
+void addOperations(const Instruction &I, int64_t &Flops, int64_t &IntOps) {
+  int64_t Lanes = getInstructionLanes(I);
+  if (isa<BinaryOperator>(I) || isa<UnaryOperator>(I)) {
+    if (I.getType()->isFPOrFPVectorTy())
+      Flops += Lanes;
+    else if (I.getType()->isIntOrIntVectorTy())
+      IntOps += Lanes;
+    return;
+  }
+  auto *II = dyn_cast<IntrinsicInst>(&I);
+  if (!II)
+    return;
+  switch (II->getIntrinsicID()) {
+  case Intrinsic::fma:
+  case Intrinsic::fmuladd:
+    Flops += 2 * Lanes;
+    break;
+  case Intrinsic::sqrt:
+    Flops += Lanes;
+    break;
+  case Intrinsic::vector_reduce_fadd:
+  case Intrinsic::vector_reduce_fmul:
+    Flops += cast<VectorType>(II->getArgOperand(1)->getType())
+                 ->getElementCount()
+                 .getKnownMinValue();
+    break;
+  default:
+    break;
+  }
+}
+} // namespace
+
+bool MachinePeaks::read(StringRef Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(Path, /*IsText=*/true);
+  if (!Buffer) {
+    errs() << "Cannot read the machine peaks " << Path << ": " << Buffer.getError().message()
+           << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 16> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n');
+  for (size_t LineNo = 0; LineNo < Lines.size(); LineNo++) {
+    StringRef Line = Lines[LineNo].split('#').first.trim();
+    if (Line.empty())
+      continue;
+    // The key and the value are separated by any blanks (spaces or tabs)
+    auto [Key, Rest] = getToken(Line, " \t");
+    StringRef Value = Rest.trim();
+    double *Peak = StringSwitch<double *>(Key)
+                       .Case("flops", &Flops)
+                       .Case("int-ops", &IntOps)
+                       .Case("bandwidth", &Bandwidth)
+                       .Default(nullptr);
+    if (!Peak || Value.getAsDouble(*Peak) || *Peak <= 0) {
+      errs() << Path << ":" << LineNo + 1 << ": expected `flops`, `int-ops` or `bandwidth` "
+             << "followed by a positive number\n";
+      return false;
+    }
+  }
+  if (Flops <= 0 || Bandwidth <= 0) {
+    errs() << Path << ": the `flops` and `bandwidth` peaks are required\n";
+    return false;
+  }
+  return true;
+}
+
+void MemoryTraffic::addFunction(Function &F, LoopInfo &LI) {
+  const DataLayout &DL = M.getDataLayout();
+  unsigned FunctionScope = Scopes.size();
+  Scopes.push_back({F.getName().str(), 0, FunctionScope, {}});
+  // Loops are named after their header (or its position in F), and its source
+  // line if known
+  DenseMap<const BasicBlock *, unsigned> BlockIdx;
+  for (BasicBlock &BB : F) {
+    unsigned Idx = BlockIdx.size();
+    BlockIdx[&BB] = Idx;
+  }
+  DenseMap<const Loop *, unsigned> LoopScopes;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    BasicBlock *Header = L->getHeader();
+    std::string Name = "loop " + (Header->hasName() ? Header->getName().str()
+                                                    : "#" + std::to_string(BlockIdx[Header]));
+    if (DebugLoc Loc = L->getStartLoc())
+      Name += " (line " + std::to_string(Loc.getLine()) + ")";
+    LoopScopes[L] = Scopes.size();
+    Scopes.push_back({Name, L->getLoopDepth(), FunctionScope, {}});
+  }
+
+  for (BasicBlock &BB : F) {
+    auto &Enclosing = BlockScopes[&BB];
+    Enclosing.push_back(FunctionScope);
+    for (Loop *L = LI.getLoopFor(&BB); L; L = L->getParentLoop())
+      Enclosing.push_back(LoopScopes.lookup(L));
+
+    Work &BlockW = BlockWork[&BB];
+    for (Instruction &I : BB) {
+      // Demotion code and demoted PHIs are not part of the program
+      StringRef DemotedOpcode;
+      if (BurstSampler::isDemoted(I, DemotedOpcode))
+        continue;
+      addOperations(I, BlockW.Flops, BlockW.IntOps);
+      MemoryAccess Access = getAccess(I, DL);
+      if (Access.AtRuntime) {
+        RuntimeAccesses.push_back(&I);
+        continue;
+      }
+      if (Access.Reads)
+        BlockW.Read += Access.Size;
+      if (Access.Writes)
+        BlockW.Written += Access.Size;
+    }
+  }
+}
+
+void MemoryTraffic::addBlock(BasicBlock &BB, Constant *Counter, int64_t Weight) {
+  Work BlockW = BlockWork.lookup(&BB);
+  if (!BlockW.Read && !BlockW.Written && !BlockW.Flops && !BlockW.IntOps)
+    return;
+  for (unsigned ScopeIdx : BlockScopes.lookup(&BB)) {
+    Work &Term = Scopes[ScopeIdx].Terms[Counter];
+    Term.Read += Weight * BlockW.Read;
+    Term.Written += Weight * BlockW.Written;
+    Term.Flops += Weight * BlockW.Flops;
+    Term.IntOps += Weight * BlockW.IntOps;
+  }
+}
+
+void MemoryTraffic::addRuntimeCounter(Instruction &I, Constant *Counter) {
+  MemoryAccess Access = getAccess(I, M.getDataLayout());
+  for (unsigned ScopeIdx : BlockScopes.lookup(I.getParent())) {
+    Work &Term = Scopes[ScopeIdx].Terms[Counter];
+    Term.Read += Access.Reads;
+    Term.Written += Access.Writes;
+  }
+}
+Value *MemoryTraffic::emitAccessSize(IRBuilder<> &Builder, Instruction &I) {
+  if (auto *MemI = dyn_cast<AnyMemIntrinsic>(&I))
+    return Builder.CreateZExtOrTrunc(MemI->getLength(), Builder.getInt64Ty());
+  // Active lanes of the mask, times the element size
+  auto &II = cast<IntrinsicInst>(I);
+  unsigned MaskIdx;
+  bool Reads;
+  getMaskedAccess(II, MaskIdx, Reads);
+  auto *Ty = cast<FixedVectorType>(getMaskedType(II, Reads));
+  Value *Bits = Builder.CreateBitCast(II.getArgOperand(MaskIdx),
+                                      Builder.getIntNTy(Ty->getNumElements()));
+  Value *Lanes = Builder.CreateZExtOrTrunc(
+      Builder.CreateUnaryIntrinsic(Intrinsic::ctpop, Bits), Builder.getInt64Ty());
+  const DataLayout &DL = I.getModule()->getDataLayout();
+  return Builder.CreateMul(Lanes,
+                           Builder.getInt64(DL.getTypeStoreSize(Ty->getElementType())));
+}
+
+void MemoryTraffic::createTables() {
+  if (ScopeTable)
+    return;
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+
+  // Terms: { ptr counter, i64 read, i64 written, i64 flops, i64 int ops },
+  // grouped by scope, and scopes: { ptr name, ptr nest name, i32 indent,
+  // i32 width, i32 first term, i32 end term }, where the nest name prefixes
+  // loops with their function (scopes that never do anything are left out)
+  StructType *TermTy = StructType::get(CTX, {PtrTy, Int64Ty, Int64Ty, Int64Ty, Int64Ty});
+  StructType *ScopeTy =
+      StructType::get(CTX, {PtrTy, PtrTy, Int32Ty, Int32Ty, Int32Ty, Int32Ty});
+  std::vector<Constant *> TermInits, ScopeInits;
+  auto createName = [&](StringRef Name) {
+    Constant *Init = ConstantDataArray::getString(CTX, Name);
+    return new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init,
+                              "LLVM_memory_scope");
+  };
+  for (const Scope &S : Scopes) {
+    if (S.Terms.empty())
+      continue;
+    unsigned First = TermInits.size();
+    for (auto &Term : S.Terms)
+      TermInits.push_back(ConstantStruct::get(
+          TermTy, {Term.first, ConstantInt::get(Int64Ty, Term.second.Read),
+                   ConstantInt::get(Int64Ty, Term.second.Written),
+                   ConstantInt::get(Int64Ty, Term.second.Flops),
+                   ConstantInt::get(Int64Ty, Term.second.IntOps)}));
+    GlobalVariable *Name = createName(S.Name);
+    GlobalVariable *NestName =
+        S.Depth ? createName(Scopes[S.Function].Name + " " + S.Name) : Name;
+    int Indent = 2 * S.Depth;
+    ScopeInits.push_back(ConstantStruct::get(
+        ScopeTy, {Name, NestName, ConstantInt::get(Int32Ty, Indent),
+                  ConstantInt::get(Int32Ty, std::max(30 - Indent, 0)),
+                  ConstantInt::get(Int32Ty, First), ConstantInt::get(Int32Ty, TermInits.size())}));
+  }
+  ArrayType *TermsTy = ArrayType::get(TermTy, TermInits.size());
+  TermTable = new GlobalVariable(M, TermsTy, true, GlobalValue::PrivateLinkage,
+                                 ConstantArray::get(TermsTy, TermInits), "LLVM_memory_terms");
+  ArrayType *ScopesTy = ArrayType::get(ScopeTy, ScopeInits.size());
+  ScopeTable = new GlobalVariable(M, ScopesTy, true, GlobalValue::PrivateLinkage,
+                                  ConstantArray::get(ScopesTy, ScopeInits),
+                                  "LLVM_memory_scopes");
+}
+
+void MemoryTraffic::emitScopeWork(IRBuilder<> &Builder, Value *ScopeIdx, Value *Scale,
+                                  ArrayRef<Value *> Sums) {
+  Type *Int64Ty = Builder.getInt64Ty();
+  Type *Int32Ty = Builder.getInt32Ty();
+  Type *PtrTy = PointerType::getUnqual(Builder.getContext());
+  Type *ScopesTy = ScopeTable->getValueType();
+  Type *TermsTy = TermTable->getValueType();
+  Value *Zero = Builder.getInt64(0);
+  auto scopeField = [&](unsigned Field) {
+    return Builder.CreateZExt(
+        Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(ScopesTy, ScopeTable,
+                                                              {Zero, ScopeIdx,
+                                                               Builder.getInt32(Field)})),
+        Int64Ty);
+  };
+  for (Value *Sum : Sums)
+    Builder.CreateStore(Zero, Sum);
+  emitLoop(Builder, scopeField(4), scopeField(5), "scope.terms", [&](Value *TermIdx) {
+    auto termField = [&](unsigned Field, Type *Ty) {
+      return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(TermsTy, TermTable,
+                                                              {Zero, TermIdx,
+                                                               Builder.getInt32(Field)}));
+    };
+    Value *Counter = Builder.CreateLoad(Int64Ty, termField(0, PtrTy));
+    for (unsigned Field = 0; Field < Sums.size(); Field++)
+      Builder.CreateStore(
+          Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Sums[Field]),
+                            Builder.CreateMul(Counter, termField(Field + 1, Int64Ty))),
+          Sums[Field]);
+  });
+  for (Value *Sum : Sums)
+    Builder.CreateStore(Builder.CreateMul(Builder.CreateLoad(Int64Ty, Sum), Scale), Sum);
+}
+
+Function *MemoryTraffic::createReportFunction() {
+  createTables();
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *ScopesTy = ScopeTable->getValueType();
+
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  Function *Report = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int64Ty}, false),
+                                      GlobalValue::InternalLinkage, "LLVM_memory_report", M);
+  Value *Scale = Report->getArg(0);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", Report));
+  Value *Zero = Builder.getInt64(0);
+  AllocaInst *Read = Builder.CreateAlloca(Int64Ty, nullptr, "read");
+  AllocaInst *Written = Builder.CreateAlloca(Int64Ty, nullptr, "written");
+  AllocaInst *TotalRead = Builder.CreateAlloca(Int64Ty, nullptr, "total.read");
+  AllocaInst *TotalWritten = Builder.CreateAlloca(Int64Ty, nullptr, "total.written");
+  Builder.CreateStore(Zero, TotalRead);
+  Builder.CreateStore(Zero, TotalWritten);
+  auto addTo = [&](AllocaInst *Sum, Value *Bytes) {
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Sum), Bytes), Sum);
+  };
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "MEMORY TRAFFIC (bytes)\n"
+                                  "SCOPE                          READ         WRITTEN\n"
+                                  "-------------------------------------------------\n")});
+
+  Value *ScopeFormat = Builder.CreateGlobalStringPtr("%*s%-*s %-12lu %-12lu\n");
+  uint64_t NumScopes = cast<ArrayType>(ScopesTy)->getNumElements();
+  emitLoop(Builder, Zero, Builder.getInt64(NumScopes), "scope", [&](Value *ScopeIdx) {
+    auto scopeField = [&](unsigned Field, Type *Ty) {
+      return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(ScopesTy, ScopeTable,
+                                                              {Zero, ScopeIdx,
+                                                               Builder.getInt32(Field)}));
+    };
+    emitScopeWork(Builder, ScopeIdx, Scale, {Read, Written});
+    Value *ScopeRead = Builder.CreateLoad(Int64Ty, Read);
+    Value *ScopeWritten = Builder.CreateLoad(Int64Ty, Written);
+
+    // Scopes that accessed memory, and the total of the functions
+    BasicBlock *Print = BasicBlock::Create(CTX, "scope.print", Report);
+    BasicBlock *Next = BasicBlock::Create(CTX, "scope.next", Report);
+    Builder.CreateCondBr(Builder.CreateIsNull(Builder.CreateOr(ScopeRead, ScopeWritten)), Next,
+                         Print);
+    Builder.SetInsertPoint(Print);
+    Value *Indent = scopeField(2, Int32Ty);
+    Builder.CreateCall(Printf, {ScopeFormat, Indent, Builder.CreateGlobalStringPtr(""),
+                                scopeField(3, Int32Ty), scopeField(0, PtrTy), ScopeRead,
+                                ScopeWritten});
+    Value *IsFunction = Builder.CreateIsNull(Indent);
+    addTo(TotalRead, Builder.CreateSelect(IsFunction, ScopeRead, Zero));
+    addTo(TotalWritten, Builder.CreateSelect(IsFunction, ScopeWritten, Zero));
+    Builder.CreateBr(Next);
+    Builder.SetInsertPoint(Next);
+  });
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n"
+                                  "%-30s %-12lu %-12lu\n"),
+                              Builder.CreateGlobalStringPtr("TOTAL"),
+                              Builder.CreateLoad(Int64Ty, TotalRead),
+                              Builder.CreateLoad(Int64Ty, TotalWritten)});
+  Builder.CreateRetVoid();
+  return Report;
+}
+
+Function *MemoryTraffic::createRooflineFunction(const MachinePeaks &Peaks, double MinShare) {
+  createTables();
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *DoubleTy = Type::getDoubleTy(CTX);
+  Type *ScopesTy = ScopeTable->getValueType();
+
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  Function *Report = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int64Ty}, false),
+                                      GlobalValue::InternalLinkage, "LLVM_roofline_report", M);
+  Value *Scale = Report->getArg(0);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", Report));
+  Value *Zero = Builder.getInt64(0);
+  // Work of the current scope (read, written, flops, int ops), and of the functions
+  std::vector<Value *> Sums, Totals;
+  for (const char *Name : {"read", "written", "flops", "intops"}) {
+    Sums.push_back(Builder.CreateAlloca(Int64Ty, nullptr, Name));
+    Totals.push_back(Builder.CreateAlloca(Int64Ty, nullptr, Twine("total.") + Name));
+    Builder.CreateStore(Zero, Totals.back());
+  }
+
+  std::string Header;
+  raw_string_ostream OS(Header);
+  OS << "-------------------------------------------------\n"
+     << "ROOFLINE (peaks: " << format("%.2f", Peaks.Flops) << " GFLOP/s, ";
+  if (Peaks.IntOps > 0)
+    OS << format("%.2f", Peaks.IntOps) << " GOP/s, ";
+  OS << format("%.2f", Peaks.Bandwidth) << " GB/s; ridge "
+     << format("%.2f", Peaks.Flops / Peaks.Bandwidth) << " FLOP/B)\n"
+     << "LOOP NEST                                FLOPS          INT OPS        BYTES          "
+        "FLOP/B    INTOP/B   GFLOP/S   BOUND\n"
+     << "-------------------------------------------------\n";
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(OS.str())});
+
+  // Arithmetic intensities, attainable performance (the lower of the compute
+  // peak and of the intensity times the bandwidth) and bound (whichever of
+  // the operations and of the bytes takes the longest at their peak)
+  Value *RowFormat =
+      Builder.CreateGlobalStringPtr("%-40s %-14lu %-14lu %-14lu %-9.3f %-9.3f %-9.2f %s\n");
+  Value *Compute = Builder.CreateGlobalStringPtr("compute");
+  Value *Memory = Builder.CreateGlobalStringPtr("memory");
+  auto printRow = [&](Value *Name, Value *Flops, Value *IntOps, Value *Bytes) {
+    auto toFP = [&](Value *V) { return Builder.CreateUIToFP(V, DoubleTy); };
+    auto peak = [&](double Value) { return ConstantFP::get(DoubleTy, Value); };
+    Value *Divisor = toFP(
+        Builder.CreateSelect(Builder.CreateIsNull(Bytes), Builder.getInt64(1), Bytes));
+    Value *FlopIntensity = Builder.CreateFDiv(toFP(Flops), Divisor);
+    Value *IntIntensity = Builder.CreateFDiv(toFP(IntOps), Divisor);
+    Value *Roof = Builder.CreateFMul(FlopIntensity, peak(Peaks.Bandwidth));
+    Value *Attainable = Builder.CreateSelect(
+        Builder.CreateFCmpOLT(Roof, peak(Peaks.Flops)), Roof, peak(Peaks.Flops));
+    Value *ComputeTime = Builder.CreateFDiv(toFP(Flops), peak(Peaks.Flops));
+    if (Peaks.IntOps > 0) {
+      Value *IntTime = Builder.CreateFDiv(toFP(IntOps), peak(Peaks.IntOps));
+      ComputeTime = Builder.CreateSelect(Builder.CreateFCmpOGT(IntTime, ComputeTime), IntTime,
+                                         ComputeTime);
+    }
+    Value *MemoryTime = Builder.CreateFDiv(toFP(Bytes), peak(Peaks.Bandwidth));
+    Builder.CreateCall(
+        Printf, {RowFormat, Name, Flops, IntOps, Bytes, FlopIntensity, IntIntensity, Attainable,
+                 Builder.CreateSelect(Builder.CreateFCmpOGE(ComputeTime, MemoryTime), Compute,
+                                      Memory)});
+  };
+
+  // Functions add up to the total, which the shares of the nests need
+  uint64_t NumScopes = cast<ArrayType>(ScopesTy)->getNumElements();
+  auto scopeField = [&](Value *ScopeIdx, unsigned Field, Type *Ty) {
+    return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(ScopesTy, ScopeTable,
+                                                            {Zero, ScopeIdx,
+                                                             Builder.getInt32(Field)}));
+  };
+  emitLoop(Builder, Zero, Builder.getInt64(NumScopes), "scope", [&](Value *ScopeIdx) {
+    emitScopeWork(Builder, ScopeIdx, Scale, Sums);
+    Value *IsFunction = Builder.CreateIsNull(scopeField(ScopeIdx, 2, Int32Ty));
+    for (unsigned Field = 0; Field < Sums.size(); Field++) {
+      Value *Sum = Builder.CreateLoad(Int64Ty, Sums[Field]);
+      Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Totals[Field]),
+                                            Builder.CreateSelect(IsFunction, Sum, Zero)),
+                          Totals[Field]);
+    }
+  });
+  Value *TotalOps = Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Totals[2]),
+                                      Builder.CreateLoad(Int64Ty, Totals[3]));
+  Value *TotalBytes = Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Totals[0]),
+                                        Builder.CreateLoad(Int64Ty, Totals[1]));
+
+  // Outermost loops that ran are printed when their operations or their
+  // bytes reach MinShare percent of those of the module, the others counted
+  AllocaInst *Hidden = Builder.CreateAlloca(Int64Ty, nullptr, "hidden");
+  Builder.CreateStore(Zero, Hidden);
+  auto reaches = [&](Value *Part, Value *Total) {
+    return Builder.CreateFCmpOGE(
+        Builder.CreateFMul(Builder.CreateUIToFP(Part, DoubleTy), ConstantFP::get(DoubleTy, 100)),
+        Builder.CreateFMul(Builder.CreateUIToFP(Total, DoubleTy),
+                           ConstantFP::get(DoubleTy, MinShare)));
+  };
+  emitLoop(Builder, Zero, Builder.getInt64(NumScopes), "nest", [&](Value *ScopeIdx) {
+    BasicBlock *Outermost = BasicBlock::Create(CTX, "nest.outermost", Report);
+    BasicBlock *Print = BasicBlock::Create(CTX, "nest.print", Report);
+    BasicBlock *Skip = BasicBlock::Create(CTX, "nest.hidden", Report);
+    BasicBlock *Next = BasicBlock::Create(CTX, "nest.next", Report);
+    Value *Indent = scopeField(ScopeIdx, 2, Int32Ty);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Indent, Builder.getInt32(2)), Outermost, Next);
+    Builder.SetInsertPoint(Outermost);
+    emitScopeWork(Builder, ScopeIdx, Scale, Sums);
+    Value *Read = Builder.CreateLoad(Int64Ty, Sums[0]);
+    Value *Written = Builder.CreateLoad(Int64Ty, Sums[1]);
+    Value *Flops = Builder.CreateLoad(Int64Ty, Sums[2]);
+    Value *IntOps = Builder.CreateLoad(Int64Ty, Sums[3]);
+    Value *Ops = Builder.CreateAdd(Flops, IntOps);
+    Value *Bytes = Builder.CreateAdd(Read, Written);
+    BasicBlock *Ran = BasicBlock::Create(CTX, "nest.ran", Report);
+    Builder.CreateCondBr(Builder.CreateIsNull(Builder.CreateOr(Ops, Bytes)), Next, Ran);
+    Builder.SetInsertPoint(Ran);
+    Builder.CreateCondBr(Builder.CreateOr(reaches(Ops, TotalOps), reaches(Bytes, TotalBytes)),
+                         Print, Skip);
+    Builder.SetInsertPoint(Print);
+    printRow(scopeField(ScopeIdx, 1, PtrTy), Flops, IntOps, Bytes);
+    Builder.CreateBr(Next);
+    Builder.SetInsertPoint(Skip);
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Hidden), Builder.getInt64(1)), Hidden);
+    Builder.CreateBr(Next);
+    Builder.SetInsertPoint(Next);
+  });
+  BasicBlock *Footer = BasicBlock::Create(CTX, "nest.footer", Report);
+  BasicBlock *ReportHidden = BasicBlock::Create(CTX, "nest.report.hidden", Report);
+  Value *NumHidden = Builder.CreateLoad(Int64Ty, Hidden);
+  Builder.CreateCondBr(Builder.CreateIsNull(NumHidden), Footer, ReportHidden);
+  Builder.SetInsertPoint(ReportHidden);
+  std::string HiddenFormat;
+  raw_string_ostream(HiddenFormat) << "(loop nests under " << format("%.2f", MinShare)
+                                   << "%% of the operations and of the bytes: %lu)\n";
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(HiddenFormat), NumHidden});
+  Builder.CreateBr(Footer);
+  Builder.SetInsertPoint(Footer);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                  "-------------------------------------------------\n")});
+  printRow(Builder.CreateGlobalStringPtr("TOTAL"), Builder.CreateLoad(Int64Ty, Totals[2]),
+           Builder.CreateLoad(Int64Ty, Totals[3]), TotalBytes);
+  Builder.CreateRetVoid();
+  return Report;
+}
@@ -0,0 +1,113 @@
+//==============================================================================
+// FILE:
+//    memoryTraffic.h
+//
+// DESCRIPTION:
+//    Declares the memory traffic report of DynamicInstCounter: the bytes
+//    read and written by every function and loop, from the access size of
+//    every load, store, atomic, memory intrinsic and masked vector access.
+//    Also declares the roofline of the loop nests, which puts their
+//    floating-point and integer operations against those bytes and the peaks
+//    of a machine.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_MEMORY_TRAFFIC_H
+#define LLVM_DYNIC_MEMORY_TRAFFIC_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+#include <vector>
+
+namespace llvm {
+class LoopInfo;
+} // namespace llvm
+
+// Peak performance of the machine of the roofline
+struct MachinePeaks {
+  double Flops = 0;     // GFLOP/s
+  double IntOps = 0;    // GOP/s (0: integer operations are not compared)
+  double Bandwidth = 0; // GB/s
+
+  // Reads the peaks from Path, made of `<key> <value>` lines (keys: flops,
+  // int-ops and bandwidth; '#' starts a comment). Prints the errors.
+  bool read(llvm::StringRef Path);
+};
+
+class MemoryTraffic {
+public:
+  explicit MemoryTraffic(llvm::Module &M) : M(M) {}
+
+  // Records the scopes of F (F itself and its loops), and the accesses and
+  // operations of its blocks. Call before adding the blocks of F.
+  void addFunction(llvm::Function &F, llvm::LoopInfo &LI);
+
+  // Records that the executions of BB include Weight times the value of the
+  // 64-bit counter Counter.
+  void addBlock(llvm::BasicBlock &BB, llvm::Constant *Counter, int64_t Weight);
+
+  // Accesses whose size is only known at runtime (memory intrinsics with a
+  // variable length, masked accesses with a variable mask): each one adds
+  // its size to a counter of its own.
+  llvm::ArrayRef<llvm::Instruction *> getRuntimeAccesses() const { return RuntimeAccesses; }
+
+  // Records that Counter holds the bytes accessed by the runtime access I.
+  void addRuntimeCounter(llvm::Instruction &I, llvm::Constant *Counter);
+
+  // Emits, at the insertion point of Builder, the number of bytes accessed
+  // by the runtime access I (an i64).
+  static llvm::Value *emitAccessSize(llvm::IRBuilder<> &Builder, llvm::Instruction &I);
+
+  // Creates `void LLVM_memory_report(i64 scale)`, which prints the bytes
+  // read and written by every function and loop that accessed memory, its
+  // counts multiplied by scale.
+  llvm::Function *createReportFunction();
+
+  // Creates `void LLVM_roofline_report(i64 scale)`, which prints the
+  // operations, bytes and arithmetic intensities of the loop nests that ran
+  // with at least MinShare percent of the operations or of the bytes of the
+  // module (and of the whole module), and whether Peaks make them compute
+  // or memory bound, its counts multiplied by scale.
+  llvm::Function *createRooflineFunction(const MachinePeaks &Peaks, double MinShare);
+
+private:
+  // Bytes read and written, floating-point and integer operations (lanes)
+  struct Work {
+    int64_t Read = 0;
+    int64_t Written = 0;
+    int64_t Flops = 0;
+    int64_t IntOps = 0;
+  };
+  // Emits, at the insertion point of Builder, the work of the scope ScopeIdx
+  // (i64 index in the scope table) multiplied by Scale, into Sums (allocas
+  // of the four fields of Work).
+  void emitScopeWork(llvm::IRBuilder<> &Builder, llvm::Value *ScopeIdx, llvm::Value *Scale,
+                     llvm::ArrayRef<llvm::Value *> Sums);
+  void createTables();
+
+  llvm::Module &M;
+  // Functions and loops, in report order (every function followed by its
+  // loops, outermost first), with their nesting depth and function
+  struct Scope {
+    std::string Name;
+    unsigned Depth;
+    unsigned Function;
+    // counter -> work per unit of the counter
+    llvm::MapVector<llvm::Constant *, Work> Terms;
+  };
+  std::vector<Scope> Scopes;
+  // Scopes of every block (its function and enclosing loops), and the work
+  // it does every time it runs
+  llvm::DenseMap<llvm::BasicBlock *, std::vector<unsigned>> BlockScopes;
+  llvm::DenseMap<llvm::BasicBlock *, Work> BlockWork;
+  std::vector<llvm::Instruction *> RuntimeAccesses;
+  // Constant tables of the scopes and of their terms, shared by the reports
+  llvm::GlobalVariable *ScopeTable = nullptr;
+  llvm::GlobalVariable *TermTable = nullptr;
+};
+
+#endif
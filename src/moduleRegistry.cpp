@@ -0,0 +1,788 @@
+//========================================================================
+// FILE:
+//    moduleRegistry.cpp
+//
+// DESCRIPTION:
+//    Registration of the instrumented modules with a runtime shared by the
+//    whole process.
+//
+//    The runtime (the registry, its functions and the public API:
+//    dynic_enable, dynic_enable_function, dynic_roi_begin, dynic_roi_end)
+//    is emitted into every module that needs it with linkonce_odr linkage
+//    and default visibility, so that the static linker keeps one copy per
+//    binary and the dynamic linker binds every shared object to the first
+//    one in lookup order. Its symbols are versioned (__dynic_v<N>_*), since
+//    every copy must have the same layout.
+//
+//    Every module has a descriptor (next module, then its implementations
+//    of the API, or null), which its constructor links into the registry
+//    and its destructor (printf_wrapper) unlinks, after adding its opcode
+//    totals to the combined totals, kept by opcode name in the registry
+//    itself: they survive the modules, so a library unloaded by dlclose
+//    still contributes. The module unregistered last prints the report.
+//    The API calls the implementation of every registered module.
+//
+//    The reports specific to a module (functions, hot paths, regions...)
+//    can only be printed while its code is loaded, but belong after the
+//    combined totals: a module unregistering prints them with its standard
+//    output redirected to a temporary file of the registry (preceded by the
+//    name of the module when there are several of them), which the module
+//    unregistered last copies out after the combined totals. Output of other
+//    threads while a module prints its reports goes to the file too.
+//
+//    SIGUSR1 and SIGUSR2 (-dynamic-ic-control) are handled by the registry
+//    too, for the whole process: the first module registering with control
+//    hooks installs the handlers, which call the dump or reset hook of every
+//    registered module (keeping errno), and they are uninstalled (default
+//    action) once no registered module has control hooks left, so that no
+//    handler outlives the code it calls. Libraries loaded with RTLD_LOCAL
+//    have registries of their own: the last one registering takes the
+//    signals over, and the others leave its handlers in place.
+//
+//    If the registry is hosted by another shared object than a module that
+//    registers (e.g. a library loaded by dlopen hosts it for the libraries
+//    it loads), its host is pinned in memory (RTLD_NODELETE), so that the
+//    registry outlives it.
+//
+//    Registration runs in constructors and destructors, which the dynamic
+//    linker serializes: the registry has no lock, and the API must not run
+//    concurrently with dlclose of an instrumented library.
+//
+// License: MIT
+//========================================================================
+#include "moduleRegistry.h"
+
+#include "irUtils.h"
+
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+namespace {
+// Fields of the registry
+enum RegistryField {
+  Modules,
+  Live,
+  Reporting,
+  Pinned,
+  Handlers,
+  Period,
+  Reports,
+  NumEntries,
+  Entries
+};
+// Fields of the module descriptors
+enum DescriptorField {
+  Next,
+  EnableHook,
+  EnableByNameHook,
+  RoiBeginHook,
+  RoiEndHook,
+  DumpHook,
+  ResetHook
+};
+
+// Emits `for (Module = Registry->Modules; Module; Module = Module->Next)
+// Body(Module);` at the insertion point of Builder, which is left after the
+// loop.
+void emitModuleLoop(IRBuilder<> &Builder, Type *RegistryTy, Value *Registry,
+                    function_ref<void(Value *)> Body) {
+  auto &CTX = Builder.getContext();
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Function *F = Builder.GetInsertBlock()->getParent();
+  BasicBlock *Preheader = Builder.GetInsertBlock();
+  BasicBlock *Check = BasicBlock::Create(CTX, "modules", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "module", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "modules.end", F);
+  Value *First = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(RegistryTy, Registry, Modules));
+  Builder.CreateBr(Check);
+
+  Builder.SetInsertPoint(Check);
+  PHINode *Module = Builder.CreatePHI(PtrTy, 2, "module");
+  Module->addIncoming(First, Preheader);
+  Builder.CreateCondBr(Builder.CreateIsNull(Module), Exit, Loop);
+  Builder.SetInsertPoint(Loop);
+  Body(Module);
+  // Next is the first field
+  Module->addIncoming(Builder.CreateLoad(PtrTy, Module), Builder.GetInsertBlock());
+  Builder.CreateBr(Check);
+  Builder.SetInsertPoint(Exit);
+}
+} // namespace
+
+ModuleRegistry::ModuleRegistry(Module &M, ArrayRef<Constant *> OpcodeNames)
+    : M(M), NumOpcodes(OpcodeNames.size()) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  EntryTy = StructType::get(CTX, {ArrayType::get(Type::getInt8Ty(CTX), NameSize), Int64Ty, Int64Ty});
+  RegistryTy = StructType::get(CTX, {PtrTy, Int64Ty, Int64Ty, Int64Ty, Int64Ty, Int64Ty, PtrTy,
+                                     Int64Ty, ArrayType::get(EntryTy, MaxEntries)});
+  DescriptorTy = StructType::get(CTX, {PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, PtrTy});
+  Descriptor = new GlobalVariable(M, DescriptorTy, false, GlobalValue::InternalLinkage,
+                                  Constant::getNullValue(DescriptorTy), "LLVM_registry_module");
+  if (NumOpcodes) {
+    ArrayType *NamesTy = ArrayType::get(PtrTy, NumOpcodes);
+    Names = new GlobalVariable(M, NamesTy, true, GlobalValue::PrivateLinkage,
+                               ConstantArray::get(NamesTy, OpcodeNames), "LLVM_registry_opcodes");
+  }
+}
+
+void ModuleRegistry::setHook(unsigned Hook, Function *F) {
+  if (!F)
+    return;
+  Constant *Init = Descriptor->getInitializer();
+  SmallVector<Constant *, 7> Fields;
+  for (unsigned Field = 0; Field < DescriptorTy->getNumElements(); Field++)
+    Fields.push_back(Init->getAggregateElement(Field));
+  Fields[Hook] = F;
+  Descriptor->setInitializer(ConstantStruct::get(DescriptorTy, Fields));
+}
+
+void ModuleRegistry::setToggleHooks(Function *Enable, Function *EnableByName) {
+  setHook(EnableHook, Enable);
+  setHook(EnableByNameHook, EnableByName);
+}
+
+void ModuleRegistry::setRegionHooks(Function *Begin, Function *End) {
+  setHook(RoiBeginHook, Begin);
+  setHook(RoiEndHook, End);
+}
+
+void ModuleRegistry::setControlHooks(Function *Dump, Function *Reset) {
+  setHook(DumpHook, Dump);
+  setHook(ResetHook, Reset);
+}
+
+// Creates the shared runtime function Name (without body), or returns nullptr
+// if the module already defines it
+Function *ModuleRegistry::getRuntimeFunction(StringRef Name, FunctionType *Ty) {
+  Function *F = M.getFunction(Name);
+  if (F && !F->isDeclaration())
+    return nullptr;
+  if (!F || F->getFunctionType() != Ty) {
+    Function *Created = Function::Create(Ty, GlobalValue::LinkOnceODRLinkage, Name, M);
+    if (F) {
+      Created->takeName(F);
+      F->replaceAllUsesWith(Created);
+      F->eraseFromParent();
+    }
+    F = Created;
+  }
+  F->setLinkage(GlobalValue::LinkOnceODRLinkage);
+  F->setVisibility(GlobalValue::DefaultVisibility);
+  if (Triple(M.getTargetTriple()).supportsCOMDAT())
+    F->setComdat(M.getOrInsertComdat(F->getName()));
+  return F;
+}
+
+GlobalVariable *ModuleRegistry::getRegistry() {
+  std::string Name = ("__dynic_v" + Twine(Version) + "_registry").str();
+  if (GlobalVariable *GV = M.getNamedGlobal(Name))
+    return GV;
+  auto *GV = new GlobalVariable(M, RegistryTy, false, GlobalValue::LinkOnceODRLinkage,
+                                Constant::getNullValue(RegistryTy), Name);
+  GV->setAlignment(Align(8));
+  if (Triple(M.getTargetTriple()).supportsCOMDAT())
+    GV->setComdat(M.getOrInsertComdat(Name));
+  return GV;
+}
+
+// void __dynic_v<N>_register(ptr module)
+Function *ModuleRegistry::getRegisterFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  std::string Name = ("__dynic_v" + Twine(Version) + "_register").str();
+  if (Function *F = M.getFunction(Name))
+    return F;
+  Function *F = getRuntimeFunction(Name, FunctionType::get(Type::getVoidTy(CTX), {PtrTy}, false));
+  GlobalVariable *Registry = getRegistry();
+  Value *Module = F->getArg(0);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Value *Head = Builder.CreateStructGEP(RegistryTy, Registry, Modules);
+  Builder.CreateStore(Builder.CreateLoad(PtrTy, Head),
+                      Builder.CreateStructGEP(DescriptorTy, Module, Next));
+  Builder.CreateStore(Module, Head);
+  Value *LiveField = Builder.CreateStructGEP(RegistryTy, Registry, Live);
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, LiveField), Builder.getInt64(1)),
+                      LiveField);
+
+  // dlopen flags (RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE): the registry is
+  // not pinned where they are unknown
+  Triple TT(M.getTargetTriple());
+  int PinFlags = 0;
+  if (TT.isOSDarwin())
+    PinFlags = 0x1 | 0x10 | 0x80;
+  else if (TT.isOSFreeBSD() || TT.isOSDragonFly())
+    PinFlags = 0x1 | 0x2000 | 0x1000;
+  else if (!TT.isOSNetBSD() && !TT.isOSOpenBSD())
+    PinFlags = 0x1 | 0x4 | 0x1000;
+  // Signal handlers, installed by the first module with control hooks
+  auto emitExit = [&]() {
+    BasicBlock *Install = BasicBlock::Create(CTX, "install", F);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+    Builder.SetInsertPoint(Exit);
+    Value *HandlersField = Builder.CreateStructGEP(RegistryTy, Registry, Handlers);
+    Value *Hooked = Builder.CreateIsNotNull(
+        Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescriptorTy, Module, DumpHook)));
+    Builder.CreateCondBr(
+        Builder.CreateAnd(Hooked, Builder.CreateIsNull(Builder.CreateLoad(Int64Ty, HandlersField))),
+        Install, Done);
+    Builder.SetInsertPoint(Install);
+    auto [User1, User2] = getUserSignals(M);
+    emitSignalHandler(Builder, Builder.getInt32(User1), getHandlerFunction(DumpHook));
+    emitSignalHandler(Builder, Builder.getInt32(User2), getHandlerFunction(ResetHook));
+    Builder.CreateStore(Builder.getInt64(1), HandlersField);
+    Builder.CreateBr(Done);
+    Builder.SetInsertPoint(Done);
+    Builder.CreateRetVoid();
+  };
+  if (!PinFlags) {
+    Builder.CreateBr(Exit);
+    emitExit();
+    return F;
+  }
+
+  // Pins the shared object hosting the registry, unless it is the module
+  // itself: Dl_info is { fname, fbase, sname, saddr } everywhere
+  FunctionCallee Dladdr =
+      M.getOrInsertFunction("dladdr", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false));
+  FunctionCallee Dlopen =
+      M.getOrInsertFunction("dlopen", FunctionType::get(PtrTy, {PtrTy, Int32Ty}, false));
+  BasicBlock *Locate = BasicBlock::Create(CTX, "locate", F);
+  BasicBlock *Compare = BasicBlock::Create(CTX, "compare", F);
+  BasicBlock *Pin = BasicBlock::Create(CTX, "pin", F);
+  ArrayType *InfoTy = ArrayType::get(PtrTy, 4);
+  Value *HostInfo = Builder.CreateAlloca(InfoTy, nullptr, "host");
+  Value *ModuleInfo = Builder.CreateAlloca(InfoTy, nullptr, "self");
+  Value *PinnedField = Builder.CreateStructGEP(RegistryTy, Registry, Pinned);
+  Builder.CreateCondBr(Builder.CreateIsNull(Builder.CreateLoad(Int64Ty, PinnedField)), Locate, Exit);
+
+  Builder.SetInsertPoint(Locate);
+  Value *HostFound = Builder.CreateCall(Dladdr, {Registry, HostInfo});
+  Value *ModuleFound = Builder.CreateCall(Dladdr, {Module, ModuleInfo});
+  Builder.CreateCondBr(Builder.CreateAnd(Builder.CreateIsNotNull(HostFound),
+                                         Builder.CreateIsNotNull(ModuleFound)),
+                       Compare, Exit);
+  Builder.SetInsertPoint(Compare);
+  auto base = [&](Value *Info) {
+    return Builder.CreateLoad(PtrTy, Builder.CreateConstInBoundsGEP2_64(InfoTy, Info, 0, 1));
+  };
+  Builder.CreateCondBr(Builder.CreateICmpEQ(base(HostInfo), base(ModuleInfo)), Exit, Pin);
+  Builder.SetInsertPoint(Pin);
+  Builder.CreateCall(Dlopen, {Builder.CreateLoad(PtrTy, HostInfo), Builder.getInt32(PinFlags)});
+  Builder.CreateStore(Builder.getInt64(1), PinnedField);
+  Builder.CreateBr(Exit);
+  emitExit();
+  return F;
+}
+
+// ptr __dynic_v<N>_entry(ptr name): combined totals of the opcode name
+// (added if new), or null if the registry is full
+Function *ModuleRegistry::getEntryFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  std::string Name = ("__dynic_v" + Twine(Version) + "_entry").str();
+  if (Function *F = M.getFunction(Name))
+    return F;
+  Function *F = getRuntimeFunction(Name, FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Strncmp = M.getOrInsertFunction(
+      "strncmp", FunctionType::get(Int32Ty, {PtrTy, PtrTy, Int64Ty}, false));
+  FunctionCallee Strncpy = M.getOrInsertFunction(
+      "strncpy", FunctionType::get(PtrTy, {PtrTy, PtrTy, Int64Ty}, false));
+  GlobalVariable *Registry = getRegistry();
+  Value *OpcodeName = F->getArg(0);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Check = BasicBlock::Create(CTX, "check", F);
+  BasicBlock *Compare = BasicBlock::Create(CTX, "compare", F);
+  BasicBlock *Found = BasicBlock::Create(CTX, "found", F);
+  BasicBlock *NotFound = BasicBlock::Create(CTX, "not_found", F);
+  BasicBlock *Add = BasicBlock::Create(CTX, "add", F);
+  BasicBlock *Full = BasicBlock::Create(CTX, "full", F);
+  IRBuilder<> Builder(Entry);
+  Value *NumField = Builder.CreateStructGEP(RegistryTy, Registry, NumEntries);
+  Value *Num = Builder.CreateLoad(Int64Ty, NumField);
+  auto entryAt = [&](Value *Idx) {
+    return Builder.CreateInBoundsGEP(RegistryTy, Registry,
+                                     {Builder.getInt64(0), Builder.getInt32(Entries), Idx});
+  };
+  Builder.CreateBr(Check);
+
+  Builder.SetInsertPoint(Check);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "idx");
+  Idx->addIncoming(Builder.getInt64(0), Entry);
+  Builder.CreateCondBr(Builder.CreateICmpULT(Idx, Num), Compare, NotFound);
+  Builder.SetInsertPoint(Compare);
+  // Only as many characters as the stored (truncated) names keep: a long
+  // name matches its own entry, instead of adding a new one every time
+  Value *Current = entryAt(Idx);
+  Value *Cmp = Builder.CreateCall(Strncmp, {Current, OpcodeName, Builder.getInt64(NameSize - 1)});
+  Idx->addIncoming(Builder.CreateAdd(Idx, Builder.getInt64(1)), Compare);
+  Builder.CreateCondBr(Builder.CreateIsNull(Cmp), Found, Check);
+  Builder.SetInsertPoint(Found);
+  Builder.CreateRet(Current);
+
+  // The name is truncated to fit, and stays null-terminated
+  Builder.SetInsertPoint(NotFound);
+  Builder.CreateCondBr(Builder.CreateICmpULT(Num, Builder.getInt64(MaxEntries)), Add, Full);
+  Builder.SetInsertPoint(Add);
+  Value *New = entryAt(Num);
+  Builder.CreateCall(Strncpy, {New, OpcodeName, Builder.getInt64(NameSize - 1)});
+  Builder.CreateStore(Builder.CreateAdd(Num, Builder.getInt64(1)), NumField);
+  Builder.CreateRet(New);
+  Builder.SetInsertPoint(Full);
+  Builder.CreateRet(ConstantPointerNull::get(cast<PointerType>(PtrTy)));
+  return F;
+}
+
+// i32 __dynic_v<N>_unregister(ptr module, ptr names, ptr totals,
+//                             ptr variances, i64 n, i64 period):
+// returns whether the combined report is due
+Function *ModuleRegistry::getUnregisterFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  std::string Name = ("__dynic_v" + Twine(Version) + "_unregister").str();
+  if (Function *F = M.getFunction(Name))
+    return F;
+  Function *F = getRuntimeFunction(
+      Name, FunctionType::get(Int32Ty, {PtrTy, PtrTy, PtrTy, PtrTy, Int64Ty, Int64Ty}, false));
+  Function *EntryF = getEntryFunction();
+  GlobalVariable *Registry = getRegistry();
+  Value *Module = F->getArg(0), *OpcodeNames = F->getArg(1), *Totals = F->getArg(2),
+        *Variances = F->getArg(3), *N = F->getArg(4), *ModulePeriod = F->getArg(5);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Find = BasicBlock::Create(CTX, "find", F);
+  BasicBlock *Test = BasicBlock::Create(CTX, "test", F);
+  BasicBlock *Unlink = BasicBlock::Create(CTX, "unlink", F);
+  BasicBlock *Merge = BasicBlock::Create(CTX, "merge", F);
+  BasicBlock *Add = BasicBlock::Create(CTX, "add", F);
+  BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+  IRBuilder<> Builder(Entry);
+  Value *Head = Builder.CreateStructGEP(RegistryTy, Registry, Modules);
+  Builder.CreateBr(Find);
+
+  // Link pointing to the module (the head, or the Next field, first of its
+  // predecessor)
+  Builder.SetInsertPoint(Find);
+  PHINode *Link = Builder.CreatePHI(PtrTy, 2, "link");
+  Link->addIncoming(Head, Entry);
+  Value *Current = Builder.CreateLoad(PtrTy, Link);
+  Builder.CreateCondBr(Builder.CreateIsNull(Current), Merge, Test);
+  Builder.SetInsertPoint(Test);
+  Link->addIncoming(Current, Test);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Current, Module), Unlink, Find);
+  Builder.SetInsertPoint(Unlink);
+  Builder.CreateStore(Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescriptorTy, Module, Next)),
+                      Link);
+  Builder.CreateBr(Merge);
+
+  Builder.SetInsertPoint(Merge);
+  Value *ReportingField = Builder.CreateStructGEP(RegistryTy, Registry, Reporting);
+  Builder.CreateCondBr(Builder.CreateIsNull(N), Done, Add);
+
+  // Periods: 0 until a sampled module reports, ~0 once two differ
+  Builder.SetInsertPoint(Add);
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(Int64Ty, ReportingField), Builder.getInt64(1)),
+      ReportingField);
+  Value *PeriodField = Builder.CreateStructGEP(RegistryTy, Registry, Period);
+  Value *Known = Builder.CreateLoad(Int64Ty, PeriodField);
+  Value *Merged = Builder.CreateSelect(
+      Builder.CreateOr(Builder.CreateIsNull(ModulePeriod), Builder.CreateICmpEQ(Known, ModulePeriod)),
+      Known,
+      Builder.CreateSelect(Builder.CreateIsNull(Known), ModulePeriod, Builder.getInt64(~0ULL)));
+  Builder.CreateStore(Merged, PeriodField);
+  emitLoop(Builder, Builder.getInt64(0), N, "opcodes", [&](Value *OpcodeIdx) {
+    Value *Combined = Builder.CreateCall(
+        EntryF, {Builder.CreateLoad(PtrTy, Builder.CreateInBoundsGEP(PtrTy, OpcodeNames, OpcodeIdx))});
+    BasicBlock *Accumulate = BasicBlock::Create(CTX, "accumulate", F);
+    BasicBlock *Skip = BasicBlock::Create(CTX, "skip", F);
+    Builder.CreateCondBr(Builder.CreateIsNull(Combined), Skip, Accumulate);
+    Builder.SetInsertPoint(Accumulate);
+    for (auto [Field, Values] : {std::pair(1u, Totals), std::pair(2u, Variances)}) {
+      Value *Sum = Builder.CreateStructGEP(EntryTy, Combined, Field);
+      Builder.CreateStore(
+          Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Sum),
+                            Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, Values, OpcodeIdx))),
+          Sum);
+    }
+    Builder.CreateBr(Skip);
+    Builder.SetInsertPoint(Skip);
+  });
+  Builder.CreateBr(Done);
+
+  Builder.SetInsertPoint(Done);
+  Value *LiveField = Builder.CreateStructGEP(RegistryTy, Registry, Live);
+  Value *Left = Builder.CreateSub(Builder.CreateLoad(Int64Ty, LiveField), Builder.getInt64(1));
+  Builder.CreateStore(Left, LiveField);
+  Value *Kept = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(RegistryTy, Registry, Reports));
+  Value *Due = Builder.CreateZExt(
+      Builder.CreateAnd(Builder.CreateIsNull(Left),
+                        Builder.CreateOr(Builder.CreateIsNotNull(
+                                             Builder.CreateLoad(Int64Ty, ReportingField)),
+                                         Builder.CreateIsNotNull(Kept))),
+      Int32Ty);
+
+  // Signal handlers: back to the default action once no registered module
+  // has control hooks
+  BasicBlock *Scan = BasicBlock::Create(CTX, "scan", F);
+  BasicBlock *Uninstall = BasicBlock::Create(CTX, "uninstall", F);
+  BasicBlock *Return = BasicBlock::Create(CTX, "return", F);
+  IRBuilder<> AllocaBuilder(Entry, Entry->begin());
+  Value *Hooked = AllocaBuilder.CreateAlloca(Int64Ty, nullptr, "hooked");
+  Value *HandlersField = Builder.CreateStructGEP(RegistryTy, Registry, Handlers);
+  Builder.CreateCondBr(Builder.CreateIsNull(Builder.CreateLoad(Int64Ty, HandlersField)), Return,
+                       Scan);
+  Builder.SetInsertPoint(Scan);
+  Builder.CreateStore(Builder.getInt64(0), Hooked);
+  emitModuleLoop(Builder, RegistryTy, Registry, [&](Value *Current) {
+    Value *Hook = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescriptorTy, Current, DumpHook));
+    Builder.CreateStore(Builder.CreateOr(Builder.CreateLoad(Int64Ty, Hooked),
+                                         Builder.CreateZExt(Builder.CreateIsNotNull(Hook), Int64Ty)),
+                        Hooked);
+  });
+  Builder.CreateCondBr(Builder.CreateIsNull(Builder.CreateLoad(Int64Ty, Hooked)), Uninstall, Return);
+  // (unless another registry, e.g. of a library loaded with RTLD_LOCAL, has
+  // replaced them since)
+  Builder.SetInsertPoint(Uninstall);
+  Constant *Default = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  auto [User1, User2] = getUserSignals(M);
+  for (auto [Signal, Hook] : {std::pair(User1, DumpHook), std::pair(User2, ResetHook)}) {
+    BasicBlock *Restore = BasicBlock::Create(CTX, "restore", F);
+    BasicBlock *Restored = BasicBlock::Create(CTX, "restored", F);
+    Value *Current = emitGetSignalHandler(Builder, Builder.getInt32(Signal));
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Current, getHandlerFunction(Hook)), Restore,
+                         Restored);
+    Builder.SetInsertPoint(Restore);
+    emitSignalHandler(Builder, Builder.getInt32(Signal), Default);
+    Builder.CreateBr(Restored);
+    Builder.SetInsertPoint(Restored);
+  }
+  Builder.CreateStore(Builder.getInt64(0), HandlersField);
+  Builder.CreateBr(Return);
+
+  Builder.SetInsertPoint(Return);
+  Builder.CreateRet(Due);
+  return F;
+}
+
+// void __dynic_v<N>_print(): prints the combined totals, like a single
+// module would, then the reports of the modules
+Function *ModuleRegistry::getPrintFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  std::string Name = ("__dynic_v" + Twine(Version) + "_print").str();
+  if (Function *F = M.getFunction(Name))
+    return F;
+  Function *F = getRuntimeFunction(Name, FunctionType::get(Type::getVoidTy(CTX), false));
+  FunctionCallee Printf = M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  FunctionCallee Fflush =
+      M.getOrInsertFunction("fflush", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Fclose =
+      M.getOrInsertFunction("fclose", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Fileno =
+      M.getOrInsertFunction("fileno", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Lseek = M.getOrInsertFunction(
+      "lseek", FunctionType::get(Int64Ty, {Int32Ty, Int64Ty, Int32Ty}, false));
+  FunctionCallee Read = M.getOrInsertFunction(
+      "read", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty}, false));
+  FunctionCallee Write = M.getOrInsertFunction(
+      "write", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty}, false));
+  GlobalVariable *Registry = getRegistry();
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *PrintTotals = BasicBlock::Create(CTX, "combined", F);
+  BasicBlock *Known = BasicBlock::Create(CTX, "period", F);
+  BasicBlock *Totals = BasicBlock::Create(CTX, "totals", F);
+  BasicBlock *ModuleReports = BasicBlock::Create(CTX, "reports", F);
+  BasicBlock *Copy = BasicBlock::Create(CTX, "copy", F);
+  BasicBlock *Chunk = BasicBlock::Create(CTX, "chunk", F);
+  BasicBlock *Copied = BasicBlock::Create(CTX, "copied", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  const uint64_t BufferSize = 4096;
+  Value *Buffer = Builder.CreateAlloca(ArrayType::get(Builder.getInt8Ty(), BufferSize), nullptr,
+                                       "buffer");
+  // Only modules without totals (raw profiles) may have reports to print
+  Builder.CreateCondBr(
+      Builder.CreateIsNull(
+          Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RegistryTy, Registry, Reporting))),
+      ModuleReports, PrintTotals);
+
+  Builder.SetInsertPoint(PrintTotals);
+  std::string Header = "=================================================\n"
+                       "LLVM Dynamic Instruction Counter results\n"
+                       "=================================================\n";
+  std::string Rule = "-------------------------------------------------\n";
+  Value *P = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RegistryTy, Registry, Period));
+  Value *Sampled = Builder.CreateIsNotNull(P);
+  Builder.CreateCall(
+      Printf,
+      {Builder.CreateSelect(
+          Sampled,
+          Builder.CreateGlobalStringPtr(Header + "INST                 #N CALLS (runtime, estimated)\n" + Rule,
+                                        "LLVM_registry_header_sampled"),
+          Builder.CreateGlobalStringPtr(Header + "INST                 #N CALLS (runtime)\n" + Rule,
+                                        "LLVM_registry_header"))});
+  Builder.CreateCondBr(Builder.CreateAnd(Sampled, Builder.CreateICmpNE(P, Builder.getInt64(~0ULL))),
+                       Known, Totals);
+  Builder.SetInsertPoint(Known);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("Sampling period: %lu\n",
+                                                            "LLVM_registry_period"),
+                              P});
+  Builder.CreateBr(Totals);
+
+  // Half-width of the 95% confidence interval of the estimates
+  Builder.SetInsertPoint(Totals);
+  Value *Format = Builder.CreateGlobalStringPtr("%-20s %-10lu\n", "LLVM_registry_format");
+  Value *SampledFormat =
+      Builder.CreateGlobalStringPtr("%-20s %-10lu +/- %lu\n", "LLVM_registry_format_sampled");
+  Value *Num = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RegistryTy, Registry, NumEntries));
+  emitLoop(Builder, Builder.getInt64(0), Num, "entries", [&](Value *Idx) {
+    Value *Combined = Builder.CreateInBoundsGEP(
+        RegistryTy, Registry, {Builder.getInt64(0), Builder.getInt32(Entries), Idx});
+    Value *Total = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(EntryTy, Combined, 1));
+    Value *Variance = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(EntryTy, Combined, 2));
+    Builder.CreateCall(Printf, {Builder.CreateSelect(Sampled, SampledFormat, Format), Combined,
+                                Total, emitSamplingBound(Builder, Variance)});
+  });
+  Builder.CreateBr(ModuleReports);
+
+  // The reports of the modules, copied from the start of their file
+  Builder.SetInsertPoint(ModuleReports);
+  Value *ReportsField = Builder.CreateStructGEP(RegistryTy, Registry, Reports);
+  Value *Kept = Builder.CreateLoad(PtrTy, ReportsField);
+  Builder.CreateCondBr(Builder.CreateIsNull(Kept), Exit, Copy);
+  Builder.SetInsertPoint(Copy);
+  Builder.CreateCall(Fflush, {ConstantPointerNull::get(cast<PointerType>(PtrTy))});
+  Value *Fd = Builder.CreateCall(Fileno, {Kept});
+  Builder.CreateCall(Lseek, {Fd, Builder.getInt64(0), Builder.getInt32(0)});
+  Builder.CreateBr(Chunk);
+  Builder.SetInsertPoint(Chunk);
+  Value *Size = Builder.CreateCall(Read, {Fd, Buffer, Builder.getInt64(BufferSize)});
+  BasicBlock *WriteOut = BasicBlock::Create(CTX, "write", F, Copied);
+  Builder.CreateCondBr(Builder.CreateICmpSGT(Size, Builder.getInt64(0)), WriteOut, Copied);
+  Builder.SetInsertPoint(WriteOut);
+  Builder.CreateCall(Write, {Builder.getInt32(1), Buffer, Size});
+  Builder.CreateBr(Chunk);
+  Builder.SetInsertPoint(Copied);
+  Builder.CreateCall(Fclose, {Kept});
+  Builder.CreateStore(ConstantPointerNull::get(cast<PointerType>(PtrTy)), ReportsField);
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// void __dynic_v<N>_capture(ptr report, ptr arg, ptr module): calls
+// report(arg) with its standard output appended to the reports of the
+// registry, preceded by the name of the module if other modules may have
+// reports (printing them directly if the file cannot be created)
+Function *ModuleRegistry::getCaptureFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  std::string Name = ("__dynic_v" + Twine(Version) + "_capture").str();
+  if (Function *F = M.getFunction(Name))
+    return F;
+  Function *F = getRuntimeFunction(Name, FunctionType::get(VoidTy, {PtrTy, PtrTy, PtrTy}, false));
+  FunctionCallee Printf = M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  FunctionCallee Fflush =
+      M.getOrInsertFunction("fflush", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Tmpfile = M.getOrInsertFunction("tmpfile", FunctionType::get(PtrTy, false));
+  FunctionCallee Fileno =
+      M.getOrInsertFunction("fileno", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Lseek = M.getOrInsertFunction(
+      "lseek", FunctionType::get(Int64Ty, {Int32Ty, Int64Ty, Int32Ty}, false));
+  FunctionCallee Dup = M.getOrInsertFunction("dup", FunctionType::get(Int32Ty, {Int32Ty}, false));
+  FunctionCallee Dup2 =
+      M.getOrInsertFunction("dup2", FunctionType::get(Int32Ty, {Int32Ty, Int32Ty}, false));
+  FunctionCallee Close = M.getOrInsertFunction("close", FunctionType::get(Int32Ty, {Int32Ty}, false));
+  GlobalVariable *Registry = getRegistry();
+  FunctionType *ReportTy = FunctionType::get(VoidTy, {PtrTy}, false);
+  Value *Report = F->getArg(0), *Arg = F->getArg(1), *Module = F->getArg(2);
+  Constant *Null = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Create = BasicBlock::Create(CTX, "create", F);
+  BasicBlock *Open = BasicBlock::Create(CTX, "open", F);
+  BasicBlock *Redirect = BasicBlock::Create(CTX, "redirect", F);
+  BasicBlock *Label = BasicBlock::Create(CTX, "label", F);
+  BasicBlock *Print = BasicBlock::Create(CTX, "print", F);
+  BasicBlock *Direct = BasicBlock::Create(CTX, "direct", F);
+  IRBuilder<> Builder(Entry);
+  Value *ReportsField = Builder.CreateStructGEP(RegistryTy, Registry, Reports);
+  Value *Kept = Builder.CreateLoad(PtrTy, ReportsField);
+  Builder.CreateCondBr(Builder.CreateIsNull(Kept), Create, Open);
+  Builder.SetInsertPoint(Create);
+  Value *Created = Builder.CreateCall(Tmpfile);
+  Builder.CreateStore(Created, ReportsField);
+  Builder.CreateCondBr(Builder.CreateIsNull(Created), Direct, Open);
+
+  // Everything printed so far goes out first
+  Builder.SetInsertPoint(Open);
+  PHINode *File = Builder.CreatePHI(PtrTy, 2, "file");
+  File->addIncoming(Kept, Entry);
+  File->addIncoming(Created, Create);
+  Builder.CreateCall(Fflush, {Null});
+  Value *Saved = Builder.CreateCall(Dup, {Builder.getInt32(1)});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Saved, Builder.getInt32(0)), Direct, Redirect);
+  Builder.SetInsertPoint(Redirect);
+  Value *Fd = Builder.CreateCall(Fileno, {File});
+  Builder.CreateCall(Dup2, {Fd, Builder.getInt32(1)});
+  // A single module keeps its usual output
+  Value *Others = Builder.CreateICmpUGT(
+      Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RegistryTy, Registry, Live)),
+      Builder.getInt64(1));
+  Value *Written = Builder.CreateICmpSGT(
+      Builder.CreateCall(Lseek, {Fd, Builder.getInt64(0), Builder.getInt32(1)}),
+      Builder.getInt64(0));
+  Builder.CreateCondBr(Builder.CreateOr(Others, Written), Label, Print);
+  Builder.SetInsertPoint(Label);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("MODULE %s\n", "LLVM_registry_module_label"),
+                              Module});
+  Builder.CreateBr(Print);
+  Builder.SetInsertPoint(Print);
+  Builder.CreateCall(ReportTy, Report, {Arg});
+  Builder.CreateCall(Fflush, {Null});
+  Builder.CreateCall(Dup2, {Saved, Builder.getInt32(1)});
+  Builder.CreateCall(Close, {Saved});
+  Builder.CreateRetVoid();
+
+  Builder.SetInsertPoint(Direct);
+  Builder.CreateCall(ReportTy, Report, {Arg});
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// void __dynic_v<N>_dump_handler(i32) / __dynic_v<N>_reset_handler(i32):
+// signal handlers calling the control hook Hook of every registered module,
+// with stderr, keeping errno
+Function *ModuleRegistry::getHandlerFunction(unsigned Hook) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  std::string Name =
+      ("__dynic_v" + Twine(Version) + (Hook == DumpHook ? "_dump" : "_reset") + "_handler").str();
+  if (Function *F = M.getFunction(Name))
+    return F;
+  FunctionType *Ty = FunctionType::get(Type::getVoidTy(CTX), {Int32Ty}, false);
+  Function *F = getRuntimeFunction(Name, Ty);
+  GlobalVariable *Registry = getRegistry();
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *Errno = emitErrnoLocation(Builder);
+  Value *Saved = Builder.CreateLoad(Int32Ty, Errno);
+  emitModuleLoop(Builder, RegistryTy, Registry, [&](Value *Module) {
+    Value *Impl = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescriptorTy, Module, Hook));
+    BasicBlock *Call = BasicBlock::Create(CTX, "call", F);
+    BasicBlock *Skip = BasicBlock::Create(CTX, "skip", F);
+    Builder.CreateCondBr(Builder.CreateIsNull(Impl), Skip, Call);
+    Builder.SetInsertPoint(Call);
+    Builder.CreateCall(Ty, Impl, {Builder.getInt32(2)});
+    Builder.CreateBr(Skip);
+    Builder.SetInsertPoint(Skip);
+  });
+  Builder.CreateStore(Saved, Errno);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+// Defines the public API function Name, which calls the hook Hook of every
+// registered module (adding up the results of dynic_enable_function)
+void ModuleRegistry::defineDispatcher(StringRef Name, unsigned Hook) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  FunctionType *Ty = Hook == EnableHook         ? FunctionType::get(VoidTy, {Int32Ty}, false)
+                     : Hook == EnableByNameHook ? FunctionType::get(Int32Ty, {PtrTy, Int32Ty}, false)
+                     : Hook == RoiBeginHook     ? FunctionType::get(VoidTy, {PtrTy}, false)
+                                                : FunctionType::get(VoidTy, false);
+  Function *F = getRuntimeFunction(Name, Ty);
+  if (!F) {
+    errs() << "The module already defines " << Name << ": runtime API not exported\n";
+    return;
+  }
+  GlobalVariable *Registry = getRegistry();
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  IRBuilder<> Builder(Entry);
+  Value *Sum = Builder.CreateAlloca(Int32Ty, nullptr, "sum");
+  Builder.CreateStore(Builder.getInt32(0), Sum);
+  SmallVector<Value *, 2> Args;
+  for (Argument &Arg : F->args())
+    Args.push_back(&Arg);
+  emitModuleLoop(Builder, RegistryTy, Registry, [&](Value *Module) {
+    Value *Impl = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(DescriptorTy, Module, Hook));
+    BasicBlock *Call = BasicBlock::Create(CTX, "call", F);
+    BasicBlock *Skip = BasicBlock::Create(CTX, "skip", F);
+    Builder.CreateCondBr(Builder.CreateIsNull(Impl), Skip, Call);
+    Builder.SetInsertPoint(Call);
+    Value *Result = Builder.CreateCall(Ty, Impl, Args);
+    if (!Ty->getReturnType()->isVoidTy())
+      Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int32Ty, Sum), Result), Sum);
+    Builder.CreateBr(Skip);
+    Builder.SetInsertPoint(Skip);
+  });
+  if (Ty->getReturnType()->isVoidTy())
+    Builder.CreateRetVoid();
+  else
+    Builder.CreateRet(Builder.CreateLoad(Int32Ty, Sum));
+}
+
+void ModuleRegistry::emitUnregister(IRBuilder<> &Builder, Value *Totals, Value *Variances,
+                                    Value *Period, Function *Reports) {
+  auto &CTX = M.getContext();
+  Function *F = Builder.GetInsertBlock()->getParent();
+  Constant *Null = ConstantPointerNull::get(PointerType::getUnqual(CTX));
+  // The reports of the module are kept while it is still registered
+  if (Reports)
+    Builder.CreateCall(getCaptureFunction(),
+                       {Reports, Totals ? Totals : Null,
+                        Builder.CreateGlobalStringPtr(M.getSourceFileName(),
+                                                      "LLVM_registry_module_name")});
+  Value *Last = Builder.CreateCall(
+      getUnregisterFunction(),
+      {Descriptor, Names ? static_cast<Value *>(Names) : Null, Totals ? Totals : Null,
+       Variances ? Variances : Null, Builder.getInt64(NumOpcodes), Period});
+  BasicBlock *Print = BasicBlock::Create(CTX, "print_combined", F);
+  BasicBlock *Continue = BasicBlock::Create(CTX, "combined", F);
+  Builder.CreateCondBr(Builder.CreateIsNotNull(Last), Print, Continue);
+  Builder.SetInsertPoint(Print);
+  Builder.CreateCall(getPrintFunction());
+  Builder.CreateBr(Continue);
+  Builder.SetInsertPoint(Continue);
+}
+
+void ModuleRegistry::finalize() {
+  auto &CTX = M.getContext();
+  // The API is defined wherever it is called or implemented
+  Constant *Init = Descriptor->getInitializer();
+  for (auto [Name, Hook] : {std::pair("dynic_enable", EnableHook),
+                            std::pair("dynic_enable_function", EnableByNameHook),
+                            std::pair("dynic_roi_begin", RoiBeginHook),
+                            std::pair("dynic_roi_end", RoiEndHook)}) {
+    Function *Declared = M.getFunction(Name);
+    if ((Declared && Declared->isDeclaration()) || !Init->getAggregateElement(Hook)->isNullValue())
+      defineDispatcher(Name, Hook);
+  }
+
+  // Constructor: void LLVM_registry_init() { __dynic_v<N>_register(&module); }
+  Function *Ctor = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                     GlobalValue::InternalLinkage, "LLVM_registry_init", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", Ctor));
+  Builder.CreateCall(getRegisterFunction(), {Descriptor});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, /*Priority=*/0);
+}
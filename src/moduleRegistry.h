@@ -0,0 +1,86 @@
+//==============================================================================
+// FILE:
+//    moduleRegistry.h
+//
+// DESCRIPTION:
+//    Declares the module registry of DynamicInstCounter: every instrumented
+//    module (translation unit or shared library) registers with a runtime
+//    shared by the whole process, which dispatches the runtime API to every
+//    module and prints a single report, combining the counts of every module,
+//    including the libraries already unloaded, followed by the reports
+//    specific to every module.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_MODULE_REGISTRY_H
+#define LLVM_DYNIC_MODULE_REGISTRY_H
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+class ModuleRegistry {
+public:
+  // OpcodeNames are the names (i8 strings) of the opcodes of the module, in
+  // the order of the totals it hands over (none if it prints no report).
+  ModuleRegistry(llvm::Module &M, llvm::ArrayRef<llvm::Constant *> OpcodeNames);
+
+  // Module implementations of dynic_enable and dynic_enable_function, and of
+  // dynic_roi_begin and dynic_roi_end, called for every registered module
+  void setToggleHooks(llvm::Function *Enable, llvm::Function *EnableByName);
+  void setRegionHooks(llvm::Function *Begin, llvm::Function *End);
+  // Module reports (`void (i32 fd)`) written on SIGUSR1 and SIGUSR2, whose
+  // handlers the registry installs while a registered module has them
+  void setControlHooks(llvm::Function *Dump, llvm::Function *Reset);
+
+  // Emits, at the insertion point of Builder, the unregistration of the
+  // module: its opcode totals ([N x i64] Totals, scaled by the sampling
+  // period, and Variances of the estimates) are added to the combined
+  // totals, and the output of Reports (`void (ptr totals)`, printing the
+  // reports specific to the module, or nullptr) is kept by the registry.
+  // If no other module is left, the combined totals are printed, then the
+  // reports kept. Period is the sampling period (0 if not sampled).
+  void emitUnregister(llvm::IRBuilder<> &Builder, llvm::Value *Totals,
+                      llvm::Value *Variances, llvm::Value *Period,
+                      llvm::Function *Reports);
+
+  // Defines the runtime API called by the module and the constructor that
+  // registers it.
+  void finalize();
+
+  // Version of the shared runtime, part of the names of its symbols: modules
+  // instrumented by incompatible versions of the pass do not share it
+  static constexpr unsigned Version = 2;
+  // Distinct opcode names the combined report can hold (every opcode of the
+  // IR fits, and the instruction classes of most programs), and their
+  // maximum length
+  static constexpr unsigned MaxEntries = 2048;
+  static constexpr unsigned NameSize = 96;
+
+private:
+  llvm::Function *getRuntimeFunction(llvm::StringRef Name, llvm::FunctionType *Ty);
+  llvm::GlobalVariable *getRegistry();
+  llvm::Function *getRegisterFunction();
+  llvm::Function *getUnregisterFunction();
+  llvm::Function *getEntryFunction();
+  llvm::Function *getPrintFunction();
+  llvm::Function *getCaptureFunction();
+  llvm::Function *getHandlerFunction(unsigned Hook);
+  void defineDispatcher(llvm::StringRef Name, unsigned Hook);
+  void setHook(unsigned Hook, llvm::Function *F);
+
+  llvm::Module &M;
+  uint64_t NumOpcodes;
+  // Constant array of the opcode names
+  llvm::GlobalVariable *Names = nullptr;
+  // Descriptor of the module: next registered module, then its hooks
+  llvm::GlobalVariable *Descriptor = nullptr;
+  llvm::StructType *DescriptorTy = nullptr;
+  // Registry: registered modules, their count, how many hand over totals,
+  // whether its host is pinned, whether the signal handlers are installed,
+  // sampling period (0: none, ~0: several), file of the module reports (a
+  // FILE *, null until a module has reports), and the combined totals
+  llvm::StructType *RegistryTy = nullptr;
+  llvm::StructType *EntryTy = nullptr;
+};
+
+#endif
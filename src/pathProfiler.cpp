@@ -0,0 +1,846 @@
+//========================================================================
+// FILE:
+//    pathProfiler.cpp
+//
+// DESCRIPTION:
+//    Ball-Larus acyclic path profiling.
+//
+//    Every function is turned into a DAG with a virtual ROOT and a virtual
+//    EXIT node: ROOT feeds the entry block, exit blocks feed EXIT, and every
+//    backedge u -> h (found by a DFS from the entry block) is replaced by the
+//    two dummy edges u -> EXIT and ROOT -> h. Every DAG edge e gets a value
+//    Val(e) such that the sum of the values along a ROOT -> EXIT path is a
+//    unique number in [0, NumPaths(ROOT)) (the path ID).
+//
+//    Increments are only placed on the chords of a maximum spanning tree of
+//    the DAG (plus a virtual EXIT -> ROOT edge): with a potential Phi defined
+//    on the nodes such that Phi(v) = Phi(u) + Val(e) for every tree edge
+//    e = (u -> v), the increment Inc(e) = Val(e) + Phi(u) - Phi(v) is zero on
+//    tree edges and the increments along any path still sum up to its ID.
+//
+//    At runtime, a path register is initialized when entering the function,
+//    updated on the chords and used to index the path counter table of the
+//    function when reaching EXIT (function exit, backedge, or call to a
+//    function that does not return, such as exit or longjmp, right before
+//    it). Functions with too many paths use a hash table instead of a dense
+//    array. At the end of the program, executed paths are decoded back to
+//    their blocks in order to rebuild the per-opcode totals and to print the
+//    hottest paths. The paths the callers of a function that does not
+//    return are executing when it is called are lost.
+//
+// License: MIT
+//========================================================================
+#include "pathProfiler.h"
+#include "counterPlacement.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+using namespace llvm;
+
+// Path IDs must fit in a signed 64-bit register
+static const uint64_t MaxPaths = 1ULL << 62;
+
+namespace {
+enum class PathEdgeKind {
+  Real,          // CFG edge u -> v that is not a backedge
+  FunctionEntry, // ROOT -> entry block
+  FunctionExit,  // exit block -> EXIT
+  BackedgeExit,  // dummy u -> EXIT for the backedge u -> h
+  BackedgeEntry  // dummy ROOT -> h for the backedges u -> h
+};
+
+struct PathEdge {
+  unsigned Src;
+  unsigned Dst;
+  PathEdgeKind Kind;
+  // CFG edge the DAG edge stands for (the backedge for BackedgeExit)
+  BasicBlock *From;
+  BasicBlock *To;
+  uint64_t Weight;
+  uint64_t Val = 0;
+  uint64_t Inc = 0;
+};
+
+Constant *createStringConstant(Module &M, StringRef Str) {
+  Constant *Init = ConstantDataArray::getString(M.getContext(), Str);
+  auto *GV = new GlobalVariable(M, Init->getType(), /*isConstant=*/true,
+                                GlobalValue::PrivateLinkage, Init);
+  GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return GV;
+}
+
+GlobalVariable *createConstantTable(Module &M, Type *ElemTy,
+                                    ArrayRef<Constant *> Elems,
+                                    const Twine &Name) {
+  ArrayType *Ty = ArrayType::get(ElemTy, Elems.size());
+  return new GlobalVariable(M, Ty, /*isConstant=*/true,
+                            GlobalValue::PrivateLinkage,
+                            ConstantArray::get(Ty, Elems), Name);
+}
+
+// First call of BB to a function that does not return (exit, abort, longjmp...),
+// where the path of BB ends: invokes are left out, since their exceptions
+// resume the path in the landing pad
+CallInst *getNoReturnCall(BasicBlock &BB) {
+  for (auto &I : BB)
+    if (auto *Call = dyn_cast<CallInst>(&I))
+      if (Call->doesNotReturn())
+        return Call;
+  return nullptr;
+}
+
+GlobalVariable *createZeroTable(Module &M, Type *ElemTy, uint64_t Size,
+                                const Twine &Name) {
+  ArrayType *Ty = ArrayType::get(ElemTy, Size);
+  auto *GV = new GlobalVariable(M, Ty, /*isConstant=*/false,
+                                GlobalValue::InternalLinkage,
+                                Constant::getNullValue(Ty), Name);
+  GV->setAlignment(MaybeAlign(8));
+  return GV;
+}
+} // namespace
+
+struct PathProfiler::FunctionPaths {
+  Function *F;
+  // DAG nodes: Nodes[0] is ROOT, Nodes.back() is EXIT (both nullptr)
+  std::vector<BasicBlock *> Nodes;
+  // DAG edges, grouped by source node and sorted by value
+  std::vector<PathEdge> Edges;
+  uint64_t NumPaths;
+  // Path counters (dense array or hash table values) and hash table keys
+  // (path ID + 1, 0 for empty slots)
+  GlobalVariable *Counters = nullptr;
+  GlobalVariable *Keys = nullptr;
+  uint64_t TableSize;
+  // Row of LLVM_path_function_totals holding the opcode totals of F
+  Constant *Totals = nullptr;
+
+  unsigned exitNode() const { return Nodes.size() - 1; }
+};
+
+PathProfiler::PathProfiler(
+    Module &M, ArrayRef<std::string> Opcodes,
+    const MapVector<BasicBlock *, StringMap<uint64_t>> &Histograms,
+    CounterTable &Table, uint64_t ArrayLimit, uint64_t HashSize)
+    : M(M), Table(Table), Opcodes(Opcodes.begin(), Opcodes.end()), Histograms(Histograms),
+      ArrayLimit(ArrayLimit), HashSize(PowerOf2Ceil(std::max<uint64_t>(HashSize, 1))) {}
+
+PathProfiler::~PathProfiler() = default;
+
+//-----------------------------------------------------------------------------
+// Path numbering
+//-----------------------------------------------------------------------------
+bool PathProfiler::addFunction(Function &F, BlockFrequencyInfo &BFI,
+                               BranchProbabilityInfo &BPI) {
+  if (!canSplitEdges(F))
+    return false;
+
+  // DFS from the entry block: collect the backedges and a postorder of the
+  // reachable blocks
+  DenseSet<std::pair<BasicBlock *, BasicBlock *>> Backedges;
+  std::vector<BasicBlock *> PostOrder;
+  DenseMap<BasicBlock *, bool> OnStack; // visited blocks -> still on stack
+  SmallVector<std::pair<BasicBlock *, succ_iterator>, 16> Stack;
+  BasicBlock *Entry = &F.getEntryBlock();
+  Stack.push_back({Entry, succ_begin(Entry)});
+  OnStack[Entry] = true;
+  while (!Stack.empty()) {
+    BasicBlock *BB = Stack.back().first;
+    succ_iterator &It = Stack.back().second;
+    if (It == succ_end(BB)) {
+      OnStack[BB] = false;
+      PostOrder.push_back(BB);
+      Stack.pop_back();
+      continue;
+    }
+    BasicBlock *Succ = *It++;
+    auto Visited = OnStack.find(Succ);
+    if (Visited == OnStack.end()) {
+      OnStack[Succ] = true;
+      Stack.push_back({Succ, succ_begin(Succ)});
+    } else if (Visited->second) {
+      Backedges.insert({BB, Succ});
+    }
+  }
+
+  // Number the nodes in reverse postorder, so that every DAG edge goes from a
+  // lower to a higher index
+  auto FP = std::make_unique<FunctionPaths>();
+  FP->F = &F;
+  FP->Nodes.push_back(nullptr);
+  DenseMap<BasicBlock *, unsigned> NodeIdx;
+  for (auto It = PostOrder.rbegin(); It != PostOrder.rend(); ++It) {
+    NodeIdx[*It] = FP->Nodes.size();
+    FP->Nodes.push_back(*It);
+  }
+  FP->Nodes.push_back(nullptr);
+  const unsigned Root = 0, Exit = FP->exitNode();
+
+  auto freq = [&](BasicBlock *BB) { return BFI.getBlockFreq(BB).getFrequency(); };
+  auto edgeFreq = [&](BasicBlock *From, BasicBlock *To) {
+    return BPI.getEdgeProbability(From, To).scale(freq(From));
+  };
+
+  // Collect the DAG edges, grouped by source node
+  std::vector<PathEdge> &Edges = FP->Edges;
+  Edges.push_back({Root, NodeIdx[Entry], PathEdgeKind::FunctionEntry, nullptr,
+                   Entry, freq(Entry)});
+  MapVector<BasicBlock *, uint64_t> Headers;
+  for (auto &Backedge : Backedges)
+    Headers[Backedge.second] += edgeFreq(Backedge.first, Backedge.second);
+  // Keep the headers in node order, for a deterministic numbering
+  std::vector<std::pair<BasicBlock *, uint64_t>> SortedHeaders(
+      Headers.begin(), Headers.end());
+  llvm::sort(SortedHeaders, [&](auto &A, auto &B) {
+    return NodeIdx[A.first] < NodeIdx[B.first];
+  });
+  for (auto &Header : SortedHeaders)
+    Edges.push_back({Root, NodeIdx[Header.first], PathEdgeKind::BackedgeEntry,
+                     nullptr, Header.first, Header.second});
+
+  // (blocks calling a function that does not return leave the function there, even if
+  // they have successors)
+  for (unsigned N = 1; N < Exit; N++) {
+    BasicBlock *BB = FP->Nodes[N];
+    if (succ_empty(BB) || getNoReturnCall(*BB)) {
+      Edges.push_back({N, Exit, PathEdgeKind::FunctionExit, BB, nullptr, freq(BB)});
+      if (succ_empty(BB))
+        continue;
+    }
+    SmallPtrSet<BasicBlock *, 4> Visited;
+    for (BasicBlock *Succ : successors(BB)) {
+      if (!Visited.insert(Succ).second)
+        continue;
+      if (Backedges.count({BB, Succ}))
+        Edges.push_back({N, Exit, PathEdgeKind::BackedgeExit, BB, Succ,
+                         edgeFreq(BB, Succ)});
+      else
+        Edges.push_back({N, NodeIdx[Succ], PathEdgeKind::Real, BB, Succ,
+                         edgeFreq(BB, Succ)});
+    }
+  }
+
+  // Assign the edge values, visiting the nodes in postorder
+  std::vector<uint64_t> NumPaths(FP->Nodes.size(), 0);
+  std::vector<unsigned> EdgeStart(FP->Nodes.size() + 1, Edges.size());
+  for (unsigned E = Edges.size(); E-- > 0;)
+    EdgeStart[Edges[E].Src] = E;
+  NumPaths[Exit] = 1;
+  for (unsigned N = Exit; N-- > 0;) {
+    uint64_t Paths = 0;
+    for (unsigned E = EdgeStart[N]; E < Edges.size() && Edges[E].Src == N; E++) {
+      Edges[E].Val = Paths;
+      Paths += NumPaths[Edges[E].Dst];
+      if (Paths > MaxPaths)
+        return false;
+    }
+    NumPaths[N] = Paths;
+  }
+  FP->NumPaths = NumPaths[Root];
+
+  // Maximum spanning tree of the DAG plus the virtual EXIT -> ROOT edge,
+  // which is forced into the tree
+  std::vector<WeightedEdge> TreeEdges;
+  for (auto &E : Edges)
+    TreeEdges.push_back({E.Src, E.Dst, E.Weight});
+  TreeEdges.push_back({Exit, Root, UINT64_MAX});
+  std::vector<bool> InTree = findMaxSpanningTree(FP->Nodes.size(), TreeEdges);
+
+  // Potential of every node (computed modulo 2^64, only the sums along
+  // complete paths are meaningful)
+  std::vector<std::vector<unsigned>> TreeAdj(FP->Nodes.size());
+  for (unsigned E = 0; E < TreeEdges.size(); E++)
+    if (InTree[E]) {
+      TreeAdj[TreeEdges[E].Src].push_back(E);
+      TreeAdj[TreeEdges[E].Dst].push_back(E);
+    }
+  auto valOf = [&](unsigned E) { return E < Edges.size() ? Edges[E].Val : 0; };
+  std::vector<uint64_t> Phi(FP->Nodes.size(), 0);
+  std::vector<bool> Reached(FP->Nodes.size(), false);
+  std::vector<unsigned> Worklist = {Root};
+  Reached[Root] = true;
+  while (!Worklist.empty()) {
+    unsigned N = Worklist.back();
+    Worklist.pop_back();
+    for (unsigned E : TreeAdj[N]) {
+      bool Forward = TreeEdges[E].Src == N;
+      unsigned Other = Forward ? TreeEdges[E].Dst : TreeEdges[E].Src;
+      if (Reached[Other])
+        continue;
+      Reached[Other] = true;
+      Phi[Other] = Forward ? Phi[N] + valOf(E) : Phi[N] - valOf(E);
+      Worklist.push_back(Other);
+    }
+  }
+  for (auto &E : Edges)
+    E.Inc = E.Val + Phi[E.Src] - Phi[E.Dst];
+
+  // Path counter table
+  std::string Name = F.getName().str();
+  FP->TableSize = FP->NumPaths <= ArrayLimit ? FP->NumPaths : HashSize;
+  FP->Counters = Table.createCounters("LLVM_path_counters_" + Name, FP->TableSize);
+  if (FP->NumPaths > ArrayLimit) {
+    FP->Keys = createZeroTable(M, Type::getInt64Ty(M.getContext()),
+                               FP->TableSize, "LLVM_path_keys_" + Name);
+  }
+
+  errs() << "Paths in " << F.getName() << ": " << FP->NumPaths
+         << (FP->Keys ? " (hash table)" : "") << "\n";
+  // The paths of the callers, still in progress, cannot be counted
+  if (F.getName() != "main" && any_of(F, [](BasicBlock &BB) { return getNoReturnCall(BB); }))
+    errs() << "Warning: " << F.getName() << " calls a function that does not return: the paths "
+           << "its callers are executing when it does are not counted\n";
+  Functions.push_back(std::move(FP));
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Instrumentation
+//-----------------------------------------------------------------------------
+void PathProfiler::instrument() {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+
+  for (auto &FP : Functions) {
+    Function &F = *FP->F;
+
+    // Path register, promoted to SSA form once instrumentation is done
+    IRBuilder<> EntryBuilder(&*F.getEntryBlock().begin());
+    AllocaInst *PathReg = EntryBuilder.CreateAlloca(Int64Ty, nullptr, "path.reg");
+
+    auto countPath = [&](IRBuilder<> &Builder, uint64_t Inc) {
+      Value *PathID = Builder.CreateAdd(Builder.CreateLoad(Int64Ty, PathReg),
+                                        Builder.getInt64(Inc));
+      if (FP->Keys) {
+        Builder.CreateCall(getHashIncrementFunction(),
+                           {FP->Keys, FP->Counters,
+                            Builder.getInt64(FP->TableSize - 1), PathID});
+        return;
+      }
+      Value *Counter = Builder.CreateInBoundsGEP(Int64Ty, FP->Counters, PathID);
+      Value *Count = Builder.CreateLoad(Int64Ty, Counter);
+      Builder.CreateStore(Builder.CreateAdd(Builder.getInt64(1), Count), Counter);
+    };
+
+    DenseMap<BasicBlock *, uint64_t> HeaderInc;
+    for (auto &E : FP->Edges)
+      if (E.Kind == PathEdgeKind::BackedgeEntry)
+        HeaderInc[E.To] = E.Inc;
+
+    for (auto &E : FP->Edges) {
+      switch (E.Kind) {
+      case PathEdgeKind::FunctionEntry: {
+        IRBuilder<> Builder(PathReg->getNextNode());
+        Builder.CreateStore(Builder.getInt64(E.Inc), PathReg);
+        break;
+      }
+      case PathEdgeKind::Real: {
+        if (E.Inc == 0)
+          break;
+        IRBuilder<> Builder(getSiteInsertionPoint({E.From, E.To, true}));
+        Value *Reg = Builder.CreateLoad(Int64Ty, PathReg);
+        Builder.CreateStore(Builder.CreateAdd(Reg, Builder.getInt64(E.Inc)), PathReg);
+        break;
+      }
+      case PathEdgeKind::FunctionExit: {
+        // (before the call that does not return, if any: what follows never runs)
+        Instruction *Exit = getNoReturnCall(*E.From);
+        IRBuilder<> Builder(Exit ? Exit : E.From->getTerminator());
+        countPath(Builder, E.Inc);
+        break;
+      }
+      case PathEdgeKind::BackedgeExit: {
+        IRBuilder<> Builder(getSiteInsertionPoint({E.From, E.To, true}));
+        countPath(Builder, E.Inc);
+        Builder.CreateStore(Builder.getInt64(HeaderInc[E.To]), PathReg);
+        break;
+      }
+      case PathEdgeKind::BackedgeEntry:
+        break;
+      }
+    }
+
+    DominatorTree DT(F);
+    PromoteMemToReg({PathReg}, DT);
+  }
+}
+
+// Emits:
+//    void LLVM_path_hash_inc(i64 *keys, i32 *counters, i64 mask, i64 id)
+// which increments the counter of path `id` in an open addressing hash table
+// (linear probing). Executions of paths that do not fit in a full table are
+// counted in LLVM_path_lost.
+Function *PathProfiler::getHashIncrementFunction() {
+  if (Function *F = M.getFunction("LLVM_path_hash_inc"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionType *FTy =
+      FunctionType::get(Type::getVoidTy(CTX), {PtrTy, PtrTy, Int64Ty, Int64Ty}, false);
+  Function *F = Function::Create(FTy, GlobalValue::InternalLinkage,
+                                 "LLVM_path_hash_inc", M);
+  Value *Keys = F->getArg(0), *Counters = F->getArg(1), *Mask = F->getArg(2);
+  LostPaths = Table.createCounters("LLVM_path_lost");
+
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Probe = BasicBlock::Create(CTX, "probe", F);
+  BasicBlock *CheckEmpty = BasicBlock::Create(CTX, "check.empty", F);
+  BasicBlock *Next = BasicBlock::Create(CTX, "next", F);
+  BasicBlock *Claim = BasicBlock::Create(CTX, "claim", F);
+  BasicBlock *Found = BasicBlock::Create(CTX, "found", F);
+  BasicBlock *Full = BasicBlock::Create(CTX, "full", F);
+
+  IRBuilder<> Builder(Entry);
+  Value *Key = Builder.CreateAdd(F->getArg(3), Builder.getInt64(1));
+  Value *Hash = Builder.CreateLShr(
+      Builder.CreateMul(Key, Builder.getInt64(0x9E3779B97F4A7C15ULL)),
+      Builder.getInt64(32));
+  Builder.CreateBr(Probe);
+
+  // probe: slot = (hash + i) & mask
+  Builder.SetInsertPoint(Probe);
+  PHINode *I = Builder.CreatePHI(Int64Ty, 2, "i");
+  I->addIncoming(Builder.getInt64(0), Entry);
+  Value *Slot = Builder.CreateAnd(Builder.CreateAdd(Hash, I), Mask);
+  Value *KeyPtr = Builder.CreateInBoundsGEP(Int64Ty, Keys, Slot);
+  Value *SlotKey = Builder.CreateLoad(Int64Ty, KeyPtr);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(SlotKey, Key), Found, CheckEmpty);
+
+  Builder.SetInsertPoint(CheckEmpty);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(SlotKey, Builder.getInt64(0)), Claim, Next);
+
+  Builder.SetInsertPoint(Next);
+  Value *INext = Builder.CreateAdd(I, Builder.getInt64(1));
+  I->addIncoming(INext, Next);
+  Builder.CreateCondBr(Builder.CreateICmpUGT(INext, Mask), Full, Probe);
+
+  Builder.SetInsertPoint(Claim);
+  Builder.CreateStore(Key, KeyPtr);
+  Builder.CreateBr(Found);
+
+  Builder.SetInsertPoint(Found);
+  Value *CounterPtr = Builder.CreateInBoundsGEP(Int64Ty, Counters, Slot);
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(Int64Ty, CounterPtr), Builder.getInt64(1)),
+      CounterPtr);
+  Builder.CreateRetVoid();
+
+  Builder.SetInsertPoint(Full);
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(Int64Ty, LostPaths), Builder.getInt64(1)),
+      LostPaths);
+  Builder.CreateRetVoid();
+
+  return F;
+}
+
+//-----------------------------------------------------------------------------
+// Path decoding (end of the program)
+//-----------------------------------------------------------------------------
+// Decode tables of a function, bundled in a descriptor of type
+//    { i8 *name, i32 *edge_start, i64 *edge_val, i32 *edge_dst,
+//      i8 **block_names, i32 *block_histograms, i64 *block_sizes, i64 exit }
+// The outgoing edges of node n are edge_start[n] .. edge_start[n + 1] - 1,
+// sorted by value. block_histograms holds one row of opcode counts per node.
+GlobalVariable *PathProfiler::createDecodeTables(FunctionPaths &FP) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  std::string Name = FP.F->getName().str();
+
+  std::vector<Constant *> Start, Val, Dst, Names, Hist, Sizes;
+  unsigned E = 0;
+  for (unsigned N = 0; N < FP.Nodes.size(); N++) {
+    Start.push_back(ConstantInt::get(Int32Ty, E));
+    while (E < FP.Edges.size() && FP.Edges[E].Src == N) {
+      Val.push_back(ConstantInt::get(Int64Ty, FP.Edges[E].Val));
+      Dst.push_back(ConstantInt::get(Int32Ty, FP.Edges[E].Dst));
+      E++;
+    }
+
+    BasicBlock *BB = FP.Nodes[N];
+    uint64_t Size = 0;
+    for (auto &Opcode : Opcodes) {
+      uint64_t Count = 0;
+      if (BB)
+        Count = Histograms.find(BB)->second.lookup(Opcode);
+      Hist.push_back(ConstantInt::get(Int32Ty, Count));
+      Size += Count;
+    }
+    Sizes.push_back(ConstantInt::get(Int64Ty, Size));
+    if (!BB) {
+      Names.push_back(ConstantPointerNull::get(cast<PointerType>(PtrTy)));
+      continue;
+    }
+    std::string BlockName =
+        BB->hasName() ? BB->getName().str() : "bb" + std::to_string(N - 1);
+    Names.push_back(createStringConstant(M, BlockName));
+  }
+  Start.push_back(ConstantInt::get(Int32Ty, E));
+
+  StructType *DescTy = StructType::get(
+      CTX, {PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, Int64Ty});
+  Constant *Desc = ConstantStruct::get(
+      DescTy,
+      {createStringConstant(M, Name),
+       createConstantTable(M, Int32Ty, Start, "LLVM_path_edge_start_" + Name),
+       createConstantTable(M, Int64Ty, Val, "LLVM_path_edge_val_" + Name),
+       createConstantTable(M, Int32Ty, Dst, "LLVM_path_edge_dst_" + Name),
+       createConstantTable(M, PtrTy, Names, "LLVM_path_block_names_" + Name),
+       createConstantTable(M, Int32Ty, Hist, "LLVM_path_block_hist_" + Name),
+       createConstantTable(M, Int64Ty, Sizes, "LLVM_path_block_sizes_" + Name),
+       ConstantInt::get(Int64Ty, FP.exitNode())});
+  return new GlobalVariable(M, DescTy, /*isConstant=*/true,
+                            GlobalValue::PrivateLinkage, Desc,
+                            "LLVM_path_desc_" + Name);
+}
+
+// Emits:
+//    i64 LLVM_path_decode(desc *d, i64 id, i64 count, i1 print, i64 *totals)
+// which walks the DAG of the function described by `d` along path `id`,
+// adding `count` times the histogram of every block to `totals` (untouched
+// when `count` is 0) and printing the block names if `print` is set. Returns the number of
+// instructions of the path.
+Function *PathProfiler::getDecodeFunction() {
+  if (Function *F = M.getFunction("LLVM_path_decode"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  StructType *DescTy = StructType::get(
+      CTX, {PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, Int64Ty});
+  FunctionType *FTy = FunctionType::get(
+      Int64Ty, {PtrTy, Int64Ty, Int64Ty, Type::getInt1Ty(CTX), PtrTy}, false);
+  Function *F = Function::Create(FTy, GlobalValue::InternalLinkage,
+                                 "LLVM_path_decode", M);
+  Value *Desc = F->getArg(0), *Count = F->getArg(2), *Print = F->getArg(3);
+  Value *Totals = F->getArg(4);
+  FunctionCallee Printf = M.getOrInsertFunction(
+      "printf", FunctionType::get(Int32Ty, {PtrTy}, /*IsVarArgs=*/true));
+  Constant *BlockFmt = createStringConstant(M, " %s");
+
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+  BasicBlock *Scan = BasicBlock::Create(CTX, "scan", F);
+  BasicBlock *ScanNext = BasicBlock::Create(CTX, "scan.next", F);
+  BasicBlock *Found = BasicBlock::Create(CTX, "found", F);
+  BasicBlock *Visit = BasicBlock::Create(CTX, "visit", F);
+  BasicBlock *PrintBB = BasicBlock::Create(CTX, "print", F);
+  BasicBlock *Accumulate = BasicBlock::Create(CTX, "accumulate", F);
+  BasicBlock *OpcodeLoop = BasicBlock::Create(CTX, "opcode.loop", F);
+  BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+
+  IRBuilder<> Builder(Entry);
+  auto field = [&](unsigned Idx) {
+    return Builder.CreateLoad(Idx == 7 ? Int64Ty : PtrTy,
+                              Builder.CreateStructGEP(DescTy, Desc, Idx));
+  };
+  Value *EdgeStart = field(1), *EdgeVal = field(2), *EdgeDst = field(3);
+  Value *Names = field(4), *Hist = field(5), *Sizes = field(6), *Exit = field(7);
+  Builder.CreateBr(Loop);
+
+  // loop: while (node != exit)
+  Builder.SetInsertPoint(Loop);
+  PHINode *Node = Builder.CreatePHI(Int64Ty, 3, "node");
+  PHINode *Reg = Builder.CreatePHI(Int64Ty, 3, "reg");
+  PHINode *Cost = Builder.CreatePHI(Int64Ty, 3, "cost");
+  Node->addIncoming(Builder.getInt64(0), Entry);
+  Reg->addIncoming(F->getArg(1), Entry);
+  Cost->addIncoming(Builder.getInt64(0), Entry);
+  Value *First = Builder.CreateZExt(
+      Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(Int32Ty, EdgeStart, Node)),
+      Int64Ty);
+  Value *End = Builder.CreateZExt(
+      Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(
+                                      Int32Ty, EdgeStart,
+                                      Builder.CreateAdd(Node, Builder.getInt64(1)))),
+      Int64Ty);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Node, Exit), Done, Scan);
+
+  // scan: find the last outgoing edge whose value is <= reg
+  Builder.SetInsertPoint(Scan);
+  PHINode *Edge = Builder.CreatePHI(Int64Ty, 2, "edge");
+  Edge->addIncoming(First, Loop);
+  Value *NextEdge = Builder.CreateAdd(Edge, Builder.getInt64(1));
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextEdge, End), ScanNext, Found);
+
+  Builder.SetInsertPoint(ScanNext);
+  Value *NextVal = Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, EdgeVal, NextEdge));
+  Edge->addIncoming(NextEdge, ScanNext);
+  Builder.CreateCondBr(Builder.CreateICmpULE(NextVal, Reg), Scan, Found);
+
+  // found: follow the edge
+  Builder.SetInsertPoint(Found);
+  Value *Val = Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, EdgeVal, Edge));
+  Value *NewReg = Builder.CreateSub(Reg, Val);
+  Value *NewNode = Builder.CreateZExt(
+      Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(Int32Ty, EdgeDst, Edge)),
+      Int64Ty);
+  Node->addIncoming(NewNode, Found);
+  Reg->addIncoming(NewReg, Found);
+  Cost->addIncoming(Cost, Found);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NewNode, Exit), Loop, Visit);
+
+  // visit: account for the block
+  Builder.SetInsertPoint(Visit);
+  Value *NewCost = Builder.CreateAdd(
+      Cost, Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, Sizes, NewNode)));
+  Builder.CreateCondBr(Print, PrintBB, Accumulate);
+
+  Builder.SetInsertPoint(PrintBB);
+  Value *Name = Builder.CreateLoad(PtrTy, Builder.CreateInBoundsGEP(PtrTy, Names, NewNode));
+  Builder.CreateCall(Printf, {BlockFmt, Name});
+  Builder.CreateBr(Accumulate);
+
+  // accumulate: totals[op] += count * hist[node][op]
+  Builder.SetInsertPoint(Accumulate);
+  Node->addIncoming(NewNode, Accumulate);
+  Reg->addIncoming(NewReg, Accumulate);
+  Cost->addIncoming(NewCost, Accumulate);
+  Value *NumOpcodes = Builder.getInt64(Opcodes.size());
+  Value *Row = Builder.CreateMul(NewNode, NumOpcodes);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Count, Builder.getInt64(0)), Loop, OpcodeLoop);
+
+  Builder.SetInsertPoint(OpcodeLoop);
+  PHINode *Op = Builder.CreatePHI(Int64Ty, 2, "op");
+  Op->addIncoming(Builder.getInt64(0), Accumulate);
+  Value *N = Builder.CreateZExt(
+      Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(Int32Ty, Hist, Builder.CreateAdd(Row, Op))),
+      Int64Ty);
+  Value *TotalPtr = Builder.CreateInBoundsGEP(Int64Ty, Totals, Op);
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(Int64Ty, TotalPtr), Builder.CreateMul(N, Count)),
+      TotalPtr);
+  Value *NextOp = Builder.CreateAdd(Op, Builder.getInt64(1));
+  Op->addIncoming(NextOp, OpcodeLoop);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextOp, NumOpcodes), OpcodeLoop, Loop);
+  // The loop latch of opcode.loop also feeds `loop`
+  Node->addIncoming(NewNode, OpcodeLoop);
+  Reg->addIncoming(NewReg, OpcodeLoop);
+  Cost->addIncoming(NewCost, OpcodeLoop);
+
+  Builder.SetInsertPoint(Done);
+  Builder.CreateRet(Cost);
+  return F;
+}
+
+// Emits:
+//    i32 LLVM_path_record_cmp(record *a, record *b)
+// qsort comparator ordering path records by decreasing execution count.
+Function *PathProfiler::getRecordCompareFunction() {
+  if (Function *F = M.getFunction("LLVM_path_record_cmp"))
+    return F;
+
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionType *FTy = FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false);
+  Function *F = Function::Create(FTy, GlobalValue::InternalLinkage,
+                                 "LLVM_path_record_cmp", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Value *A = Builder.CreateLoad(Int64Ty, F->getArg(0));
+  Value *B = Builder.CreateLoad(Int64Ty, F->getArg(1));
+  Value *Greater = Builder.CreateZExt(Builder.CreateICmpUGT(B, A), Int32Ty);
+  Value *Less = Builder.CreateZExt(Builder.CreateICmpULT(B, A), Int32Ty);
+  Builder.CreateRet(Builder.CreateSub(Greater, Less));
+  return F;
+}
+
+void PathProfiler::emitPathDecoding(IRBuilder<> &Builder) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+
+  // Every executed path is stored in a record { i64 count, desc *d, i64 id }
+  StructType *RecordTy = StructType::get(CTX, {Int64Ty, PtrTy, Int64Ty});
+  uint64_t Capacity = 0;
+  for (auto &FP : Functions)
+    Capacity += FP->TableSize;
+  Records = createZeroTable(M, RecordTy, std::max<uint64_t>(Capacity, 1),
+                            "LLVM_path_records");
+  NumRecords = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                                  Builder.getInt64(0), "LLVM_path_num_records");
+  uint64_t NumOpcodes = std::max<size_t>(Opcodes.size(), 1);
+  OpcodeTotals = createZeroTable(M, Int64Ty, NumOpcodes, "LLVM_path_opcode_totals");
+  FunctionTotals = createZeroTable(M, ArrayType::get(Int64Ty, NumOpcodes),
+                                   std::max<size_t>(Functions.size(), 1),
+                                   "LLVM_path_function_totals");
+  Function *Decode = getDecodeFunction();
+
+  // Collect the records of every function
+  Function *Wrapper = Builder.GetInsertBlock()->getParent();
+  Value *Collected = Builder.getInt64(0);
+  for (unsigned FunctionIdx = 0; FunctionIdx < Functions.size(); FunctionIdx++) {
+    auto &FP = Functions[FunctionIdx];
+    FP->Totals = ConstantExpr::getInBoundsGetElementPtr(
+        FunctionTotals->getValueType(), FunctionTotals,
+        ArrayRef<Constant *>{Builder.getInt64(0), Builder.getInt64(FunctionIdx)});
+    GlobalVariable *Desc = createDecodeTables(*FP);
+    BasicBlock *Preheader = Builder.GetInsertBlock();
+    BasicBlock *Loop = BasicBlock::Create(CTX, "collect", Wrapper);
+    BasicBlock *Store = BasicBlock::Create(CTX, "collect.store", Wrapper);
+    BasicBlock *Latch = BasicBlock::Create(CTX, "collect.next", Wrapper);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "collect.end", Wrapper);
+    Builder.CreateBr(Loop);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *Slot = Builder.CreatePHI(Int64Ty, 2, "slot");
+    PHINode *Num = Builder.CreatePHI(Int64Ty, 2, "num");
+    Slot->addIncoming(Builder.getInt64(0), Preheader);
+    Num->addIncoming(Collected, Preheader);
+    Value *Count =
+        Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, FP->Counters, Slot));
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Count, Builder.getInt64(0)), Latch, Store);
+
+    Builder.SetInsertPoint(Store);
+    Value *PathID = Slot;
+    if (FP->Keys)
+      PathID = Builder.CreateSub(
+          Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(
+                                          FP->Keys->getValueType(), FP->Keys,
+                                          {Builder.getInt64(0), Slot})),
+          Builder.getInt64(1));
+    Value *Record = Builder.CreateInBoundsGEP(RecordTy, Records, Num);
+    Builder.CreateStore(Count, Builder.CreateStructGEP(RecordTy, Record, 0));
+    Builder.CreateStore(Desc, Builder.CreateStructGEP(RecordTy, Record, 1));
+    Builder.CreateStore(PathID, Builder.CreateStructGEP(RecordTy, Record, 2));
+    // Accumulate the opcodes of the path
+    Builder.CreateCall(Decode, {Desc, PathID, Count, Builder.getFalse(), FP->Totals});
+    Value *StoredNum = Builder.CreateAdd(Num, Builder.getInt64(1));
+    Builder.CreateBr(Latch);
+
+    Builder.SetInsertPoint(Latch);
+    PHINode *NewNum = Builder.CreatePHI(Int64Ty, 2, "num.next");
+    NewNum->addIncoming(Num, Loop);
+    NewNum->addIncoming(StoredNum, Store);
+    Value *NextSlot = Builder.CreateAdd(Slot, Builder.getInt64(1));
+    Slot->addIncoming(NextSlot, Latch);
+    Num->addIncoming(NewNum, Latch);
+    Builder.CreateCondBr(
+        Builder.CreateICmpULT(NextSlot, Builder.getInt64(FP->TableSize)), Loop, Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Collected = NewNum;
+  }
+  Builder.CreateStore(Collected, NumRecords);
+
+  // Sum the per-function totals into the module totals
+  BasicBlock *Preheader = Builder.GetInsertBlock();
+  BasicBlock *Loop = BasicBlock::Create(CTX, "sum", Wrapper);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "sum.end", Wrapper);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "idx");
+  Idx->addIncoming(Builder.getInt64(0), Preheader);
+  Value *Op = Builder.CreateURem(Idx, Builder.getInt64(NumOpcodes));
+  Value *TotalPtr = Builder.CreateInBoundsGEP(Int64Ty, OpcodeTotals, Op);
+  Value *Row = Builder.CreateLoad(
+      Int64Ty, Builder.CreateInBoundsGEP(Int64Ty, FunctionTotals, Idx));
+  Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, TotalPtr), Row),
+                      TotalPtr);
+  Value *NextIdx = Builder.CreateAdd(Idx, Builder.getInt64(1));
+  Idx->addIncoming(NextIdx, Loop);
+  uint64_t NumTotals = NumOpcodes * std::max<size_t>(Functions.size(), 1);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextIdx, Builder.getInt64(NumTotals)),
+                       Loop, Exit);
+  Builder.SetInsertPoint(Exit);
+}
+
+Constant *PathProfiler::getFunctionOpcodeTotal(Function &F, unsigned OpcodeIdx) {
+  for (auto &FP : Functions)
+    if (FP->F == &F)
+      return ConstantExpr::getInBoundsGetElementPtr(
+          Type::getInt64Ty(M.getContext()), FP->Totals,
+          ConstantInt::get(Type::getInt64Ty(M.getContext()), OpcodeIdx));
+  return nullptr;
+}
+
+Value *PathProfiler::emitOpcodeTotal(IRBuilder<> &Builder, unsigned OpcodeIdx) {
+  return Builder.CreateLoad(
+      Builder.getInt64Ty(),
+      Builder.CreateConstInBoundsGEP2_64(OpcodeTotals->getValueType(),
+                                         OpcodeTotals, 0, OpcodeIdx));
+}
+
+void PathProfiler::emitTopPaths(IRBuilder<> &Builder, FunctionCallee Printf,
+                                unsigned N) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  StructType *RecordTy = StructType::get(CTX, {Int64Ty, PtrTy, Int64Ty});
+  Function *Wrapper = Builder.GetInsertBlock()->getParent();
+
+  // Sort the records by decreasing execution count
+  FunctionCallee Qsort = M.getOrInsertFunction(
+      "qsort", FunctionType::get(Type::getVoidTy(CTX),
+                                 {PtrTy, Int64Ty, Int64Ty, PtrTy}, false));
+  Value *Num = Builder.CreateLoad(Int64Ty, NumRecords);
+  Builder.CreateCall(Qsort, {Records, Num,
+                             Builder.getInt64(M.getDataLayout().getTypeAllocSize(RecordTy)),
+                             getRecordCompareFunction()});
+
+  std::string Header = "";
+  Header += "-------------------------------------------------\n";
+  Header += "HOT PATHS (top " + std::to_string(N) + ")\n";
+  Header += "FUNCTION             #N CALLS   PATH       #INSTS     BLOCKS\n";
+  Header += "-------------------------------------------------\n";
+  Builder.CreateCall(Printf, {createStringConstant(M, Header)});
+
+  Value *Limit = Builder.CreateSelect(
+      Builder.CreateICmpULT(Num, Builder.getInt64(N)), Num,
+      Builder.getInt64(N));
+  BasicBlock *Preheader = Builder.GetInsertBlock();
+  BasicBlock *Loop = BasicBlock::Create(CTX, "top.paths", Wrapper);
+  BasicBlock *Body = BasicBlock::Create(CTX, "top.paths.print", Wrapper);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "top.paths.end", Wrapper);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *I = Builder.CreatePHI(Int64Ty, 2, "i");
+  I->addIncoming(Builder.getInt64(0), Preheader);
+  Builder.CreateCondBr(Builder.CreateICmpULT(I, Limit), Body, Exit);
+
+  Builder.SetInsertPoint(Body);
+  Value *Record = Builder.CreateInBoundsGEP(RecordTy, Records, I);
+  Value *Count = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RecordTy, Record, 0));
+  Value *Desc = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(RecordTy, Record, 1));
+  Value *PathID = Builder.CreateLoad(Int64Ty, Builder.CreateStructGEP(RecordTy, Record, 2));
+  Value *FnName = Builder.CreateLoad(PtrTy, Desc);
+  Function *Decode = getDecodeFunction();
+  Constant *NoTotals = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  Value *Cost = Builder.CreateCall(
+      Decode, {Desc, PathID, Builder.getInt64(0), Builder.getFalse(), NoTotals});
+  Builder.CreateCall(Printf, {createStringConstant(M, "%-20s %-10lu %-10lu %-10lu"),
+                              FnName, Count, PathID, Cost});
+  Builder.CreateCall(Decode, {Desc, PathID, Builder.getInt64(0), Builder.getTrue(), NoTotals});
+  Builder.CreateCall(Printf, {createStringConstant(M, "\n")});
+  I->addIncoming(Builder.CreateAdd(I, Builder.getInt64(1)), Body);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Exit);
+  if (!LostPaths)
+    return;
+  BasicBlock *Lost = BasicBlock::Create(CTX, "lost.paths", Wrapper);
+  BasicBlock *End = BasicBlock::Create(CTX, "lost.paths.end", Wrapper);
+  Value *NumLost = Builder.CreateLoad(Int64Ty, LostPaths);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NumLost, Builder.getInt64(0)), End, Lost);
+  Builder.SetInsertPoint(Lost);
+  Builder.CreateCall(Printf, {createStringConstant(M, "WARNING: %lu path executions not "
+                                                      "recorded (hash tables full)\n"),
+                              NumLost});
+  Builder.CreateBr(End);
+  Builder.SetInsertPoint(End);
+}
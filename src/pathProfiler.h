@@ -0,0 +1,96 @@
+//==============================================================================
+// FILE:
+//    pathProfiler.h
+//
+// DESCRIPTION:
+//    Declares the Ball-Larus path profiler used by the path counting mode of
+//    DynamicInstCounter.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_PATH_PROFILER_H
+#define LLVM_DYNIC_PATH_PROFILER_H
+
+#include "counterTable.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+} // namespace llvm
+
+class PathProfiler {
+public:
+  // Opcodes are the opcode names reported by the pass, in report order.
+  // Histograms is the static opcode histogram of every basic block.
+  // Path counters are allocated in Table. Functions with at most ArrayLimit
+  // paths get a dense path counter array, the others a hash table with
+  // HashSize slots.
+  PathProfiler(
+      llvm::Module &M, llvm::ArrayRef<std::string> Opcodes,
+      const llvm::MapVector<llvm::BasicBlock *, llvm::StringMap<uint64_t>>
+          &Histograms,
+      CounterTable &Table, uint64_t ArrayLimit, uint64_t HashSize);
+  ~PathProfiler();
+
+  // Numbers the acyclic paths of F and injects its path counter table.
+  // Returns false if F cannot be path profiled (EH pads, indirectbr, callbr,
+  // or too many paths to be numbered in 64 bits).
+  bool addFunction(llvm::Function &F, llvm::BlockFrequencyInfo &BFI,
+                   llvm::BranchProbabilityInfo &BPI);
+
+  // Injects the path register updates and the path counter increments in
+  // every function added so far.
+  void instrument();
+
+  // Emits, at the insertion point of Builder, the code that decodes every
+  // executed path and accumulates its instructions into per-opcode totals.
+  void emitPathDecoding(llvm::IRBuilder<> &Builder);
+
+  // Returns the total accumulated by emitPathDecoding for the opcode with
+  // index OpcodeIdx in Opcodes.
+  llvm::Value *emitOpcodeTotal(llvm::IRBuilder<> &Builder, unsigned OpcodeIdx);
+
+  // Returns a pointer to the total accumulated by emitPathDecoding for the
+  // opcode with index OpcodeIdx in F, or nullptr if F is not path profiled.
+  // Must be called after emitPathDecoding.
+  llvm::Constant *getFunctionOpcodeTotal(llvm::Function &F, unsigned OpcodeIdx);
+
+  // Prints the N hottest paths with their decoded block sequences. Must be
+  // emitted after emitPathDecoding, and run after the decoding code.
+  void emitTopPaths(llvm::IRBuilder<> &Builder, llvm::FunctionCallee Printf,
+                    unsigned N);
+
+private:
+  struct FunctionPaths;
+
+  llvm::Function *getHashIncrementFunction();
+  llvm::Function *getDecodeFunction();
+  llvm::Function *getRecordCompareFunction();
+  llvm::GlobalVariable *createDecodeTables(FunctionPaths &FP);
+
+  llvm::Module &M;
+  CounterTable &Table;
+  std::vector<std::string> Opcodes;
+  const llvm::MapVector<llvm::BasicBlock *, llvm::StringMap<uint64_t>>
+      &Histograms;
+  uint64_t ArrayLimit;
+  uint64_t HashSize;
+
+  std::vector<std::unique_ptr<FunctionPaths>> Functions;
+  llvm::GlobalVariable *LostPaths = nullptr;
+  llvm::GlobalVariable *OpcodeTotals = nullptr;
+  llvm::GlobalVariable *FunctionTotals = nullptr;
+  llvm::GlobalVariable *Records = nullptr;
+  llvm::GlobalVariable *NumRecords = nullptr;
+};
+
+#endif
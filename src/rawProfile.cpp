@@ -0,0 +1,337 @@
+//========================================================================
+// FILE:
+//    rawProfile.cpp
+//
+// DESCRIPTION:
+//    Raw profile output. Instead of evaluating and printing the reports,
+//    the instrumented program writes its counter table verbatim at exit,
+//    behind a 48-byte header, with one writev. Everything needed to read
+//    the table (opcode names, function names, what each counter counts and
+//    the weight of every counter in every opcode total) goes to a text
+//    manifest written by the pass, so the program carries no strings but
+//    the name of its profile, and dynic-read rebuilds the reports offline.
+//
+//    The manifest is hashed, and the hash is stored in the header of every
+//    raw profile, so that profiles of another build are rejected.
+//
+//    Continuous profiles are created at startup instead: the header takes the
+//    first page of the file (the page size is queried at runtime), and the
+//    rest is mapped (MAP_SHARED | MAP_FIXED) over the counter table, which is
+//    aligned and padded to 64K for this purpose (a multiple of the 4K, 16K
+//    and 64K pages of the usual targets). The instrumented code keeps updating the table as
+//    usual, and the kernel writes it back, so the profile survives crashes,
+//    kills and _exit, and exiting costs nothing.
+//
+//    Manifest format (one record per line, fields separated by tabs):
+//      dynic-manifest  <version>
+//      hash            <hash of the lines below, hexadecimal>
+//      module          <module identifier>
+//      counters        <number of counters>  <1 if sampled, else 0>
+//      opcode          <index>  <name>
+//      function        <index>  <name>
+//      counter         <slot>   <function index>  <kind>  <block>
+//      term            <slot>   <opcode index>    <weight>
+//
+// License: MIT
+//========================================================================
+#include "rawProfile.h"
+
+#include "counterTable.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+RawProfile::RawProfile(Module &M, StringRef Pattern, bool Continuous)
+    : M(M), Pattern(Pattern) {
+  // Largest page size of the usual configurations of every target (the
+  // runtime page size divides it)
+  if (Continuous)
+    PageSize = 65536;
+}
+
+void RawProfile::addCounter(GlobalVariable *Counter, Function &F, StringRef Kind,
+                            StringRef Block) {
+  auto Inserted = FunctionIdx.insert({&F, Functions.size()});
+  if (Inserted.second)
+    Functions.push_back(F.getName().str());
+  Counters[Counter] = {Counter->getName().str(), Inserted.first->second, Kind.str(),
+                       Block.str()};
+}
+
+void RawProfile::addTerm(Constant *Counter, unsigned OpcodeIdx, int64_t Weight) {
+  Terms[{Counter, OpcodeIdx}] += Weight;
+}
+
+bool RawProfile::writeManifest(StringRef Path, ArrayRef<std::string> Opcodes,
+                               const CounterTable &Table, uint64_t NumCounters,
+                               bool Sampled) {
+  // Counters in table order
+  std::vector<std::pair<uint64_t, const CounterInfo *>> Slots;
+  DenseMap<Constant *, uint64_t> SlotOf;
+  for (auto &Counter : Counters) {
+    uint64_t Slot = Table.getSlot(Counter.second.Name);
+    Slots.push_back({Slot, &Counter.second});
+    SlotOf[Counter.first] = Slot;
+  }
+  llvm::sort(Slots, [](auto &A, auto &B) { return A.first < B.first; });
+
+  std::string Body;
+  raw_string_ostream OS(Body);
+  OS << "module\t" << M.getModuleIdentifier() << "\n";
+  OS << "counters\t" << NumCounters << "\t" << (Sampled ? 1 : 0) << "\n";
+  for (unsigned Idx = 0; Idx < Opcodes.size(); Idx++)
+    OS << "opcode\t" << Idx << "\t" << Opcodes[Idx] << "\n";
+  for (unsigned Idx = 0; Idx < Functions.size(); Idx++)
+    OS << "function\t" << Idx << "\t" << Functions[Idx] << "\n";
+  for (auto &Slot : Slots)
+    OS << "counter\t" << Slot.first << "\t" << Slot.second->Function << "\t"
+       << Slot.second->Kind << "\t" << Slot.second->Block << "\n";
+  for (auto &Term : Terms)
+    if (Term.second != 0)
+      OS << "term\t" << SlotOf.lookup(Term.first.first) << "\t" << Term.first.second << "\t"
+         << Term.second << "\n";
+  OS.flush();
+  Hash = MD5Hash(Body);
+
+  std::error_code EC;
+  raw_fd_ostream File(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Cannot write the manifest " << Path << ": " << EC.message() << "\n";
+    return false;
+  }
+  File << "dynic-manifest\t" << Version << "\n";
+  File << "hash\t" << format_hex_no_prefix(Hash, 16) << "\n";
+  File << Body;
+  return true;
+}
+
+GlobalVariable *RawProfile::getHeader(uint64_t NumCounters) {
+  if (Header)
+    return Header;
+  // The sampling period is filled in at runtime; mapped continuous profiles
+  // move the counters to the first page boundary, so that they can be mapped
+  Type *Int64Ty = Type::getInt64Ty(M.getContext());
+  ArrayType *HeaderTy = ArrayType::get(Int64Ty, HeaderWords);
+  uint64_t Offset = HeaderWords * sizeof(uint64_t);
+  Header = new GlobalVariable(
+      M, HeaderTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantArray::get(HeaderTy, {ConstantInt::get(Int64Ty, Magic),
+                                    ConstantInt::get(Int64Ty, Version),
+                                    ConstantInt::get(Int64Ty, Hash),
+                                    ConstantInt::get(Int64Ty, NumCounters),
+                                    ConstantInt::get(Int64Ty, 1),
+                                    ConstantInt::get(Int64Ty, Offset)}),
+      "LLVM_raw_header");
+  Header->setAlignment(MaybeAlign(8));
+  return Header;
+}
+
+// The pattern becomes a format string: %p -> %d (getpid), %h -> %s
+// (gethostname), %m -> hash of the module name (at compile time), any other %
+// is literal
+Value *emitProfilePath(IRBuilder<> &Builder, StringRef Pattern) {
+  Module &M = *Builder.GetInsertBlock()->getModule();
+  Type *Int32Ty = Builder.getInt32Ty();
+  Type *Int64Ty = Builder.getInt64Ty();
+  Type *PtrTy = PointerType::getUnqual(Builder.getContext());
+  const unsigned PathSize = 4096, HostSize = 256;
+
+  std::string Format;
+  std::vector<char> Args;
+  for (size_t Idx = 0; Idx < Pattern.size(); Idx++) {
+    char C = Pattern[Idx];
+    char Next = Idx + 1 < Pattern.size() ? Pattern[Idx + 1] : 0;
+    if (C == '%' && (Next == 'p' || Next == 'h')) {
+      Format += Next == 'p' ? "%d" : "%s";
+      Args.push_back(Next);
+      Idx++;
+    } else if (C == '%' && Next == 'm') {
+      Format += utohexstr(MD5Hash(M.getModuleIdentifier()), /*LowerCase=*/true);
+      Idx++;
+    } else if (C == '%') {
+      Format += "%%";
+      Idx += Next == '%';
+    } else {
+      Format += C;
+    }
+  }
+
+  FunctionCallee Snprintf = M.getOrInsertFunction(
+      "snprintf", FunctionType::get(Int32Ty, {PtrTy, Int64Ty, PtrTy}, true));
+  FunctionCallee Getpid = M.getOrInsertFunction("getpid", FunctionType::get(Int32Ty, false));
+  FunctionCallee Gethostname = M.getOrInsertFunction(
+      "gethostname", FunctionType::get(Int32Ty, {PtrTy, Int64Ty}, false));
+
+  Value *Path = Builder.CreateAlloca(ArrayType::get(Builder.getInt8Ty(), PathSize), nullptr, "path");
+  std::vector<Value *> SnprintfArgs = {Path, Builder.getInt64(PathSize),
+                                       Builder.CreateGlobalStringPtr(Format, "LLVM_raw_pattern")};
+  Value *Host = nullptr;
+  if (llvm::is_contained(Args, 'h')) {
+    Host = Builder.CreateAlloca(ArrayType::get(Builder.getInt8Ty(), HostSize), nullptr, "host");
+    Builder.CreateStore(Builder.getInt8(0), Host);
+    Builder.CreateCall(Gethostname, {Host, Builder.getInt64(HostSize - 1)});
+    Builder.CreateStore(Builder.getInt8(0), Builder.CreateConstInBoundsGEP1_64(
+                                                Builder.getInt8Ty(), Host, HostSize - 1));
+  }
+  for (char Arg : Args)
+    SnprintfArgs.push_back(Arg == 'p' ? static_cast<Value *>(Builder.CreateCall(Getpid)) : Host);
+  Builder.CreateCall(Snprintf, SnprintfArgs);
+  return Path;
+}
+
+Function *RawProfile::createDumpFunction(GlobalVariable *Table, uint64_t NumCounters) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  getHeader(NumCounters);
+
+  FunctionCallee Creat =
+      M.getOrInsertFunction("creat", FunctionType::get(Int32Ty, {PtrTy, Int32Ty}, false));
+  FunctionCallee Writev = M.getOrInsertFunction(
+      "writev", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int32Ty}, false));
+  FunctionCallee Close = M.getOrInsertFunction("close", FunctionType::get(Int32Ty, {Int32Ty}, false));
+  FunctionCallee Perror = M.getOrInsertFunction("perror", FunctionType::get(VoidTy, {PtrTy}, false));
+
+  Function *F = Function::Create(FunctionType::get(VoidTy, {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_raw_dump", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Open = BasicBlock::Create(CTX, "open", F);
+  BasicBlock *Write = BasicBlock::Create(CTX, "write", F);
+  BasicBlock *Fail = BasicBlock::Create(CTX, "fail", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  StructType *IovecTy = StructType::get(PtrTy, Int64Ty);
+  ArrayType *IovTy = ArrayType::get(IovecTy, 2);
+  Value *Iov = Builder.CreateAlloca(IovTy, nullptr, "iov");
+  Value *Path = emitProfilePath(Builder, Pattern);
+  // A mapped continuous profile is already up to date
+  if (Mapped)
+    Builder.CreateCondBr(Builder.CreateLoad(Builder.getInt1Ty(), Mapped), Exit, Open);
+  else
+    Builder.CreateBr(Open);
+
+  Builder.SetInsertPoint(Open);
+  Builder.CreateStore(F->getArg(0), Builder.CreateConstInBoundsGEP2_64(
+                                        Header->getValueType(), Header, 0, 4));
+  // (the counters follow the header, even if a failed mapping moved them)
+  if (Mapped)
+    Builder.CreateStore(Builder.getInt64(HeaderWords * sizeof(uint64_t)),
+                        Builder.CreateConstInBoundsGEP2_64(Header->getValueType(), Header, 0, 5));
+  Value *Fd = Builder.CreateCall(Creat, {Path, Builder.getInt32(0644)});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Fd, Builder.getInt32(0)), Fail, Write);
+
+  Builder.SetInsertPoint(Fail);
+  Builder.CreateCall(Perror, {Path});
+  Builder.CreateBr(Exit);
+
+  // One write for the header and the table
+  Builder.SetInsertPoint(Write);
+  auto StoreIovec = [&](unsigned Idx, Value *Base, uint64_t Size) {
+    Builder.CreateStore(Base, Builder.CreateConstInBoundsGEP2_32(IovTy, Iov, 0, Idx));
+    Value *Len = Builder.CreateInBoundsGEP(IovTy, Iov, {Builder.getInt32(0), Builder.getInt32(Idx),
+                                                        Builder.getInt32(1)});
+    Builder.CreateStore(Builder.getInt64(Size), Len);
+  };
+  StoreIovec(0, Header, HeaderWords * sizeof(uint64_t));
+  if (Table)
+    StoreIovec(1, Table, NumCounters * sizeof(uint64_t));
+  Builder.CreateCall(Writev, {Fd, Iov, Builder.getInt32(Table ? 2 : 1)});
+  Builder.CreateCall(Close, {Fd});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+Function *RawProfile::createMapFunction(GlobalVariable *Table, uint64_t NumCounters) {
+  assert(PageSize && Table && "Only continuous profiles with counters are mapped");
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  getHeader(NumCounters);
+  uint64_t MapSize = M.getDataLayout().getTypeAllocSize(Table->getValueType());
+  Mapped = new GlobalVariable(M, Type::getInt1Ty(CTX), false, GlobalValue::InternalLinkage,
+                              ConstantInt::getFalse(CTX), "LLVM_raw_mapped");
+
+  // open(2) flags and _SC_PAGESIZE differ between the BSDs (including Darwin) and Linux
+  Triple TT(M.getTargetTriple());
+  bool BSD = TT.isOSDarwin() || TT.isOSFreeBSD() || TT.isOSNetBSD() || TT.isOSOpenBSD() ||
+             TT.isOSDragonFly();
+  const int ReadWrite = 02, Create = BSD ? 0x200 : 0100, Truncate = BSD ? 0x400 : 01000;
+  const int SCPageSize = TT.isOSDarwin()                          ? 29
+                         : TT.isOSFreeBSD() || TT.isOSDragonFly() ? 47
+                         : TT.isOSNetBSD() || TT.isOSOpenBSD()    ? 28
+                                                                  : 30;
+  const int ProtReadWrite = 0x3, MapSharedFixed = 0x01 | 0x10;
+  FunctionCallee Open =
+      M.getOrInsertFunction("open", FunctionType::get(Int32Ty, {PtrTy, Int32Ty}, true));
+  FunctionCallee Sysconf =
+      M.getOrInsertFunction("sysconf", FunctionType::get(Int64Ty, {Int32Ty}, false));
+  FunctionCallee Ftruncate = M.getOrInsertFunction(
+      "ftruncate", FunctionType::get(Int32Ty, {Int32Ty, Int64Ty}, false));
+  FunctionCallee Pwrite = M.getOrInsertFunction(
+      "pwrite", FunctionType::get(Int64Ty, {Int32Ty, PtrTy, Int64Ty, Int64Ty}, false));
+  FunctionCallee Mmap = M.getOrInsertFunction(
+      "mmap", FunctionType::get(PtrTy, {PtrTy, Int64Ty, Int32Ty, Int32Ty, Int32Ty, Int64Ty}, false));
+  FunctionCallee Close = M.getOrInsertFunction("close", FunctionType::get(Int32Ty, {Int32Ty}, false));
+  FunctionCallee Perror = M.getOrInsertFunction("perror", FunctionType::get(VoidTy, {PtrTy}, false));
+
+  Function *F = Function::Create(FunctionType::get(VoidTy, {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_raw_map", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Map = BasicBlock::Create(CTX, "map", F);
+  BasicBlock *Done = BasicBlock::Create(CTX, "done", F);
+  BasicBlock *Fail = BasicBlock::Create(CTX, "fail", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateStore(F->getArg(0), Builder.CreateConstInBoundsGEP2_64(
+                                        Header->getValueType(), Header, 0, 4));
+  Value *Path = emitProfilePath(Builder, Pattern);
+  Value *Fd = Builder.CreateCall(
+      Open, {Path, Builder.getInt32(ReadWrite | Create | Truncate), Builder.getInt32(0644)});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Fd, Builder.getInt32(0)), Fail, Map);
+
+  // Header page, then the counters counted so far (e.g. by constructors), then
+  // the mapping (which fails if the runtime page size does not divide the
+  // alignment of the table, in which case the profile is written at exit
+  // instead)
+  Builder.SetInsertPoint(Map);
+  Value *Page = Builder.CreateCall(Sysconf, {Builder.getInt32(SCPageSize)}, "page.size");
+  Builder.CreateStore(Page, Builder.CreateConstInBoundsGEP2_64(Header->getValueType(), Header,
+                                                               0, 5));
+  Builder.CreateCall(Ftruncate, {Fd, Builder.CreateAdd(Page, Builder.getInt64(MapSize))});
+  Builder.CreateCall(Pwrite, {Fd, Header, Builder.getInt64(HeaderWords * sizeof(uint64_t)),
+                              Builder.getInt64(0)});
+  Builder.CreateCall(Pwrite, {Fd, Table, Builder.getInt64(MapSize), Page});
+  Value *Addr = Builder.CreateCall(
+      Mmap, {Table, Builder.getInt64(MapSize), Builder.getInt32(ProtReadWrite),
+             Builder.getInt32(MapSharedFixed), Fd, Page});
+  Builder.CreateCall(Close, {Fd});
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Addr, Table), Done, Fail);
+
+  Builder.SetInsertPoint(Done);
+  Builder.CreateStore(Builder.getTrue(), Mapped);
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Fail);
+  Builder.CreateCall(Perror, {Path});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
@@ -0,0 +1,107 @@
+//==============================================================================
+// FILE:
+//    rawProfile.h
+//
+// DESCRIPTION:
+//    Declares the raw profile output of DynamicInstCounter: the counter table
+//    is dumped as is at the end of the program, and a manifest written at
+//    compile time maps every counter to its function, block and opcodes. In
+//    continuous mode, the profile file is mapped over the table instead.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_RAW_PROFILE_H
+#define LLVM_DYNIC_RAW_PROFILE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+#include <vector>
+
+class CounterTable;
+
+// Emits the expansion of the file name Pattern (%p: process ID, %h: host name,
+// %m: hash of the module name, %%: %) into a stack buffer at the insertion point of Builder, and returns
+// the buffer.
+llvm::Value *emitProfilePath(llvm::IRBuilder<> &Builder, llvm::StringRef Pattern);
+
+class RawProfile {
+public:
+  // Pattern is the name of the raw profile, where %p stands for the process
+  // ID, %h for the host name, %m for a hash of the module name (one profile
+  // per instrumented module) and %% for %. Continuous profiles are mapped
+  // onto the counter table at startup, so that they are kept up to date by
+  // the kernel even if the program never exits normally.
+  RawProfile(llvm::Module &M, llvm::StringRef Pattern, bool Continuous);
+
+  // Alignment the counter table must be laid out with, a multiple of the
+  // runtime page size (0 if the profile is not continuous)
+  uint64_t getPageSize() const { return PageSize; }
+
+  // Records the 64-bit counter Counter, incremented in F by the counter site
+  // of the given kind (inst, bb, edge or loop) located at Block.
+  void addCounter(llvm::GlobalVariable *Counter, llvm::Function &F,
+                  llvm::StringRef Kind, llvm::StringRef Block);
+
+  // Records that the executions of opcode OpcodeIdx include Weight times the
+  // value of Counter.
+  void addTerm(llvm::Constant *Counter, unsigned OpcodeIdx, int64_t Weight);
+
+  // Writes the manifest to Path, once the counters are laid out by Table in
+  // a table of NumCounters counters. Returns false if it cannot be written.
+  bool writeManifest(llvm::StringRef Path, llvm::ArrayRef<std::string> Opcodes,
+                     const CounterTable &Table, uint64_t NumCounters,
+                     bool Sampled);
+
+  // Creates `void LLVM_raw_dump(i64 period)`, which writes the raw profile:
+  // a header identifying the manifest and the sampling period, followed by
+  // the NumCounters counters of Table (nullptr if there are none), with a
+  // single system call. Continuous profiles are only written if they could
+  // not be mapped. Must run after writeManifest.
+  llvm::Function *createDumpFunction(llvm::GlobalVariable *Table,
+                                     uint64_t NumCounters);
+
+  // Creates `void LLVM_raw_map(i64 period)`, which creates the continuous
+  // profile, copies the counters of Table into it and maps it over them.
+  // Must run after writeManifest.
+  llvm::Function *createMapFunction(llvm::GlobalVariable *Table,
+                                    uint64_t NumCounters);
+
+  // Hash of the manifest, once written
+  uint64_t getHash() const { return Hash; }
+
+  // Raw profile header: magic, format version, manifest hash, number of
+  // counters, sampling period (1 if not sampled) and file offset of the
+  // counters, as 64-bit words. The manifest has the same format version.
+  static constexpr uint64_t Magic = 0x57415243494e5944; // "DYNICRAW"
+  static constexpr uint64_t Version = 2;
+  static constexpr unsigned HeaderWords = 6;
+
+private:
+  struct CounterInfo {
+    std::string Name;
+    unsigned Function;
+    std::string Kind;
+    std::string Block;
+  };
+
+  llvm::GlobalVariable *getHeader(uint64_t NumCounters);
+
+  llvm::Module &M;
+  std::string Pattern;
+  uint64_t PageSize = 0;
+  uint64_t Hash = 0;
+  llvm::GlobalVariable *Header = nullptr;
+  // Whether the continuous profile is mapped
+  llvm::GlobalVariable *Mapped = nullptr;
+  std::vector<std::string> Functions;
+  llvm::DenseMap<llvm::Function *, unsigned> FunctionIdx;
+  llvm::MapVector<llvm::Constant *, CounterInfo> Counters;
+  // (counter, opcode) -> weight
+  llvm::MapVector<std::pair<llvm::Constant *, unsigned>, int64_t> Terms;
+};
+
+#endif
@@ -0,0 +1,389 @@
+//========================================================================
+// FILE:
+//    regionProfiler.cpp
+//
+// DESCRIPTION:
+//    Region-of-interest runtime, emitted in the instrumented module (the
+//    module implementations of the API, called by the API for every
+//    instrumented module, see moduleRegistry.cpp):
+//      void dynic_roi_begin(const char *name);
+//      void dynic_roi_end(void);
+//    Regions nest: a region is identified by its name and by its parent,
+//    the region open when it begins. dynic_roi_begin pushes the region on a
+//    stack together with a snapshot of the opcode totals of the program, and
+//    dynic_roi_end pops it and adds the difference between the totals and
+//    the snapshot to the counts of the region. At the end of the program,
+//    every region is printed below its parent, with its number of
+//    executions and its per-opcode counts (inclusive of the regions nested
+//    in it).
+//
+//    Snapshots only hold the opcode totals (and the sums making up the
+//    variances of sampled estimates), so regions take (MaxRegions +
+//    MaxDepth) x 2 x #opcodes i64, whatever the size of the counter table.
+//    Computing the totals still reads every counter, weighted by the
+//    instructions of each opcode it accounts for: every dynic_roi_begin and
+//    dynic_roi_end costs about as much as a few instructions per
+//    instrumented block, so regions are meant to enclose coarse pieces of
+//    work (a request, a phase), not the body of a hot loop.
+//
+//    Region names must stay valid until the end of the program (e.g. string
+//    literals). The stack is shared by all threads: regions are meant to be
+//    opened and closed by one thread at a time, and the other threads only
+//    contribute the counts they already flushed (see threadSafeCounters.cpp).
+//
+// License: MIT
+//========================================================================
+#include "regionProfiler.h"
+
+using namespace llvm;
+
+bool RegionProfiler::isUsed(const Module &M) {
+  for (StringRef Name : {"dynic_roi_begin", "dynic_roi_end"})
+    if (const Function *F = M.getFunction(Name))
+      if (F->isDeclaration() && !F->use_empty())
+        return true;
+  return false;
+}
+
+// Creates the module implementation of the API function Name
+Function *RegionProfiler::defineApiFunction(StringRef Name, FunctionType *Ty) {
+  return Function::Create(Ty, GlobalValue::InternalLinkage, "LLVM_roi_" + Name, M);
+}
+
+// void LLVM_roi_print(i32 region, i32 depth): prints a region, then its children
+Function *RegionProfiler::createPrintRegionFunction(Function *PrintCounts) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int32Ty, Int32Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_roi_print", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", F);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "children", F);
+  BasicBlock *Child = BasicBlock::Create(CTX, "child", F);
+  BasicBlock *Next = BasicBlock::Create(CTX, "children.next", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", F);
+  Value *Region = F->getArg(0);
+  Value *Depth = F->getArg(1);
+  Value *Zero = ConstantInt::get(Int64Ty, 0);
+
+  IRBuilder<> Builder(Entry);
+  Value *RegionIdx = Builder.CreateZExt(Region, Int64Ty);
+  Value *Name =
+      Builder.CreateLoad(PtrTy, Builder.CreateInBoundsGEP(Names->getValueType(), Names,
+                                                          {Zero, RegionIdx}));
+  Value *Executions =
+      Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(Entries->getValueType(), Entries,
+                                                            {Zero, RegionIdx}));
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("%*s%s: %lu executions\n"),
+                              Builder.CreateShl(Depth, 1), Builder.CreateGlobalStringPtr(""),
+                              Name, Executions});
+  Builder.CreateCall(PrintCounts, {Builder.CreateInBoundsGEP(Counts->getValueType(), Counts,
+                                                             {Zero, RegionIdx})});
+  // Children are always recorded after their parent
+  Value *First = Builder.CreateAdd(Region, Builder.getInt32(1));
+  Value *Num = Builder.CreateLoad(Int32Ty, NumRegions);
+  Builder.CreateCondBr(Builder.CreateICmpULT(First, Num), Loop, Exit);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int32Ty, 2, "j");
+  Idx->addIncoming(First, Entry);
+  Value *Parent = Builder.CreateLoad(
+      Int32Ty, Builder.CreateInBoundsGEP(Parents->getValueType(), Parents,
+                                         {Zero, Builder.CreateZExt(Idx, Int64Ty)}));
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Parent, Region), Child, Next);
+
+  Builder.SetInsertPoint(Child);
+  Builder.CreateCall(F, {Idx, Builder.CreateAdd(Depth, Builder.getInt32(1))});
+  Builder.CreateBr(Next);
+
+  Builder.SetInsertPoint(Next);
+  Value *NextIdx = Builder.CreateAdd(Idx, Builder.getInt32(1));
+  Idx->addIncoming(NextIdx, Next);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextIdx, Num), Loop, Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
+
+Function *RegionProfiler::finalize(unsigned NumTotals, Function *Totals,
+                                   Function *PrintCounts, Function *Fold, Function *Enable) {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  ArrayType *CountsTy = ArrayType::get(Int64Ty, NumTotals);
+  Value *Zero = ConstantInt::get(Int64Ty, 0);
+  Constant *NullPtr = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+
+  auto createArray = [&](Type *ElementTy, unsigned Size, const Twine &Name) {
+    ArrayType *Ty = ArrayType::get(ElementTy, Size);
+    return new GlobalVariable(M, Ty, false, GlobalValue::InternalLinkage,
+                              Constant::getNullValue(Ty), Name);
+  };
+  Names = createArray(PtrTy, MaxRegions, "LLVM_roi_names");
+  Parents = createArray(Int32Ty, MaxRegions, "LLVM_roi_parents");
+  Entries = createArray(Int64Ty, MaxRegions, "LLVM_roi_entries");
+  Counts = createArray(CountsTy, MaxRegions, "LLVM_roi_counts");
+  NumRegions = new GlobalVariable(M, Int32Ty, false, GlobalValue::InternalLinkage,
+                                  ConstantInt::get(Int32Ty, 0), "LLVM_roi_num");
+  Lost = new GlobalVariable(M, Int64Ty, false, GlobalValue::InternalLinkage,
+                            ConstantInt::get(Int64Ty, 0), "LLVM_roi_lost");
+  // Stack of the open regions, with the totals when they began
+  GlobalVariable *Stack = createArray(Int32Ty, MaxDepth, "LLVM_roi_stack");
+  GlobalVariable *Snapshots = createArray(CountsTy, MaxDepth, "LLVM_roi_snapshots");
+  auto *Depth = new GlobalVariable(M, Int32Ty, false, GlobalValue::InternalLinkage,
+                                   ConstantInt::get(Int32Ty, 0), "LLVM_roi_depth");
+  FunctionCallee Strcmp =
+      M.getOrInsertFunction("strcmp", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false));
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+
+  // void dynic_roi_begin(const char *name)
+  // ----------------------------------------
+  Begin = defineApiFunction("begin", FunctionType::get(VoidTy, {PtrTy}, false));
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Begin);
+    BasicBlock *TooDeep = BasicBlock::Create(CTX, "too.deep", Begin);
+    BasicBlock *Lookup = BasicBlock::Create(CTX, "lookup", Begin);
+    BasicBlock *Find = BasicBlock::Create(CTX, "find", Begin);
+    BasicBlock *CompareName = BasicBlock::Create(CTX, "find.name", Begin);
+    BasicBlock *FindNext = BasicBlock::Create(CTX, "find.next", Begin);
+    BasicBlock *Create = BasicBlock::Create(CTX, "create", Begin);
+    BasicBlock *Full = BasicBlock::Create(CTX, "full", Begin);
+    BasicBlock *Record = BasicBlock::Create(CTX, "record", Begin);
+    BasicBlock *Push = BasicBlock::Create(CTX, "push", Begin);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", Begin);
+    Value *Name = Begin->getArg(0);
+
+    IRBuilder<> Builder(Entry);
+    if (Fold)
+      Builder.CreateCall(Fold, {NullPtr});
+    Value *Level = Builder.CreateLoad(Int32Ty, Depth);
+    Builder.CreateStore(Builder.CreateAdd(Level, Builder.getInt32(1)), Depth);
+    Builder.CreateCondBr(Builder.CreateICmpUGE(Level, Builder.getInt32(MaxDepth)), TooDeep,
+                         Lookup);
+
+    Builder.SetInsertPoint(TooDeep);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Lost), Builder.getInt64(1)),
+                        Lost);
+    Builder.CreateBr(Exit);
+
+    // Parent: the innermost open region (-1 at top level). The children of a
+    // region that was not recorded are not recorded either.
+    Builder.SetInsertPoint(Lookup);
+    Value *TopLevel = Builder.CreateICmpEQ(Level, Builder.getInt32(0));
+    Value *ParentSlot = Builder.CreateSelect(TopLevel, Builder.getInt32(0),
+                                             Builder.CreateSub(Level, Builder.getInt32(1)));
+    Value *StackParent = Builder.CreateLoad(
+        Int32Ty, Builder.CreateInBoundsGEP(Stack->getValueType(), Stack,
+                                           {Zero, Builder.CreateZExt(ParentSlot, Int64Ty)}));
+    Value *Parent = Builder.CreateSelect(TopLevel, Builder.getInt32(-1), StackParent);
+    Value *Num = Builder.CreateLoad(Int32Ty, NumRegions);
+    Value *Orphan = Builder.CreateICmpEQ(Parent, Builder.getInt32(-1));
+    Orphan = Builder.CreateAnd(Orphan, Builder.CreateNot(TopLevel));
+    BasicBlock *Search = BasicBlock::Create(CTX, "search", Begin, Find);
+    Builder.CreateCondBr(Orphan, Full, Search);
+    Builder.SetInsertPoint(Search);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Num, Builder.getInt32(0)), Create, Find);
+
+    Builder.SetInsertPoint(Find);
+    PHINode *Idx = Builder.CreatePHI(Int32Ty, 2, "i");
+    Idx->addIncoming(Builder.getInt32(0), Search);
+    Value *Idx64 = Builder.CreateZExt(Idx, Int64Ty);
+    Value *RegionParent = Builder.CreateLoad(
+        Int32Ty, Builder.CreateInBoundsGEP(Parents->getValueType(), Parents, {Zero, Idx64}));
+    Builder.CreateCondBr(Builder.CreateICmpEQ(RegionParent, Parent), CompareName, FindNext);
+
+    Builder.SetInsertPoint(CompareName);
+    Value *RegionName = Builder.CreateLoad(
+        PtrTy, Builder.CreateInBoundsGEP(Names->getValueType(), Names, {Zero, Idx64}));
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(Builder.CreateCall(Strcmp, {Name, RegionName}), Builder.getInt32(0)),
+        Push, FindNext);
+
+    Builder.SetInsertPoint(FindNext);
+    Value *NextIdx = Builder.CreateAdd(Idx, Builder.getInt32(1));
+    Idx->addIncoming(NextIdx, FindNext);
+    Builder.CreateCondBr(Builder.CreateICmpULT(NextIdx, Num), Find, Create);
+
+    Builder.SetInsertPoint(Create);
+    Builder.CreateCondBr(Builder.CreateICmpUGE(Num, Builder.getInt32(MaxRegions)), Full, Record);
+
+    Builder.SetInsertPoint(Full);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Lost), Builder.getInt64(1)),
+                        Lost);
+    Builder.CreateBr(Push);
+
+    Builder.SetInsertPoint(Record);
+    Value *Num64 = Builder.CreateZExt(Num, Int64Ty);
+    Builder.CreateStore(Name, Builder.CreateInBoundsGEP(Names->getValueType(), Names,
+                                                        {Zero, Num64}));
+    Builder.CreateStore(Parent, Builder.CreateInBoundsGEP(Parents->getValueType(), Parents,
+                                                          {Zero, Num64}));
+    Builder.CreateStore(Builder.CreateAdd(Num, Builder.getInt32(1)), NumRegions);
+    Builder.CreateBr(Push);
+
+    Builder.SetInsertPoint(Push);
+    PHINode *Region = Builder.CreatePHI(Int32Ty, 3, "region");
+    Region->addIncoming(Idx, CompareName);
+    Region->addIncoming(Builder.getInt32(-1), Full);
+    Region->addIncoming(Num, Record);
+    Value *Level64 = Builder.CreateZExt(Level, Int64Ty);
+    Builder.CreateStore(Region, Builder.CreateInBoundsGEP(Stack->getValueType(), Stack,
+                                                          {Zero, Level64}));
+    Builder.CreateCall(Totals, {Builder.CreateInBoundsGEP(Snapshots->getValueType(), Snapshots,
+                                                          {Zero, Level64})});
+    if (Enable) {
+      BasicBlock *TurnOn = BasicBlock::Create(CTX, "enable", Begin, Exit);
+      Builder.CreateCondBr(TopLevel, TurnOn, Exit);
+      Builder.SetInsertPoint(TurnOn);
+      Builder.CreateCall(Enable, {Builder.getInt32(1)});
+    }
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  // void dynic_roi_end(void)
+  // ----------------------------------------
+  End = defineApiFunction("end", FunctionType::get(VoidTy, false));
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "entry", End);
+    BasicBlock *Pop = BasicBlock::Create(CTX, "pop", End);
+    BasicBlock *Read = BasicBlock::Create(CTX, "read", End);
+    BasicBlock *Accumulate = BasicBlock::Create(CTX, "accumulate", End);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", End);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", End);
+
+    IRBuilder<> Builder(Entry);
+    Value *Current = Builder.CreateAlloca(CountsTy, nullptr, "totals");
+    if (Fold)
+      Builder.CreateCall(Fold, {NullPtr});
+    Value *Level = Builder.CreateLoad(Int32Ty, Depth);
+    // Unbalanced dynic_roi_end: ignored
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Level, Builder.getInt32(0)), Exit, Pop);
+
+    Builder.SetInsertPoint(Pop);
+    Value *NewLevel = Builder.CreateSub(Level, Builder.getInt32(1));
+    Builder.CreateStore(NewLevel, Depth);
+    Builder.CreateCondBr(Builder.CreateICmpUGE(NewLevel, Builder.getInt32(MaxDepth)), Exit, Read);
+
+    Builder.SetInsertPoint(Read);
+    Value *NewLevel64 = Builder.CreateZExt(NewLevel, Int64Ty);
+    Value *Region = Builder.CreateLoad(
+        Int32Ty, Builder.CreateInBoundsGEP(Stack->getValueType(), Stack, {Zero, NewLevel64}));
+    Builder.CreateCondBr(Builder.CreateICmpSLT(Region, Builder.getInt32(0)), Done, Accumulate);
+
+    // counts[region][k] += totals[k] - snapshot[k]
+    Builder.SetInsertPoint(Accumulate);
+    Value *Region64 = Builder.CreateZExt(Region, Int64Ty);
+    if (NumTotals) {
+      Builder.CreateCall(Totals, {Current});
+      BasicBlock *Loop = BasicBlock::Create(CTX, "accumulate.loop", End, Done);
+      BasicBlock *LoopExit = BasicBlock::Create(CTX, "accumulate.end", End, Done);
+      Builder.CreateBr(Loop);
+      Builder.SetInsertPoint(Loop);
+      PHINode *K = Builder.CreatePHI(Int64Ty, 2, "k");
+      K->addIncoming(Zero, Accumulate);
+      Value *Total =
+          Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(CountsTy, Current, {Zero, K}));
+      Value *Snapshot = Builder.CreateLoad(
+          Int64Ty, Builder.CreateInBoundsGEP(Snapshots->getValueType(), Snapshots,
+                                             {Zero, NewLevel64, K}));
+      Value *CountPtr =
+          Builder.CreateInBoundsGEP(Counts->getValueType(), Counts, {Zero, Region64, K});
+      Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Int64Ty, CountPtr),
+                                            Builder.CreateSub(Total, Snapshot)),
+                          CountPtr);
+      Value *NextK = Builder.CreateAdd(K, Builder.getInt64(1));
+      K->addIncoming(NextK, Loop);
+      Builder.CreateCondBr(Builder.CreateICmpULT(NextK, Builder.getInt64(NumTotals)), Loop,
+                           LoopExit);
+      Builder.SetInsertPoint(LoopExit);
+    }
+    Value *ExecutionsPtr =
+        Builder.CreateInBoundsGEP(Entries->getValueType(), Entries, {Zero, Region64});
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(Int64Ty, ExecutionsPtr), Builder.getInt64(1)),
+        ExecutionsPtr);
+    Builder.CreateBr(Done);
+
+    Builder.SetInsertPoint(Done);
+    if (Enable) {
+      BasicBlock *TurnOff = BasicBlock::Create(CTX, "disable", End, Exit);
+      Builder.CreateCondBr(Builder.CreateICmpEQ(NewLevel, Builder.getInt32(0)), TurnOff, Exit);
+      Builder.SetInsertPoint(TurnOff);
+      Builder.CreateCall(Enable, {Builder.getInt32(0)});
+    }
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  // void LLVM_roi_report(): prints the top-level regions (and their children)
+  // ----------------------------------------
+  Function *PrintRegion = createPrintRegionFunction(PrintCounts);
+  Function *Report = Function::Create(FunctionType::get(VoidTy, false),
+                                      GlobalValue::InternalLinkage, "LLVM_roi_report", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Report);
+  BasicBlock *Header = BasicBlock::Create(CTX, "header", Report);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "regions", Report);
+  BasicBlock *TopLevel = BasicBlock::Create(CTX, "top", Report);
+  BasicBlock *Next = BasicBlock::Create(CTX, "regions.next", Report);
+  BasicBlock *CheckLost = BasicBlock::Create(CTX, "lost", Report);
+  BasicBlock *PrintLost = BasicBlock::Create(CTX, "lost.print", Report);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", Report);
+
+  IRBuilder<> Builder(Entry);
+  Value *Num = Builder.CreateLoad(Int32Ty, NumRegions);
+  Value *NumLost = Builder.CreateLoad(Int64Ty, Lost);
+  Builder.CreateCondBr(Builder.CreateAnd(Builder.CreateICmpEQ(Num, Builder.getInt32(0)),
+                                         Builder.CreateICmpEQ(NumLost, Builder.getInt64(0))),
+                       Exit, Header);
+
+  Builder.SetInsertPoint(Header);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                 "-------------------------------------------------\n"
+                                 "REGIONS\n"
+                                 "-------------------------------------------------\n")});
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Num, Builder.getInt32(0)), CheckLost, Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int32Ty, 2, "i");
+  Idx->addIncoming(Builder.getInt32(0), Header);
+  Value *Parent = Builder.CreateLoad(
+      Int32Ty, Builder.CreateInBoundsGEP(Parents->getValueType(), Parents,
+                                         {Zero, Builder.CreateZExt(Idx, Int64Ty)}));
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Parent, Builder.getInt32(-1)), TopLevel, Next);
+
+  Builder.SetInsertPoint(TopLevel);
+  Builder.CreateCall(PrintRegion, {Idx, Builder.getInt32(0)});
+  Builder.CreateBr(Next);
+
+  Builder.SetInsertPoint(Next);
+  Value *NextIdx = Builder.CreateAdd(Idx, Builder.getInt32(1));
+  Idx->addIncoming(NextIdx, Next);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextIdx, Num), Loop, CheckLost);
+
+  Builder.SetInsertPoint(CheckLost);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(NumLost, Builder.getInt64(0)), Exit, PrintLost);
+
+  Builder.SetInsertPoint(PrintLost);
+  Builder.CreateCall(
+      Printf, {Builder.CreateGlobalStringPtr(
+                   "Region executions not recorded (more than %u regions or %u levels): %lu\n"),
+               Builder.getInt32(MaxRegions), Builder.getInt32(MaxDepth), NumLost});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return Report;
+}
@@ -0,0 +1,66 @@
+//==============================================================================
+// FILE:
+//    regionProfiler.h
+//
+// DESCRIPTION:
+//    Declares the region-of-interest runtime of DynamicInstCounter: the
+//    dynic_roi_begin / dynic_roi_end API and the per-region report.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_REGION_PROFILER_H
+#define LLVM_DYNIC_REGION_PROFILER_H
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+class RegionProfiler {
+public:
+  // Whether M calls dynic_roi_begin or dynic_roi_end
+  static bool isUsed(const llvm::Module &M);
+
+  // At most MaxRegions distinct regions are recorded, nested at most
+  // MaxDepth levels deep.
+  RegionProfiler(llvm::Module &M, unsigned MaxRegions, unsigned MaxDepth)
+      : M(M), MaxRegions(MaxRegions), MaxDepth(MaxDepth) {}
+
+  // Defines the module implementations of the API (see getBegin and
+  // getEnd) and returns the report function (`void ()`), which
+  // prints the counts of every region with PrintCounts (`void (ptr)`,
+  // printing an array of NumTotals i64). Totals (`void (ptr)`) stores the
+  // NumTotals current totals of the program in an array (the counts of a
+  // region are the differences of the totals when it ends and begins), Fold
+  // is the function folding the thread-local counters of the calling thread
+  // (nullptr if counters are shared), and Enable, if given, turns counting
+  // on (`void (i32)`) when the first region begins and off when the last one
+  // ends.
+  llvm::Function *finalize(unsigned NumTotals, llvm::Function *Totals,
+                           llvm::Function *PrintCounts, llvm::Function *Fold,
+                           llvm::Function *Enable);
+
+  // Implementations of dynic_roi_begin and dynic_roi_end (once finalized)
+  llvm::Function *getBegin() const { return Begin; }
+  llvm::Function *getEnd() const { return End; }
+
+private:
+  llvm::Function *defineApiFunction(llvm::StringRef Name,
+                                    llvm::FunctionType *Ty);
+  llvm::Function *createPrintRegionFunction(llvm::Function *PrintCounts);
+
+  llvm::Module &M;
+  unsigned MaxRegions;
+  unsigned MaxDepth;
+  llvm::Function *Begin = nullptr;
+  llvm::Function *End = nullptr;
+  // Region records: name, parent (-1 for top-level regions), number of
+  // executions, and counts accumulated over them
+  llvm::GlobalVariable *Names = nullptr;
+  llvm::GlobalVariable *Parents = nullptr;
+  llvm::GlobalVariable *Entries = nullptr;
+  llvm::GlobalVariable *Counts = nullptr;
+  llvm::GlobalVariable *NumRegions = nullptr;
+  // Regions not recorded (too many, or nested too deeply)
+  llvm::GlobalVariable *Lost = nullptr;
+};
+
+#endif
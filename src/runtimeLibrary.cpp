@@ -0,0 +1,156 @@
+//========================================================================
+// FILE:
+//    runtimeLibrary.cpp
+//
+// DESCRIPTION:
+//    Hand-over of the counters to libdynic_rt (-dynamic-ic-runtime). The
+//    module only carries its counter table and a constant description of it
+//    (struct dynic_rt_module, see dynicRuntime.h): opcode names, function
+//    names, the function of every counter and the weight of every counter in
+//    every opcode total, like the manifest of a raw profile. The library
+//    evaluates and writes the reports, so that no report code is generated.
+//
+//    The description is registered by the startup function (with the
+//    sampling period), and unregistered at exit (or when the library holding
+//    the module is unloaded), when the library reads the counters.
+//
+// License: MIT
+//========================================================================
+#include "runtimeLibrary.h"
+
+#include "counterTable.h"
+
+#include <tuple>
+
+using namespace llvm;
+
+void RuntimeLibrary::addCounter(GlobalVariable *Counter, Function &F) {
+  auto Inserted = FunctionIdx.insert({&F, Functions.size()});
+  if (Inserted.second)
+    Functions.push_back(F.getName().str());
+  Counters.push_back({Counter->getName().str(), Inserted.first->second});
+}
+
+void RuntimeLibrary::addTerm(Constant *Counter, unsigned OpcodeIdx, int64_t Weight) {
+  if (Weight == 0)
+    return;
+  const DataLayout &DL = M.getDataLayout();
+  APInt Offset(DL.getIndexTypeSizeInBits(Counter->getType()), 0);
+  auto *Placeholder = cast<GlobalVariable>(
+      Counter->stripAndAccumulateConstantOffsets(DL, Offset, /*AllowNonInbounds=*/true));
+  Terms.push_back({Placeholder->getName().str(), Offset.getZExtValue() / 8, OpcodeIdx, Weight});
+}
+
+void RuntimeLibrary::setToggleHooks(Function *Enable, Function *EnableByName) {
+  this->Enable = Enable;
+  this->EnableByName = EnableByName;
+}
+
+// Constant struct dynic_rt_module: created empty, filled in once the counters
+// are laid out
+GlobalVariable *RuntimeLibrary::getDescriptor() {
+  if (Descriptor)
+    return Descriptor;
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  StructType *DescriptorTy = StructType::get(
+      CTX, {Int64Ty, PtrTy, PtrTy, Int64Ty, Int64Ty, PtrTy, Int64Ty, PtrTy, Int64Ty, PtrTy, PtrTy,
+            Int64Ty, Int64Ty, PtrTy, PtrTy});
+  Descriptor = new GlobalVariable(M, DescriptorTy, /*isConstant=*/true,
+                                  GlobalValue::InternalLinkage,
+                                  Constant::getNullValue(DescriptorTy), "LLVM_rt_module");
+  Descriptor->setAlignment(Align(8));
+  return Descriptor;
+}
+
+void RuntimeLibrary::emitUnregister(IRBuilder<> &Builder) {
+  FunctionCallee Unregister = M.getOrInsertFunction(
+      "__dynic_rt_unregister",
+      FunctionType::get(Builder.getVoidTy(), {PointerType::getUnqual(M.getContext())}, false));
+  Builder.CreateCall(Unregister, {getDescriptor()});
+}
+
+Function *RuntimeLibrary::createRegisterFunction(const CounterTable &Layout,
+                                                 GlobalVariable *Table,
+                                                 uint64_t NumCounters,
+                                                 ArrayRef<std::string> Opcodes, bool Sampled,
+                                                 unsigned TopFunctions) {
+  auto &CTX = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Constant *NullPtr = ConstantPointerNull::get(cast<PointerType>(PtrTy));
+  auto createString = [&](StringRef Text, const Twine &Name) -> Constant * {
+    Constant *Init = ConstantDataArray::getString(CTX, Text);
+    auto *GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init,
+                                  Name);
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return GV;
+  };
+  auto createTable = [&](Type *ElemTy, ArrayRef<Constant *> Elems,
+                         const Twine &Name) -> Constant * {
+    if (Elems.empty())
+      return NullPtr;
+    ArrayType *Ty = ArrayType::get(ElemTy, Elems.size());
+    return new GlobalVariable(M, Ty, true, GlobalValue::PrivateLinkage,
+                              ConstantArray::get(Ty, Elems), Name);
+  };
+
+  // Names
+  std::vector<Constant *> OpcodeNames, FunctionNames;
+  for (const std::string &Opcode : Opcodes)
+    OpcodeNames.push_back(createString(Opcode, "LLVM_rt_opcode"));
+  for (const std::string &Function : Functions)
+    FunctionNames.push_back(createString(Function, "LLVM_rt_function"));
+
+  // Function of every counter, in table order
+  std::vector<uint32_t> CounterFunctions(NumCounters, UINT32_MAX);
+  for (auto &[Name, Function] : Counters)
+    CounterFunctions[Layout.getSlot(Name)] = Function;
+  Constant *CounterFunctionTable = NullPtr;
+  if (NumCounters) {
+    Constant *Init = ConstantDataArray::get(CTX, CounterFunctions);
+    CounterFunctionTable = new GlobalVariable(M, Init->getType(), true,
+                                              GlobalValue::PrivateLinkage, Init,
+                                              "LLVM_rt_counter_functions");
+  }
+
+  // Terms, in table order: { i64 slot, i64 opcode, i64 weight }
+  std::vector<std::tuple<uint64_t, unsigned, int64_t>> SortedTerms;
+  for (const PendingTerm &Pending : Terms)
+    SortedTerms.push_back(
+        {Layout.getSlot(Pending.Placeholder) + Pending.Offset, Pending.Opcode, Pending.Weight});
+  llvm::sort(SortedTerms);
+  StructType *TermTy = StructType::get(CTX, {Int64Ty, Int64Ty, Int64Ty});
+  std::vector<Constant *> TermInits;
+  for (auto &[Slot, Opcode, Weight] : SortedTerms)
+    TermInits.push_back(ConstantStruct::get(
+        TermTy, {ConstantInt::get(Int64Ty, Slot), ConstantInt::get(Int64Ty, Opcode),
+                 ConstantInt::get(Int64Ty, Weight)}));
+
+  GlobalVariable *Desc = getDescriptor();
+  auto *DescriptorTy = cast<StructType>(Desc->getValueType());
+  Desc->setInitializer(ConstantStruct::get(
+      DescriptorTy,
+      {ConstantInt::get(Int64Ty, Version), createString(M.getModuleIdentifier(), "LLVM_rt_name"),
+       Table ? static_cast<Constant *>(Table) : NullPtr,
+       ConstantInt::get(Int64Ty, NumCounters), ConstantInt::get(Int64Ty, OpcodeNames.size()),
+       createTable(PtrTy, OpcodeNames, "LLVM_rt_opcodes"),
+       ConstantInt::get(Int64Ty, TermInits.size()),
+       createTable(TermTy, TermInits, "LLVM_rt_terms"),
+       ConstantInt::get(Int64Ty, FunctionNames.size()),
+       createTable(PtrTy, FunctionNames, "LLVM_rt_functions"), CounterFunctionTable,
+       ConstantInt::get(Int64Ty, Sampled ? SampledFlag : 0),
+       ConstantInt::get(Int64Ty, TopFunctions), Enable ? static_cast<Constant *>(Enable) : NullPtr,
+       EnableByName ? static_cast<Constant *>(EnableByName) : NullPtr}));
+
+  // void LLVM_rt_register(i64 period) { __dynic_rt_register(&LLVM_rt_module, period); }
+  FunctionCallee Register = M.getOrInsertFunction(
+      "__dynic_rt_register", FunctionType::get(Type::getVoidTy(CTX), {PtrTy, Int64Ty}, false));
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_rt_register", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "entry", F));
+  Builder.CreateCall(Register, {Desc, F->getArg(0)});
+  Builder.CreateRetVoid();
+  return F;
+}
@@ -0,0 +1,81 @@
+//==============================================================================
+// FILE:
+//    runtimeLibrary.h
+//
+// DESCRIPTION:
+//    Declares the module description handed over to libdynic_rt (see
+//    dynicRuntime.h) by the programs instrumented with -dynamic-ic-runtime,
+//    instead of the reports generated in IR.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_RUNTIME_LIBRARY_H
+#define LLVM_DYNIC_RUNTIME_LIBRARY_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+#include <vector>
+
+class CounterTable;
+
+class RuntimeLibrary {
+public:
+  explicit RuntimeLibrary(llvm::Module &M) : M(M) {}
+
+  // Records that the 64-bit counter Counter is incremented in F.
+  void addCounter(llvm::GlobalVariable *Counter, llvm::Function &F);
+
+  // Records that the executions of opcode OpcodeIdx include Weight times the
+  // value of Counter.
+  void addTerm(llvm::Constant *Counter, unsigned OpcodeIdx, int64_t Weight);
+
+  // Implementations of dynic_enable and dynic_enable_function, called by the
+  // library for every registered module
+  void setToggleHooks(llvm::Function *Enable, llvm::Function *EnableByName);
+
+  // Emits, at the insertion point of Builder, the unregistration of the
+  // module, which hands its counters over to the library.
+  void emitUnregister(llvm::IRBuilder<> &Builder);
+
+  // Creates the description of the module, once the counters are laid out by
+  // Layout in Table (nullptr if there are none), with NumCounters counters,
+  // and `void LLVM_rt_register(i64 period)`, which registers it.
+  llvm::Function *createRegisterFunction(const CounterTable &Layout,
+                                         llvm::GlobalVariable *Table,
+                                         uint64_t NumCounters,
+                                         llvm::ArrayRef<std::string> Opcodes,
+                                         bool Sampled, unsigned TopFunctions);
+
+  // Description of the module (struct dynic_rt_module), filled in by
+  // createRegisterFunction
+  llvm::GlobalVariable *getDescriptor();
+
+  // Layout version of dynic_rt_module and its flags (must match
+  // dynicRuntime.h)
+  static constexpr uint64_t Version = 1;
+  static constexpr uint64_t SampledFlag = 1;
+
+private:
+  llvm::Module &M;
+  llvm::GlobalVariable *Descriptor = nullptr;
+  llvm::Function *Enable = nullptr;
+  llvm::Function *EnableByName = nullptr;
+  // Counters by placeholder name, with the index of their function
+  std::vector<std::pair<std::string, unsigned>> Counters;
+  std::vector<std::string> Functions;
+  llvm::DenseMap<llvm::Function *, unsigned> FunctionIdx;
+  // Terms by placeholder name and offset in the placeholder (in counters):
+  // the counters themselves are replaced by the layout
+  struct PendingTerm {
+    std::string Placeholder;
+    uint64_t Offset;
+    unsigned Opcode;
+    int64_t Weight;
+  };
+  std::vector<PendingTerm> Terms;
+};
+
+#endif
@@ -0,0 +1,42 @@
+//==============================================================================
+// FILE:
+//    samplingError.h
+//
+// DESCRIPTION:
+//    Error of the counts estimated with -dynamic-ic-sample-period, shared by
+//    the reports emitted by the pass, dynic-read and libdynic_rt.
+//
+//    Every increment of a counter happens with probability 1/P (P = mean
+//    period), so a counter c holds about 1/P of its value and P * c estimates
+//    it. An increment adding s contributes s^2 * (P - 1) to the variance of
+//    the estimate, which c * P * (P - 1) only accounts for when s is 1: the
+//    counters of the per-opcode totals are therefore never hoisted when
+//    sampling (see dynamicInstCounter.cpp). Byte counters, whose increments
+//    add access sizes, stay sampled: their estimates are unbiased, and no
+//    error is reported for them.
+//
+//    Standalone on purpose: it only depends on the standard library.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_SAMPLING_ERROR_H
+#define LLVM_DYNIC_SAMPLING_ERROR_H
+
+#include <cmath>
+#include <cstdint>
+
+// Quantile of the normal distribution of the 95% confidence intervals
+constexpr double SamplingConfidence = 1.96;
+
+// Variance of the estimate of Count (a counter incremented by 1) times Weight,
+// sampled with Period
+inline uint64_t getSamplingVariance(uint64_t Count, int64_t Weight, uint64_t Period) {
+  return Count * static_cast<uint64_t>(Weight * Weight) * Period * (Period - 1);
+}
+
+// Half-width of the 95% confidence interval of an estimate
+inline uint64_t getSamplingBound(uint64_t Variance) {
+  return static_cast<uint64_t>(std::sqrt(static_cast<double>(Variance)) * SamplingConfidence);
+}
+
+#endif
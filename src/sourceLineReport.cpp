@@ -0,0 +1,319 @@
+//========================================================================
+// FILE:
+//    sourceLineReport.cpp
+//
+// DESCRIPTION:
+//    Source-line report. Every instruction with a debug location is
+//    attributed to its file:line, and every call site of its inlined-at
+//    chain gets it as an inlined instruction. The counts of a line are
+//    rebuilt from the block counters, like the opcode totals: the static
+//    per-block line histograms are folded at compile time into one weight
+//    per (counter, line) pair, and no counter is added at runtime.
+//
+//    The line table is compact: one { line, flags } entry per distinct
+//    source line, sorted by file and line, and one entry per file pointing
+//    to its lines. At the end of the program, every file is listed like
+//    gcov does, with two columns: the instructions of the line itself, and
+//    the ones inlined from the calls it makes.
+//          -:        -:    0:Source:demo.c
+//          -:        -:    1:int square(int x) {
+//         20:        -:    2:  return x * x;
+//      #####:        -:    3:  puts("never");
+//         41:       20:    4:  return square(y) + 1;
+//    Lines without instructions are marked '-', lines whose instructions
+//    never ran '#####'. Files that cannot be opened only list their lines
+//    with instructions.
+//
+// License: MIT
+//========================================================================
+#include "sourceLineReport.h"
+#include "burstSampler.h"
+
+#include "llvm/ADT/SmallSet.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Path.h"
+
+using namespace llvm;
+
+// Static flags of a line: it has instructions, it has inlined instructions
+enum LineFlags { HasSelf = 1, HasInlined = 2 };
+
+unsigned SourceLineReport::getLine(const DILocation *Loc) {
+  SmallString<128> Path(Loc->getFilename());
+  if (!sys::path::is_absolute(Path) && !Loc->getDirectory().empty()) {
+    Path = Loc->getDirectory();
+    sys::path::append(Path, Loc->getFilename());
+  }
+  auto File = FileIdx.try_emplace(Path, Files.size());
+  if (File.second)
+    Files.push_back(Path.str().str());
+  auto Line = LineIdx.try_emplace({File.first->second, Loc->getLine()}, LineIdx.size());
+  return Line.first->second;
+}
+
+void SourceLineReport::addBlock(BasicBlock &BB, Constant *Counter, int64_t Weight) {
+  auto Histogram = Histograms.find(&BB);
+  if (Histogram == Histograms.end()) {
+    Histogram = Histograms.try_emplace(&BB).first;
+    for (Instruction &I : BB) {
+      StringRef DemotedOpcode;
+      if (isa<DbgInfoIntrinsic>(I) ||
+          (BurstSampler::isDemoted(I, DemotedOpcode) && DemotedOpcode.empty()))
+        continue;
+      const DILocation *Loc = I.getDebugLoc().get();
+      if (!Loc || !Loc->getLine())
+        continue;
+      Histogram->second[2 * getLine(Loc)]++;
+      // Every call site of the inlined-at chain (once, for recursive inlining)
+      SmallSet<unsigned, 4> Sites;
+      for (const DILocation *Site = Loc->getInlinedAt(); Site; Site = Site->getInlinedAt())
+        if (Site->getLine()) {
+          unsigned SiteLine = getLine(Site);
+          if (Sites.insert(SiteLine).second)
+            Histogram->second[2 * SiteLine + 1]++;
+        }
+    }
+  }
+  for (auto &Column : Histogram->second)
+    Terms[{Counter, Column.first}] += Weight * Column.second;
+}
+
+Function *SourceLineReport::createReportFunction() {
+  auto &CTX = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+
+  // Lines are renumbered in (file, line) order
+  std::vector<unsigned> Order(LineIdx.size());
+  std::vector<unsigned> Flags(LineIdx.size());
+  unsigned Position = 0;
+  for (auto &Line : LineIdx)
+    Order[Line.second] = Position++;
+  for (auto &Term : Terms)
+    if (Term.second)
+      Flags[Term.first.second / 2] |= Term.first.second % 2 ? HasInlined : HasSelf;
+
+  // Constant tables:
+  //   { ptr counter, i64 weight, i32 column } LLVM_lines_terms[]
+  //   { i32 line, i32 flags } LLVM_lines[]
+  //   { ptr path, i32 first line, i32 end line } LLVM_lines_files[]
+  StructType *TermTy = StructType::get(CTX, {PtrTy, Int64Ty, Int32Ty});
+  StructType *LineTy = StructType::get(CTX, {Int32Ty, Int32Ty});
+  StructType *FileTy = StructType::get(CTX, {PtrTy, Int32Ty, Int32Ty});
+  std::vector<Constant *> TermInits, LineInits, FileInits;
+  for (auto &Term : Terms) {
+    if (Term.second == 0)
+      continue;
+    unsigned Column = 2 * Order[Term.first.second / 2] + Term.first.second % 2;
+    TermInits.push_back(ConstantStruct::get(
+        TermTy, {Term.first.first, ConstantInt::get(Int64Ty, Term.second, /*IsSigned=*/true),
+                 ConstantInt::get(Int32Ty, Column)}));
+  }
+  Terms.clear();
+  std::vector<unsigned> FileFirst(Files.size(), 0), FileEnd(Files.size(), 0);
+  for (auto &Line : LineIdx) {
+    unsigned File = Line.first.first;
+    if (FileFirst[File] == FileEnd[File])
+      FileFirst[File] = LineInits.size();
+    LineInits.push_back(ConstantStruct::get(
+        LineTy, {ConstantInt::get(Int32Ty, Line.first.second),
+                 ConstantInt::get(Int32Ty, Flags[Line.second])}));
+    FileEnd[File] = LineInits.size();
+  }
+  for (unsigned File = 0; File < Files.size(); File++) {
+    Constant *Path = ConstantDataArray::getString(CTX, Files[File]);
+    auto *PathVar = new GlobalVariable(M, Path->getType(), true, GlobalValue::PrivateLinkage,
+                                       Path, "LLVM_lines_path");
+    PathVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    FileInits.push_back(ConstantStruct::get(
+        FileTy, {PathVar, ConstantInt::get(Int32Ty, FileFirst[File]),
+                 ConstantInt::get(Int32Ty, FileEnd[File])}));
+  }
+  auto createTable = [&](Type *ElemTy, ArrayRef<Constant *> Inits, const Twine &Name) {
+    ArrayType *Ty = ArrayType::get(ElemTy, Inits.size());
+    return new GlobalVariable(M, Ty, true, GlobalValue::InternalLinkage,
+                              ConstantArray::get(Ty, Inits), Name);
+  };
+  GlobalVariable *TermTable = createTable(TermTy, TermInits, "LLVM_lines_terms");
+  GlobalVariable *LineTable = createTable(LineTy, LineInits, "LLVM_lines");
+  GlobalVariable *FileTable = createTable(FileTy, FileInits, "LLVM_lines_files");
+  ArrayType *CountsTy = ArrayType::get(Int64Ty, std::max<size_t>(2 * LineInits.size(), 1));
+  auto *Counts = new GlobalVariable(M, CountsTy, false, GlobalValue::InternalLinkage,
+                                    Constant::getNullValue(CountsTy), "LLVM_lines_counts");
+
+  FunctionCallee Printf =
+      M.getOrInsertFunction("printf", FunctionType::get(Int32Ty, {PtrTy}, true));
+  FunctionCallee Fopen =
+      M.getOrInsertFunction("fopen", FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+  FunctionCallee Fclose =
+      M.getOrInsertFunction("fclose", FunctionType::get(Int32Ty, {PtrTy}, false));
+  FunctionCallee Getline = M.getOrInsertFunction(
+      "getline", FunctionType::get(Int64Ty, {PtrTy, PtrTy, PtrTy}, false));
+  FunctionCallee Free = M.getOrInsertFunction("free", FunctionType::get(VoidTy, {PtrTy}, false));
+
+  Function *F = Function::Create(FunctionType::get(VoidTy, {Int64Ty}, false),
+                                 GlobalValue::InternalLinkage, "LLVM_lines_report", M);
+  Value *Scale = F->getArg(0);
+  auto createBlock = [&](const Twine &Name) { return BasicBlock::Create(CTX, Name, F); };
+  BasicBlock *Entry = createBlock("entry");
+  BasicBlock *AddTerms = createBlock("terms");
+  BasicBlock *ListFiles = createBlock("files");
+  BasicBlock *OpenFile = createBlock("file");
+  BasicBlock *Read = createBlock("read");
+  BasicBlock *SourceLine = createBlock("read.line");
+  BasicBlock *Close = createBlock("read.close");
+  BasicBlock *Rest = createBlock("rest");
+  BasicBlock *RestLine = createBlock("rest.line");
+  BasicBlock *NextFile = createBlock("files.next");
+  BasicBlock *Exit = createBlock("exit");
+
+  IRBuilder<> Builder(Entry);
+  Value *Zero = Builder.getInt64(0);
+  AllocaInst *Idx = Builder.CreateAlloca(Int64Ty, nullptr, "idx");
+  AllocaInst *LineIdxVar = Builder.CreateAlloca(Int64Ty, nullptr, "line.idx");
+  AllocaInst *LineEnd = Builder.CreateAlloca(Int64Ty, nullptr, "line.end");
+  AllocaInst *LineNo = Builder.CreateAlloca(Int32Ty, nullptr, "line.no");
+  AllocaInst *Buffer = Builder.CreateAlloca(PtrTy, nullptr, "buffer");
+  AllocaInst *Capacity = Builder.CreateAlloca(Int64Ty, nullptr, "capacity");
+  Builder.CreateStore(Zero, Idx);
+  Builder.CreateBr(AddTerms);
+
+  auto loadField = [&](GlobalVariable *Table, Value *Index, unsigned Field, Type *Ty) {
+    return Builder.CreateLoad(Ty, Builder.CreateInBoundsGEP(Table->getValueType(), Table,
+                                                            {Zero, Index, Builder.getInt32(Field)}));
+  };
+  auto increment = [&](AllocaInst *Var) {
+    Value *Old = Builder.CreateLoad(Var->getAllocatedType(), Var);
+    Builder.CreateStore(Builder.CreateAdd(Old, ConstantInt::get(Old->getType(), 1)), Var);
+  };
+
+  // counts[column] += counter * weight, for every term
+  Builder.SetInsertPoint(AddTerms);
+  {
+    BasicBlock *Body = createBlock("terms.add");
+    Value *I = Builder.CreateLoad(Int64Ty, Idx);
+    Builder.CreateCondBr(Builder.CreateICmpULT(I, Builder.getInt64(TermInits.size())), Body,
+                         ListFiles);
+    Builder.SetInsertPoint(Body);
+    Value *Counter = Builder.CreateLoad(Int64Ty, loadField(TermTable, I, 0, PtrTy));
+    Value *Weight = loadField(TermTable, I, 1, Int64Ty);
+    Value *Column = Builder.CreateZExt(loadField(TermTable, I, 2, Int32Ty), Int64Ty);
+    Value *Ptr = Builder.CreateInBoundsGEP(CountsTy, Counts, {Zero, Column});
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Ptr), Builder.CreateMul(Counter, Weight)),
+        Ptr);
+    increment(Idx);
+    Builder.CreateBr(AddTerms);
+  }
+  Builder.SetInsertPoint(ListFiles);
+  Builder.CreateStore(Zero, Idx);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr(
+                                 "-------------------------------------------------\n"
+                                 "SOURCE LINES (instructions: own, inlined)\n"
+                                 "-------------------------------------------------\n")});
+  BasicBlock *FilesLoop = createBlock("files.loop");
+  Builder.CreateBr(FilesLoop);
+  Builder.SetInsertPoint(FilesLoop);
+  Value *FileI = Builder.CreateLoad(Int64Ty, Idx);
+  Builder.CreateCondBr(Builder.CreateICmpULT(FileI, Builder.getInt64(FileInits.size())), OpenFile,
+                       Exit);
+
+  // Prints the counts of line `line.idx` (both columns)
+  auto emitCounts = [&]() {
+    Value *L = Builder.CreateLoad(Int64Ty, LineIdxVar);
+    Value *LineFlags = loadField(LineTable, L, 1, Int32Ty);
+    for (unsigned Inlined = 0; Inlined < 2; Inlined++) {
+      Value *Count = Builder.CreateMul(
+          Builder.CreateLoad(Int64Ty, Builder.CreateInBoundsGEP(
+                                          CountsTy, Counts,
+                                          {Zero, Builder.CreateAdd(Builder.CreateShl(L, 1),
+                                                                   Builder.getInt64(Inlined))})),
+          Scale);
+      Value *Has = Builder.CreateICmpNE(
+          Builder.CreateAnd(LineFlags, Builder.getInt32(Inlined ? HasInlined : HasSelf)),
+          Builder.getInt32(0));
+      Value *Format = Builder.CreateSelect(
+          Has,
+          Builder.CreateSelect(Builder.CreateICmpEQ(Count, Zero),
+                               Builder.CreateGlobalStringPtr("    #####:"),
+                               Builder.CreateGlobalStringPtr("%9lu:")),
+          Builder.CreateGlobalStringPtr("        -:"));
+      Builder.CreateCall(Printf, {Format, Count});
+    }
+  };
+
+  Builder.SetInsertPoint(OpenFile);
+  Value *Path = loadField(FileTable, FileI, 0, PtrTy);
+  Builder.CreateStore(Builder.CreateZExt(loadField(FileTable, FileI, 1, Int32Ty), Int64Ty),
+                      LineIdxVar);
+  Builder.CreateStore(Builder.CreateZExt(loadField(FileTable, FileI, 2, Int32Ty), Int64Ty),
+                      LineEnd);
+  Builder.CreateStore(Builder.getInt32(1), LineNo);
+  Builder.CreateStore(ConstantPointerNull::get(cast<PointerType>(PtrTy)), Buffer);
+  Builder.CreateStore(Zero, Capacity);
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("        -:        -:    0:Source:%s\n"),
+                              Path});
+  Value *Stream = Builder.CreateCall(Fopen, {Path, Builder.CreateGlobalStringPtr("r")});
+  Builder.CreateCondBr(Builder.CreateIsNull(Stream), Rest, Read);
+
+  // Source lines, with the counts of the next line of the table when it is this one
+  Builder.SetInsertPoint(Read);
+  Value *Length = Builder.CreateCall(Getline, {Buffer, Capacity, Stream});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(Length, Zero), Close, SourceLine);
+
+  Builder.SetInsertPoint(SourceLine);
+  {
+    BasicBlock *Counted = createBlock("read.counted");
+    BasicBlock *NotCounted = createBlock("read.uncounted");
+    BasicBlock *Print = createBlock("read.print");
+    Value *L = Builder.CreateLoad(Int64Ty, LineIdxVar);
+    Value *No = Builder.CreateLoad(Int32Ty, LineNo);
+    Value *InTable = Builder.CreateICmpULT(L, Builder.CreateLoad(Int64Ty, LineEnd));
+    // (the line number is only read when in the table)
+    Value *SafeL = Builder.CreateSelect(InTable, L, Zero);
+    Value *Match = Builder.CreateAnd(
+        InTable, Builder.CreateICmpEQ(loadField(LineTable, SafeL, 0, Int32Ty), No));
+    Builder.CreateCondBr(Match, Counted, NotCounted);
+    Builder.SetInsertPoint(Counted);
+    emitCounts();
+    increment(LineIdxVar);
+    Builder.CreateBr(Print);
+    Builder.SetInsertPoint(NotCounted);
+    Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("        -:        -:")});
+    Builder.CreateBr(Print);
+    Builder.SetInsertPoint(Print);
+    Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("%5u:%s"), No,
+                                Builder.CreateLoad(PtrTy, Buffer)});
+    increment(LineNo);
+    Builder.CreateBr(Read);
+  }
+
+  Builder.SetInsertPoint(Close);
+  Builder.CreateCall(Fclose, {Stream});
+  Builder.CreateCall(Free, {Builder.CreateLoad(PtrTy, Buffer)});
+  Builder.CreateBr(Rest);
+
+  // Lines of the table past the end of the file (or of a file that cannot be read)
+  Builder.SetInsertPoint(Rest);
+  Value *RestL = Builder.CreateLoad(Int64Ty, LineIdxVar);
+  Builder.CreateCondBr(Builder.CreateICmpULT(RestL, Builder.CreateLoad(Int64Ty, LineEnd)),
+                       RestLine, NextFile);
+  Builder.SetInsertPoint(RestLine);
+  emitCounts();
+  Builder.CreateCall(Printf, {Builder.CreateGlobalStringPtr("%5u:<source not available>\n"),
+                              loadField(LineTable, RestL, 0, Int32Ty)});
+  increment(LineIdxVar);
+  Builder.CreateBr(Rest);
+
+  Builder.SetInsertPoint(NextFile);
+  increment(Idx);
+  Builder.CreateBr(FilesLoop);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  return F;
+}
@@ -0,0 +1,59 @@
+//==============================================================================
+// FILE:
+//    sourceLineReport.h
+//
+// DESCRIPTION:
+//    Declares the source-line report of DynamicInstCounter: a gcov-style
+//    listing of the source files with the dynamic instruction count of every
+//    line, built from the debug locations of the instructions.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_SOURCE_LINE_REPORT_H
+#define LLVM_DYNIC_SOURCE_LINE_REPORT_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Module.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class DILocation;
+} // namespace llvm
+
+class SourceLineReport {
+public:
+  explicit SourceLineReport(llvm::Module &M) : M(M) {}
+
+  // Records that the executions of BB include Weight times the value of the
+  // 64-bit counter Counter.
+  void addBlock(llvm::BasicBlock &BB, llvm::Constant *Counter, int64_t Weight);
+
+  // Number of distinct source lines found so far
+  size_t getNumLines() const { return LineIdx.size(); }
+
+  // Creates `void LLVM_lines_report(i64 scale)`, which prints the listing of
+  // every source file, its counts multiplied by scale.
+  llvm::Function *createReportFunction();
+
+private:
+  unsigned getLine(const llvm::DILocation *Loc);
+
+  llvm::Module &M;
+  // Source files, and (file, line) -> index of the line
+  std::vector<std::string> Files;
+  llvm::StringMap<unsigned> FileIdx;
+  std::map<std::pair<unsigned, unsigned>, unsigned> LineIdx;
+  // Static histogram of every block: (2 * line + inlined) -> instructions,
+  // where inlined is 1 for the call sites of inlined code
+  llvm::DenseMap<llvm::BasicBlock *, llvm::MapVector<unsigned, int64_t>>
+      Histograms;
+  // (counter, 2 * line + inlined) -> weight
+  llvm::MapVector<std::pair<llvm::Constant *, unsigned>, int64_t> Terms;
+};
+
+#endif
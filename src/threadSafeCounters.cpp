@@ -0,0 +1,214 @@
+//========================================================================
+// FILE:
+//    threadSafeCounters.cpp
+//
+// DESCRIPTION:
+//    Thread-safe counter updates.
+//
+//    Atomic mode turns every `load/add/store` increment into a relaxed
+//    `atomicrmw add`: no count is lost, but threads incrementing the same
+//    counters keep stealing each other's cache lines.
+//
+//    Thread-local mode keeps the counter table as the totals read by the
+//    report, and redirects the increments to a thread_local copy of the table,
+//    so that threads never share counter cache lines. Each copy is folded into
+//    the table:
+//      * at thread exit, through the destructor of a pthread key (created by
+//        a module constructor). The key is set by the thread the first time
+//        it runs the entry block of an instrumented function, since
+//        destructors only run for non-null values;
+//      * before the report, for the thread printing it (the destructors of
+//        the main thread do not run on exit);
+//      * by a module destructor, for the thread unloading the module, which
+//        then deletes the key: once the module is unloaded (dlclose), threads
+//        exiting later must not run a destructor that is no longer mapped.
+//    Counts of threads still running when the report is printed are lost.
+//    With -dynamic-ic-runtime, libdynic_rt owns these hooks: the first time a
+//    thread runs an instrumented function, it hands its copy over to the
+//    library (__dynic_rt_thread_counters), which folds it at the same points.
+//
+// License: MIT
+//========================================================================
+#include "threadSafeCounters.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// Atomic increments
+//-----------------------------------------------------------------------------
+void makeIncrementsAtomic(ArrayRef<GlobalVariable *> Counters) {
+  for (GlobalVariable *Counter : Counters) {
+    SmallVector<StoreInst *, 16> Stores;
+    for (User *U : Counter->users())
+      if (auto *Store = dyn_cast<StoreInst>(U))
+        if (Store->getPointerOperand() == Counter)
+          Stores.push_back(Store);
+
+    for (StoreInst *Store : Stores) {
+      auto *Add = dyn_cast<BinaryOperator>(Store->getValueOperand());
+      if (!Add || Add->getOpcode() != Instruction::Add)
+        continue;
+      auto *Load = dyn_cast<LoadInst>(Add->getOperand(1));
+      Value *Step = Add->getOperand(0);
+      if (!Load || Load->getPointerOperand() != Counter) {
+        Load = dyn_cast<LoadInst>(Add->getOperand(0));
+        Step = Add->getOperand(1);
+      }
+      if (!Load || Load->getPointerOperand() != Counter)
+        continue;
+
+      IRBuilder<> Builder(Store);
+      Builder.CreateAtomicRMW(AtomicRMWInst::Add, Counter, Step, MaybeAlign(),
+                              AtomicOrdering::Monotonic);
+      Store->eraseFromParent();
+      if (Add->use_empty())
+        Add->eraseFromParent();
+      if (Load->use_empty())
+        Load->eraseFromParent();
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Thread-local counters
+//-----------------------------------------------------------------------------
+Function *makeCountersThreadLocal(Module &M, GlobalVariable *Table,
+                                  ArrayRef<Function *> Functions,
+                                  GlobalVariable *RuntimeModule) {
+  auto &CTX = M.getContext();
+  Type *Int8Ty = Type::getInt8Ty(CTX);
+  Type *Int32Ty = Type::getInt32Ty(CTX);
+  Type *Int64Ty = Type::getInt64Ty(CTX);
+  Type *PtrTy = PointerType::getUnqual(CTX);
+  auto *TableTy = cast<ArrayType>(Table->getValueType());
+
+  // Shadow table: the counters of Functions point into it instead
+  auto *Shadow = new GlobalVariable(M, TableTy, false, GlobalValue::InternalLinkage,
+                                    Constant::getNullValue(TableTy), Table->getName() + ".tls",
+                                    nullptr, GlobalValue::GeneralDynamicTLSModel);
+  Shadow->setAlignment(Table->getAlign());
+  SmallPtrSet<Function *, 32> Instrumented(Functions.begin(), Functions.end());
+  auto isInstrumented = [&](User *U) {
+    auto *I = dyn_cast<Instruction>(U);
+    return I && Instrumented.count(I->getFunction());
+  };
+  SmallVector<User *, 32> TableUsers(Table->users());
+  for (User *U : TableUsers) {
+    if (isInstrumented(U)) {
+      U->replaceUsesOfWith(Table, Shadow);
+      continue;
+    }
+    auto *CE = dyn_cast<ConstantExpr>(U);
+    if (!CE)
+      continue;
+    SmallVector<Constant *, 4> Ops;
+    for (Value *Op : CE->operand_values())
+      Ops.push_back(cast<Constant>(Op));
+    Ops[0] = Shadow;
+    Constant *ShadowCE = CE->getWithOperands(Ops);
+    SmallVector<User *, 8> CEUsers(CE->users());
+    for (User *CEUser : CEUsers)
+      if (isInstrumented(CEUser))
+        CEUser->replaceUsesOfWith(CE, ShadowCE);
+  }
+
+  // Per-thread registration, at the end of the entry block of every instrumented function
+  // (splitting it earlier would move its allocas out of the entry block)
+  auto *Registered = new GlobalVariable(M, Int8Ty, false, GlobalValue::InternalLinkage,
+                                        ConstantInt::get(Int8Ty, 0), "LLVM_tls_registered",
+                                        nullptr, GlobalValue::GeneralDynamicTLSModel);
+  auto emitRegistration = [&](function_ref<void(IRBuilder<> &)> Register) {
+    for (Function *F : Functions) {
+      Instruction *InsertPt = F->getEntryBlock().getTerminator();
+      IRBuilder<> Builder(InsertPt);
+      Value *IsNew = Builder.CreateICmpEQ(Builder.CreateLoad(Int8Ty, Registered),
+                                          ConstantInt::get(Int8Ty, 0));
+      Builder.SetInsertPoint(SplitBlockAndInsertIfThen(IsNew, InsertPt, false));
+      Builder.CreateStore(ConstantInt::get(Int8Ty, 1), Registered);
+      Register(Builder);
+    }
+  };
+  if (RuntimeModule) {
+    FunctionCallee ThreadCounters = M.getOrInsertFunction(
+        "__dynic_rt_thread_counters",
+        FunctionType::get(Type::getVoidTy(CTX), {PtrTy, PtrTy}, false));
+    emitRegistration([&](IRBuilder<> &Builder) {
+      Builder.CreateCall(ThreadCounters, {RuntimeModule, Shadow});
+    });
+    return nullptr;
+  }
+
+  // Fold function (also the destructor of the pthread key)
+  Function *Fold = Function::Create(FunctionType::get(Type::getVoidTy(CTX), {PtrTy}, false),
+                                    GlobalValue::InternalLinkage, "LLVM_tls_fold", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "entry", Fold);
+  BasicBlock *Loop = BasicBlock::Create(CTX, "fold", Fold);
+  BasicBlock *Add = BasicBlock::Create(CTX, "fold.add", Fold);
+  BasicBlock *Latch = BasicBlock::Create(CTX, "fold.next", Fold);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "fold.end", Fold);
+  IRBuilder<> Builder(Entry);
+  Builder.CreateBr(Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Idx = Builder.CreatePHI(Int64Ty, 2, "idx");
+  Idx->addIncoming(Builder.getInt64(0), Entry);
+  Value *ShadowPtr = Builder.CreateInBoundsGEP(TableTy, Shadow, {Builder.getInt64(0), Idx});
+  Value *Count = Builder.CreateLoad(Int64Ty, ShadowPtr);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Count, Builder.getInt64(0)), Latch, Add);
+
+  Builder.SetInsertPoint(Add);
+  Builder.CreateAtomicRMW(AtomicRMWInst::Add,
+                          Builder.CreateInBoundsGEP(TableTy, Table, {Builder.getInt64(0), Idx}),
+                          Count, MaybeAlign(), AtomicOrdering::Monotonic);
+  Builder.CreateStore(Builder.getInt64(0), ShadowPtr);
+  Builder.CreateBr(Latch);
+
+  Builder.SetInsertPoint(Latch);
+  Value *NextIdx = Builder.CreateAdd(Idx, Builder.getInt64(1));
+  Idx->addIncoming(NextIdx, Latch);
+  Builder.CreateCondBr(
+      Builder.CreateICmpULT(NextIdx, Builder.getInt64(TableTy->getNumElements())), Loop, Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+
+  // pthread key, created by a module constructor and deleted by a module destructor
+  // (pthread_key_t is an unsigned long on Darwin, an unsigned int elsewhere)
+  Type *KeyTy = Triple(M.getTargetTriple()).isOSDarwin()
+                    ? Type::getIntNTy(CTX, M.getDataLayout().getPointerSizeInBits())
+                    : Int32Ty;
+  auto *Key = new GlobalVariable(M, KeyTy, false, GlobalValue::InternalLinkage,
+                                 ConstantInt::get(KeyTy, 0), "LLVM_tls_key");
+  FunctionCallee KeyCreate = M.getOrInsertFunction(
+      "pthread_key_create", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, false));
+  FunctionCallee KeyDelete = M.getOrInsertFunction(
+      "pthread_key_delete", FunctionType::get(Int32Ty, {KeyTy}, false));
+  FunctionCallee SetSpecific = M.getOrInsertFunction(
+      "pthread_setspecific", FunctionType::get(Int32Ty, {KeyTy, PtrTy}, false));
+  Function *Init = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                    GlobalValue::InternalLinkage, "LLVM_tls_init", M);
+  Builder.SetInsertPoint(BasicBlock::Create(CTX, "entry", Init));
+  Builder.CreateCall(KeyCreate, {Key, Fold});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Init, /*Priority=*/0);
+  Function *Fini = Function::Create(FunctionType::get(Type::getVoidTy(CTX), false),
+                                    GlobalValue::InternalLinkage, "LLVM_tls_fini", M);
+  Builder.SetInsertPoint(BasicBlock::Create(CTX, "entry", Fini));
+  Builder.CreateCall(Fold, {ConstantPointerNull::get(cast<PointerType>(PtrTy))});
+  Builder.CreateCall(KeyDelete, {Builder.CreateLoad(KeyTy, Key)});
+  Builder.CreateRetVoid();
+  appendToGlobalDtors(M, Fini, /*Priority=*/0);
+
+  // (the value of the key only has to be non-null)
+  emitRegistration([&](IRBuilder<> &Builder) {
+    Builder.CreateCall(SetSpecific, {Builder.CreateLoad(KeyTy, Key), Registered});
+  });
+  return Fold;
+}
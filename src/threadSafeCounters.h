@@ -0,0 +1,36 @@
+//==============================================================================
+// FILE:
+//    threadSafeCounters.h
+//
+// DESCRIPTION:
+//    Declares the rewrites that make the counter increments injected by
+//    DynamicInstCounter safe in multi-threaded programs.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_DYNIC_THREAD_SAFE_COUNTERS_H
+#define LLVM_DYNIC_THREAD_SAFE_COUNTERS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Module.h"
+
+// Rewrites every increment of Counters (`store (add Step, (load Counter)),
+// Counter`, in either operand order) into a relaxed `atomicrmw add`.
+void makeIncrementsAtomic(llvm::ArrayRef<llvm::GlobalVariable *> Counters);
+
+// Gives every thread its own copy of the counter table Table: the counter
+// updates of Functions are redirected to a thread-local copy, which is added
+// (atomically) to Table when the thread exits, or when the module is
+// unloaded. Every function in Functions registers the thread-exit hook of the
+// running thread at the end of its entry block, the first time it runs in
+// that thread. Returns a `void (ptr)` function that folds the shadows of the
+// calling thread into the counters, to be called before reading them.
+// With RuntimeModule (the dynic_rt_module describing Table), libdynic_rt
+// does the folding instead: the functions hand the copy of the running thread
+// over to it, and nullptr is returned.
+llvm::Function *
+makeCountersThreadLocal(llvm::Module &M, llvm::GlobalVariable *Table,
+                        llvm::ArrayRef<llvm::Function *> Functions,
+                        llvm::GlobalVariable *RuntimeModule = nullptr);
+
+#endif
@@ -0,0 +1,7 @@
+; Second module of twoModules.ll
+
+define i32 @triple(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
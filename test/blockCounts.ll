@@ -0,0 +1,50 @@
+; Counts of a loop with a branch and a call: 10 iterations, 5 of them taking
+; the odd branch. Counting blocks (bb) multiplies their counts by their
+; opcode histograms, and finds the counts of every instruction (inst), and so
+; does counting edges (edge).
+
+; RUN: -dynamic-ic-mode=inst
+; RUN: -dynamic-ic-mode=bb
+; RUN: -dynamic-ic-mode=edge
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 30
+; CHECK-DAG: and 10
+; CHECK-DAG: br 26
+; CHECK-DAG: icmp 20
+; CHECK-DAG: add 20
+; CHECK-DAG: ret 6
+; CHECK-DAG: call 5
+; CHECK-DAG: mul 5
+
+define i32 @odd(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %bit = and i32 %i, 1
+  %is.odd = icmp ne i32 %bit, 0
+  br i1 %is.odd, label %then, label %latch
+
+then:
+  %c = call i32 @odd(i32 %i)
+  br label %latch
+
+latch:
+  %v = phi i32 [ %c, %then ], [ %i, %loop ]
+  %sum.next = add i32 %sum, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 10
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
@@ -0,0 +1,51 @@
+; Counts of the program of blockCounts.ll with bursts of 1 check every other
+; check: every check (entries of main and odd, backedges of the loop) switches
+; between the clean and the instrumented copies, and a function keeps its copy
+; until its next check. The entry of main, iterations 0, 3, 4, 7 and 8 of its
+; loop (iterations 3 and 7 calling odd) and the calls of odd from iterations
+; 1, 5 and 9 are counted.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-burst-period=1 -dynamic-ic-burst-length=1
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-burst-period=1 -dynamic-ic-burst-length=1
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 15
+; CHECK-DAG: and 5
+; CHECK-DAG: br 13
+; CHECK-DAG: icmp 10
+; CHECK-DAG: add 10
+; CHECK-DAG: ret 3
+; CHECK-DAG: call 2
+; CHECK-DAG: mul 3
+
+define i32 @odd(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %bit = and i32 %i, 1
+  %is.odd = icmp ne i32 %bit, 0
+  br i1 %is.odd, label %then, label %latch
+
+then:
+  %c = call i32 @odd(i32 %i)
+  br label %latch
+
+latch:
+  %v = phi i32 [ %c, %then ], [ %i, %loop ]
+  %sum.next = add i32 %sum, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 10
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
@@ -0,0 +1,59 @@
+; Calling-context tree: leaf is called twice by left and once by right, 4
+; times each, and its counts are kept apart for each of its callers. Every
+; node shows its inclusive and exclusive instructions and its calls.
+
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-contexts
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-contexts
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-contexts
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 4
+; CHECK-DAG: br 5
+; CHECK-DAG: add 4
+; CHECK-DAG: icmp 4
+; CHECK-DAG: ret 21
+; CHECK-DAG: call 20
+; CHECK-DAG: mul 12
+; CHECK: CALLING CONTEXTS
+; CHECK: INCLUSIVE EXCLUSIVE #N CALLS CONTEXT
+; CHECK: -------------------------------------------------
+; CHECK: 70 26 1 main
+; CHECK: 28 12 4 left
+; CHECK: 16 16 8 leaf
+; CHECK: 16 8 4 right
+; CHECK: 8 8 4 leaf
+
+define i32 @leaf(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @left(i32 %x) {
+entry:
+  %a = call i32 @leaf(i32 %x)
+  %b = call i32 @leaf(i32 %a)
+  ret i32 %b
+}
+
+define i32 @right(i32 %x) {
+entry:
+  %a = call i32 @leaf(i32 %x)
+  ret i32 %a
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %l = call i32 @left(i32 %i)
+  %r = call i32 @right(i32 %i)
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, 4
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
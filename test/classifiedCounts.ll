@@ -0,0 +1,57 @@
+; Classified counts: 3 calls of a body with a <4 x float> multiply, a scalar
+; add and an intrinsic call. Rows split opcodes by type and calls by callee,
+; and the multiply weighs 4 lanes: 12 of the 44 operations (27.27%) are in
+; vector instructions.
+
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-classify
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-classify
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-classify
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: fmul <4 x float> 3
+; CHECK-DAG: fadd float 3
+; CHECK-DAG: extractelement float 3
+; CHECK-DAG: call float @llvm.fabs 3
+; CHECK-DAG: call float @body 3
+; CHECK-DAG: phi float 3
+; CHECK-DAG: phi i32 3
+; CHECK-DAG: add i32 3
+; CHECK-DAG: icmp i32 3
+; CHECK-DAG: br 4
+; CHECK-DAG: ret 4
+; CHECK: LANE-WEIGHTED OPERATIONS
+; CHECK-DAG: fmul <4 x float> 12 4
+; CHECK-DAG: fadd float 3 1
+; CHECK-DAG: extractelement float 3 1
+; CHECK-DAG: call float @llvm.fabs 3 1
+; CHECK-DAG: call float @body 3 1
+; CHECK-DAG: br 4 1
+; CHECK-DAG: ret 4 1
+; CHECK: TOTAL 44 27.27% in vector instructions
+
+declare float @llvm.fabs.f32(float)
+
+define float @body(<4 x float> %v, float %s) {
+entry:
+  %vm = fmul <4 x float> %v, %v
+  %e = extractelement <4 x float> %vm, i32 0
+  %a = call float @llvm.fabs.f32(float %e)
+  %r = fadd float %a, %s
+  ret float %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %acc = phi float [ 0.0, %entry ], [ %acc.next, %loop ]
+  %acc.next = call float @body(<4 x float> <float 1.0, float 2.0, float 3.0, float 4.0>, float %acc)
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 3
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
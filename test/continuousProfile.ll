@@ -0,0 +1,61 @@
+; Continuous raw profile: the counter table is padded to 64K and mapped over
+; the profile, after its header page, so the counts of the program of
+; blockCounts.ll reach the file although it ends with _exit, which skips the
+; destructors writing ordinary profiles.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-continuous -dynamic-ic-raw-profile=%t.raw -dynamic-ic-manifest=%t.manifest
+; POST: %dynic-read -counters %t.manifest %t.raw
+
+; CHECK-IR: @LLVM_counters = internal global [8192 x i64] zeroinitializer, section "dynic_counters", align 65536
+; CHECK-IR: call ptr @mmap(ptr @LLVM_counters, i64 65536,
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 30
+; CHECK-DAG: and 10
+; CHECK-DAG: br 26
+; CHECK-DAG: icmp 20
+; CHECK-DAG: add 20
+; CHECK-DAG: ret 5
+; CHECK-DAG: call 6
+; CHECK-DAG: unreachable 1
+; CHECK-DAG: mul 5
+; CHECK: COUNTERS
+; CHECK: 0 10 bb main loop
+; CHECK: 1 10 bb main latch
+; CHECK: 2 5 bb main then
+; CHECK: 3 5 bb odd entry
+; CHECK: 4 1 bb main entry
+; CHECK: 5 1 bb main exit
+
+define i32 @odd(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %bit = and i32 %i, 1
+  %is.odd = icmp ne i32 %bit, 0
+  br i1 %is.odd, label %then, label %latch
+
+then:
+  %c = call i32 @odd(i32 %i)
+  br label %latch
+
+latch:
+  %v = phi i32 [ %c, %then ], [ %i, %loop ]
+  %sum.next = add i32 %sum, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 10
+  br i1 %done, label %exit, label %loop
+
+exit:
+  call void @_exit(i32 0)
+  unreachable
+}
+declare void @_exit(i32)
@@ -0,0 +1,59 @@
+; On-demand reports: the program raises SIGUSR1 after work(5), which prints
+; the totals so far, and SIGUSR2 after work(3), which prints them and resets
+; the counters, so the report at exit only counts work(10) and the end of
+; main. Counting instructions (inst) counts the calls raising the signals.
+
+; REQUIRES: linux
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-control
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 10
+; CHECK-DAG: br 6
+; CHECK-DAG: add 10
+; CHECK-DAG: icmp 5
+; CHECK-DAG: ret 1
+; CHECK-DAG: call 2
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 16
+; CHECK-DAG: br 10
+; CHECK-DAG: add 16
+; CHECK-DAG: icmp 8
+; CHECK-DAG: ret 2
+; CHECK-DAG: call 4
+; CHECK: Counters reset
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 20
+; CHECK-DAG: br 11
+; CHECK-DAG: add 20
+; CHECK-DAG: icmp 10
+; CHECK-DAG: ret 2
+; CHECK-DAG: call 1
+
+define i32 @work(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %loop ]
+  %sum.next = add i32 %sum, %i
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %sum.next
+}
+
+define i32 @main() {
+entry:
+  %a = call i32 @work(i32 5)
+  %d = call i32 @raise(i32 10)
+  %b = call i32 @work(i32 3)
+  %r = call i32 @raise(i32 12)
+  %c = call i32 @work(i32 10)
+  ret i32 0
+}
+
+; SIGUSR1 and SIGUSR2 on Linux
+declare i32 @raise(i32)
@@ -0,0 +1,61 @@
+; Layout of the counter table: the 6 block counters of the program of
+; blockCounts.ll are 64-bit slots of LLVM_counters, in its own section and
+; aligned to a cache line, hottest first: the loop (slot 0, left out below
+; since its address may fold to the table itself), its latch (1) and the
+; branch calling odd (2), then the blocks running once, in the order of the
+; functions (3 to 5).
+
+; RUN: -dynamic-ic-mode=bb
+
+; CHECK-IR: @LLVM_counters = internal global [6 x i64] zeroinitializer, section "dynic_counters", align 64
+; CHECK-IR: define i32 @odd(
+; CHECK-IR: ptr @LLVM_counters, i64 0, i64 3)
+; CHECK-IR: define i32 @main(
+; CHECK-IR: ptr @LLVM_counters, i64 0, i64 4)
+; CHECK-IR: then:
+; CHECK-IR: ptr @LLVM_counters, i64 0, i64 2)
+; CHECK-IR: latch:
+; CHECK-IR: ptr @LLVM_counters, i64 0, i64 1)
+; CHECK-IR: exit:
+; CHECK-IR: ptr @LLVM_counters, i64 0, i64 5)
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 30
+; CHECK-DAG: and 10
+; CHECK-DAG: br 26
+; CHECK-DAG: icmp 20
+; CHECK-DAG: add 20
+; CHECK-DAG: ret 6
+; CHECK-DAG: call 5
+; CHECK-DAG: mul 5
+
+define i32 @odd(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %bit = and i32 %i, 1
+  %is.odd = icmp ne i32 %bit, 0
+  br i1 %is.odd, label %then, label %latch
+
+then:
+  %c = call i32 @odd(i32 %i)
+  br label %latch
+
+latch:
+  %v = phi i32 [ %c, %then ], [ %i, %loop ]
+  %sum.next = add i32 %sum, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 10
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
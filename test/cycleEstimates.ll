@@ -0,0 +1,40 @@
+; Estimated cycles in the cost model of skylake: the loop of main runs 8
+; times two adds (1 cycle of throughput and latency each), a compare (1 and
+; 1) and a branch (0 and 1), the other branch and the return cost 0 and 1.
+; Phis and truncations are free and do not show up.
+
+; REQUIRES: x86_64
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-cycles -dynamic-ic-cost-triple=x86_64-pc-linux-gnu -dynamic-ic-cost-cpu=skylake
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-cycles -dynamic-ic-cost-triple=x86_64-pc-linux-gnu -dynamic-ic-cost-cpu=skylake
+
+; CHECK: ESTIMATED CYCLES (x86_64-pc-linux-gnu, skylake)
+; CHECK: SCOPE THROUGHPUT LATENCY
+; CHECK: -------------------------------------------------
+; CHECK: main 24 34
+; CHECK: loop loop 24 32
+; CHECK: -------------------------------------------------
+; CHECK: INST THROUGHPUT LATENCY
+; CHECK: -------------------------------------------------
+; CHECK-DAG: br 0 9
+; CHECK-DAG: add 16 16
+; CHECK-DAG: icmp 8 8
+; CHECK-DAG: ret 0 1
+; CHECK: -------------------------------------------------
+; CHECK: TOTAL 24 34
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %s = phi i64 [ 0, %entry ], [ %s.next, %loop ]
+  %s.next = add i64 %s, %i
+  %next = add i64 %i, 1
+  %done = icmp eq i64 %next, 8
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %r = trunc i64 %s.next to i32
+  ret i32 0
+}
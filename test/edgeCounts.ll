@@ -0,0 +1,71 @@
+; Counts of nested loops, a switch and an early return, when the counters sit
+; on the edges of a spanning tree (edge): the counts of the other edges, and
+; of the blocks, are rebuilt from them at exit.
+;
+; classify(i) runs for i = 0..11: 4 times for each case of i % 3 (case 0
+; returns early). For each i, the inner loop runs i % 4 + 1 times.
+
+; RUN: -dynamic-ic-mode=inst
+; RUN: -dynamic-ic-mode=edge
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 50
+; CHECK-DAG: switch 12
+; CHECK-DAG: and 12
+; CHECK-DAG: br 63
+; CHECK-DAG: shl 4
+; CHECK-DAG: urem 12
+; CHECK-DAG: xor 4
+; CHECK-DAG: ret 13
+; CHECK-DAG: add 42
+; CHECK-DAG: call 12
+; CHECK-DAG: icmp 42
+
+define i32 @classify(i32 %i) {
+entry:
+  %r = urem i32 %i, 3
+  switch i32 %r, label %other [
+    i32 0, label %zero
+    i32 1, label %one
+  ]
+
+zero:
+  ret i32 0
+
+one:
+  %a = shl i32 %i, 1
+  br label %done
+
+other:
+  %b = xor i32 %i, 5
+  br label %done
+
+done:
+  %v = phi i32 [ %a, %one ], [ %b, %other ]
+  ret i32 %v
+}
+
+define i32 @main() {
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  %n = and i32 %i, 3
+  br label %inner
+
+inner:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %inner ]
+  %j.next = add i32 %j, 1
+  %inner.done = icmp ugt i32 %j.next, %n
+  br i1 %inner.done, label %outer.latch, label %inner
+
+outer.latch:
+  %c = call i32 @classify(i32 %i)
+  %i.next = add i32 %i, 1
+  %outer.done = icmp eq i32 %i.next, 12
+  br i1 %outer.done, label %exit, label %outer
+
+exit:
+  ret i32 0
+}
@@ -0,0 +1,74 @@
+; Per-function report of the program of edgeCounts.ll: the functions sorted
+; by executed instructions, with their share of the total and their opcodes.
+
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-top-functions=5
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-top-functions=5
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-top-functions=5
+
+; CHECK: FUNCTIONS (top 2 of 2)
+; CHECK: FUNCTION #N INSTS SHARE
+; CHECK: main 206 77.44%
+; CHECK-DAG: phi 42
+; CHECK-DAG: and 12
+; CHECK-DAG: br 55
+; CHECK-DAG: ret 1
+; CHECK-DAG: add 42
+; CHECK-DAG: call 12
+; CHECK-DAG: icmp 42
+; CHECK: classify 60 22.56%
+; CHECK-DAG: phi 8
+; CHECK-DAG: switch 12
+; CHECK-DAG: br 8
+; CHECK-DAG: shl 4
+; CHECK-DAG: urem 12
+; CHECK-DAG: xor 4
+; CHECK-DAG: ret 12
+
+define i32 @classify(i32 %i) {
+entry:
+  %r = urem i32 %i, 3
+  switch i32 %r, label %other [
+    i32 0, label %zero
+    i32 1, label %one
+  ]
+
+zero:
+  ret i32 0
+
+one:
+  %a = shl i32 %i, 1
+  br label %done
+
+other:
+  %b = xor i32 %i, 5
+  br label %done
+
+done:
+  %v = phi i32 [ %a, %one ], [ %b, %other ]
+  ret i32 %v
+}
+
+define i32 @main() {
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  %n = and i32 %i, 3
+  br label %inner
+
+inner:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %inner ]
+  %j.next = add i32 %j, 1
+  %inner.done = icmp ugt i32 %j.next, %n
+  br i1 %inner.done, label %outer.latch, label %inner
+
+outer.latch:
+  %c = call i32 @classify(i32 %i)
+  %i.next = add i32 %i, 1
+  %outer.done = icmp eq i32 %i.next, 12
+  br i1 %outer.done, label %exit, label %outer
+
+exit:
+  ret i32 0
+}
@@ -0,0 +1,48 @@
+; Counts of a loop whose trip count ScalarEvolution knows on entry: its
+; counter is incremented once in the preheader, by the trip count, instead of
+; once per iteration. sum(n) runs its loop n times, for n = 7, 0 and 100.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-hoist-loops
+
+; CHECK-OPT: Counters injected: 6 (6 basic blocks, 1 hoisted loops, 0 counters shared by control equivalent blocks)
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 217
+; CHECK-DAG: br 114
+; CHECK-DAG: icmp 110
+; CHECK-DAG: add 214
+; CHECK-DAG: ret 4
+; CHECK-DAG: call 3
+; CHECK-DAG: mul 107
+
+define i32 @sum(i32 %n) {
+entry:
+  %empty = icmp eq i32 %n, 0
+  br i1 %empty, label %exit, label %preheader
+
+preheader:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %preheader ], [ %i.next, %loop ]
+  %s = phi i32 [ 0, %preheader ], [ %s.next, %loop ]
+  %sq = mul i32 %i, %i
+  %s.next = add i32 %s, %sq
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %loop.exit, label %loop
+
+loop.exit:
+  br label %exit
+
+exit:
+  %r = phi i32 [ 0, %entry ], [ %s.next, %loop.exit ]
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  %a = call i32 @sum(i32 7)
+  %b = call i32 @sum(i32 0)
+  %c = call i32 @sum(i32 100)
+  ret i32 0
+}
@@ -0,0 +1,59 @@
+; Memory traffic: fill stores 8 i64 (64 bytes) in its loop, and the loop of
+; main loads them back along with one byte of each (8 * (8 + 1) = 72 bytes).
+; Bytes add up by function, and by loop under it.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-memory
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-memory
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: load 16
+; CHECK-DAG: store 8
+; CHECK: MEMORY TRAFFIC (bytes)
+; CHECK: SCOPE READ WRITTEN
+; CHECK: -------------------------------------------------
+; CHECK: fill 0 64
+; CHECK: loop loop 0 64
+; CHECK: main 72 0
+; CHECK: loop loop 72 0
+; CHECK: -------------------------------------------------
+; CHECK: TOTAL 72 64
+
+@buf = global [8 x i64] zeroinitializer
+
+define void @fill(i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %p = getelementptr [8 x i64], ptr @buf, i64 0, i64 %i
+  store i64 %i, ptr %p
+  %next = add i64 %i, 1
+  %done = icmp eq i64 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+define i32 @main() {
+entry:
+  call void @fill(i64 8)
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %sum = phi i64 [ 0, %entry ], [ %sum.next, %loop ]
+  %p = getelementptr [8 x i64], ptr @buf, i64 0, i64 %i
+  %v = load i64, ptr %p
+  %b = load i8, ptr %p
+  %b.ext = zext i8 %b to i64
+  %s1 = add i64 %sum, %v
+  %sum.next = add i64 %s1, %b.ext
+  %next = add i64 %i, 1
+  %done = icmp eq i64 %next, 8
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
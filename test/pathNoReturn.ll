@@ -0,0 +1,58 @@
+; Paths ending at a call that does not return: check(9) leaves through longjmp
+; back to main, and its path (entry leave) is counted right before the call.
+; The path main was executing (the 10th iteration of its loop) is lost, which
+; the pass warns about, and main then returns through its entry block again.
+
+; RUN: -dynamic-ic-mode=path
+
+; CHECK-OPT: Warning: check calls a function that does not return: the paths its callers are executing when it does are not counted
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 9
+; CHECK-DAG: br 21
+; CHECK-DAG: icmp 12
+; CHECK-DAG: unreachable 1
+; CHECK-DAG: ret 10
+; CHECK-DAG: call 12
+; CHECK-DAG: add 9
+; CHECK: HOT PATHS (top 10)
+; CHECK: FUNCTION #N CALLS PATH #INSTS BLOCKS
+; CHECK: -------------------------------------------------
+; CHECK: check 9 1 3 entry ok
+; CHECK: main 8 2 4 loop
+; CHECK-DAG: check 1 0 4 entry leave
+; CHECK-DAG: main 1 0 4 entry done
+; CHECK-DAG: main 1 1 7 entry loop
+
+@env = global [64 x i64] zeroinitializer
+
+declare i32 @setjmp(ptr) returns_twice
+declare void @longjmp(ptr, i32) noreturn
+
+define void @check(i32 %i) {
+entry:
+  %last = icmp eq i32 %i, 9
+  br i1 %last, label %leave, label %ok
+
+leave:
+  call void @longjmp(ptr @env, i32 1)
+  unreachable
+
+ok:
+  ret void
+}
+
+define i32 @main() {
+entry:
+  %jumped = call i32 @setjmp(ptr @env) returns_twice
+  %back = icmp ne i32 %jumped, 0
+  br i1 %back, label %done, label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  call void @check(i32 %i)
+  %next = add i32 %i, 1
+  br label %loop
+
+done:
+  ret i32 0
+}
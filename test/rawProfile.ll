@@ -0,0 +1,64 @@
+; Raw profile of the program of blockCounts.ll: the program prints nothing
+; and writes its counter table, and dynic-read finds the counts of
+; blockCounts.ll from the table and the manifest, and adds up the counts of
+; several profiles of the same build (here the same profile twice).
+
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-raw-profile=%t.raw -dynamic-ic-manifest=%t.manifest
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-raw-profile=%t.raw -dynamic-ic-manifest=%t.manifest
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-raw-profile=%t.raw -dynamic-ic-manifest=%t.manifest
+; POST: %dynic-read -top-functions=2 %t.manifest %t.raw
+; POST: %dynic-read %t.manifest %t.raw %t.raw
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 30
+; CHECK-DAG: and 10
+; CHECK-DAG: br 26
+; CHECK-DAG: icmp 20
+; CHECK-DAG: add 20
+; CHECK-DAG: ret 6
+; CHECK-DAG: call 5
+; CHECK-DAG: mul 5
+; CHECK: FUNCTIONS (top 2 of 2)
+; CHECK: main 112 91.80%
+; CHECK: odd 10 8.20%
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 60
+; CHECK-DAG: and 20
+; CHECK-DAG: br 52
+; CHECK-DAG: icmp 40
+; CHECK-DAG: add 40
+; CHECK-DAG: ret 12
+; CHECK-DAG: call 10
+; CHECK-DAG: mul 10
+
+define i32 @odd(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %bit = and i32 %i, 1
+  %is.odd = icmp ne i32 %bit, 0
+  br i1 %is.odd, label %then, label %latch
+
+then:
+  %c = call i32 @odd(i32 %i)
+  br label %latch
+
+latch:
+  %v = phi i32 [ %c, %then ], [ %i, %loop ]
+  %sum.next = add i32 %sum, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 10
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
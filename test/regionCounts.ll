@@ -0,0 +1,73 @@
+; Counts of nested regions of interest: 3 requests run work(4) in the outer
+; region, then work(2) in the inner one. Counting is compiled out outside the
+; regions, so the totals are the counts of the outer region (work(10), at
+; exit, is not counted), and main switches copy right after the calls to
+; dynic_roi_begin and dynic_roi_end (5 calls counted per request, 2 of them in
+; the inner region).
+
+; RUN: -dynamic-ic-mode=bb
+; RUN: -dynamic-ic-mode=inst
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 18
+; CHECK-DAG: br 24
+; CHECK-DAG: add 18
+; CHECK-DAG: icmp 18
+; CHECK-DAG: ret 6
+; CHECK-DAG: call 15
+; CHECK: REGIONS
+; CHECK: outer: 3 executions
+; CHECK-DAG: phi 18
+; CHECK-DAG: br 24
+; CHECK-DAG: add 18
+; CHECK-DAG: icmp 18
+; CHECK-DAG: ret 6
+; CHECK-DAG: call 15
+; CHECK: inner: 3 executions
+; CHECK-DAG: phi 6
+; CHECK-DAG: br 9
+; CHECK-DAG: add 6
+; CHECK-DAG: icmp 6
+; CHECK-DAG: ret 3
+; CHECK-DAG: call 6
+
+@outer = private constant [6 x i8] c"outer\00"
+@inner = private constant [6 x i8] c"inner\00"
+
+declare void @dynic_roi_begin(ptr)
+declare void @dynic_roi_end()
+
+define i32 @work(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %i
+}
+
+define i32 @main() {
+entry:
+  br label %request
+
+request:
+  %r = phi i32 [ 0, %entry ], [ %r.next, %request ]
+  call void @dynic_roi_begin(ptr @outer)
+  %a = call i32 @work(i32 4)
+  call void @dynic_roi_begin(ptr @inner)
+  %b = call i32 @work(i32 2)
+  call void @dynic_roi_end()
+  call void @dynic_roi_end()
+  %r.next = add i32 %r, 1
+  %more = icmp ult i32 %r.next, 3
+  br i1 %more, label %request, label %exit
+
+exit:
+  %c = call i32 @work(i32 10)
+  ret i32 0
+}
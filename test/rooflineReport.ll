@@ -0,0 +1,62 @@
+; Roofline of two loop nests against Inputs/peaks.txt (100 GFLOP/s, 10 GB/s:
+; ridge at 10 FLOP/B). The first one runs 8 times a fused multiply-add (2
+; FLOPs) and an add over 3 accesses of 8 bytes: 24 FLOPs for 192 bytes, memory
+; bound at 0.125 * 10 = 1.25 GFLOP/s. The second one runs 64 times a
+; <4 x double> multiply without touching memory: 256 FLOPs, compute bound.
+; The third one runs a single add, 1 of the 353 operations of the module and
+; none of its bytes: under the default share of 1%, it is only counted.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-roofline=%S/Inputs/peaks.txt
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-roofline=%S/Inputs/peaks.txt
+
+; CHECK: ROOFLINE (peaks: 100.00 GFLOP/s, 10.00 GB/s; ridge 10.00 FLOP/B)
+; CHECK: LOOP NEST FLOPS INT OPS BYTES FLOP/B INTOP/B GFLOP/S BOUND
+; CHECK: -------------------------------------------------
+; CHECK: main loop loop 24 8 192 0.125 0.042 1.25 memory
+; CHECK: main loop scale 256 64 0 256.000 64.000 100.00 compute
+; CHECK: (loop nests under 1.00% of the operations and of the bytes: 1)
+; CHECK: -------------------------------------------------
+; CHECK: TOTAL 280 73 192 1.458 0.380 14.58 memory
+
+@x = global [8 x double] zeroinitializer
+@y = global [8 x double] zeroinitializer
+
+declare double @llvm.fmuladd.f64(double, double, double)
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %px = getelementptr [8 x double], ptr @x, i64 0, i64 %i
+  %py = getelementptr [8 x double], ptr @y, i64 0, i64 %i
+  %vx = load double, ptr %px
+  %vy = load double, ptr %py
+  %r = call double @llvm.fmuladd.f64(double 2.0, double %vx, double %vy)
+  %s = fadd double %r, 1.0
+  store double %s, ptr %py
+  %next = add i64 %i, 1
+  %done = icmp eq i64 %next, 8
+  br i1 %done, label %exit, label %loop
+
+exit:
+  br label %scale
+
+scale:
+  %j = phi i64 [ 0, %exit ], [ %j.next, %scale ]
+  %v = phi <4 x double> [ <double 1.0, double 1.0, double 1.0, double 1.0>, %exit ], [ %v.next, %scale ]
+  %v.next = fmul <4 x double> %v, <double 0.5, double 0.5, double 0.5, double 0.5>
+  %j.next = add i64 %j, 1
+  %j.done = icmp eq i64 %j.next, 64
+  br i1 %j.done, label %tail, label %scale
+
+tail:
+  %k = phi i64 [ 0, %scale ], [ %k.next, %tail ]
+  %k.next = add i64 %k, 1
+  %k.done = icmp eq i64 %k.next, 1
+  br i1 %k.done, label %end, label %tail
+
+end:
+  ret i32 0
+}
@@ -0,0 +1,304 @@
+#===============================================================================
+# Runs one test of this directory (cmake -P runTest.cmake):
+#   -DOPT=<opt> -DLLI=<lli> -DPLUGIN=<dynamicInstCounter> -DTEST=<file.ll>
+#   -DWORK_DIR=<dir for the instrumented modules> [-DDYNIC_READ=<dynic-read>]
+#   [-DDYNIC_RT=<shared libdynic_rt>] [-DLLVM_LINK=<llvm-link>]
+#
+# TEST is instrumented with the plugin once for every `; RUN: <options>` line,
+# and run with lli (with the options of the `; LLI: <options>` lines, e.g. to
+# load libdynic_rt), then the commands of the `; POST: <command>` lines run in
+# order (e.g. dynic-read on the raw profile of the program). The modules of
+# the `; MODULE: <file.ll>` lines are instrumented with the same options and
+# linked with TEST (with llvm-link: lli cannot run instrumented modules side
+# by side), so that they register with the runtime as the translation units
+# of a program would. In the options, the commands and the modules, %S stands
+# for the directory of TEST (e.g. for the files of Inputs/), %t for a prefix
+# of files private to the run (removed before it), %dynic-read for dynic-read,
+# %dynic-rt for the shared libdynic_rt, %cmake for cmake (`%cmake -E cat`
+# shows a file) and, in the commands, %run for the command running the
+# program (e.g. `%cmake -E env DYNIC_FORMAT=csv %run` runs it again with
+# another environment). For every run:
+#   * the output of the program and of the commands (stdout and stderr) must
+#     contain the lines of the `; CHECK: <line>` comments, in order, and the
+#     lines of consecutive `; CHECK-DAG: <line>` comments, in any order,
+#     between the lines of the surrounding CHECK comments (e.g. the rows of
+#     the opcode totals, whose order is the order of a hash table), and the
+#     line of a `; CHECK-NEXT: <line>` comment right after the line of the
+#     previous check;
+#   * the messages of opt for TEST must contain the lines of the
+#     `; CHECK-OPT: <line>` comments, in any order (e.g. how many loops were
+#     hoisted);
+#   * the instrumented module (written as text when there are such checks)
+#     must contain the text of the `; CHECK-IR: <text>` comments, in order,
+#     each one in a line of its own (e.g. the slot of a counter).
+# Lines match whole lines of the output, blanks being insignificant: runs of
+# spaces and tabs compare equal, and leading and trailing ones are ignored.
+# In CHECK lines, {{<regex>}} matches what the regex matches within the line
+# (e.g. a time).
+#
+# A test with a `; REQUIRES: <feature>...` line only runs on the hosts with
+# all of its features, the names of their system and processor in lower case
+# (e.g. linux, x86_64), and is reported as UNSUPPORTED elsewhere, like the
+# tests with MODULE lines when llvm-link is missing.
+#===============================================================================
+foreach(Var OPT LLI PLUGIN TEST WORK_DIR)
+  if(NOT DEFINED ${Var})
+    message(FATAL_ERROR "runTest.cmake: ${Var} is not set")
+  endif()
+endforeach()
+
+# Lines of the output compare like the CHECK lines: blanks collapsed and
+# trimmed, every line between newlines
+function(normalize Text Out)
+  string(REGEX REPLACE "[ \t\r]+" " " Text "${Text}")
+  string(REGEX REPLACE " ?\n ?" "\n" Text "${Text}")
+  string(STRIP "${Text}" Text)
+  set(${Out} "\n${Text}\n" PARENT_SCOPE)
+endfunction()
+
+# The directives (the kind of every check is its first character: C, D or N)
+file(STRINGS "${TEST}" Lines)
+set(Runs "")
+set(Modules "")
+set(Requires "")
+set(Posts "")
+set(LliOptions "")
+set(Checks "")
+set(OptChecks "")
+set(IRChecks "")
+foreach(Line IN LISTS Lines)
+  if(Line MATCHES "^; RUN:(.*)$")
+    string(STRIP "${CMAKE_MATCH_1}" Options)
+    list(APPEND Runs "${Options}")
+  elseif(Line MATCHES "^; REQUIRES:(.*)$")
+    separate_arguments(Features UNIX_COMMAND "${CMAKE_MATCH_1}")
+    list(APPEND Requires ${Features})
+  elseif(Line MATCHES "^; MODULE:(.*)$")
+    string(STRIP "${CMAKE_MATCH_1}" Module)
+    list(APPEND Modules "${Module}")
+  elseif(Line MATCHES "^; LLI:(.*)$")
+    string(STRIP "${CMAKE_MATCH_1}" Options)
+    string(APPEND LliOptions " ${Options}")
+  elseif(Line MATCHES "^; POST:(.*)$")
+    string(STRIP "${CMAKE_MATCH_1}" Command)
+    list(APPEND Posts "${Command}")
+  elseif(Line MATCHES "^; CHECK-OPT:(.*)$")
+    normalize("${CMAKE_MATCH_1}" Check)
+    list(APPEND OptChecks "${Check}")
+  elseif(Line MATCHES "^; CHECK-IR:(.*)$")
+    normalize("${CMAKE_MATCH_1}" Check)
+    string(STRIP "${Check}" Check)
+    list(APPEND IRChecks "${Check}")
+  elseif(Line MATCHES "^; CHECK(-DAG|-NEXT)?:(.*)$")
+    normalize("${CMAKE_MATCH_2}" Check)
+    if(CMAKE_MATCH_1 STREQUAL "-DAG")
+      list(APPEND Checks "D${Check}")
+    elseif(CMAKE_MATCH_1 STREQUAL "-NEXT")
+      list(APPEND Checks "N${Check}")
+    else()
+      list(APPEND Checks "C${Check}")
+    endif()
+  endif()
+endforeach()
+if(NOT Runs OR NOT Checks)
+  message(FATAL_ERROR "${TEST}: no RUN or no CHECK lines")
+endif()
+
+cmake_host_system_information(RESULT System QUERY OS_NAME)
+cmake_host_system_information(RESULT Processor QUERY OS_PLATFORM)
+string(TOLOWER "${System};${Processor}" Host)
+foreach(Feature IN LISTS Requires)
+  list(FIND Host "${Feature}" Found)
+  if(Found EQUAL -1)
+    message(STATUS "${TEST}: UNSUPPORTED (requires ${Feature})")
+    return()
+  endif()
+endforeach()
+if(Modules AND NOT LLVM_LINK)
+  message(STATUS "${TEST}: UNSUPPORTED (requires llvm-link)")
+  return()
+endif()
+
+get_filename_component(Name "${TEST}" NAME_WE)
+get_filename_component(TestDir "${TEST}" DIRECTORY)
+set(RunIdx 0)
+
+# Finds the first match of the CHECK line Expected in Text: its offset (-1 if
+# there is none) and its length
+function(find_check Text Expected Offset Length)
+  if(NOT Expected MATCHES "{{")
+    string(FIND "${Text}" "${Expected}" Found)
+    string(LENGTH "${Expected}" Size)
+  else()
+    # The text around the {{regex}} is matched literally
+    set(Regex "")
+    set(Rest "${Expected}")
+    while(Rest MATCHES "^(.*){{(.*)}}(.*)$")
+      set(Rest "${CMAKE_MATCH_1}")
+      set(Pattern "${CMAKE_MATCH_2}")
+      string(REGEX REPLACE "([][\\^$.|?*+(){}])" "\\\\\\1" Literal "${CMAKE_MATCH_3}")
+      # . stays within the line (twice, for the dots following each other)
+      string(REGEX REPLACE "(^|[^\\])\\." "\\1[^\n]" Pattern "${Pattern}")
+      string(REGEX REPLACE "(^|[^\\])\\." "\\1[^\n]" Pattern "${Pattern}")
+      set(Regex "(${Pattern})${Literal}${Regex}")
+    endwhile()
+    string(REGEX REPLACE "([][\\^$.|?*+(){}])" "\\\\\\1" Literal "${Rest}")
+    string(REGEX MATCH "${Literal}${Regex}" Match "${Text}")
+    if(Match STREQUAL "")
+      set(Found -1)
+    else()
+      # The first occurrence of the match is the first match
+      string(FIND "${Text}" "${Match}" Found)
+    endif()
+    string(LENGTH "${Match}" Size)
+  endif()
+  set(${Offset} ${Found} PARENT_SCOPE)
+  set(${Length} ${Size} PARENT_SCOPE)
+endfunction()
+
+# Options or command of a run, with the substitutions, as a list of arguments
+function(substitute Line Out)
+  string(REPLACE "%run" "${LLI} ${LliOptions} ${Module}" Line "${Line}")
+  string(REPLACE "%S" "${TestDir}" Line "${Line}")
+  string(REPLACE "%t" "${Private}" Line "${Line}")
+  string(REPLACE "%dynic-read" "${DYNIC_READ}" Line "${Line}")
+  string(REPLACE "%dynic-rt" "${DYNIC_RT}" Line "${Line}")
+  string(REPLACE "%cmake" "${CMAKE_COMMAND}" Line "${Line}")
+  separate_arguments(Line UNIX_COMMAND "${Line}")
+  set(${Out} "${Line}" PARENT_SCOPE)
+endfunction()
+
+foreach(Options IN LISTS Runs)
+  set(Prefix "${WORK_DIR}/${Name}.${RunIdx}")
+  math(EXPR RunIdx "${RunIdx} + 1")
+  set(Private "${Prefix}.tmp")
+  file(GLOB Stale "${Private}*")
+  if(Stale)
+    file(REMOVE ${Stale})
+  endif()
+  substitute("${Options}" Args)
+  if(IRChecks)
+    set(Module "${Prefix}.ll")
+    set(Format -S)
+  else()
+    set(Module "${Prefix}.bc")
+    set(Format "")
+  endif()
+  execute_process(
+    COMMAND "${OPT}" "-load-pass-plugin=${PLUGIN}" -passes=dynamic-ic ${Args} ${Format} "${TEST}"
+            -o "${Module}"
+    RESULT_VARIABLE Result
+    ERROR_VARIABLE Errors)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "${TEST} (${Options}): opt failed:\n${Errors}")
+  endif()
+  normalize("${Errors}" Text)
+  foreach(Expected IN LISTS OptChecks)
+    string(FIND "${Text}" "${Expected}" Found)
+    if(Found EQUAL -1)
+      string(STRIP "${Expected}" Expected)
+      message(FATAL_ERROR "${TEST} (${Options}): expected message `${Expected}` not found in:\n"
+                          "${Errors}")
+    endif()
+  endforeach()
+  if(IRChecks)
+    file(READ "${Module}" IR)
+    normalize("${IR}" Text)
+    set(Pos 0)
+    foreach(Expected IN LISTS IRChecks)
+      string(SUBSTRING "${Text}" ${Pos} -1 Rest)
+      string(FIND "${Rest}" "${Expected}" Found)
+      if(Found EQUAL -1)
+        message(FATAL_ERROR "${TEST} (${Options}): expected IR `${Expected}` not found in "
+                            "${Module} (after the previous CHECK-IR)")
+      endif()
+      # The next check starts on the next line
+      math(EXPR Start "${Pos} + ${Found}")
+      string(SUBSTRING "${Text}" ${Start} -1 Rest)
+      string(FIND "${Rest}" "\n" Found)
+      math(EXPR Pos "${Start} + ${Found}")
+    endforeach()
+  endif()
+  # The other modules of the program, instrumented alike
+  set(Linked "")
+  set(ModuleIdx 0)
+  foreach(Extra IN LISTS Modules)
+    string(REPLACE "%S" "${TestDir}" Extra "${Extra}")
+    set(ExtraModule "${Prefix}.${ModuleIdx}.bc")
+    math(EXPR ModuleIdx "${ModuleIdx} + 1")
+    execute_process(
+      COMMAND "${OPT}" "-load-pass-plugin=${PLUGIN}" -passes=dynamic-ic ${Args} "${Extra}"
+              -o "${ExtraModule}"
+      RESULT_VARIABLE Result
+      ERROR_VARIABLE Errors)
+    if(NOT Result EQUAL 0)
+      message(FATAL_ERROR "${Extra} (${Options}): opt failed:\n${Errors}")
+    endif()
+    list(APPEND Linked "${ExtraModule}")
+  endforeach()
+  if(Linked)
+    set(Program "${Prefix}.linked.bc")
+    execute_process(
+      COMMAND "${LLVM_LINK}" "${Module}" ${Linked} -o "${Program}"
+      RESULT_VARIABLE Result
+      ERROR_VARIABLE Errors)
+    if(NOT Result EQUAL 0)
+      message(FATAL_ERROR "${TEST} (${Options}): llvm-link failed:\n${Errors}")
+    endif()
+    set(Module "${Program}")
+  endif()
+
+  substitute("${LliOptions}" LliArgs)
+  execute_process(
+    COMMAND "${LLI}" ${LliArgs} "${Module}"
+    RESULT_VARIABLE Result
+    OUTPUT_VARIABLE Output
+    ERROR_VARIABLE Output)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "${TEST} (${Options}): the program failed (${Result}):\n${Output}")
+  endif()
+  foreach(Post IN LISTS Posts)
+    substitute("${Post}" Command)
+    execute_process(
+      COMMAND ${Command}
+      RESULT_VARIABLE Result
+      OUTPUT_VARIABLE PostOutput
+      ERROR_VARIABLE PostOutput)
+    if(NOT Result EQUAL 0)
+      message(FATAL_ERROR "${TEST} (${Options}): `${Post}` failed (${Result}):\n${PostOutput}")
+    endif()
+    string(APPEND Output "${PostOutput}")
+  endforeach()
+  normalize("${Output}" Text)
+
+  # Pos: where the next CHECK line, or group of CHECK-DAG lines, may start
+  # (the newline before it); GroupEnd: end of the matches of the current group
+  set(Pos 0)
+  set(GroupEnd 0)
+  foreach(Check IN LISTS Checks)
+    string(SUBSTRING "${Check}" 0 1 Kind)
+    string(SUBSTRING "${Check}" 1 -1 Expected)
+    if(NOT Kind STREQUAL "D")
+      set(Pos ${GroupEnd})
+    endif()
+    string(SUBSTRING "${Text}" ${Pos} -1 Rest)
+    find_check("${Rest}" "${Expected}" Found Length)
+    if(Found EQUAL -1)
+      string(STRIP "${Expected}" Expected)
+      message(FATAL_ERROR "${TEST} (${Options}): expected line `${Expected}` not found in:\n"
+                          "${Output}")
+    elseif(Kind STREQUAL "N" AND NOT Found EQUAL 0)
+      string(STRIP "${Expected}" Expected)
+      message(FATAL_ERROR "${TEST} (${Options}): expected line `${Expected}` not right after "
+                          "the previous one in:\n${Output}")
+    endif()
+    # The newline ending the match starts the rest
+    math(EXPR End "${Pos} + ${Found} + ${Length} - 1")
+    if(NOT Kind STREQUAL "D")
+      set(Pos ${End})
+      set(GroupEnd ${End})
+    elseif(End GREATER GroupEnd)
+      set(GroupEnd ${End})
+    endif()
+  endforeach()
+endforeach()
@@ -0,0 +1,103 @@
+; Results written by libdynic_rt (-dynamic-ic-runtime), in its three formats:
+; text on stdout, then CSV and JSON (written to DYNIC_OUTPUT) by running the
+; program again. The library records the regions of interest, turns counting
+; on at the outermost one (so work(10), at exit, is not counted), and folds
+; the thread-local counters of the main thread. Names with quotes and commas
+; (a function, the classes of the calls to it, a region) are quoted in CSV and
+; escaped in JSON.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-classify -dynamic-ic-threads=tls -dynamic-ic-runtime -dynamic-ic-top-functions=3
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-classify -dynamic-ic-threads=tls -dynamic-ic-runtime -dynamic-ic-top-functions=3
+; LLI: -load=%dynic-rt
+; POST: %cmake -E env DYNIC_FORMAT=csv %run
+; POST: %cmake -E env DYNIC_FORMAT=json DYNIC_OUTPUT=%t.json %run
+; POST: %cmake -E cat %t.json
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: call @dynic_roi_begin 1
+; CHECK-DAG: call i32 @say "hi" 1
+; CHECK-DAG: call @dynic_roi_end 2
+; CHECK-DAG: br 5
+; CHECK-DAG: add i32 4
+; CHECK-DAG: icmp i32 4
+; CHECK-DAG: ret 2
+; CHECK-DAG: mul i32 1
+; CHECK-DAG: call i32 @work 1
+; CHECK-DAG: phi i32 4
+; CHECK: FUNCTIONS (top 3 of 3)
+; CHECK: work 18 72.00%
+; CHECK: main 5 20.00%
+; CHECK: say "hi" 2 8.00%
+; CHECK: REGIONS
+; CHECK: phase "1",a: 1 executions
+; CHECK: step: 1 executions
+; CHECK-DAG: call @dynic_roi_begin 0
+; CHECK-DAG: call i32 @say "hi" 1
+; CHECK-DAG: call @dynic_roi_end 1
+; CHECK-DAG: br 0
+; CHECK-DAG: ret 1
+; CHECK-DAG: mul i32 1
+
+; CHECK: kind,name,count,share,error
+; CHECK-NEXT: opcode,br,5,20.0000,0
+; CHECK-DAG: opcode,add i32,4,16.0000,0
+; CHECK-DAG: opcode,icmp i32,4,16.0000,0
+; CHECK-DAG: opcode,phi i32,4,16.0000,0
+; CHECK-DAG: opcode,"call i32 @say ""hi""",1,4.0000,0
+; CHECK: function,work,18,72.0000,
+; CHECK-NEXT: function,main,5,20.0000,
+; CHECK-NEXT: function,"say ""hi""",2,8.0000,
+; CHECK-NEXT: region,"phase ""1"",a",1,,
+; CHECK-NEXT: region_opcode,"phase ""1"",a/br",5,20.0000,0
+; CHECK: region,"phase ""1"",a/step",1,,
+; CHECK-DAG: region_opcode,"phase ""1"",a/step/call i32 @say ""hi""",1,25.0000,0
+; CHECK-DAG: region_opcode,"phase ""1"",a/step/mul i32",1,25.0000,0
+
+; (the closing brackets are matched by {{.}}: the runner cannot read lines
+; with unbalanced brackets)
+; CHECK: "total": 25,
+; CHECK: {"name": "call i32 @say \"hi\"", "count": 1, "share": 4.0000},
+; CHECK: {"name": "say \"hi\"", "count": 2, "share": 8.0000, "opcodes": {"ret": 1, "mul i32": 1}}
+; CHECK: {"name": "phase \"1\",a", "executions": 1, "opcodes": {{.*}}
+; CHECK-NEXT: {"name": "step", "executions": 1, "opcodes": {"call i32 @say \"hi\"": 1, {{.*}}}, "regions": []}
+; CHECK-NEXT: {{.}}}
+; CHECK-NEXT: {{.}}
+; CHECK-NEXT: }
+
+declare void @dynic_roi_begin(ptr)
+declare void @dynic_roi_end()
+
+@phase = private constant [12 x i8] c"phase \221\22,a\00"
+@step = private constant [5 x i8] c"step\00"
+
+define i32 @work(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %next
+}
+
+define i32 @"say \22hi\22"(i32 %x) {
+entry:
+  %y = mul i32 %x, 3
+  ret i32 %y
+}
+
+define i32 @main() {
+entry:
+  call void @dynic_roi_begin(ptr @phase)
+  %a = call i32 @work(i32 4)
+  call void @dynic_roi_begin(ptr @step)
+  %b = call i32 @"say \22hi\22"(i32 %a)
+  call void @dynic_roi_end()
+  call void @dynic_roi_end()
+  %c = call i32 @work(i32 10)
+  ret i32 0
+}
@@ -0,0 +1,49 @@
+; Counts of the program of blockCounts.ll when the counter updates are
+; sampled with a period of 1: every update is taken, so the estimates are the
+; exact counts, with a confidence interval of 0.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-sample-period=1
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-sample-period=1
+
+; CHECK: INST #N CALLS (runtime, estimated)
+; CHECK: Sampling period: 1
+; CHECK-DAG: phi 30 +/- 0
+; CHECK-DAG: and 10 +/- 0
+; CHECK-DAG: br 26 +/- 0
+; CHECK-DAG: icmp 20 +/- 0
+; CHECK-DAG: add 20 +/- 0
+; CHECK-DAG: ret 6 +/- 0
+; CHECK-DAG: call 5 +/- 0
+; CHECK-DAG: mul 5 +/- 0
+
+define i32 @odd(i32 %x) {
+entry:
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %bit = and i32 %i, 1
+  %is.odd = icmp ne i32 %bit, 0
+  br i1 %is.odd, label %then, label %latch
+
+then:
+  %c = call i32 @odd(i32 %i)
+  br label %latch
+
+latch:
+  %v = phi i32 [ %c, %then ], [ %i, %loop ]
+  %sum.next = add i32 %sum, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 10
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
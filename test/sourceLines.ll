@@ -0,0 +1,48 @@
+; Counts of source lines, from hand-written debug locations: a loop of 5
+; iterations with 2 instructions on each of lines 3 and 4, and a multiply of
+; line 9 inlined on line 3, which counts for line 9 and as inlined on line 3.
+; The source file does not exist, and its lines are not printed.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-lines
+; RUN: -dynamic-ic-mode=edge -dynamic-ic-lines
+
+; CHECK: SOURCE LINES (instructions: own, inlined)
+; CHECK: -------------------------------------------------
+; CHECK: -: -: 0:Source:/nonexistent/loop.c
+; CHECK: 1: -: 2:<source not available>
+; CHECK: 10: 5: 3:<source not available>
+; CHECK: 10: -: 4:<source not available>
+; CHECK: 1: -: 5:<source not available>
+; CHECK: 5: -: 9:<source not available>
+
+define i32 @main() !dbg !4 {
+entry:
+  br label %loop, !dbg !7
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ], !dbg !8
+  %next = add i32 %i, 1, !dbg !8
+  %twice = mul i32 %next, 2, !dbg !12
+  %done = icmp eq i32 %next, 5, !dbg !9
+  br i1 %done, label %exit, label %loop, !dbg !9
+
+exit:
+  ret i32 0, !dbg !10
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!2, !3}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, emissionKind: FullDebug)
+!1 = !DIFile(filename: "loop.c", directory: "/nonexistent")
+!2 = !{i32 2, !"Debug Info Version", i32 3}
+!3 = !{i32 7, !"Dwarf Version", i32 5}
+!4 = distinct !DISubprogram(name: "main", scope: !1, file: !1, line: 1, type: !5, unit: !0, spFlags: DISPFlagDefinition)
+!5 = !DISubroutineType(types: !6)
+!6 = !{}
+!7 = !DILocation(line: 2, scope: !4)
+!8 = !DILocation(line: 3, scope: !4)
+!9 = !DILocation(line: 4, scope: !4)
+!10 = !DILocation(line: 5, scope: !4)
+!11 = distinct !DISubprogram(name: "twice", scope: !1, file: !1, line: 8, type: !5, unit: !0, spFlags: DISPFlagDefinition)
+!12 = !DILocation(line: 9, scope: !11, inlinedAt: !8)
@@ -0,0 +1,60 @@
+; Counts of 4 threads running 100000 iterations each, with atomic
+; increments and with thread-local counters (added to the totals when each
+; thread exits): no count is lost either way.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-threads=atomic
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-threads=tls
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: getelementptr 8
+; CHECK-DAG: phi 400008
+; CHECK-DAG: load 4
+; CHECK-DAG: br 400013
+; CHECK-DAG: add 400008
+; CHECK-DAG: icmp 400008
+; CHECK-DAG: ret 5
+; CHECK-DAG: alloca 1
+; CHECK-DAG: call 8
+
+declare i32 @pthread_create(ptr, ptr, ptr, ptr)
+declare i32 @pthread_join(i64, ptr)
+
+define ptr @worker(ptr %arg) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, 100000
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret ptr null
+}
+
+define i32 @main() {
+entry:
+  %threads = alloca [4 x i64]
+  br label %spawn
+
+spawn:
+  %s = phi i64 [ 0, %entry ], [ %s.next, %spawn ]
+  %slot = getelementptr [4 x i64], ptr %threads, i64 0, i64 %s
+  %rc = call i32 @pthread_create(ptr %slot, ptr null, ptr @worker, ptr null)
+  %s.next = add i64 %s, 1
+  %spawned = icmp eq i64 %s.next, 4
+  br i1 %spawned, label %join, label %spawn
+
+join:
+  %j = phi i64 [ 0, %spawn ], [ %j.next, %join ]
+  %jslot = getelementptr [4 x i64], ptr %threads, i64 0, i64 %j
+  %t = load i64, ptr %jslot
+  %jrc = call i32 @pthread_join(i64 %t, ptr null)
+  %j.next = add i64 %j, 1
+  %joined = icmp eq i64 %j.next, 4
+  br i1 %joined, label %exit, label %join
+
+exit:
+  ret i32 0
+}
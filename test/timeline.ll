@@ -0,0 +1,55 @@
+; Timeline of a program that forks: the child runs work(5) and exits, then
+; the parent runs work(10). The interval is longer than the program, so the
+; only row is the last snapshot of the parent, taken at exit. The child
+; inherits the file but records nothing, and the header is written once.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-timeline=%t.csv -dynamic-ic-timeline-interval=1000
+; POST: %cmake -E cat %t.csv
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 20
+; CHECK-DAG: br 12
+; CHECK-DAG: add 20
+; CHECK-DAG: icmp 11
+; CHECK-DAG: ret 2
+; CHECK-DAG: call 3
+; CHECK-DAG: unreachable 0
+; CHECK: time_ms,instructions,phi,br,add,icmp,ret,call,unreachable
+; CHECK-NEXT: {{[0-9]+}},68,20,12,20,11,2,3,0
+
+define i32 @work(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %loop ]
+  %sum.next = add i32 %sum, %i
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %sum.next
+}
+
+define i32 @main() {
+entry:
+  %pid = call i32 @fork()
+  %child = icmp eq i32 %pid, 0
+  br i1 %child, label %in.child, label %in.parent
+
+in.child:
+  %c = call i32 @work(i32 5)
+  call void @exit(i32 0)
+  unreachable
+
+in.parent:
+  %w = call i32 @waitpid(i32 %pid, ptr null, i32 0)
+  %p = call i32 @work(i32 10)
+  ret i32 0
+}
+
+declare i32 @fork()
+declare i32 @waitpid(i32, ptr, i32)
+declare void @exit(i32)
@@ -0,0 +1,41 @@
+; Counts when the program turns counting on and off: counting starts
+; disabled, and main switches to its instrumented copy right after enabling
+; it, and back to its clean copy right after disabling it. Only the calls of
+; work(7) and dynic_enable(0), and the 7 iterations of work(7), are counted.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-toggle
+; RUN: -dynamic-ic-mode=inst -dynamic-ic-toggle
+
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 7
+; CHECK-DAG: br 8
+; CHECK-DAG: add 7
+; CHECK-DAG: icmp 7
+; CHECK-DAG: ret 1
+; CHECK-DAG: call 2
+
+declare void @dynic_enable(i32)
+
+define i32 @work(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %i
+}
+
+define i32 @main() {
+entry:
+  %a = call i32 @work(i32 5)
+  call void @dynic_enable(i32 1)
+  %b = call i32 @work(i32 7)
+  call void @dynic_enable(i32 0)
+  %c = call i32 @work(i32 9)
+  ret i32 0
+}
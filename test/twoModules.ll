@@ -0,0 +1,42 @@
+; A program made of two instrumented modules: main calls triple, defined in
+; Inputs/triple.ll, 4 times. The module unregistered last prints a single
+; report, with the combined totals first, then the reports of every module,
+; each one under the name of its module.
+
+; RUN: -dynamic-ic-mode=bb -dynamic-ic-top-functions=3
+; MODULE: %S/Inputs/triple.ll
+
+; CHECK: LLVM Dynamic Instruction Counter results
+; CHECK: INST #N CALLS (runtime)
+; CHECK-DAG: phi 4
+; CHECK-DAG: br 5
+; CHECK-DAG: add 4
+; CHECK-DAG: icmp 4
+; CHECK-DAG: ret 5
+; CHECK-DAG: call 4
+; CHECK-DAG: mul 4
+; CHECK: MODULE {{.*}}twoModules.ll
+; CHECK: FUNCTIONS (top 1 of 1)
+; CHECK: main 22 100.00%
+; CHECK: MODULE {{.*}}triple.ll
+; CHECK: FUNCTIONS (top 1 of 1)
+; CHECK: triple 8 100.00%
+; CHECK-NEXT: ret 4
+; CHECK-NEXT: mul 4
+
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %c = call i32 @triple(i32 %i)
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, 4
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 0
+}
+
+declare i32 @triple(i32)